@@ -0,0 +1,157 @@
+// adc_calibration.cc
+// Loading of ADC channel maps and calibrations, and conversion of readings
+
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "adc_calibration.h"
+#include "spi_protocol.h"
+
+AdcCalibration::AdcCalibration()
+{
+    for (int group = 0; group < ADC_NUM_GROUPS; group++) {
+        for (int i = 0; i < ADC_CHANNELS_PER_GROUP; i++) {
+            int channel = ADC_CHANNELS_PER_GROUP * group + i;
+            channel_module[channel] = ADC_CHANNEL_MODULES[group][i];
+            voltage_gain[channel] = NOMINAL_VOLTAGE_GAIN;
+            voltage_offset[channel] = 0.0;
+            current_gain[channel] = NOMINAL_CURRENT_GAIN;
+            current_offset[channel] = 0.0;
+        }
+    }
+}
+
+bool load_adc_calibration(const std::string &file_name,
+        AdcCalibration &calibration)
+{
+    std::ifstream file(file_name);
+    if (!file) {
+        std::cerr << "Error: could not read " << file_name << std::endl;
+        return false;
+    }
+
+    // Read the map and the calibration of each module, which is applied to
+    // the channels once the whole map is known
+    int channel_module[ADC_NUM_CHANNELS];
+    float module_gains[ADC_NUM_CHANNELS][4];
+    for (int channel = 0; channel < ADC_NUM_CHANNELS; channel++) {
+        int module = calibration.channel_module[channel];
+        channel_module[channel] = module;
+        module_gains[module][0] = calibration.voltage_gain[channel];
+        module_gains[module][1] = calibration.voltage_offset[channel];
+        module_gains[module][2] = calibration.current_gain[channel];
+        module_gains[module][3] = calibration.current_offset[channel];
+    }
+    std::string line;
+    int line_counter = 0;
+    while (std::getline(file, line)) {
+        line_counter++;
+        auto pos = line.find('#');
+        if (pos != std::string::npos) {
+            line.erase(pos);
+        }
+        std::istringstream words(line);
+        std::string keyword;
+        if (!(words >> keyword)) {
+            continue; // blank or only a comment
+        }
+        bool error_on_line = false;
+        if (keyword == "MAP") {
+            int group;
+            if (!(words >> group) || (group < 0)
+                    || (group >= ADC_NUM_GROUPS)) {
+                error_on_line = true;
+            }
+            for (int i = 0; !error_on_line && (i < ADC_CHANNELS_PER_GROUP);
+                    i++) {
+                int module;
+                if (!(words >> module) || (module < 0)
+                        || (module >= ADC_NUM_CHANNELS)) {
+                    error_on_line = true;
+                } else {
+                    channel_module[ADC_CHANNELS_PER_GROUP * group + i] =
+                        module;
+                }
+            }
+        } else if (keyword == "CALIBRATE") {
+            std::string module_name;
+            float gains[4];
+            if (!(words >> module_name >> gains[0] >> gains[1] >> gains[2]
+                        >> gains[3])) {
+                error_on_line = true;
+            } else if (module_name == "all") {
+                for (int module = 0; module < ADC_NUM_CHANNELS; module++) {
+                    std::copy(gains, gains + 4, module_gains[module]);
+                }
+            } else {
+                int module = std::atoi(module_name.c_str());
+                if ((module_name.find_first_not_of("0123456789")
+                            != std::string::npos)
+                        || (module >= ADC_NUM_CHANNELS)) {
+                    error_on_line = true;
+                } else {
+                    std::copy(gains, gains + 4, module_gains[module]);
+                }
+            }
+        } else {
+            error_on_line = true;
+        }
+        std::string extra;
+        if (!error_on_line && (words >> extra)) {
+            error_on_line = true;
+        }
+        if (error_on_line) {
+            std::cerr << "Error: could not parse line " << line_counter
+                << " of " << file_name << ':' << std::endl << line
+                << std::endl;
+            return false;
+        }
+    }
+
+    // Each module must be read by exactly one channel
+    bool mapped[ADC_NUM_CHANNELS] = {false};
+    for (int channel = 0; channel < ADC_NUM_CHANNELS; channel++) {
+        int module = channel_module[channel];
+        if (mapped[module]) {
+            std::cerr << "Error: module " << module << " mapped to more "
+                << "than one ADC channel in " << file_name << std::endl;
+            return false;
+        }
+        mapped[module] = true;
+    }
+
+    for (int channel = 0; channel < ADC_NUM_CHANNELS; channel++) {
+        const float *gains = module_gains[channel_module[channel]];
+        calibration.channel_module[channel] = channel_module[channel];
+        calibration.voltage_gain[channel] = gains[0];
+        calibration.voltage_offset[channel] = gains[1];
+        calibration.current_gain[channel] = gains[2];
+        calibration.current_offset[channel] = gains[3];
+    }
+    return true;
+}
+
+void convert_adc_readings(const unsigned short spi_data[],
+        const int channel_module[], const float gain[], const float offset[],
+        float values[])
+{
+    // Gather the data words of the four messages into channel order, scale
+    // every channel in one loop free of indirection (which the compiler can
+    // vectorize), then scatter the results to their modules
+    float counts[ADC_NUM_CHANNELS];
+    for (int group = 0; group < ADC_NUM_GROUPS; group++) {
+        const unsigned short *data = spi_data + SPI_MESSAGE_WORDS * group + 2;
+        for (int i = 0; i < ADC_CHANNELS_PER_GROUP; i++) {
+            counts[ADC_CHANNELS_PER_GROUP * group + i] = data[i];
+        }
+    }
+    for (int channel = 0; channel < ADC_NUM_CHANNELS; channel++) {
+        counts[channel] = counts[channel] * gain[channel] + offset[channel];
+    }
+    for (int channel = 0; channel < ADC_NUM_CHANNELS; channel++) {
+        values[channel_module[channel]] = counts[channel];
+    }
+}
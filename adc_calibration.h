@@ -0,0 +1,48 @@
+// adc_calibration.h
+// Mapping of the backplane's housekeeping ADC channels to modules, and the
+// conversion of their readings to volts and amps, both of which may differ
+// from one revision of the backplane (or one board) to the next
+
+#ifndef ADC_CALIBRATION_H
+#define ADC_CALIBRATION_H
+
+#include <string>
+
+// The ADC channels are read by four read commands (CW_RD_FEE0, CW_RD_FEE8,
+// CW_RD_FEE16, and CW_RD_FEE24) of eight data words each
+const int ADC_NUM_GROUPS = 4;
+const int ADC_CHANNELS_PER_GROUP = 8;
+const int ADC_NUM_CHANNELS = ADC_NUM_GROUPS * ADC_CHANNELS_PER_GROUP;
+
+// Nominal conversion factors from ADC counts to units
+const float NOMINAL_VOLTAGE_GAIN = 0.006158; // volts per count
+const float NOMINAL_CURRENT_GAIN = 0.00117; // amps per count
+
+// Everything is indexed by channel, in the order the channels are read, so
+// that all channels convert in one pass over contiguous arrays
+struct AdcCalibration {
+    // Module each channel belongs to
+    int channel_module[ADC_NUM_CHANNELS];
+    // Readings convert to units as counts * gain + offset
+    float voltage_gain[ADC_NUM_CHANNELS];
+    float voltage_offset[ADC_NUM_CHANNELS];
+    float current_gain[ADC_NUM_CHANNELS];
+    float current_offset[ADC_NUM_CHANNELS];
+
+    // The channel map in spi_protocol.h, with the nominal gains and no offsets
+    AdcCalibration();
+};
+
+// Load a channel map and calibration from a file (see adc_calibration.config)
+// Anything the file doesn't give keeps its default
+// Return true if successful, false otherwise, leaving calibration unchanged
+bool load_adc_calibration(const std::string &file_name,
+        AdcCalibration &calibration);
+
+// Convert the data of the four messages reading a set of ADC channels to a
+// value for each module, with the given gain and offset for each channel
+void convert_adc_readings(const unsigned short spi_data[],
+        const int channel_module[], const float gain[], const float offset[],
+        float values[]);
+
+#endif
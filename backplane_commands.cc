@@ -0,0 +1,55 @@
+// backplane_commands.cc
+// Lookup between names and codes of the low level commands performed by the Pi
+
+#include <unordered_map>
+
+#include "backplane_commands.h"
+
+// Command names and numbers of integer arguments, indexed by command code
+const char *command_names[NUM_BACKPLANE_COMMANDS] = {
+    "",
+#define BACKPLANE_COMMAND_NAME(code, name, n_ints) #name,
+    BACKPLANE_COMMANDS(BACKPLANE_COMMAND_NAME)
+#undef BACKPLANE_COMMAND_NAME
+};
+
+const int command_n_ints[NUM_BACKPLANE_COMMANDS] = {
+    -1,
+#define BACKPLANE_COMMAND_N_INTS(code, name, n_ints) n_ints,
+    BACKPLANE_COMMANDS(BACKPLANE_COMMAND_N_INTS)
+#undef BACKPLANE_COMMAND_N_INTS
+};
+
+int backplane_command_code(const std::string &command_name)
+{
+    // Built once on first use; the initialization of a local static is
+    // thread safe
+    static const std::unordered_map<std::string, int> command_codes = []() {
+        std::unordered_map<std::string, int> codes;
+        for (int code = 1; code < NUM_BACKPLANE_COMMANDS; code++) {
+            codes[command_names[code]] = code;
+        }
+        return codes;
+    }();
+    auto it = command_codes.find(command_name);
+    if (it == command_codes.end()) {
+        return BP_UNKNOWN_COMMAND;
+    }
+    return it->second;
+}
+
+std::string backplane_command_name(int code)
+{
+    if ((code <= BP_UNKNOWN_COMMAND) || (code >= NUM_BACKPLANE_COMMANDS)) {
+        return "";
+    }
+    return command_names[code];
+}
+
+int backplane_command_n_ints(int code)
+{
+    if ((code <= BP_UNKNOWN_COMMAND) || (code >= NUM_BACKPLANE_COMMANDS)) {
+        return -1;
+    }
+    return command_n_ints[code];
+}
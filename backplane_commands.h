@@ -0,0 +1,69 @@
+// backplane_commands.h
+// Codes for the low level commands performed by the Pi, shared by the server
+// and the Pi so that commands can be sent and dispatched as small integers
+
+#ifndef BACKPLANE_COMMANDS_H
+#define BACKPLANE_COMMANDS_H
+
+#include <string>
+
+// Most backplanes one Pi drives, on chip selects or devices of their own;
+// commands and results carry the index of theirs, counting from 0
+const int MAX_BACKPLANES = 4;
+
+// The low level commands performed by the Pi, one per line as
+//     X(code, name, number of integer arguments)
+// where name is that used in commands.config; none take float or string
+// arguments. The command codes and names, the Pi's handlers (perform_name in
+// backplane_control.h), and the server's definitions of the commands are all
+// generated from this list, so a command is added here, given a handler, and
+// nowhere else. Codes are sent between server and Pi, so add commands at the
+// end.
+#define BACKPLANE_COMMANDS(X) \
+    X(BP_POWER_CONTROL_MODULES, power_control_modules, 2) \
+    X(BP_RESET_DACQ1_POWER, reset_dacq1_power, 0) \
+    X(BP_RESET_DACQ2_POWER, reset_dacq2_power, 0) \
+    X(BP_SET_HOLDOFF_TIME, set_holdoff_time, 1) \
+    X(BP_SET_TACK_TYPE_AND_MODE, set_tack_type_and_mode, 2) \
+    X(BP_SET_TRIGGER, set_trigger, 4) \
+    X(BP_SET_TRIGGER_MASK, set_trigger_mask, 0) \
+    X(BP_RESET_TRIGGER_COUNTER_AND_TIMER, reset_trigger_counter_and_timer, 0) \
+    X(BP_TOGGLE_TRIGGER_TACK, toggle_trigger_tack, 7) \
+    X(BP_SYNC, sync, 0) \
+    X(BP_READ_MODULES_PRESENT, read_modules_present, 0) \
+    X(BP_READ_MODULE_CURRENTS, read_module_currents, 0) \
+    X(BP_READ_MODULE_VOLTAGES, read_module_voltages, 0) \
+    X(BP_READ_TIMER_AND_TRIGGER_RATE, read_timer_and_trigger_rate, 0) \
+    X(BP_READ_MODULE_HOUSEKEEPING, read_module_housekeeping, 0) \
+    X(BP_START_SAMPLING, start_sampling, 1) \
+    X(BP_STOP_SAMPLING, stop_sampling, 0) \
+    X(BP_SET_MODULE_TRIGGER_MASK, set_module_trigger_mask, 2) \
+    X(BP_START_HIT_PATTERNS, start_hit_patterns, 1) \
+    X(BP_STOP_HIT_PATTERNS, stop_hit_patterns, 0) \
+    X(BP_START_TRIGGER_RATES, start_trigger_rates, 2) \
+    X(BP_STOP_TRIGGER_RATES, stop_trigger_rates, 0) \
+    X(BP_READ_SPI_JOURNAL, read_spi_journal, 1) \
+    X(BP_READ_MODULE_HOUSEKEEPING_OVERSAMPLED, \
+            read_module_housekeeping_oversampled, 1) \
+    X(BP_READ_ALL_HOUSEKEEPING, read_all_housekeeping, 0)
+
+// Command codes, in the order listed above
+enum BackplaneCommandCode {
+    BP_UNKNOWN_COMMAND = 0,
+#define BACKPLANE_COMMAND_CODE(code, name, n_ints) code,
+    BACKPLANE_COMMANDS(BACKPLANE_COMMAND_CODE)
+#undef BACKPLANE_COMMAND_CODE
+    NUM_BACKPLANE_COMMANDS
+};
+
+// Return the code of the named command, or BP_UNKNOWN_COMMAND if none
+int backplane_command_code(const std::string &command_name);
+
+// Return the name of the command with the given code, or empty string if none
+std::string backplane_command_name(int code);
+
+// Return the number of integer arguments the command with the given code
+// takes, or -1 if there is no such command
+int backplane_command_n_ints(int code);
+
+#endif
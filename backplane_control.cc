@@ -0,0 +1,744 @@
+// backplane_control.cc
+// File containing the implementation of the class performing commands on one
+// backplane
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+
+#include "backplane_control.h"
+#include "clock_sync.h"
+
+// number of uint parameters to send to backplane low level code
+const int NUM_COMMAND_PARAMETERS = 4; 
+
+BackplaneControl::BackplaneControl(int backplane_index) :
+    index(backplane_index), trigger_mask_file(TRIGGER_MASK_FILE),
+    pending_commands(COMMAND_QUEUE_SIZE),
+    emergency_commands(COMMAND_QUEUE_SIZE), quit(false),
+    results(COMMAND_QUEUE_SIZE), n_commands_done(0),
+    file_trigger_mask_loaded(false),
+    trigger_mask_set(false), sampler(spi_mutex, backplane_index),
+    hit_pattern_reader(spi_mutex, backplane_index),
+    rate_monitor(spi_mutex, backplane_index),
+    watchdog(backplane_index, [this]() { interrupt_signal.raise(); })
+{
+    if (index > 0) {
+        trigger_mask_file += "_" + std::to_string(index);
+    }
+    // Make room for the largest result up front; clearing keeps it
+    backplane_variables.mutable_spi_command()->reserve(
+            2 * SPI_MESSAGE_LENGTH * MAX_NUM_SPI_MESSAGES);
+    backplane_variables.mutable_spi_data()->reserve(
+            2 * SPI_MESSAGE_LENGTH * MAX_NUM_SPI_MESSAGES);
+    backplane_variables.mutable_trigger_mask()->reserve(2 * NUM_FEES);
+    backplane_variables.mutable_voltage()->Reserve(NUM_FEES);
+    backplane_variables.mutable_current()->Reserve(NUM_FEES);
+}
+
+BackplaneControl::~BackplaneControl()
+{
+    if (command_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            quit = true;
+        }
+        command_queued.notify_one();
+        command_thread.join();
+    }
+}
+
+bool BackplaneControl::start_command_thread(
+        const CommandThreadSettings &settings)
+{
+    bool success = true;
+    command_thread = std::thread(&BackplaneControl::run_commands, this);
+    pthread_t handle = command_thread.native_handle();
+    if (settings.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(settings.cpu, &cpus);
+        int error = pthread_setaffinity_np(handle, sizeof(cpus), &cpus);
+        if (error != 0) {
+            std::cerr << "Error: could not pin command thread " << index
+                << " to CPU " << settings.cpu << ": " << strerror(error)
+                << std::endl;
+            success = false;
+        }
+    }
+    if (settings.priority > 0) {
+        struct sched_param param;
+        param.sched_priority = settings.priority;
+        int error = pthread_setschedparam(handle, SCHED_FIFO, &param);
+        if (error != 0) {
+            std::cerr << "Error: could not set SCHED_FIFO priority "
+                << settings.priority << ": " << strerror(error) << std::endl;
+            success = false;
+        }
+    }
+    return success;
+}
+
+bool BackplaneControl::queue_command(const PendingCommand &pending)
+{
+    // Emergency commands in their own queue
+    bool emergency = (pending.command.priority() == EMERGENCY_PRIORITY);
+    SpscRing<PendingCommand> &queue = emergency ? emergency_commands
+        : pending_commands;
+    if (!queue.push(pending)) {
+        return false;
+    }
+    // Stop a read waiting for a conversion straight away
+    if (emergency) {
+        interrupt_signal.raise();
+    }
+    return true;
+}
+
+void BackplaneControl::wake_command_thread()
+{
+    // Lock so the wake up can't come between the thread's check for
+    // commands and its wait
+    { std::lock_guard<std::mutex> lock(wake_mutex); }
+    command_queued.notify_one();
+}
+
+bool BackplaneControl::emergency_command_waiting()
+{
+    return !emergency_commands.empty();
+}
+
+bool BackplaneControl::interrupt_command()
+{
+    return watchdog.expired() || emergency_command_waiting();
+}
+
+bool BackplaneControl::report_start_latency(std::ostream &out)
+{
+    return start_latency.report(out);
+}
+
+bool BackplaneControl::load_trigger_mask_file()
+{
+    struct stat status;
+    if (stat(trigger_mask_file.c_str(), &status) != 0) {
+        std::cerr << "Error: could not read " << trigger_mask_file << ": "
+            << strerror(errno) << std::endl;
+        return false;
+    }
+    if (file_trigger_mask_loaded
+            && (status.st_mtim.tv_sec == file_trigger_mask_mtime.tv_sec)
+            && (status.st_mtim.tv_nsec == file_trigger_mask_mtime.tv_nsec)
+            && (status.st_size == file_trigger_mask_size)) {
+        return true;
+    }
+    std::ifstream file(trigger_mask_file.c_str());
+    unsigned short mask[NUM_FEES];
+    for (int i = 0; i < NUM_FEES; i++) {
+        if (!(file >> std::hex >> mask[i])) {
+            std::cerr << "Error: could not read the mask of module " << i
+                << " from " << trigger_mask_file << std::endl;
+            return false;
+        }
+    }
+    std::copy(mask, mask + NUM_FEES, file_trigger_mask);
+    file_trigger_mask_loaded = true;
+    file_trigger_mask_mtime = status.st_mtim;
+    file_trigger_mask_size = status.st_size;
+    return true;
+}
+
+bool BackplaneControl::add_samples(slow_control::BackplaneVariables &update)
+{
+    HousekeepingSample sample;
+    while ((update.samples_size() < MAX_SAMPLES_PER_UPDATE)
+            && sampler.next_sample(sample)) {
+        slow_control::HousekeepingSample *added = update.add_samples();
+        added->set_time_usec(sample.time_usec);
+        for (int i = 0; i < SAMPLE_NUM_FEES; i++) {
+            added->add_voltage(sample.voltage[i]);
+            added->add_current(sample.current[i]);
+        }
+        added->set_nstimer(sample.nstimer);
+        added->set_tack_count(sample.tack_count);
+        added->set_trigger_count(sample.trigger_count);
+    }
+    uint32_t n_dropped = sampler.take_dropped_count();
+    if (n_dropped) {
+        update.set_samples_dropped(n_dropped);
+    }
+    return (update.samples_size() > 0) || (n_dropped > 0);
+}
+
+bool BackplaneControl::add_hit_patterns(
+        slow_control::BackplaneVariables &update)
+{
+    // Frames go in one batch, each as an offset from the first frame's time
+    // and its words
+    HitPatternFrame frame;
+    int n_frames = 0;
+    slow_control::HitPatterns *patterns = update.mutable_hit_patterns();
+    std::string &frames = *patterns->mutable_frames();
+    while ((n_frames < MAX_HIT_PATTERNS_PER_UPDATE)
+            && hit_pattern_reader.next_frame(frame)) {
+        if (n_frames == 0) {
+            patterns->set_first_time_usec(frame.time_usec);
+        }
+        patterns->add_time_offset_usec(frame.time_usec
+                - patterns->first_time_usec());
+        append_words(frame.pattern, NUM_HIT_PATTERN_WORDS, frames);
+        n_frames++;
+    }
+    uint32_t n_dropped = hit_pattern_reader.take_dropped_count();
+    if (n_dropped > 0) {
+        patterns->set_frames_dropped(n_dropped);
+    }
+    if ((n_frames == 0) && (n_dropped == 0)) {
+        update.clear_hit_patterns();
+        return false;
+    }
+    return true;
+}
+
+bool BackplaneControl::add_trigger_rates(
+        slow_control::BackplaneVariables &update)
+{
+    TriggerRateRecord record;
+    while ((update.trigger_rates_size() < MAX_TRIGGER_RATES_PER_UPDATE)
+            && rate_monitor.next_record(record)) {
+        slow_control::TriggerRates *added = update.add_trigger_rates();
+        added->set_time_usec(record.time_usec);
+        added->set_window_nsec(record.window_nsec);
+        added->set_n_intervals(record.n_intervals);
+        const CounterRates *rates[2] = {&record.trigger, &record.tack};
+        slow_control::CounterRates *added_rates[2] = {
+            added->mutable_trigger(), added->mutable_tack()};
+        for (int i = 0; i < 2; i++) {
+            added_rates[i]->set_count(rates[i]->count);
+            added_rates[i]->set_mean_hz(rates[i]->mean_hz);
+            added_rates[i]->set_min_hz(rates[i]->min_hz);
+            added_rates[i]->set_max_hz(rates[i]->max_hz);
+            added_rates[i]->set_smoothed_hz(rates[i]->smoothed_hz);
+        }
+    }
+    uint32_t n_dropped = rate_monitor.take_dropped_count();
+    if (n_dropped > 0) {
+        update.set_trigger_rates_dropped(n_dropped);
+    }
+    return (update.trigger_rates_size() > 0) || (n_dropped > 0);
+}
+
+void BackplaneControl::run_commands()
+{
+    select_backplane(index);
+    // Reads are cut short for emergency commands or their deadlines, from
+    // this thread only
+    set_interrupt_check([this]() { return interrupt_command(); },
+            &interrupt_signal);
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex);
+            command_queued.wait(lock, [this]() {
+                    return quit || !pending_commands.empty()
+                        || !emergency_commands.empty(); });
+            if (quit) {
+                return;
+            }
+        }
+        perform_next_command();
+        n_commands_done.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void BackplaneControl::perform_next_command()
+{
+    // Emergency commands first
+    PendingCommand &pending = current_command;
+    if (!emergency_commands.pop(pending) && !pending_commands.pop(pending)) {
+        // Nothing to do
+        return;
+    }
+    const slow_control::LowLevelCommand &backplane_command = pending.command;
+
+    // Look up the handler for the command by code
+    int code = backplane_command.code();
+    if ((code <= BP_UNKNOWN_COMMAND) || (code >= NUM_BACKPLANE_COMMANDS)) {
+        reject_command(backplane_command, "command code "
+                + std::to_string(code) + " not recognized");
+        return;
+    }
+    if (backplane_command.int_args_size() != backplane_command_n_ints(code)) {
+        reject_command(backplane_command, "command "
+                + backplane_command_name(code) + " takes "
+                + std::to_string(backplane_command_n_ints(code))
+                + " integer arguments, not "
+                + std::to_string(backplane_command.int_args_size()));
+        return;
+    }
+
+    int num_spi_messages_sent = 0;
+    unsigned short spi_command[SPI_MESSAGE_LENGTH * MAX_NUM_SPI_MESSAGES] = {0};
+    unsigned short spi_data[SPI_MESSAGE_LENGTH * MAX_NUM_SPI_MESSAGES] = {0};
+    
+    // Handlers fill in only the readings their command takes
+    backplane_variables.Clear();
+
+    // Take appropriate action depending on received command, timing it
+    // The backplane is shared with the sampler, so wait for any sample to
+    // finish; the deadline, counted from receipt, covers the wait
+    if (backplane_command.has_deadline_msec()) {
+        watchdog.watch(code, pending.time_received,
+                backplane_command.deadline_msec());
+    }
+    std::unique_lock<std::mutex> spi_lock(spi_mutex);
+    set_spi_journal_source(SPI_SOURCE_COMMAND, code);
+    auto start = std::chrono::steady_clock::now();
+    int64_t start_unix_usec = unix_time_usec();
+    num_spi_messages_sent = (this->*command_handlers[code])(backplane_command,
+            spi_command, spi_data);
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+    spi_lock.unlock();
+    bool timed_out = watchdog.finish();
+    SpiCheckCounts checks = take_thread_check_counts();
+    auto start_latency_usec = std::chrono::duration_cast<
+        std::chrono::microseconds>(start - pending.time_received).count();
+    start_latency.record(start_latency_usec);
+    if (num_spi_messages_sent < 0) {
+        reject_command(backplane_command, "invalid arguments for command "
+                + backplane_command_name(code));
+        return;
+    }
+    backplane_variables.mutable_command()->CopyFrom(backplane_command);
+    backplane_variables.set_n_spi_messages(num_spi_messages_sent);
+    backplane_variables.set_interrupted(command_interrupted());
+    if (timed_out) {
+        backplane_variables.set_timed_out(true);
+    }
+    backplane_variables.set_command_duration_usec(duration.count());
+    backplane_variables.set_time_usec(start_unix_usec);
+    backplane_variables.set_monotonic_usec(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                start.time_since_epoch()).count());
+    if (checks.retried > 0) {
+        backplane_variables.set_spi_messages_retried(checks.retried);
+    }
+    if (checks.unrecovered > 0) {
+        backplane_variables.set_spi_messages_failed(checks.unrecovered);
+    }
+    pack_words(spi_command, SPI_MESSAGE_LENGTH * num_spi_messages_sent,
+            *backplane_variables.mutable_spi_command());
+    pack_words(spi_data, SPI_MESSAGE_LENGTH * num_spi_messages_sent,
+            *backplane_variables.mutable_spi_data());
+
+    // Pass the result to the network loop to send
+    current_result.variables.CopyFrom(backplane_variables);
+    current_result.start_latency_usec = start_latency_usec;
+    if (!results.push(current_result)) {
+        std::cerr << "Error: result queue full, result of "
+            << backplane_command_name(code) << " dropped" << std::endl;
+    }
+}
+
+void BackplaneControl::reject_command(
+        const slow_control::LowLevelCommand &command,
+        const std::string &reason)
+{
+    std::cerr << "Error: " << reason << std::endl;
+    current_result.variables.Clear();
+    current_result.variables.mutable_command()->CopyFrom(command);
+    current_result.variables.set_interrupted(true);
+    current_result.variables.set_rejected(reason);
+    current_result.start_latency_usec = 0;
+    if (!results.push(current_result)) {
+        std::cerr << "Error: result queue full, rejection of "
+            << backplane_command_name(command.code()) << " dropped"
+            << std::endl;
+    }
+}
+
+// Handlers for each command, indexed by command code
+const BackplaneControl::CommandHandler
+BackplaneControl::command_handlers[NUM_BACKPLANE_COMMANDS] = {
+    nullptr, // BP_UNKNOWN_COMMAND
+#define COMMAND_HANDLER(code, name, n_ints) &BackplaneControl::perform_##name,
+    BACKPLANE_COMMANDS(COMMAND_HANDLER)
+#undef COMMAND_HANDLER
+};
+
+int BackplaneControl::perform_power_control_modules(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    unsigned short command_parameters[NUM_COMMAND_PARAMETERS] = {0};
+    command_parameters[0] = command.int_args(0);
+    command_parameters[1] = command.int_args(1);
+    return power_control_modules(command_parameters, spi_command, spi_data);
+}
+
+int BackplaneControl::perform_reset_dacq1_power(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    return reset_dacq1_power(spi_command, spi_data);
+}
+
+int BackplaneControl::perform_reset_dacq2_power(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    return reset_dacq2_power(spi_command, spi_data);
+}
+
+int BackplaneControl::perform_set_holdoff_time(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    unsigned short command_parameters[NUM_COMMAND_PARAMETERS] = {0};
+    command_parameters[0] = command.int_args(0);
+    return set_holdoff_time(command_parameters, spi_command, spi_data);
+}
+
+int BackplaneControl::perform_set_tack_type_and_mode(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    // type and mode must be 0-3 - enforce this with min
+    unsigned int tack_type = std::min(command.int_args(0), 3u);
+    unsigned int tack_mode = std::min(command.int_args(1), 3u);
+    unsigned short command_parameters[NUM_COMMAND_PARAMETERS] = {0};
+    command_parameters[0] = ((tack_type << 2) | tack_mode);
+    return set_tack_type_and_mode(command_parameters, spi_command, spi_data);
+}
+
+int BackplaneControl::perform_set_trigger(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    unsigned short command_parameters[NUM_COMMAND_PARAMETERS] = {0};
+    for (int i = 0; i < 4; i++) {
+        command_parameters[i] = command.int_args(i);
+    }
+    return set_trigger(command_parameters, spi_command, spi_data);
+}
+
+int BackplaneControl::perform_set_trigger_mask(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    if (!load_trigger_mask_file()) {
+        return -1;
+    }
+    std::copy(file_trigger_mask, file_trigger_mask + NUM_FEES, trigger_mask);
+    trigger_mask_set = true;
+    // Loading the file writes the whole mask, so that it also restores a
+    // mask the FPGA has lost
+    forget_trigger_mask();
+    unsigned short applied[NUM_FEES];
+    int num_spi_messages_sent = set_trigger_mask(trigger_mask, applied,
+            spi_command, spi_data);
+    pack_words(applied, NUM_FEES, *backplane_variables.mutable_trigger_mask());
+    return num_spi_messages_sent;
+}
+
+int BackplaneControl::perform_reset_trigger_counter_and_timer(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    return reset_trigger_and_nstimer(spi_command, spi_data);
+}
+
+int BackplaneControl::perform_toggle_trigger_tack(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    unsigned short command_parameters[NUM_COMMAND_PARAMETERS] = {0};
+    for (int i = 0; i < 7; i++) {
+        // each argument must be 0 or 1 - enforce this with min
+        command_parameters[0] = (command_parameters[0] & ~(1 << i))
+            | (std::min(command.int_args(i), 1u) << i);
+    }
+    return enable_disable_trigger(command_parameters, spi_command, spi_data);
+}
+
+int BackplaneControl::perform_sync(const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    return sync(spi_command, spi_data);
+}
+
+int BackplaneControl::perform_read_modules_present(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    unsigned short fees_present[NUM_FEES];
+    int num_spi_messages_sent = read_fees_present(fees_present, spi_command,
+            spi_data);
+    backplane_variables.set_present(pack_flags(fees_present, NUM_FEES));
+    return num_spi_messages_sent;
+}
+
+int BackplaneControl::perform_read_module_currents(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    float currents[NUM_FEES] = {0};
+    int num_spi_messages_sent = read_currents(currents, spi_command, spi_data);
+    for (int i = 0; i < NUM_FEES; i++) {
+        backplane_variables.add_current(currents[i]);
+    }
+    return num_spi_messages_sent;
+}
+
+int BackplaneControl::perform_read_module_voltages(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    float voltages[NUM_FEES] = {0};
+    int num_spi_messages_sent = read_voltages(voltages, spi_command, spi_data);
+    for (int i = 0; i < NUM_FEES; i++) {
+        backplane_variables.add_voltage(voltages[i]);
+    }
+    return num_spi_messages_sent;
+}
+
+int BackplaneControl::perform_read_timer_and_trigger_rate(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    return read_nstimer_trigger_rate(spi_command, spi_data);
+}
+
+int BackplaneControl::perform_read_module_housekeeping(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    float voltages[NUM_FEES] = {0};
+    float currents[NUM_FEES] = {0};
+    int num_spi_messages_sent = read_housekeeping(voltages, currents,
+            spi_command, spi_data);
+    for (int i = 0; i < NUM_FEES; i++) {
+        backplane_variables.add_voltage(voltages[i]);
+        backplane_variables.add_current(currents[i]);
+    }
+    return num_spi_messages_sent;
+}
+
+int BackplaneControl::perform_start_sampling(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    if (command.int_args(0) == 0) {
+        return -1;
+    }
+    sampler.set_period(command.int_args(0));
+    return 0; // no SPI messages sent here
+}
+
+int BackplaneControl::perform_stop_sampling(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    sampler.set_period(0);
+    return 0; // no SPI messages sent here
+}
+
+int BackplaneControl::perform_set_module_trigger_mask(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    if (command.int_args(0) >= NUM_FEES) {
+        return -1;
+    }
+    // Other modules keep their masks, those of the file until set otherwise
+    if (!trigger_mask_set) {
+        if (!load_trigger_mask_file()) {
+            return -1;
+        }
+        std::copy(file_trigger_mask, file_trigger_mask + NUM_FEES,
+                trigger_mask);
+        trigger_mask_set = true;
+    }
+    trigger_mask[command.int_args(0)] = command.int_args(1);
+    // Only the block of eight modules including this one is sent, if its
+    // mask changed
+    unsigned short applied[NUM_FEES];
+    int num_spi_messages_sent = set_trigger_mask(trigger_mask, applied,
+            spi_command, spi_data);
+    pack_words(applied, NUM_FEES, *backplane_variables.mutable_trigger_mask());
+    return num_spi_messages_sent;
+}
+
+int BackplaneControl::perform_start_hit_patterns(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    if (command.int_args(0) == 0) {
+        return -1;
+    }
+    hit_pattern_reader.set_period(command.int_args(0));
+    return 0; // no SPI messages sent here
+}
+
+int BackplaneControl::perform_stop_hit_patterns(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    hit_pattern_reader.set_period(0);
+    return 0; // no SPI messages sent here
+}
+
+int BackplaneControl::perform_start_trigger_rates(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    // A record period of 0 would make no records
+    if ((command.int_args(0) == 0) || (command.int_args(1) == 0)) {
+        return -1;
+    }
+    rate_monitor.set_periods(command.int_args(0), command.int_args(1));
+    return 0; // no SPI messages sent here
+}
+
+int BackplaneControl::perform_stop_trigger_rates(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    rate_monitor.set_periods(0, 0);
+    return 0; // no SPI messages sent here
+}
+
+int BackplaneControl::perform_read_spi_journal(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    if ((command.int_args(0) == 0)
+            || (command.int_args(0) > MAX_SPI_JOURNAL_ENTRIES)) {
+        return -1;
+    }
+    SpiJournalEntry entries[MAX_SPI_JOURNAL_ENTRIES];
+    int n_entries = read_spi_journal(entries, command.int_args(0));
+    for (int i = 0; i < n_entries; i++) {
+        slow_control::SpiJournalEntry *added =
+            backplane_variables.add_spi_journal();
+        added->set_sequence(entries[i].sequence);
+        added->set_start_nsec(entries[i].start_nsec);
+        added->set_duration_nsec(entries[i].end_nsec - entries[i].start_nsec);
+        added->set_command_word(entries[i].command_word);
+        added->set_source(entries[i].source);
+        if (entries[i].source == SPI_SOURCE_COMMAND) {
+            added->set_command_code(entries[i].command_code);
+        }
+        added->set_checks_passed(entries[i].checks_passed);
+        if (entries[i].backplane > 0) {
+            added->set_backplane(entries[i].backplane);
+        }
+    }
+    return 0; // no SPI messages sent here
+}
+
+int BackplaneControl::perform_read_module_housekeeping_oversampled(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    int n_conversions = command.int_args(0);
+    if ((n_conversions < 1)
+            || (n_conversions > MAX_HOUSEKEEPING_CONVERSIONS)) {
+        return -1;
+    }
+    static_assert(STATISTICS_NUM_FEES == NUM_FEES,
+            "statistics must be kept of every module");
+    ReadingStatistics voltage_statistics;
+    ReadingStatistics current_statistics;
+    float voltages[NUM_FEES] = {0};
+    float currents[NUM_FEES] = {0};
+    // Each conversion reuses the buffers, so the messages of the last are
+    // those sent back; an interrupted conversion rebuilds the same commands
+    // before sending any, leaving the replies of the last completed
+    int num_spi_messages_sent = 0;
+    for (int i = 0; i < n_conversions; i++) {
+        int n_messages = read_housekeeping(voltages, currents, spi_command,
+                spi_data);
+        if (n_messages == 0) {
+            // Interrupted, and marked so; the conversions completed are
+            // still sent back, with their number
+            break;
+        }
+        num_spi_messages_sent = n_messages;
+        voltage_statistics.add(voltages);
+        current_statistics.add(currents);
+    }
+    if (voltage_statistics.count() == 0) {
+        return 0; // interrupted before any conversion, so no readings
+    }
+
+    float mean[NUM_FEES], min[NUM_FEES], max[NUM_FEES], std_dev[NUM_FEES];
+    slow_control::ReadingSpread *spread =
+        backplane_variables.mutable_voltage_spread();
+    voltage_statistics.finish(mean, min, max, std_dev);
+    for (int i = 0; i < NUM_FEES; i++) {
+        backplane_variables.add_voltage(mean[i]);
+        spread->add_min(min[i]);
+        spread->add_max(max[i]);
+        spread->add_std(std_dev[i]);
+    }
+    spread = backplane_variables.mutable_current_spread();
+    current_statistics.finish(mean, min, max, std_dev);
+    for (int i = 0; i < NUM_FEES; i++) {
+        backplane_variables.add_current(mean[i]);
+        spread->add_min(min[i]);
+        spread->add_max(max[i]);
+        spread->add_std(std_dev[i]);
+    }
+    backplane_variables.set_n_conversions(voltage_statistics.count());
+    return num_spi_messages_sent;
+}
+
+int BackplaneControl::perform_read_all_housekeeping(
+        const slow_control::LowLevelCommand &command,
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    // Presence, then voltages and currents from one conversion, then the
+    // trigger counters, each set of messages following the last in the
+    // buffers
+    unsigned short fees_present[NUM_FEES];
+    int num_spi_messages_sent = read_fees_present(fees_present, spi_command,
+            spi_data);
+    backplane_variables.set_present(pack_flags(fees_present, NUM_FEES));
+
+    float voltages[NUM_FEES] = {0};
+    float currents[NUM_FEES] = {0};
+    int num_read = read_housekeeping(voltages, currents,
+            spi_command + num_spi_messages_sent * SPI_MESSAGE_LENGTH,
+            spi_data + num_spi_messages_sent * SPI_MESSAGE_LENGTH);
+    if (num_read == 0) {
+        // Interrupted, and marked so
+        return num_spi_messages_sent;
+    }
+    num_spi_messages_sent += num_read;
+    int64_t time_usec = unix_time_usec();
+
+    unsigned short *counter_data =
+        spi_data + num_spi_messages_sent * SPI_MESSAGE_LENGTH;
+    num_spi_messages_sent += read_nstimer_trigger_rate(
+            spi_command + num_spi_messages_sent * SPI_MESSAGE_LENGTH,
+            counter_data);
+    TriggerCounters counters;
+    decode_trigger_counters(counter_data, counters);
+
+    slow_control::HousekeepingSample *snapshot =
+        backplane_variables.mutable_snapshot();
+    snapshot->set_time_usec(time_usec);
+    for (int i = 0; i < NUM_FEES; i++) {
+        snapshot->add_voltage(voltages[i]);
+        snapshot->add_current(currents[i]);
+    }
+    snapshot->set_nstimer(counters.nstimer);
+    snapshot->set_tack_count(counters.tack_count);
+    snapshot->set_trigger_count(counters.trigger_count);
+    return num_spi_messages_sent;
+}
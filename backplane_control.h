@@ -0,0 +1,198 @@
+// backplane_control.h
+// Header file containing the class performing commands on one backplane
+
+#ifndef BACKPLANE_CONTROL_H
+#define BACKPLANE_CONTROL_H
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <sys/stat.h>
+
+#include "slow_control.pb.h"
+#include "backplane_spi.h"
+#include "backplane_commands.h"
+#include "backplane_encoding.h"
+#include "housekeeping_sampler.h"
+#include "hit_pattern_reader.h"
+#include "trigger_rate_monitor.h"
+#include "latency_histogram.h"
+#include "command_watchdog.h"
+#include "spi_journal.h"
+#include "reading_statistics.h"
+#include "spsc_ring.h"
+
+// TODO: load constants from config file
+const int NUM_FEES = 32; // number of modules allowed for in underlying code
+const int SPI_MESSAGE_LENGTH = 11;
+// Most SPI messages one command sends, those of read_all_housekeeping
+const int MAX_NUM_SPI_MESSAGES = 10;
+// Priority (CHK) level of commands performed ahead of all others
+const int EMERGENCY_PRIORITY = 3;
+// Most housekeeping samples sent in one update, keeping it well within the
+// largest network message
+const int MAX_SAMPLES_PER_UPDATE = 32;
+// Most hit pattern frames sent in one update, about 17 kB
+const int MAX_HIT_PATTERNS_PER_UPDATE = 256;
+// Most trigger rate records sent in one update, about 4 kB
+const int MAX_TRIGGER_RATES_PER_UPDATE = 64;
+// Most SPI journal entries sent in one result, about 16 kB
+const int MAX_SPI_JOURNAL_ENTRIES = 512;
+// Most conversions averaged by one oversampled housekeeping read, which
+// holds the backplane for that many ADC conversion times
+const int MAX_HOUSEKEEPING_CONVERSIONS = 1000;
+// Commands, and results, waiting to be passed between threads
+const std::size_t COMMAND_QUEUE_SIZE = 256;
+// File the trigger mask of backplane 0 is loaded from, in the working
+// directory: the mask of each module in turn, as hex words; that of backplane
+// n is loaded from the same name followed by "_n"
+const char * const TRIGGER_MASK_FILE = "trigger_mask";
+
+// How the threads performing commands are run
+struct CommandThreadSettings {
+    int cpu; // to pin the threads to, or -1 for any
+    int priority; // SCHED_FIFO priority, or 0 for normal scheduling
+    bool lock_memory; // lock the program's memory to avoid page faults
+    CommandThreadSettings() : cpu(-1), priority(0), lock_memory(false) {}
+};
+
+// A command received from the server and awaiting execution
+struct PendingCommand {
+    slow_control::LowLevelCommand command;
+    std::chrono::steady_clock::time_point time_received;
+};
+
+// The backplane variables following a command, awaiting sending
+struct CommandResult {
+    slow_control::BackplaneVariables variables;
+    long long start_latency_usec; // from receipt to reaching the bus
+};
+
+// Commands for one backplane are queued by the network loop and performed
+// by a thread of their own, with the backplane selected (see
+// backplane_spi.h), so that network and protobuf work don't delay commands
+// once started. The two pass commands and results through rings that don't
+// lock. Each backplane has its own command thread and its own sampler, hit
+// pattern reader, and rate monitor, so a command waits only for work on its
+// own backplane; the others' use the bus between its messages.
+class BackplaneControl {
+protected:
+    int index; // of the backplane, as selected
+    std::string trigger_mask_file;
+
+    // Passed from the network loop to the command thread, which is woken
+    // by command_queued when a command arrives
+    SpscRing<PendingCommand> pending_commands;
+    SpscRing<PendingCommand> emergency_commands; // performed first
+    std::mutex wake_mutex;
+    std::condition_variable command_queued;
+    bool quit; // guarded by wake_mutex
+
+    // Passed back from the command thread to the network loop
+    SpscRing<CommandResult> results;
+    LatencyHistogram start_latency;
+    // Commands taken from the queues, whether performed or rejected
+    std::atomic<uint64_t> n_commands_done;
+
+    // Used by the command thread only, each reused to keep its buffers
+    slow_control::BackplaneVariables backplane_variables;
+    PendingCommand current_command;
+    CommandResult current_result;
+    std::thread command_thread;
+
+    // Trigger mask as last loaded from the file, kept until the file is
+    // modified, and the mask to apply, which starts as the file's and is
+    // then changed module by module
+    unsigned short file_trigger_mask[NUM_FEES];
+    bool file_trigger_mask_loaded;
+    struct timespec file_trigger_mask_mtime;
+    off_t file_trigger_mask_size;
+    unsigned short trigger_mask[NUM_FEES];
+    bool trigger_mask_set;
+
+    // Held while using the backplane, which is shared with the sampler
+    std::mutex spi_mutex;
+    HousekeepingSampler sampler;
+    HitPatternReader hit_pattern_reader;
+    TriggerRateMonitor rate_monitor;
+    // Wakes the command thread from an ADC conversion for an emergency
+    // command or its deadline
+    InterruptSignal interrupt_signal;
+    // Cuts short commands overrunning the deadline the server gives them
+    CommandWatchdog watchdog;
+
+    // Return true if an emergency command is waiting to be performed
+    bool emergency_command_waiting();
+    // Return true if the command being performed should be cut short, for an
+    // emergency command or its deadline
+    bool interrupt_command();
+    // Perform commands as they arrive until told to quit
+    void run_commands();
+    // Perform the next command, emergency commands first, and queue the
+    // result to be sent
+    void perform_next_command();
+    // Queue the result of a command that couldn't be performed, so that the
+    // server stops waiting for it straight away
+    void reject_command(const slow_control::LowLevelCommand &command,
+            const std::string &reason);
+    // Load the trigger mask file, unless it's unchanged since last loaded
+    // Return true if successful, false otherwise
+    bool load_trigger_mask_file();
+
+    // Perform a command, filling in the SPI messages and any readings, with
+    // one handler, perform_name, for each command in BACKPLANE_COMMANDS
+    // (see backplane_commands.h), called with the number of integer
+    // arguments listed there
+    // Return the number of SPI messages sent, or -1 if the arguments are
+    // invalid
+    typedef int (BackplaneControl::*CommandHandler)(
+            const slow_control::LowLevelCommand &command,
+            unsigned short spi_command[], unsigned short spi_data[]);
+    static const CommandHandler command_handlers[NUM_BACKPLANE_COMMANDS];
+#define DECLARE_COMMAND_HANDLER(code, name, n_ints) \
+    int perform_##name(const slow_control::LowLevelCommand &command, \
+            unsigned short spi_command[], unsigned short spi_data[]);
+    BACKPLANE_COMMANDS(DECLARE_COMMAND_HANDLER)
+#undef DECLARE_COMMAND_HANDLER
+public:
+    BackplaneControl(int backplane_index);
+    ~BackplaneControl();
+    // Start the thread performing commands
+    // Return false if it could not be set up as asked; it runs regardless
+    bool start_command_thread(const CommandThreadSettings &settings);
+
+    // Queue a command to be performed, from the network loop
+    // Return false if the queue is full
+    bool queue_command(const PendingCommand &pending);
+    // Wake the command thread for the commands queued
+    void wake_command_thread();
+    // Take the oldest result not yet taken
+    // Return false if there is none
+    bool next_result(CommandResult &result) { return results.pop(result); }
+    // Number of commands taken from the queues and finished with, whether
+    // performed or rejected, so that their results (if any) have been queued
+    uint64_t commands_done() const {
+        return n_commands_done.load(std::memory_order_acquire);
+    }
+
+    // Move samples waiting to be sent into an update for the server
+    // Return true if there was anything to add
+    bool add_samples(slow_control::BackplaneVariables &update);
+    // Move hit patterns waiting to be sent into an update for the server
+    // Return true if there was anything to add
+    bool add_hit_patterns(slow_control::BackplaneVariables &update);
+    // Move trigger rate records waiting to be sent into an update for the
+    // server
+    // Return true if there was anything to add
+    bool add_trigger_rates(slow_control::BackplaneVariables &update);
+
+    // Write how long commands waited to start since the last report
+    // Return false, writing nothing, if no command has been performed
+    bool report_start_latency(std::ostream &out);
+};
+
+#endif
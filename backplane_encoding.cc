@@ -0,0 +1,41 @@
+// backplane_encoding.cc
+// Packing and unpacking of the readings in BackplaneVariables
+
+#include "backplane_encoding.h"
+
+void pack_words(const unsigned short words[], int n_words, std::string &bytes)
+{
+    bytes.clear();
+    append_words(words, n_words, bytes);
+}
+
+void append_words(const unsigned short words[], int n_words,
+        std::string &bytes)
+{
+    std::size_t start = bytes.size();
+    bytes.resize(start + 2 * n_words);
+    for (int i = 0; i < n_words; i++) {
+        bytes[start + 2 * i] = words[i] & 0xff;
+        bytes[start + 2 * i + 1] = words[i] >> 8;
+    }
+}
+
+unsigned short packed_word(const std::string &bytes, int i)
+{
+    if ((i < 0) || (i >= packed_word_count(bytes))) {
+        return 0;
+    }
+    return (unsigned char)bytes[2 * i]
+        | ((unsigned char)bytes[2 * i + 1] << 8);
+}
+
+uint32_t pack_flags(const unsigned short flags[], int n)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < n; i++) {
+        if (flags[i] != 0) {
+            mask |= (uint32_t)1 << i;
+        }
+    }
+    return mask;
+}
@@ -0,0 +1,38 @@
+// backplane_encoding.h
+// Compact encoding of the readings in BackplaneVariables (see
+// slow_control.proto), shared by the Pi, which fills them in, and the server
+// and interface, which read them
+
+#ifndef BACKPLANE_ENCODING_H
+#define BACKPLANE_ENCODING_H
+
+#include <cstdint>
+#include <string>
+
+// Pack 16 bit words into bytes, two per word, little-endian, reusing the
+// string's storage
+void pack_words(const unsigned short words[], int n_words, std::string &bytes);
+
+// Append 16 bit words to bytes, packed the same way
+void append_words(const unsigned short words[], int n_words,
+        std::string &bytes);
+
+// Number of words packed in bytes
+inline int packed_word_count(const std::string &bytes)
+{
+    return bytes.size() / 2;
+}
+
+// Word i of packed words, or 0 if there aren't that many
+unsigned short packed_word(const std::string &bytes, int i);
+
+// Pack one flag per module (set if nonzero) into a bitmask, module 0 lowest
+uint32_t pack_flags(const unsigned short flags[], int n);
+
+// Flag i of a bitmask, as 0 or 1
+inline int mask_flag(uint32_t mask, int i)
+{
+    return (mask >> i) & 1;
+}
+
+#endif
@@ -0,0 +1,269 @@
+// backplane_encoding_test.cc
+/* Check that the packed readings of BackplaneVariables (see
+ * backplane_encoding.h) decode to what was encoded, for every module, both
+ * directly and through a serialized message, and report the size of typical
+ * results as encoded now and as they were before: every result then carried
+ * all 44 SPI word slots and all 32 voltages, currents, presence flags, and
+ * trigger masks, as packed repeated integers and floats. The results are
+ * filled in as the Pi does, with the messages of a simulated backplane.
+ * Exits with status 1 if anything decodes differently. */
+
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "backplane_encoding.h"
+#include "backplane_spi.h"
+#include "slow_control.pb.h"
+#include "spi_protocol.h"
+
+using google::protobuf::io::CodedOutputStream;
+
+const int NUM_MODULES = 32;
+// SPI word slots of every result before, 11 for each of up to four messages,
+// or as many as were sent
+const int OLD_SPI_WORDS = 44;
+
+int n_failed = 0;
+
+void check(bool passed, const std::string &what)
+{
+    if (!passed) {
+        std::cout << "FAIL: " << what << std::endl;
+        n_failed++;
+    }
+}
+
+// Check that words packed, appended after other words, and sent in a
+// message unpack to the same words, and nothing past them
+void check_words(const std::vector<unsigned short> &words,
+        const std::string &name)
+{
+    int n = words.size();
+    std::string bytes;
+    pack_words(words.data(), n, bytes);
+    check(packed_word_count(bytes) == n, name + ": word count");
+    std::string appended;
+    const unsigned short before[3] = {0x1234, 0xFFFF, 0x0000};
+    pack_words(before, 3, appended);
+    append_words(words.data(), n, appended);
+    slow_control::BackplaneVariables sent;
+    sent.set_trigger_mask(bytes);
+    slow_control::BackplaneVariables received;
+    received.ParseFromString(sent.SerializeAsString());
+    for (int i = 0; i < n; i++) {
+        check(packed_word(bytes, i) == words[i], name + ": word "
+                + std::to_string(i));
+        check(packed_word(appended, 3 + i) == words[i], name
+                + ": appended word " + std::to_string(i));
+        check(packed_word(received.trigger_mask(), i) == words[i], name
+                + ": sent word " + std::to_string(i));
+    }
+    for (int i = 0; i < 3; i++) {
+        check(packed_word(appended, i) == before[i], name
+                + ": word before those appended " + std::to_string(i));
+    }
+    check(packed_word(bytes, -1) == 0, name + ": word before the first");
+    check(packed_word(bytes, n) == 0, name + ": word after the last");
+}
+
+// Check that one flag per module packs to a bitmask giving each back, also
+// once sent in a message
+void check_flags(const unsigned short flags[], const std::string &name)
+{
+    uint32_t mask = pack_flags(flags, NUM_MODULES);
+    slow_control::BackplaneVariables sent;
+    sent.set_present(mask);
+    slow_control::BackplaneVariables received;
+    received.ParseFromString(sent.SerializeAsString());
+    for (int i = 0; i < NUM_MODULES; i++) {
+        int flag = (flags[i] != 0) ? 1 : 0;
+        check(mask_flag(mask, i) == flag, name + ": module "
+                + std::to_string(i));
+        check(mask_flag(received.present(), i) == flag, name
+                + ": sent module " + std::to_string(i));
+    }
+}
+
+void check_round_trips()
+{
+    std::minstd_rand random;
+    std::vector<unsigned short> words(NUM_MODULES);
+    for (int i = 0; i < NUM_MODULES; i++) {
+        words[i] = 1 << (i % 16);
+    }
+    check_words(words, "single bits");
+    for (int i = 0; i < NUM_MODULES; i++) {
+        words[i] = 0xFFFF - i;
+    }
+    check_words(words, "high words");
+    for (int i = 0; i < NUM_MODULES; i++) {
+        words[i] = random();
+    }
+    check_words(words, "random words");
+    check_words(std::vector<unsigned short>(NUM_MODULES, 0), "zero words");
+    check_words(std::vector<unsigned short>(), "no words");
+
+    unsigned short flags[NUM_MODULES];
+    for (int module = 0; module < NUM_MODULES; module++) {
+        // Any nonzero value is a set flag
+        std::fill(flags, flags + NUM_MODULES, 0);
+        flags[module] = 1 + module;
+        check_flags(flags, "only module " + std::to_string(module));
+        std::fill(flags, flags + NUM_MODULES, 0xFFFF);
+        flags[module] = 0;
+        check_flags(flags, "all but module " + std::to_string(module));
+    }
+    for (int i = 0; i < NUM_MODULES; i++) {
+        flags[i] = random() % 2;
+    }
+    check_flags(flags, "random flags");
+}
+
+// Size of a packed repeated field with a payload of the given size
+int packed_field_size(int field, int payload)
+{
+    return CodedOutputStream::VarintSize32(field << 3)
+        + CodedOutputStream::VarintSize32(payload) + payload;
+}
+
+int varints_size(const std::vector<uint32_t> &values)
+{
+    int size = 0;
+    for (std::size_t i = 0; i < values.size(); i++) {
+        size += CodedOutputStream::VarintSize32(values[i]);
+    }
+    return size;
+}
+
+// Words packed in bytes, padded with zeros to at least n
+std::vector<uint32_t> unpacked_words(const std::string &bytes, int n)
+{
+    std::vector<uint32_t> words(std::max(n, packed_word_count(bytes)), 0);
+    for (int i = 0; i < packed_word_count(bytes); i++) {
+        words[i] = packed_word(bytes, i);
+    }
+    return words;
+}
+
+// Size of a result with the encoding before: the same but for spi_command
+// (3), spi_data (4), voltage (5), current (6), present (7), and trigger_mask
+// (8), which were always sent whole as packed repeated fields
+int old_size(const slow_control::BackplaneVariables &variables)
+{
+    slow_control::BackplaneVariables others(variables);
+    others.clear_spi_command();
+    others.clear_spi_data();
+    others.clear_voltage();
+    others.clear_current();
+    others.clear_present();
+    others.clear_trigger_mask();
+    int size = others.SerializeAsString().size();
+    size += packed_field_size(3, varints_size(unpacked_words(
+                    variables.spi_command(), OLD_SPI_WORDS)));
+    size += packed_field_size(4, varints_size(unpacked_words(
+                    variables.spi_data(), OLD_SPI_WORDS)));
+    size += 2 * packed_field_size(5, 4 * NUM_MODULES);
+    std::vector<uint32_t> present(NUM_MODULES);
+    for (int i = 0; i < NUM_MODULES; i++) {
+        present[i] = mask_flag(variables.present(), i);
+    }
+    size += packed_field_size(7, varints_size(present));
+    size += packed_field_size(8, varints_size(unpacked_words(
+                    variables.trigger_mask(), NUM_MODULES)));
+    return size;
+}
+
+// Fill in the variables every result has, as the Pi does, and report the
+// size of the result now and before
+void report_size(const std::string &name, int code, int n_messages,
+        const unsigned short spi_command[], const unsigned short spi_data[],
+        slow_control::BackplaneVariables &variables)
+{
+    variables.mutable_command()->set_device(0);
+    variables.mutable_command()->set_priority(0);
+    variables.mutable_command()->set_code(code);
+    variables.set_n_spi_messages(n_messages);
+    variables.set_interrupted(false);
+    variables.set_command_duration_usec(1000 * n_messages);
+    variables.set_time_usec(1792385829362176);
+    variables.set_monotonic_usec(25030806);
+    pack_words(spi_command, SPI_MESSAGE_WORDS * n_messages,
+            *variables.mutable_spi_command());
+    pack_words(spi_data, SPI_MESSAGE_WORDS * n_messages,
+            *variables.mutable_spi_data());
+    char line[80];
+    std::snprintf(line, sizeof(line), "  %-28s %4d -> %4d", name.c_str(),
+            old_size(variables),
+            (int)variables.SerializeAsString().size());
+    std::cout << line << std::endl;
+}
+
+void report_sizes()
+{
+    if (!initialize_lowlevel("simulated")) {
+        check(false, "simulated backplane");
+        return;
+    }
+    unsigned short spi_command[8 * SPI_MESSAGE_WORDS];
+    unsigned short spi_data[8 * SPI_MESSAGE_WORDS];
+    std::cout << "Size of results (bytes), before -> now:" << std::endl;
+
+    slow_control::BackplaneVariables counters;
+    int n = read_nstimer_trigger_rate(spi_command, spi_data);
+    report_size("read_timer_and_trigger_rate",
+            BP_READ_TIMER_AND_TRIGGER_RATE, n, spi_command, spi_data,
+            counters);
+
+    slow_control::BackplaneVariables present;
+    unsigned short fees_present[NUM_MODULES];
+    n = read_fees_present(fees_present, spi_command, spi_data);
+    present.set_present(pack_flags(fees_present, NUM_MODULES));
+    report_size("read_modules_present", BP_READ_MODULES_PRESENT, n,
+            spi_command, spi_data, present);
+
+    slow_control::BackplaneVariables housekeeping;
+    float voltages[NUM_MODULES];
+    float currents[NUM_MODULES];
+    n = read_housekeeping(voltages, currents, spi_command, spi_data);
+    for (int i = 0; i < NUM_MODULES; i++) {
+        housekeeping.add_voltage(voltages[i]);
+        housekeeping.add_current(currents[i]);
+    }
+    report_size("read_module_housekeeping", BP_READ_MODULE_HOUSEKEEPING, n,
+            spi_command, spi_data, housekeeping);
+
+    slow_control::BackplaneVariables mask;
+    unsigned short trigger_mask[NUM_TRIGGER_MASKS];
+    unsigned short applied[NUM_TRIGGER_MASKS];
+    for (int i = 0; i < NUM_TRIGGER_MASKS; i++) {
+        trigger_mask[i] = (i % 3 == 0) ? 0xFFFF : 0x0000;
+    }
+    n = set_trigger_mask(trigger_mask, applied, spi_command, spi_data);
+    pack_words(applied, NUM_TRIGGER_MASKS, *mask.mutable_trigger_mask());
+    report_size("set_trigger_mask", BP_SET_TRIGGER_MASK, n, spi_command,
+            spi_data, mask);
+    // What the server reads back is what was applied
+    for (int i = 0; i < NUM_TRIGGER_MASKS; i++) {
+        check(packed_word(mask.trigger_mask(), i) == trigger_mask[i],
+                "trigger mask of module " + std::to_string(i));
+    }
+}
+
+int main()
+{
+    set_adc_conversion_time(0);
+    check_round_trips();
+    report_sizes();
+    if (n_failed > 0) {
+        std::cout << n_failed << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All readings decode as encoded" << std::endl;
+    return 0;
+}
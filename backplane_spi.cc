@@ -5,126 +5,327 @@
 
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <arpa/inet.h>
 
-#include <ctime>
 #include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "adc_calibration.h"
+#include "backplane_spi.h"
+#include "spi_backend.h"
+#include "spi_capture.h"
+#include "spi_journal.h"
+#include "spi_protocol.h"
+
+// Check for pending emergency commands, and whether the last command was
+// stopped early because of one; kept for each thread, so that only the
+// thread performing commands from the server is interrupted
+thread_local std::function<bool()> interrupt_check;
+thread_local InterruptSignal *interrupt_signal = nullptr;
+thread_local bool interrupted = false;
+
+// Counts of replies failing their checks, of the calling thread's messages,
+// and of all messages by backplane and command word
+thread_local SpiCheckCounts thread_check_counts = {0, 0, 0, 0};
+std::mutex check_totals_mutex;
+SpiCheckTotals check_totals;
+
+// Name of the capture files of backplanes added, if captured
+std::string spi_capture_file;
+
+// Time between words sent, if the FPGA needs one
+int spi_word_gap_usec = 0;
+
+// Time allowed for the ADCs to convert all channels after being triggered
+int adc_conversion_usec = DEFAULT_ADC_CONVERSION_USEC;
+
+// Blocks of eight modules whose trigger masks are set together
+const int TRIGGER_MASK_BLOCKS = NUM_TRIGGER_MASKS / 8;
+
+// A backplane, reached through a backend of its own (its chip select or
+// device), and what's known of its state
+struct Backplane {
+    std::unique_ptr<SpiBackend> backend;
+    // Writes its capture, if captured
+    std::shared_ptr<SpiCaptureWriter> capture;
+    // Module read by each ADC channel, and the conversion of its readings
+    AdcCalibration adc_calibration;
+    // When its ADCs were last triggered
+    std::chrono::steady_clock::time_point adc_trigger_time;
+    // The masks the FPGA last read back for each block, if they're the ones
+    // sent
+    unsigned short applied_trigger_mask[NUM_TRIGGER_MASKS];
+    bool trigger_mask_applied[TRIGGER_MASK_BLOCKS];
+};
+
+// Backplanes added, all before any thread uses them, and the one each
+// thread's messages go to
+std::vector<std::unique_ptr<Backplane>> backplanes;
+thread_local int selected_backplane = 0;
+
+// Held while a batch is on the bus, which the backplanes share
+std::mutex bus_mutex;
+
+// Return the backplane selected by the calling thread
+Backplane &backplane()
+{
+    return *backplanes[selected_backplane];
+}
+
+bool initialize_lowlevel(std::string backend_name)
+{
+    backplanes.clear();
+    selected_backplane = 0;
+    return add_backplane(backend_name) == 0;
+}
+
+int add_backplane(std::string backend_name)
+{
+    SpiBackend *backend = create_spi_backend(backend_name);
+    if (!backend) {
+        return -1;
+    }
+    return add_backplane_backend(backend);
+}
+
+int add_backplane_backend(SpiBackend *backend)
+{
+    std::unique_ptr<Backplane> added(new Backplane());
+    added->backend.reset(backend);
+    if (backplanes.size() >= (std::size_t)MAX_BACKPLANES) {
+        std::cerr << "Error: at most " << MAX_BACKPLANES
+            << " backplanes can be added" << std::endl;
+        return -1;
+    }
+    if (!spi_capture_file.empty()) {
+        std::string file_name = spi_capture_file;
+        if (!backplanes.empty()) {
+            file_name += "_" + std::to_string(backplanes.size());
+        }
+        added->capture = std::make_shared<SpiCaptureWriter>();
+        if (!added->capture->open(file_name, backplanes.size())) {
+            return -1;
+        }
+        added->backend.reset(new CapturingBackend(added->backend.release(),
+                    added->capture));
+    }
+    if (!added->backend->initialize()) {
+        return -1;
+    }
+    std::fill(added->applied_trigger_mask,
+            added->applied_trigger_mask + NUM_TRIGGER_MASKS, 0);
+    std::fill(added->trigger_mask_applied,
+            added->trigger_mask_applied + TRIGGER_MASK_BLOCKS, false);
+    backplanes.push_back(std::move(added));
+    return backplanes.size() - 1;
+}
+
+int num_backplanes()
+{
+    return backplanes.size();
+}
+
+void select_backplane(int index)
+{
+    selected_backplane = index;
+}
+
+void set_spi_capture(std::string file_name)
+{
+    spi_capture_file = file_name;
+}
+
+void capture_command(int index, const std::string &command)
+{
+    const std::shared_ptr<SpiCaptureWriter> &capture =
+        backplanes[index]->capture;
+    if (capture) {
+        capture->write_command(monotonic_nsec(), command);
+    }
+}
+
+void InterruptSignal::raise()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        raised = true;
+    }
+    raised_changed.notify_one();
+}
+
+void InterruptSignal::wait_until(std::chrono::steady_clock::time_point time)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    raised_changed.wait_until(lock, time, [this]() { return raised; });
+    raised = false;
+}
+
+void set_interrupt_check(std::function<bool()> check, InterruptSignal *signal)
+{
+    interrupt_check = check;
+    interrupt_signal = signal;
+}
 
-#include "bcm2835.h" // Driver for SPI chip
-
-/* Command Words */
-#define  SPI_WRAP_AROUND   	0x0000   /* cmd */
-#define  CW_RESET_FEE   	0x0100   /* cmd */
-#define  CW_FEEs_PRESENT    0x0200   /* cmd */
-#define  CW_FEE_POWER_CTL   0x0400   /* cmd */
-#define  CW_RD_FEE0_I	    0x0500   /* cmd */
-#define  CW_RD_FEE8_I	    0x0507   /* cmd */
-#define  CW_RD_FEE16_I	    0x050F   /* cmd */
-#define  CW_RD_FEE24_I	    0x0510   /* cmd */
-#define  CW_RD_FEE0_V	    0x0600   /* cmd */
-#define  CW_RD_FEE8_V	    0x0607   /* cmd */
-#define  CW_RD_FEE16_V	    0x060F   /* cmd */
-#define  CW_RD_FEE24_V	    0x0610   /* cmd */
-#define  CW_RD_ENV          0x0700   /* cmd */
-#define  CW_RD_HKPWB	    0x0800   /* cmd */
-#define  CW_PERI_TRIG       0x0900   /* cmd */
-#define  CW_TRG_ADCS	    0x0A00   /* cmd */
-#define  CW_RD_PWRSTATUS    0x0B00   /* cmd */
-#define  CW_DACQ1_PWR_RESET  0x0C00   /* cmd */
-#define  CW_DACQ2_PWR_RESET  0x0D00   /* cmd */
-#define  SPI_SOM_HKFPGA		0xeb90 // Start of Message HKFPGA
-#define  SPI_EOM_HKFPGA		0xeb09 // End of Message HKFPGA
-
-#define  SPI_SOM_TFPGA		0xeb91 // Start of Message TFPGA
-#define  SPI_EOM_TFPGA		0xeb0a // End of Message TFPGA
-#define  SPI_WRAP_AROUND_TFPGA	0x0000   /* cmd */
-
-#define  SPI_SET_nsTimer_TFPGA   	0x0100   /* cmd */
-#define  SPI_READ_nsTimer_TFPGA   	0x0200   /* cmd */
-#define  SPI_TRIGGERMASK_TFPGA  0x0300 /* cmd */
-#define  SPI_TRIGGERMASK1_TFPGA 0x0400 /* cmd */
-#define  SPI_TRIGGERMASK2_TFPGA 0x0500 /* cmd */
-#define  SPI_TRIGGERMASK3_TFPGA 0x0600 /* cmd */
-#define  SPI_READ_TRIGGER_NSTIMER_TFPGA	0x0700   /* cmd */
-#define  SPI_HOLDOFF_TFPGA   	0x0800   /* cmd */
-#define  SPI_TRIGGER_TFPGA   	0x0900   /* cmd */
-#define  SPI_L1_TRIGGER_EN 0x0a00  /* cmd */
-#define  RESET_TRIGGER_COUNT_AND_NSTIMER 0x0b00 /* cmd */
-#define  SPI_READ_HIT_PATTERN   	0x0c00   /* cmd */
-#define  SPI_READ_HIT_PATTERN1   	0x0d00   /* cmd */
-#define  SPI_READ_HIT_PATTERN2   	0x0e00   /* cmd */
-#define  SPI_READ_HIT_PATTERN3   	0x0f00   /* cmd */
-#define  SPI_SET_ARRAY_SERDES_CONFIG 0x1000  /* cmd */
-#define  SPI_SET_TACK_TYPE_MODE 0x1100 /* cmd */
-#define  SPI_SET_TRIG_AT_TIME 0x1200 /* cmd */
-#define  SPI_READ_DIAT_WORDS 0x1300 /* cmd */
-
-#define  DWnull   	0x0000   /* zero word */
-
-// Conversion factors from SPI readout to units
-#define VOLT_CONVERSION_FACTOR 0.006158 // convert to volts
-#define AMP_CONVERSION_FACTOR 0.00117 // convert to amps
-
-// Sleep for a given number of milliseconds
-void sleep_msec(int msec)
-{
-    msec = std::min(msec, 999);
-    struct timespec tim;
-    tim.tv_sec = 0;
-    tim.tv_nsec = 1000000 * msec; // convert millisec to nanosec
-
-    nanosleep(&tim, NULL);
-}
-
-bool initialize_lowlevel()
-{
-	if (!bcm2835_init()) {
-	  return false;
+bool command_interrupted()
+{
+    bool was_interrupted = interrupted;
+    interrupted = false;
+    return was_interrupted;
+}
+
+// Return true if the current command should be stopped early
+// Only side-effect free reads check this, so no setting is left half applied
+bool interrupt_requested()
+{
+    if (interrupt_check && interrupt_check()) {
+        interrupted = true;
     }
-	bcm2835_spi_begin();
-	bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST); // The default
-	// Set Mode to zero
-	bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);  
-	// Set clock divider (BCM2835_SPI_CLOCK_DIVIDER_256) to give 1024 ns clock
-	// nominal value needed by BP is 640 ns - slower works too
-	// Tried 512 ns (BCM2835_SPI_CLOCK_DIVIDER_128) 8-10-2015 Seems OK
-	bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_128); 
-	bcm2835_spi_chipSelect(BCM2835_SPI_CS0);              
-	bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);  // the default
-
-    return true;
+    return interrupted;
 }
     
-/*
-	spi_tword
-	J. Buckley
-	8/5/15
-	
-	bcm2835 library (and possibly all SPI on Raspberry PI)
-	assumes 8bit transfers.   This function turns two 8-bit
-	transfers (write and simultaneous read) as 16-bit transfers
-	(I hope)
-*/
-unsigned short spi_tword(unsigned short write_word)
-{
-	unsigned char write_msb;
-    unsigned char write_lsb;
-    unsigned char read_msb;
-    unsigned char read_lsb;
-    unsigned short tword;
-    char tbuf[2];
-    char rbuf[2];
-
-    tword = (write_word & 0xff00)>>8;
-    tbuf[0] = write_msb = (unsigned char)(tword);
-    tword = (write_word & 0x00ff);
-    tbuf[1] = write_lsb = (unsigned char)(tword);
-
-    bcm2835_spi_transfernb(tbuf, rbuf, 0x00000002);
-    read_msb = rbuf[0];
-    read_lsb = rbuf[1];
-    tword = read_msb;
-    tword = (tword<<8)+read_lsb;
-    return(tword);
+// Time between the messages of a sync
+const int SYNC_MESSAGE_GAP_USEC = 10000;
+
+// Most messages sent in one transfer
+const int MAX_MESSAGES_PER_TRANSFER = 8;
+
+// Frame of each message in SPI_MESSAGES (see spi_protocol.h), built at
+// compile time, with its parameters still to be filled in
+struct SpiFrameTemplate {
+    unsigned short som;
+    unsigned short cw;
+    unsigned short data[SPI_MESSAGE_WORDS - 3];
+    unsigned short eom;
+    int n_parameters;
+    SpiRetryPolicy retry_policy;
+};
+
+#define SPI_FRAME_TEMPLATE(message, fpga, cw, n_parameters, fill, retry) \
+    {SPI_SOM_##fpga, cw, SPI_FILL_##fill, SPI_EOM_##fpga, n_parameters, \
+        retry},
+constexpr SpiFrameTemplate spi_frame_templates[NUM_SPI_MESSAGES] = {
+    SPI_MESSAGES(SPI_FRAME_TEMPLATE)
+};
+#undef SPI_FRAME_TEMPLATE
+
+#define CHECK_SPI_PARAMETERS(message, fpga, cw, n_parameters, fill, retry) \
+    static_assert(n_parameters <= SPI_MESSAGE_WORDS - 3, \
+            #message " has more parameters than data words");
+SPI_MESSAGES(CHECK_SPI_PARAMETERS)
+#undef CHECK_SPI_PARAMETERS
+
+// Fill in a message by copying its template and setting its parameters,
+// from the first data word on
+void build_message(int message, const unsigned short parameters[],
+        unsigned short spi_command[])
+{
+    const SpiFrameTemplate &frame = spi_frame_templates[message];
+    spi_command[0] = frame.som;
+    spi_command[1] = frame.cw;
+    std::copy(frame.data, frame.data + SPI_MESSAGE_WORDS - 3,
+            spi_command + 2);
+    std::copy(parameters, parameters + frame.n_parameters, spi_command + 2);
+    spi_command[SPI_MESSAGE_WORDS - 1] = frame.eom;
+}
+
+// Fill in messages sent together, one to each block of eight modules, the
+// first to block 0
+void build_block_messages(int first_message, int n_blocks,
+        unsigned short spi_command[])
+{
+    for (int block = 0; block < n_blocks; block++) {
+        build_message(first_message + block, nullptr,
+                spi_command + SPI_MESSAGE_WORDS * block);
+    }
+}
+
+SpiCheckCounts &SpiCheckCounts::operator+=(const SpiCheckCounts &counts)
+{
+    failed += counts.failed;
+    retried += counts.retried;
+    recovered += counts.recovered;
+    unrecovered += counts.unrecovered;
+    return *this;
+}
+
+SpiCheckCounts take_thread_check_counts()
+{
+    SpiCheckCounts counts = thread_check_counts;
+    thread_check_counts = SpiCheckCounts{0, 0, 0, 0};
+    return counts;
+}
+
+void take_spi_check_counts(SpiCheckTotals &counts)
+{
+    std::lock_guard<std::mutex> lock(check_totals_mutex);
+    counts.clear();
+    counts.swap(check_totals);
+}
+
+void set_spi_word_gap(int usec)
+{
+    spi_word_gap_usec = std::max(usec, 0);
+}
+
+void set_adc_conversion_time(int usec)
+{
+    adc_conversion_usec = std::max(usec, 0);
+}
+
+void forget_trigger_mask()
+{
+    bool *applied = backplane().trigger_mask_applied;
+    std::fill(applied, applied + TRIGGER_MASK_BLOCKS, false);
+}
+
+void set_adc_calibration(const AdcCalibration &calibration)
+{
+    backplane().adc_calibration = calibration;
+}
+
+// Convert words to the big endian byte order they're sent in, and back
+void words_to_bytes(const unsigned short *words, char *bytes, int n_words)
+{
+    for (int i = 0; i < n_words; i++) {
+        uint16_t word = htons(words[i]);
+        memcpy(bytes + 2 * i, &word, sizeof(word));
+    }
+}
+
+void bytes_to_words(const char *bytes, unsigned short *words, int n_words)
+{
+    for (int i = 0; i < n_words; i++) {
+        uint16_t word;
+        memcpy(&word, bytes + 2 * i, sizeof(word));
+        words[i] = ntohs(word);
+    }
+}
+
+// Return the SPI_CHECK_* flags of the checks a message's reply passes
+unsigned int check_reply(const unsigned short *message,
+        const unsigned short *reply)
+{
+    unsigned short eom = (message[0] == SPI_SOM_HKFPGA) ? SPI_EOM_HKFPGA
+        : SPI_EOM_TFPGA;
+    unsigned int checks_passed = 0;
+    if (reply[0] == message[0]) {
+        checks_passed |= SPI_CHECK_SOM;
+    }
+    if (reply[1] == message[1]) {
+        checks_passed |= SPI_CHECK_CW;
+    }
+    if (reply[SPI_MESSAGE_WORDS - 1] == eom) {
+        checks_passed |= SPI_CHECK_EOM;
+    }
+    return checks_passed;
 }
 
 /*
@@ -138,181 +339,239 @@ unsigned short spi_tword(unsigned short write_word)
 	SOM word, CMD word, 8 words of data, EOM word.
 	Full duplex operation makes this simultaneous transfer of bits,
 	bytes and words a bit tricky.
+
+	Each message is clocked as 12 words, the whole set of messages in one
+	SPI transfer, or one transfer per message if a gap between messages
+	is asked for (or one per word if an inter-word gap is set), all handed
+	to the SPI backend as one batch:
+	  sent:     SOM CW  D0  D1  D2  D3  D4  D5  D6  D7  null EOM
+	  received: --  SOM CW  R0  R1  R2  R3  R4  R5  R6  R7   EOM
+	By causality, nobody is in a state to send anything back on MISO
+	while the SOM goes out, so the first word back is a dummy. The slave
+	is one word behind, so it sends its SOM back with the CW, which can be
+	checked to make sure the command response makes sense, and then the
+	CW with the first data word. A null word gets the 8th data word back.
+	Before the master sends the EOM to the slave it first sends out that
+	null word then sends EOM, while the slave SIMULTANEOUSLY sends back
+	its EOM - no causality problems since it's just end of message.
+	pdata gets the 11 words received after the dummy.
+	Every message is journaled (see spi_journal.h) with the time of
+	the transfer carrying it and the checks its reply passes.
 */ 
-void transfer_message(unsigned short *message, unsigned short *pdata)
-{
-	unsigned short som_word;
-	unsigned short cmd_word;
-
-	// Write Start word
-	// By causality, nobody is in a state to send anything back on MISO
-	// so one reads a dummy word coming back from the slave to the master.
-	spi_tword(message[0]); // read a dummy word - AB
-	// Write command word
-	// word sent now that a specific SPI slave knows that the following
-	// command and data is meant for it.   The slave is one byte behind,
-	// and sends its start of message word back to the master.  This
-	// can be checked to make sure the command response makes sense.
-	pdata[0] = som_word = spi_tword(message[1]);
-	// Next send the first data word, stored in mesage[2] from master
-	// to slave.  Simultaneously read out the returned command word from
-	// slave to master.   Full duplex du-suck.
-	pdata[1] = cmd_word = spi_tword(message[2]);
-	// now, the next 7 words coming back are actually data, but the 
-	// last message word message[9] from the 
-	pdata[2] = spi_tword(message[3]);
-	pdata[3] = spi_tword(message[4]);
-	pdata[4] = spi_tword(message[5]);
-	pdata[5] = spi_tword(message[6]);
-	pdata[6] = spi_tword(message[7]);
-	pdata[7] = spi_tword(message[8]);
-	pdata[8] = spi_tword(message[9]);
-	pdata[9] = spi_tword(0x0000); //Send null word, get 8th data word from slave
-	
-	// This next bit is tricky.  Since there is a phase shift of one
-	// word (received from slave versus sent to slave), you might ask
-	// "When I send the 11th word from master to slave, the slave is not
-	// done - it still needs to send its last EOM word.  What gives?"
-	// Well, it turns out before the master sends the EOM to the slave
-	// it first sends out a dummy_word then sends EOM, while the slave
-	// SIMULTANEOUSLY sends back its EOM - no causality problems since
-	// it's just end of message.
-	pdata[10] = spi_tword(message[10]);
+// Send up to MAX_MESSAGES_PER_TRANSFER messages in one SPI transfer,
+// journaling each and filling in the checks its reply passed
+// Return the delay to leave before sending anything more
+unsigned int transfer_batch(const unsigned short *messages,
+        unsigned short *pdata, int n, int message_gap_usec,
+        unsigned int checks_passed[])
+{
+    unsigned short frame[SPI_FRAME_WORDS * MAX_MESSAGES_PER_TRANSFER] = {0};
+    char tbuf[sizeof(frame)];
+    char rbuf[sizeof(frame)];
+    SpiSegment segments[SPI_FRAME_WORDS * MAX_MESSAGES_PER_TRANSFER];
+    for (int i = 0; i < n; i++) {
+        const unsigned short *message = messages + SPI_MESSAGE_WORDS * i;
+        unsigned short *words = frame + SPI_FRAME_WORDS * i;
+        std::copy(message, message + SPI_MESSAGE_WORDS - 1, words);
+        words[SPI_FRAME_WORDS - 2] = DWnull;
+        words[SPI_FRAME_WORDS - 1] = message[SPI_MESSAGE_WORDS - 1];
+    }
+    int n_words = SPI_FRAME_WORDS * n;
+    words_to_bytes(frame, tbuf, n_words);
+
+    // Split the frames where gaps are needed
+    int segment_words = n_words;
+    if (spi_word_gap_usec > 0) {
+        segment_words = 1;
+    } else if (message_gap_usec > 0) {
+        segment_words = SPI_FRAME_WORDS;
+    }
+    int n_segments = n_words / segment_words;
+    for (int i = 0; i < n_segments; i++) {
+        SpiSegment &segment = segments[i];
+        segment.tbuf = tbuf + 2 * segment_words * i;
+        segment.rbuf = rbuf + 2 * segment_words * i;
+        segment.length = 2 * segment_words;
+        segment.delay_usec = spi_word_gap_usec;
+        if ((segment_words * (i + 1)) % SPI_FRAME_WORDS == 0) {
+            segment.delay_usec = std::max(spi_word_gap_usec,
+                    message_gap_usec);
+        }
+        segment.cs_change = true;
+    }
+    SpiJournalEntry entry;
+    entry.backplane = selected_backplane;
+    {
+        // Only the transfer holds the bus, so that another backplane's
+        // messages can go out while this one's ADCs convert
+        std::lock_guard<std::mutex> lock(bus_mutex);
+        entry.start_nsec = monotonic_nsec();
+        backplane().backend->transfer_segments(segments, n_segments);
+        entry.end_nsec = monotonic_nsec();
+    }
+
+    bytes_to_words(rbuf, frame, n_words);
+    for (int i = 0; i < n; i++) {
+        unsigned short *words = frame + SPI_FRAME_WORDS * i;
+        const unsigned short *message = messages + SPI_MESSAGE_WORDS * i;
+        unsigned short *reply = pdata + SPI_MESSAGE_WORDS * i;
+        std::copy(words + 1, words + SPI_FRAME_WORDS, reply);
+        checks_passed[i] = check_reply(message, reply);
+        entry.command_word = message[1];
+        entry.checks_passed = checks_passed[i];
+        journal_spi_message(entry);
+    }
+    return segments[n_segments - 1].delay_usec;
+}
+
+// Count a message whose reply failed its checks, sending it again until it
+// passes if that does no harm
+void recover_message(const unsigned short *message, unsigned short *reply,
+        SpiRetryPolicy retry_policy)
+{
+    SpiCheckCounts counts = {1, 0, 0, 0};
+    unsigned int checks_passed = 0;
+    if (retry_policy == RETRY_IF_FAILED) {
+        counts.retried = 1;
+        for (int retry = 0; (retry < MAX_SPI_RETRIES)
+                && (checks_passed != SPI_CHECK_ALL); retry++) {
+            transfer_batch(message, reply, 1, 0, &checks_passed);
+            if (checks_passed != SPI_CHECK_ALL) {
+                counts.failed++;
+            }
+        }
+    }
+    if (checks_passed == SPI_CHECK_ALL) {
+        counts.recovered = 1;
+    } else {
+        counts.unrecovered = 1;
+    }
+    thread_check_counts += counts;
+    std::lock_guard<std::mutex> lock(check_totals_mutex);
+    check_totals[std::make_pair(selected_backplane, message[1])] += counts;
+}
+
+void transfer_messages(unsigned short *messages, unsigned short *pdata,
+        int n_messages, SpiRetryPolicy retry_policy,
+        int message_gap_usec = 0)
+{
+    unsigned int checks_passed[MAX_MESSAGES_PER_TRANSFER];
+    while (n_messages > 0) {
+        int n = std::min(n_messages, MAX_MESSAGES_PER_TRANSFER);
+        unsigned int delay_usec = transfer_batch(messages, pdata, n,
+                message_gap_usec, checks_passed);
+        for (int i = 0; i < n; i++) {
+            if (checks_passed[i] != SPI_CHECK_ALL) {
+                recover_message(messages + SPI_MESSAGE_WORDS * i,
+                        pdata + SPI_MESSAGE_WORDS * i, retry_policy);
+            }
+        }
+        messages += SPI_MESSAGE_WORDS * n;
+        pdata += SPI_MESSAGE_WORDS * n;
+        n_messages -= n;
+        if ((n_messages > 0) && (delay_usec > 0)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(delay_usec));
+        }
+    }
+}
+
+void transfer_message(unsigned short *message, unsigned short *pdata,
+        SpiRetryPolicy retry_policy)
+{
+    transfer_messages(message, pdata, 1, retry_policy);
+}
+
+int send_message(int message, const unsigned short parameters[],
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    build_message(message, parameters, spi_command);
+    transfer_message(spi_command, spi_data,
+            spi_frame_templates[message].retry_policy);
+    return 1;
 }
 
 void trig_adcs()
 {
-	unsigned short spi_command[11];
-	unsigned short data[11];
-	
-	spi_command[0] = SPI_SOM_HKFPGA; // som
-	spi_command[1] = CW_TRG_ADCS; // cw
-	spi_command[2] = 0x0111;
-	spi_command[3] = 0x1222;
-	spi_command[4] = 0x2333;
-	spi_command[5] = 0x3444;
-	spi_command[6] = 0x4555;
-	spi_command[7] = 0x5666;
-	spi_command[8] = 0x0000;
-	spi_command[9] = 0x0088;
-	spi_command[10] = SPI_EOM_HKFPGA; // not used
-	transfer_message(spi_command, data);// trig ADCs
-	delay(100);
+    unsigned short spi_command[SPI_MESSAGE_WORDS];
+    unsigned short data[SPI_MESSAGE_WORDS];
+    send_message(SPI_MSG_TRIGGER_ADCS, nullptr, spi_command, data);
+    backplane().adc_trigger_time = std::chrono::steady_clock::now();
+}
+
+// Wait until the conversion started by trig_adcs() has had time to finish,
+// checking for interruption before and after, and whenever woken by the
+// interrupt signal meanwhile
+// Return false if the read should stop instead
+bool wait_for_adc_conversion()
+{
+    auto converted = backplane().adc_trigger_time +
+        std::chrono::microseconds(adc_conversion_usec);
+    while (!interrupt_requested()) {
+        if (std::chrono::steady_clock::now() >= converted) {
+            return true;
+        }
+        if (interrupt_signal) {
+            interrupt_signal->wait_until(converted);
+        } else {
+            std::this_thread::sleep_until(converted);
+        }
+    }
+    return false;
+}
+
+// Convert the data of the four messages reading voltages, or currents
+void convert_voltages(const unsigned short spi_data[], float voltages[])
+{
+    const AdcCalibration &calibration = backplane().adc_calibration;
+    convert_adc_readings(spi_data, calibration.channel_module,
+            calibration.voltage_gain, calibration.voltage_offset, voltages);
+}
+
+void convert_currents(const unsigned short spi_data[], float currents[])
+{
+    const AdcCalibration &calibration = backplane().adc_calibration;
+    convert_adc_readings(spi_data, calibration.channel_module,
+            calibration.current_gain, calibration.current_offset, currents);
+}
+
+// Expand the lowest n bits of a mask into one value (0 or 1) per bit,
+// lowest bit first
+void expand_bits(uint32_t mask, unsigned short values[], int n)
+{
+    for (int i = 0; i < n; i++) {
+        values[i] = (mask >> i) & 1;
+    }
 }
 
 // Enable or disable trigger
 int enable_disable_trigger(unsigned short command_parameters[],
         unsigned short spi_command[], unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_TFPGA; //som
-	spi_command[1] = SPI_L1_TRIGGER_EN; //cw
-	spi_command[2] = command_parameters[0];
-	spi_command[3] = 0x0002;
-	spi_command[4] = 0x0003;
-	spi_command[5] = 0x0004;
-	spi_command[6] = 0x0005;
-	spi_command[7] = 0x0006;
-	spi_command[8] = 0x0007;
-	spi_command[9] = 0x0008;			
-	spi_command[10] = SPI_EOM_TFPGA; //not used
-	transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_L1_TRIGGER_ENABLE, command_parameters,
+            spi_command, spi_data);
 }
 
 // Turn FEEs on and off
 int power_control_modules(unsigned short command_parameters[],
         unsigned short spi_command[], unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_HKFPGA; //som
-    spi_command[1] = CW_FEE_POWER_CTL; //cw
-    spi_command[2] = command_parameters[0];
-    spi_command[3] = command_parameters[1];
-    spi_command[4] = 0x2333;
-    spi_command[5] = 0x3444;
-    spi_command[6] = 0x4555;
-    spi_command[7] = 0x5666;
-    spi_command[8] = 0x6777;
-    spi_command[9] = 0x7888;			
-    spi_command[10] = SPI_EOM_HKFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_POWER_CONTROL, command_parameters,
+            spi_command, spi_data);
 }
 
 // Read in and store FEE housekeeping currents
 int read_currents(float currents[], unsigned short spi_command[],
         unsigned short spi_data[])
 {
-    // Define conversion factor from SPI readout to meaningful unit
-    float cf = AMP_CONVERSION_FACTOR;
-	
     trig_adcs();
+    build_block_messages(SPI_MSG_READ_CURRENTS_0, 4, spi_command);
 
-    for (int mi = 0; mi < 4; mi++) {    
-	    spi_command[mi*11 + 0] = SPI_SOM_HKFPGA; // som
-	    spi_command[mi*11 + 2] = 0x0111;
-	    spi_command[mi*11 + 3] = 0x1222;
-	    spi_command[mi*11 + 4] = 0x2333;
-	    spi_command[mi*11 + 5] = 0x3444;
-	    spi_command[mi*11 + 6] = 0x4555;
-	    spi_command[mi*11 + 7] = 0x5666;
-	    spi_command[mi*11 + 8] = 0x0000;
-	    spi_command[mi*11 + 9] = 0x0088;	
-	    spi_command[mi*11 + 10] = SPI_EOM_HKFPGA; // not used
+    // Read all four messages in one transfer once converted
+    if (!wait_for_adc_conversion()) {
+        return 0;
     }
-    
-    spi_command[1] = CW_RD_FEE0_I;
-    spi_command[12] = CW_RD_FEE8_I;
-    spi_command[23] = CW_RD_FEE16_I;
-    spi_command[34] = CW_RD_FEE24_I;
-	
-    sleep_msec(10);
-	transfer_message(spi_command, spi_data);
-	
-    currents[5]  = spi_data[2] * cf;
-	currents[12] = spi_data[3] * cf;
-	currents[6]  = spi_data[4] * cf;
-	currents[17] = spi_data[5] * cf;
-	currents[7]  = spi_data[6] * cf;
-	currents[13] = spi_data[7] * cf;
-	currents[11] = spi_data[8] * cf;
-	currents[18] = spi_data[9] * cf;
-		
-	sleep_msec(10);
-	transfer_message(spi_command + 11, spi_data + 11);
-	
-    currents[4]  = spi_data[13] * cf;
-	currents[10] = spi_data[14] * cf;
-	currents[1]  = spi_data[15] * cf;
-	currents[0]  = spi_data[16] * cf;
-	currents[3]  = spi_data[17] * cf;
-	currents[2]  = spi_data[18] * cf;
-	currents[16] = spi_data[19] * cf;
-	currents[22] = spi_data[20] * cf;
-	
-	sleep_msec(10);
-	transfer_message(spi_command + 22, spi_data + 22);
-
-    currents[28] = spi_data[24] * cf;
-	currents[24] = spi_data[25] * cf;
-	currents[30] = spi_data[26] * cf;
-	currents[23] = spi_data[27] * cf;
-	currents[31] = spi_data[28] * cf;
-	currents[29] = spi_data[29] * cf;
-	currents[26] = spi_data[30] * cf;
-	currents[25] = spi_data[31] * cf;
-	
-	sleep_msec(10);
-	transfer_message(spi_command + 33, spi_data + 33);
-	
-    currents[20] = spi_data[35] * cf;
-	currents[8]  = spi_data[36] * cf;
-	currents[27] = spi_data[37] * cf;
-	currents[15] = spi_data[38] * cf;
-	currents[9]  = spi_data[39] * cf;
-	currents[19] = spi_data[40] * cf;
-	currents[21] = spi_data[41] * cf;
-	currents[14] = spi_data[42] * cf;
-    
+    transfer_messages(spi_command, spi_data, 4, RETRY_IF_FAILED);
+    convert_currents(spi_data, currents);
     return 4; // number of SPI messages sent
 }
 
@@ -320,133 +579,48 @@ int read_currents(float currents[], unsigned short spi_command[],
 int read_voltages(float voltages[], unsigned short spi_command[],
         unsigned short spi_data[])
 {
-    // Define conversion factor from SPI readout to meaningful unit
-    float cf = VOLT_CONVERSION_FACTOR;
-	
     trig_adcs();
+    build_block_messages(SPI_MSG_READ_VOLTAGES_0, 4, spi_command);
 
-    for (int mi = 0; mi < 4; mi++) {    
-	    spi_command[mi*11 + 0] = SPI_SOM_HKFPGA; // som
-	    spi_command[mi*11 + 2] = 0x0111;
-	    spi_command[mi*11 + 3] = 0x1222;
-	    spi_command[mi*11 + 4] = 0x2333;
-	    spi_command[mi*11 + 5] = 0x3444;
-	    spi_command[mi*11 + 6] = 0x4555;
-	    spi_command[mi*11 + 7] = 0x5666;
-	    spi_command[mi*11 + 8] = 0x0000;
-	    spi_command[mi*11 + 9] = 0x0088;	
-	    spi_command[mi*11 + 10] = SPI_EOM_HKFPGA; // not used
+    // Read all four messages in one transfer once converted
+    if (!wait_for_adc_conversion()) {
+        return 0;
     }
-    
-    spi_command[1] = CW_RD_FEE0_V;
-    spi_command[12] = CW_RD_FEE8_V;
-    spi_command[23] = CW_RD_FEE16_V;
-    spi_command[34] = CW_RD_FEE24_V;
-	
-    sleep_msec(10);
-	transfer_message(spi_command, spi_data);
-	
-    voltages[5]  = spi_data[2] * cf;
-	voltages[12] = spi_data[3] * cf;
-	voltages[6]  = spi_data[4] * cf;
-	voltages[17] = spi_data[5] * cf;
-	voltages[7]  = spi_data[6] * cf;
-	voltages[13] = spi_data[7] * cf;
-	voltages[11] = spi_data[8] * cf;
-	voltages[18] = spi_data[9] * cf;
-		
-	sleep_msec(10);
-	transfer_message(spi_command + 11, spi_data + 11);
-	
-    voltages[4]  = spi_data[13] * cf;
-	voltages[10] = spi_data[14] * cf;
-	voltages[1]  = spi_data[15] * cf;
-	voltages[0]  = spi_data[16] * cf;
-	voltages[3]  = spi_data[17] * cf;
-	voltages[2]  = spi_data[18] * cf;
-	voltages[16] = spi_data[19] * cf;
-	voltages[22] = spi_data[20] * cf;
-	
-	sleep_msec(10);
-	transfer_message(spi_command + 22, spi_data + 22);
-
-    voltages[28] = spi_data[24] * cf;
-	voltages[24] = spi_data[25] * cf;
-	voltages[30] = spi_data[26] * cf;
-	voltages[23] = spi_data[27] * cf;
-	voltages[31] = spi_data[28] * cf;
-	voltages[29] = spi_data[29] * cf;
-	voltages[26] = spi_data[30] * cf;
-	voltages[25] = spi_data[31] * cf;
-	
-	sleep_msec(10);
-	transfer_message(spi_command + 33, spi_data + 33);
-	
-    voltages[20] = spi_data[35] * cf;
-	voltages[8]  = spi_data[36] * cf;
-	voltages[27] = spi_data[37] * cf;
-	voltages[15] = spi_data[38] * cf;
-	voltages[9]  = spi_data[39] * cf;
-	voltages[19] = spi_data[40] * cf;
-	voltages[21] = spi_data[41] * cf;
-	voltages[14] = spi_data[42] * cf;
-    
+    transfer_messages(spi_command, spi_data, 4, RETRY_IF_FAILED);
+    convert_voltages(spi_data, voltages);
     return 4; // number of SPI messages sent
 }
 
+// Read in and store FEE housekeeping voltages and currents from the same
+// conversion
+int read_housekeeping(float voltages[], float currents[],
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    trig_adcs();
+    build_block_messages(SPI_MSG_READ_VOLTAGES_0, 4, spi_command);
+    build_block_messages(SPI_MSG_READ_CURRENTS_0, 4,
+            spi_command + 4 * SPI_MESSAGE_WORDS);
+
+    // Read all eight messages once converted
+    if (!wait_for_adc_conversion()) {
+        return 0;
+    }
+    transfer_messages(spi_command, spi_data, 8, RETRY_IF_FAILED);
+    convert_voltages(spi_data, voltages);
+    convert_currents(spi_data + 4 * SPI_MESSAGE_WORDS, currents);
+    return 8; // number of SPI messages sent
+}
+
 // Determine which FEEs are present
 int read_fees_present(unsigned short fees_present[],
         unsigned short spi_command[], unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_HKFPGA; // som
-    spi_command[1] = CW_FEEs_PRESENT; // cw
-    spi_command[2] = 0x0111;
-    spi_command[3] = 0x1222;
-    spi_command[4] = 0x2333;
-    spi_command[5] = 0x3444;
-    spi_command[6] = 0x4555;
-    spi_command[7] = 0x5666;
-    spi_command[8] = 0x6777;
-    spi_command[9] = 0x7888;
-    spi_command[10] = SPI_EOM_HKFPGA; // not used
-    transfer_message(spi_command, spi_data);
+    send_message(SPI_MSG_READ_FEES_PRESENT, nullptr, spi_command, spi_data);
 
     // data[2] is FEEs present J0-15
     // data[3] is FEEs present J16-31
-    
-    fees_present[0] = spi_data[2] & 0x0001;
-    fees_present[1] = (spi_data[2] & 0x0002) >> 1;
-    fees_present[2] = (spi_data[2] & 0x0004) >> 2;
-    fees_present[3] = (spi_data[2] & 0x0008) >> 3;
-    fees_present[4] = (spi_data[2] & 0x0010) >> 4;
-    fees_present[5] = (spi_data[2] & 0x0020) >> 5;
-    fees_present[6] = (spi_data[2] & 0x0040) >> 6;
-    fees_present[7] = (spi_data[2] & 0x0080) >> 7;
-    fees_present[8] = (spi_data[2] & 0x0100) >> 8;
-    fees_present[9] = (spi_data[2] & 0x0200) >> 9;
-    fees_present[10] = (spi_data[2] & 0x0400) >> 10;
-    fees_present[11] = (spi_data[2] & 0x0800) >> 11;
-    fees_present[12] = (spi_data[2] & 0x1000) >> 12;
-    fees_present[13] = (spi_data[2] & 0x2000) >> 13;
-    fees_present[14] = (spi_data[2] & 0x4000) >> 14;
-    fees_present[15] = (spi_data[2] & 0x8000) >> 15;
-    fees_present[16] = spi_data[3] & 0x0001;
-    fees_present[17] = (spi_data[3] & 0x0002) >> 1;
-    fees_present[18] = (spi_data[3] & 0x0004) >> 2;
-    fees_present[19] = (spi_data[3] & 0x0008) >> 3;
-    fees_present[20] = (spi_data[3] & 0x0010) >> 4;
-    fees_present[21] = (spi_data[3] & 0x0020) >> 5;
-    fees_present[22] = (spi_data[3] & 0x0040) >> 6;
-    fees_present[23] = (spi_data[3] & 0x0080) >> 7;
-    fees_present[24] = (spi_data[3] & 0x0100) >> 8;
-    fees_present[25] = (spi_data[3] & 0x0200) >> 9;
-    fees_present[26] = (spi_data[3] & 0x0400) >> 10;
-    fees_present[27] = (spi_data[3] & 0x0800) >> 11;
-    fees_present[28] = (spi_data[3] & 0x1000) >> 12;
-    fees_present[29] = (spi_data[3] & 0x2000) >> 13;
-    fees_present[30] = (spi_data[3] & 0x4000) >> 14;
-    fees_present[31] = (spi_data[3] & 0x8000) >> 15;
-    
+    expand_bits(spi_data[2] | ((uint32_t)spi_data[3] << 16), fees_present, 32);
+
     return 1; // number of SPI messages sent
 }
 
@@ -454,286 +628,159 @@ int read_fees_present(unsigned short fees_present[],
 int read_nstimer_trigger_rate(unsigned short spi_command[],
         unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_TFPGA; //som
-    spi_command[1] = SPI_READ_nsTimer_TFPGA; //cw
-    spi_command[2] = 0X0001;
-    spi_command[3] = 0X0002;
-    spi_command[4] = 0X0003;
-    spi_command[5] = 0X0004;
-    spi_command[6] = 0x0005;
-    spi_command[7] = 0x0006;
-    spi_command[8] = 0x0007;
-    spi_command[9] = 0x0008;			
-    spi_command[10] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_READ_NSTIMER, nullptr, spi_command,
+            spi_data);
+}
+
+void decode_trigger_counters(const unsigned short spi_data[],
+        TriggerCounters &counters)
+{
+    // Words 2-5 are the timer, 6-7 the TACK count, and 8-9 the trigger
+    // count, each count one more than the number since the last reset
+    counters.nstimer = 0;
+    for (int i = 2; i < 6; i++) {
+        counters.nstimer = (counters.nstimer << 16) | spi_data[i];
+    }
+    counters.tack_count = ((uint32_t)spi_data[6] << 16 | spi_data[7]) - 1;
+    counters.trigger_count = ((uint32_t)spi_data[8] << 16 | spi_data[9]) - 1;
+}
+
+// Read the hit pattern of every module
+int read_hit_pattern(unsigned short hit_pattern[],
+        unsigned short spi_command[], unsigned short spi_data[])
+{
+    build_block_messages(SPI_MSG_READ_HIT_PATTERN_0, 4, spi_command);
+    transfer_messages(spi_command, spi_data, 4, RETRY_IF_FAILED);
+    for (int block = 0; block < 4; block++) {
+        const unsigned short *data = spi_data + SPI_MESSAGE_WORDS * block + 2;
+        std::copy(data, data + 8, hit_pattern + 8 * block);
+    }
+    return 4; // number of SPI messages sent
 }
 
 // Reset DACQ 1 power
 int reset_dacq1_power(unsigned short spi_command[], unsigned short spi_data[])
 {
-	spi_command[0] = SPI_SOM_HKFPGA; //som
-	spi_command[1] = CW_DACQ1_PWR_RESET; //cw
-	spi_command[2] = 0x0111;
-	spi_command[3] = 0x1222;
-	spi_command[4] = 0x2333;
-	spi_command[5] = 0x3444;
-	spi_command[6] = 0x4555;
-	spi_command[7] = 0x5666;
-	spi_command[8] = 0x6777;
-	spi_command[9] = 0x7888;			
-	spi_command[10] = SPI_EOM_HKFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_RESET_DACQ1_POWER, nullptr, spi_command,
+            spi_data);
 }
 
 // Reset DACQ 2 power
 int reset_dacq2_power(unsigned short spi_command[], unsigned short spi_data[])
 {
-	spi_command[0] = SPI_SOM_HKFPGA; //som
-	spi_command[1] = CW_DACQ2_PWR_RESET; //cw
-	spi_command[2] = 0x0111;
-	spi_command[3] = 0x1222;
-	spi_command[4] = 0x2333;
-	spi_command[5] = 0x3444;
-	spi_command[6] = 0x4555;
-	spi_command[7] = 0x5666;
-	spi_command[8] = 0x6777;
-	spi_command[9] = 0x7888;			
-	spi_command[10] = SPI_EOM_HKFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_RESET_DACQ2_POWER, nullptr, spi_command,
+            spi_data);
 }
 
 // Reset trigger and nstimer
 int reset_trigger_and_nstimer(unsigned short spi_command[],
         unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_TFPGA; //som
-	spi_command[1] = RESET_TRIGGER_COUNT_AND_NSTIMER; //cw
-	spi_command[2] = 0x0111;
-	spi_command[3] = 0x1222;
-	spi_command[4] = 0x2333;
-	spi_command[5] = 0x3444;
-	spi_command[6] = 0x4555;
-	spi_command[7] = 0x5666;
-	spi_command[8] = 0x6777;
-	spi_command[9] = 0x7888;			
-	spi_command[10] = SPI_EOM_TFPGA; //not used
-	transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_RESET_TRIGGER_AND_NSTIMER, nullptr,
+            spi_command, spi_data);
 }
 
 // Set holdoff time
 int set_holdoff_time(unsigned short command_parameters[],
         unsigned short spi_command[], unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_TFPGA; //som
-    spi_command[1] = SPI_HOLDOFF_TFPGA; //cw
-    spi_command[2] = command_parameters[0];
-    spi_command[3] = 0x0002;
-    spi_command[4] = 0x0003;
-    spi_command[5] = 0x0004;
-    spi_command[6] = 0x0005;
-    spi_command[7] = 0x0006;
-    spi_command[8] = 0x0007;
-    spi_command[9] = 0x0008;			
-    spi_command[10] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_SET_HOLDOFF, command_parameters, spi_command,
+            spi_data);
 }
 
 // Set TACK type and mode
 int set_tack_type_and_mode(unsigned short command_parameters[],
         unsigned short spi_command[], unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_TFPGA; //som
-    spi_command[1] = SPI_SET_TACK_TYPE_MODE; //cw
-    spi_command[2] = command_parameters[0];
-    spi_command[3] = 0x0002;
-    spi_command[4] = 0x0003;
-    spi_command[5] = 0x0004;
-    spi_command[6] = 0x0005;
-    spi_command[7] = 0x0006;
-    spi_command[8] = 0x0007;
-    spi_command[9] = 0x0008;			
-    spi_command[10] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_SET_TACK_TYPE_MODE, command_parameters,
+            spi_command, spi_data);
 }
 
 // Set trigger
 int set_trigger(unsigned short command_parameters[],
         unsigned short spi_command[], unsigned short spi_data[])
 {
-    spi_command[0] = SPI_SOM_TFPGA; //som
-	spi_command[1] = SPI_SET_TRIG_AT_TIME; //cw
-	spi_command[2] = command_parameters[0];
-	spi_command[3] = command_parameters[1];
-	spi_command[4] = command_parameters[2];
-	spi_command[5] = command_parameters[3];
-	spi_command[6] = 0x0005;
-	spi_command[7] = 0x0006;
-	spi_command[8] = 0x0007;
-	spi_command[9] = 0x0008;			
-	spi_command[10] = SPI_EOM_TFPGA; //not used
-	transfer_message(spi_command, spi_data);
-    return 1; // number of SPI messages sent
+    return send_message(SPI_MSG_SET_TRIGGER_AT_TIME, command_parameters,
+            spi_command, spi_data);
 }
 
-// Set trigger mask
-int set_trigger_mask(unsigned short trigger_mask[],
-        unsigned short spi_command[], unsigned short spi_data[])
+// Set trigger mask, sending only the blocks that changed
+int set_trigger_mask(const unsigned short trigger_mask[],
+        unsigned short applied[], unsigned short spi_command[],
+        unsigned short spi_data[])
 {
-    unsigned short trigger_mask_commands[32];
-    
-    // Setting Trigger Mask from file trigger_mask
-    FILE *myfile;
-    myfile = fopen("trigger_mask", "r");
-    for(int i = 0; i < 32; i++) {
-        fscanf(myfile, "%hx", &trigger_mask_commands[i]);
+    unsigned short *applied_trigger_mask = backplane().applied_trigger_mask;
+    bool *trigger_mask_applied = backplane().trigger_mask_applied;
+    // Build a message for each block of eight modules whose masks differ
+    // from those last applied, or which haven't been applied
+    int block_sent[TRIGGER_MASK_BLOCKS];
+    int n_messages = 0;
+    for (int block = 0; block < TRIGGER_MASK_BLOCKS; block++) {
+        const unsigned short *block_mask = trigger_mask + 8 * block;
+        if (trigger_mask_applied[block] && std::equal(block_mask,
+                    block_mask + 8, applied_trigger_mask + 8 * block)) {
+            continue;
+        }
+        build_message(SPI_MSG_SET_TRIGGER_MASK_0 + block, block_mask,
+                spi_command + SPI_MESSAGE_WORDS * n_messages);
+        block_sent[n_messages++] = block;
     }
-    fclose(myfile);
-    
-    spi_command[0] = SPI_SOM_TFPGA; //som
-    spi_command[1] = SPI_TRIGGERMASK_TFPGA; //cw
-    spi_command[2] = trigger_mask_commands[0];
-    spi_command[3] = trigger_mask_commands[1];
-    spi_command[4] = trigger_mask_commands[2];
-    spi_command[5] = trigger_mask_commands[3];
-    spi_command[6] = trigger_mask_commands[4];
-    spi_command[7] = trigger_mask_commands[5];
-    spi_command[8] = trigger_mask_commands[6];
-    spi_command[9] = trigger_mask_commands[7];			
-    spi_command[10] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    for (int i = 0; i < 8; i++) {
-        trigger_mask[i] = spi_data[i + 2];
+    if (n_messages > 0) {
+        transfer_messages(spi_command, spi_data, n_messages, RETRY_IF_FAILED);
     }
 
-    spi_command[11] = SPI_SOM_TFPGA; //som
-    spi_command[12] = SPI_TRIGGERMASK1_TFPGA; //cw
-    spi_command[13] = trigger_mask_commands[8];
-    spi_command[14] = trigger_mask_commands[9];
-    spi_command[15] = trigger_mask_commands[10];
-    spi_command[16] = trigger_mask_commands[11];
-    spi_command[17] = trigger_mask_commands[12];
-    spi_command[18] = trigger_mask_commands[13];
-    spi_command[19] = trigger_mask_commands[14];
-    spi_command[20] = trigger_mask_commands[15];			
-    spi_command[21] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command + 11, spi_data + 11);
-    for (int i = 0; i < 8; i++) {
-        trigger_mask[i + 8] = spi_data[i + 13];
+    // The FPGA echoes the mask it applied; a block that doesn't match what
+    // was sent is sent again next time
+    for (int i = 0; i < n_messages; i++) {
+        int block = block_sent[i];
+        const unsigned short *echo = spi_data + SPI_MESSAGE_WORDS * i + 2;
+        std::copy(echo, echo + 8, applied_trigger_mask + 8 * block);
+        trigger_mask_applied[block] = std::equal(echo, echo + 8,
+                trigger_mask + 8 * block);
+        if (!trigger_mask_applied[block]) {
+            std::cerr << "Error: trigger mask of modules " << 8 * block
+                << "-" << 8 * block + 7 << " read back differently"
+                << std::endl;
+        }
     }
-    
-    spi_command[22] = SPI_SOM_TFPGA; //som
-    spi_command[23] = SPI_TRIGGERMASK2_TFPGA; //cw
-    spi_command[24] = trigger_mask_commands[16];
-    spi_command[25] = trigger_mask_commands[17];
-    spi_command[26] = trigger_mask_commands[18];
-    spi_command[27] = trigger_mask_commands[19];
-    spi_command[28] = trigger_mask_commands[20];
-    spi_command[29] = trigger_mask_commands[21];
-    spi_command[30] = trigger_mask_commands[22];
-    spi_command[31] = trigger_mask_commands[23];			
-    spi_command[32] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command + 22, spi_data + 22);
-    for (int i = 0; i < 8; i++) {
-        trigger_mask[i + 16] = spi_data[i + 24];
-    }
-    
-    spi_command[33] = SPI_SOM_TFPGA; //som
-    spi_command[34] = SPI_TRIGGERMASK3_TFPGA; //cw
-    spi_command[35] = trigger_mask_commands[24];
-    spi_command[36] = trigger_mask_commands[25];
-    spi_command[37] = trigger_mask_commands[26];
-    spi_command[38] = trigger_mask_commands[27];
-    spi_command[39] = trigger_mask_commands[28];
-    spi_command[40] = trigger_mask_commands[29];
-    spi_command[41] = trigger_mask_commands[30];
-    spi_command[42] = trigger_mask_commands[31];			
-    spi_command[43] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command + 33, spi_data + 33);
-    for (int i = 0; i < 8; i++) {
-        trigger_mask[i + 24] = spi_data[i + 35];
-    }
-    
-    return 4; // number of SPI messages sent
+    std::copy(applied_trigger_mask, applied_trigger_mask + NUM_TRIGGER_MASKS,
+            applied);
+    return n_messages; // number of SPI messages sent
 }
 
 // Send sync commands
 int sync(unsigned short spi_command[], unsigned short spi_data[])
 {
-    // Setup SYNC message.
-    // Must do a SYNC before TAACK messages will be effective
+    // Must do a SYNC before TACK messages will be effective
     /* If Target module has already been synced, sending a SYNC message will
      * have no effect */
     // Set TYPE (01) and MODE (00) for a SYNC
-    spi_command[0] = SPI_SOM_TFPGA; //som
-    spi_command[1] = SPI_SET_TACK_TYPE_MODE; //cw
-    spi_command[2] = 0x0004; // TYPE 01 MODE 00
-    spi_command[3] = 0x0000;
-    spi_command[4] = 0x0000;
-    spi_command[5] = 0x0000;
-    spi_command[6] = 0x0000;
-    spi_command[7] = 0x0000;
-    spi_command[8] = 0x0000;
-    spi_command[9] = 0x0000;			
-    spi_command[10] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command, spi_data);
-    sleep_msec(10);
-    
-    // Set a time to send the SYNC message
-    spi_command[11] = SPI_SOM_TFPGA; //som
-    spi_command[12] = SPI_SET_TRIG_AT_TIME; //cw
-    spi_command[13] = 0x0000;
-    spi_command[14] = 0x0000;
-    spi_command[15] = 0x0001; // A short time after 0
-    spi_command[16] = 0x0004; //RichW0x0000;
-    spi_command[17] = 0x0000;
-    spi_command[18] = 0x0000;
-    spi_command[19] = 0x0000;
-    spi_command[20] = 0x0000;			
+    const unsigned short sync_type_mode[4] = {0x0004, 0x0000, 0x0000, 0x0000};
+    // A short time after 0 at which to send the SYNC message, and reset the
+    // nsTimer to 0
     // ?? Need a 4 because time in message ends up one tick behind
     // A bug to be investigated in the TFPGA gate array HDL.
     // Also the time has to have 3 LSBs 000
-    spi_command[21] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command + 11, spi_data + 11);
-    sleep_msec(10);
-    
-    // Reset the nsTimer to 0
-    spi_command[22] = SPI_SOM_TFPGA; //som
-    spi_command[23] = RESET_TRIGGER_COUNT_AND_NSTIMER; //cw
-    spi_command[24] = 0x0000;
-    spi_command[25] = 0x0000;
-    spi_command[26] = 0x0001; // A short time after 0
-    spi_command[27] = 0x0004; //RichW0x0000;
-    spi_command[28] = 0x0000;
-    spi_command[29] = 0x0000;
-    spi_command[30] = 0x0000;
-    spi_command[31] = 0x0000;			
-    spi_command[32] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command + 22, spi_data + 22);
-    sleep_msec(10);
-    
+    const unsigned short sync_time[4] = {0x0000, 0x0000, 0x0001, 0x0004};
+    build_message(SPI_MSG_SYNC_SET_TACK_TYPE_MODE, sync_type_mode,
+            spi_command);
+    build_message(SPI_MSG_SYNC_SET_TRIGGER_AT_TIME, sync_time,
+            spi_command + SPI_MESSAGE_WORDS);
+    build_message(SPI_MSG_SYNC_RESET_NSTIMER, sync_time,
+            spi_command + 2 * SPI_MESSAGE_WORDS);
+
     // The TFPGA will send the SYNC message when nsTimer reaches the time set
     // above
-    
-    // Set TYPE and MODE back in anticipation of sending a TACK
-    // Setting TYPE (00) and MODE (00) so subsequent message are TACKs
-    spi_command[33] = SPI_SOM_TFPGA; //som
-    spi_command[34] = SPI_SET_TACK_TYPE_MODE; //cw
-    spi_command[35] = 0x0000; // TYPE 00 MODE 00
-    spi_command[36] = 0x0000;
-    spi_command[37] = 0x0001; // A short time after 0
-    spi_command[38] = 0x0004; //RichW0x0000;
-    spi_command[39] = 0x0000;
-    spi_command[40] = 0x0000;
-    spi_command[41] = 0x0000;
-    spi_command[42] = 0x0000;			
-    spi_command[43] = SPI_EOM_TFPGA; //not used
-    transfer_message(spi_command + 33, spi_data + 33);
-    
+
+    // Set TYPE (00) and MODE (00) back so subsequent messages are TACKs,
+    // with the same words following as have always been sent
+    build_message(SPI_MSG_SYNC_SET_TACK_TYPE_MODE, sync_time,
+            spi_command + 3 * SPI_MESSAGE_WORDS);
+
+    // Send the four messages as one batch, with time between them for each
+    // to take effect
+    transfer_messages(spi_command, spi_data, 4, NEVER_RETRY,
+            SYNC_MESSAGE_GAP_USEC);
+
     return 4; // number of SPI messages sent
 }
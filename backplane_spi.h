@@ -3,11 +3,136 @@
 #ifndef BACKPLANE_SPI_H
 #define BACKPLANE_SPI_H
 
-// Initialize low level SPI communication
+#include <cstdint>
+#include <string>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "adc_calibration.h"
+#include "backplane_commands.h"
+
+class SpiBackend;
+
+// Initialize low level SPI communication with a single backplane, through
+// the named SPI backend (see spi_backend.h), or the default one if no name
+// is given, forgetting any backplanes added before
 // Return true if successful, false otherwise
-bool initialize_lowlevel();
+bool initialize_lowlevel(std::string backend_name="");
+
+// Several backplanes can share the bus, each reached through a backend of
+// its own naming its chip select or device. Each has its own ADC
+// calibration, ADC trigger time, and trigger masks applied, and a thread's
+// messages go to the backplane it has selected, backplane 0 unless set
+// otherwise. The bus is held only for each transfer, so threads working
+// with different backplanes interleave their messages, and one backplane's
+// ADCs convert while another's are read.
+
+// Add a backplane through the named SPI backend; all backplanes must be
+// added before any thread uses one
+// Return its index, counting from 0, or -1 if it could not be initialized
+int add_backplane(std::string backend_name);
+
+// Add a backplane reached through the given backend, which is taken over
+// and deleted with the backplane, e.g. a simulated backplane set up first
+// Return its index as for add_backplane
+int add_backplane_backend(SpiBackend *backend);
+
+// Return the number of backplanes added
+int num_backplanes();
+
+// Select the backplane the calling thread's messages go to, which must have
+// been added
+void select_backplane(int index);
+
+// Capture the transfers made with each backplane added from now on, and
+// the commands it's sent, to a file of the given name (see spi_capture.h),
+// followed by "_n" for backplane n after the first
+void set_spi_capture(std::string file_name);
+
+// Capture a command, as received from the server, sent to a backplane
+void capture_command(int index, const std::string &command);
+
+// Set a gap between the words of SPI messages, if the backplane needs one
+// With no gap (the default) each message, or set of messages read together,
+// is sent in a single SPI transfer; with a gap, each word is sent separately
+void set_spi_word_gap(int usec);
+
+// Time the ADCs are given to convert all channels after being triggered,
+// before their readings are read out. The default is the settling delay the
+// reads have always used; a shorter time calibrated against a given
+// backplane can be set to speed up housekeeping reads.
+const int DEFAULT_ADC_CONVERSION_USEC = 100000;
+void set_adc_conversion_time(int usec);
+
+// Set the map of ADC channels to modules and the conversion of their readings
+// (see adc_calibration.h) of the selected backplane, used by all following
+// reads; the default is that of the current backplane with nominal gains
+void set_adc_calibration(const AdcCalibration &calibration);
+
+// Wakes a thread waiting for an ADC conversion early, so that it can run its
+// interrupt check (see set_interrupt_check) rather than wait out the
+// conversion. A raise with no thread waiting is kept for the next wait.
+class InterruptSignal {
+protected:
+    std::mutex mutex;
+    std::condition_variable raised_changed;
+    bool raised;
+public:
+    InterruptSignal() : raised(false) {}
+    // Wake the waiting thread, from any thread
+    void raise();
+    // Wait until the given time, or until raised, clearing the raise
+    void wait_until(std::chrono::steady_clock::time_point time);
+};
+
+// Set a check to be run before and while waiting for ADC conversions, and
+// between the SPI messages of multi-message reads
+// If it returns true, the read stops early so that an emergency command can
+// be performed without waiting for it to finish; raising the signal given,
+// if any, runs the check at once during a conversion
+// The check only applies to reads from the thread setting it
+void set_interrupt_check(std::function<bool()> check,
+        InterruptSignal *signal = nullptr);
+
+// Return true if the last command was stopped early by the interrupt check,
+// and clear the flag for the next command
+bool command_interrupted();
+
+// The reply to every message is checked for the echoed SOM and command word
+// and the EOM. A message whose reply fails is sent again, up to twice, if
+// sending it again does no harm: reads, and settings that leave the same
+// state however often they're sent. Resets, syncs, and ADC triggers are
+// never sent again, only counted.
+struct SpiCheckCounts {
+    uint32_t failed; // replies failing their checks, retries included
+    uint32_t retried; // messages sent again
+    uint32_t recovered; // of those, messages passing in the end
+    uint32_t unrecovered; // messages still failing, retried or not
+    SpiCheckCounts &operator+=(const SpiCheckCounts &counts);
+};
+
+// Return the counts of the messages sent by the calling thread since the
+// last call (from the thread performing commands, those of the last
+// command), and clear them
+SpiCheckCounts take_thread_check_counts();
+
+// Fill in the counts of all messages since the last call, by backplane and
+// command word, and clear them
+typedef std::map<std::pair<int, unsigned short>, SpiCheckCounts>
+    SpiCheckTotals;
+void take_spi_check_counts(SpiCheckTotals &counts);
 
 // Return value for all following commands is number of SPI messages sent
+// (not counting ADC trigger messages)
+
+// Build and send a single message of SPI_MESSAGES (see spi_protocol.h) as
+// its template says, with its parameters taken from the start of parameters
+int send_message(int message, const unsigned short parameters[],
+        unsigned short spi_command[], unsigned short spi_data[]);
 
 // Enable or disable trigger
 int enable_disable_trigger(unsigned short command_parameters[],
@@ -25,6 +150,11 @@ int read_currents(float currents[], unsigned short spi_command[],
 int read_voltages(float voltages[], unsigned short spi_command[],
         unsigned short spi_data[]);
 
+// Read in and store FEE housekeeping voltages and currents, triggering the
+// ADCs once for both
+int read_housekeeping(float voltages[], float currents[],
+        unsigned short spi_command[], unsigned short spi_data[]);
+
 // Read in and store FEEs present
 int read_fees_present(unsigned short fees_present[],
         unsigned short spi_command[], unsigned short spi_data[]);
@@ -33,6 +163,22 @@ int read_fees_present(unsigned short fees_present[],
 int read_nstimer_trigger_rate(unsigned short spi_command[],
         unsigned short spi_data[]);
 
+// The timer and counters read by read_nstimer_trigger_rate
+struct TriggerCounters {
+    uint64_t nstimer; // in ns
+    uint32_t tack_count; // since the last reset, wrapping at 2^32
+    uint32_t trigger_count;
+};
+// Decode the data words of read_nstimer_trigger_rate
+void decode_trigger_counters(const unsigned short spi_data[],
+        TriggerCounters &counters);
+
+// Read the hit pattern of every module, the trigger pixels hit, as one 16
+// bit word per module; the four blocks of eight modules are read back to back
+const int NUM_HIT_PATTERN_WORDS = 32;
+int read_hit_pattern(unsigned short hit_pattern[],
+        unsigned short spi_command[], unsigned short spi_data[]);
+
 // Reset DACQ 1 power
 int reset_dacq1_power(unsigned short spi_command[], unsigned short spi_data[]);
 
@@ -55,9 +201,18 @@ int set_tack_type_and_mode(unsigned short command_parameters[],
 int set_trigger(unsigned short command_parameters[],
         unsigned short spi_command[], unsigned short spi_data[]);
 
-// Set trigger mask
-int set_trigger_mask(unsigned short trigger_mask[],
-        unsigned short spi_command[], unsigned short spi_data[]);
+// Set the trigger mask of each module, sending only the blocks of eight
+// modules with a mask different from the one last applied; applied gets the
+// masks now in effect, as read back from the FPGA
+const int NUM_TRIGGER_MASKS = 32;
+int set_trigger_mask(const unsigned short trigger_mask[],
+        unsigned short applied[], unsigned short spi_command[],
+        unsigned short spi_data[]);
+
+// Forget the trigger masks last applied to the selected backplane, so that
+// the next set_trigger_mask sends every block, e.g. after the trigger FPGA
+// has been power cycled
+void forget_trigger_mask();
 
 // Send sync commands
 int sync(unsigned short spi_command[], unsigned short spi_data[]);
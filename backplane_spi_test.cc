@@ -0,0 +1,350 @@
+// backplane_spi_test.cc
+/* Check that the batched transfers of backplane_spi.cc are bit-exact with
+ * the word-by-word code they replaced. Every message of SPI_MESSAGES, and
+ * the reads and settings sending several together, is sent both ways to two
+ * simulated backplanes with their clocks stopped, so that both answer alike:
+ * once through backplane_spi.cc, and once a word per 2-byte transfer as the
+ * old transfer_message() did. Every word sent and received must match, as
+ * must the replies handed back. This is done with no gap and with a gap
+ * between words, and again with the reply of one message in each corrupted,
+ * which must then be sent again as its retry policy says.
+ * Exits with status 1 on any difference. */
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "backplane_spi.h"
+#include "simulated_backplane.h"
+#include "spi_protocol.h"
+
+// Name and retry policy of each message in SPI_MESSAGES
+#define SPI_MESSAGE_NAME(message, fpga, cw, n_parameters, fill, retry) \
+    #message,
+const char *message_names[NUM_SPI_MESSAGES] = {
+    SPI_MESSAGES(SPI_MESSAGE_NAME)
+};
+#undef SPI_MESSAGE_NAME
+
+#define SPI_MESSAGE_RETRY(message, fpga, cw, n_parameters, fill, retry) \
+    retry,
+const SpiRetryPolicy message_retry_policies[NUM_SPI_MESSAGES] = {
+    SPI_MESSAGES(SPI_MESSAGE_RETRY)
+};
+#undef SPI_MESSAGE_RETRY
+
+// Most messages sent by one of the calls checked
+const int MAX_MESSAGES = 9;
+
+// A simulated backplane recording every byte sent and received, and the
+// length of every transfer, with one received byte corrupted if asked
+class TapBackend : public SpiBackend {
+public:
+    SimulatedBackplane simulated;
+    std::vector<char> sent;
+    std::vector<char> received;
+    std::vector<unsigned int> transfer_lengths;
+    // Position in received of the byte to corrupt, if any
+    long corrupt_at;
+
+    TapBackend() : corrupt_at(-1)
+    {
+        simulated.set_transfer_overhead(0);
+        simulated.set_adc_conversion_time(0);
+        simulated.freeze_clock();
+    }
+    bool initialize() { return true; }
+    void transfer(const char *tbuf, char *rbuf, unsigned int length)
+    {
+        simulated.transfer(tbuf, rbuf, length);
+        long start = received.size();
+        if ((corrupt_at >= start) && (corrupt_at < start + (long)length)) {
+            rbuf[corrupt_at - start] ^= 0xFF;
+        }
+        sent.insert(sent.end(), tbuf, tbuf + length);
+        received.insert(received.end(), rbuf, rbuf + length);
+        transfer_lengths.push_back(length);
+    }
+};
+
+// Send one word as the old spi_tword() did, big endian in its own transfer
+// Return the word received meanwhile
+unsigned short transfer_word(SpiBackend &backend, unsigned short word)
+{
+    char tbuf[2] = {(char)(word >> 8), (char)(word & 0x00FF)};
+    char rbuf[2];
+    backend.transfer(tbuf, rbuf, 2);
+    return ((unsigned char)rbuf[0] << 8) | (unsigned char)rbuf[1];
+}
+
+// Send a message word by word as the old transfer_message() did: the SOM,
+// CW, and data words, a null word, then the EOM, keeping the 11 words
+// received after the dummy
+// Return whether the reply echoed the SOM and CW and ended with the EOM
+bool transfer_message_by_word(SpiBackend &backend,
+        const unsigned short message[], unsigned short reply[])
+{
+    transfer_word(backend, message[0]);
+    for (int i = 1; i < SPI_MESSAGE_WORDS - 1; i++) {
+        reply[i - 1] = transfer_word(backend, message[i]);
+    }
+    reply[SPI_MESSAGE_WORDS - 2] = transfer_word(backend, DWnull);
+    reply[SPI_MESSAGE_WORDS - 1] = transfer_word(backend,
+            message[SPI_MESSAGE_WORDS - 1]);
+    unsigned short eom = (message[0] == SPI_SOM_HKFPGA) ? SPI_EOM_HKFPGA
+        : SPI_EOM_TFPGA;
+    return (reply[0] == message[0]) && (reply[1] == message[1])
+        && (reply[SPI_MESSAGE_WORDS - 1] == eom);
+}
+
+// Send messages word by word, then send those whose replies failed their
+// checks again, as many times as allowed, and count them as
+// backplane_spi.cc does
+SpiCheckCounts transfer_messages_by_word(SpiBackend &backend,
+        const unsigned short messages[], unsigned short replies[], int n,
+        SpiRetryPolicy retry_policy)
+{
+    SpiCheckCounts counts = {0, 0, 0, 0};
+    bool passed[MAX_MESSAGES];
+    for (int i = 0; i < n; i++) {
+        passed[i] = transfer_message_by_word(backend,
+                messages + SPI_MESSAGE_WORDS * i,
+                replies + SPI_MESSAGE_WORDS * i);
+    }
+    for (int i = 0; i < n; i++) {
+        if (passed[i]) {
+            continue;
+        }
+        counts.failed++;
+        if (retry_policy == RETRY_IF_FAILED) {
+            counts.retried++;
+            for (int retry = 0; (retry < MAX_SPI_RETRIES) && !passed[i];
+                    retry++) {
+                passed[i] = transfer_message_by_word(backend,
+                        messages + SPI_MESSAGE_WORDS * i,
+                        replies + SPI_MESSAGE_WORDS * i);
+                if (!passed[i]) {
+                    counts.failed++;
+                }
+            }
+        }
+        if (passed[i]) {
+            counts.recovered++;
+        } else {
+            counts.unrecovered++;
+        }
+    }
+    return counts;
+}
+
+// Compare what two taps sent and received from the given positions on
+// Return true if they're the same
+bool same_bytes(const std::string &what, const std::vector<char> &batched,
+        std::size_t batched_start, const std::vector<char> &by_word,
+        std::size_t by_word_start)
+{
+    std::size_t n = batched.size() - batched_start;
+    if (by_word.size() - by_word_start != n) {
+        std::cout << "  " << what << " " << n << " bytes, not "
+            << by_word.size() - by_word_start << std::endl;
+        return false;
+    }
+    for (std::size_t i = 0; i < n; i++) {
+        if (batched[batched_start + i] != by_word[by_word_start + i]) {
+            std::cout << "  " << what << " byte " << i << " differs"
+                << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Both ways of sending, one checked against the other
+struct Comparison {
+    TapBackend *batched; // added to backplane_spi.cc
+    TapBackend by_word;
+    bool word_gap;
+    int n_failed;
+};
+
+// Check a call sending messages through backplane_spi.cc, which returns
+// their commands, against sending them word by word, first corrupting the
+// reply to the frame numbered corrupt of the call if it isn't -1
+// Messages sent by the call before those it returns, as the ADC trigger of
+// a housekeeping read, are given in extra
+template <typename Call>
+void check(Comparison &comparison, const std::string &name, Call call,
+        SpiRetryPolicy retry_policy, int corrupt, int n_extra = 0,
+        const unsigned short extra[] = nullptr)
+{
+    TapBackend &batched = *comparison.batched;
+    TapBackend &by_word = comparison.by_word;
+    std::size_t batched_start = batched.sent.size();
+    std::size_t by_word_start = by_word.sent.size();
+    // The EOM of the frame corrupted, whose last byte is flipped
+    long corrupt_offset = 2 * SPI_FRAME_WORDS * (corrupt + 1) - 1;
+    batched.corrupt_at = (corrupt < 0) ? -1 : batched_start + corrupt_offset;
+    by_word.corrupt_at = (corrupt < 0) ? -1 : by_word_start + corrupt_offset;
+
+    unsigned short spi_command[MAX_MESSAGES * SPI_MESSAGE_WORDS];
+    unsigned short spi_data[MAX_MESSAGES * SPI_MESSAGE_WORDS];
+    take_thread_check_counts();
+    std::size_t first_transfer = batched.transfer_lengths.size();
+    int n = call(spi_command, spi_data);
+    SpiCheckCounts counts = take_thread_check_counts();
+
+    // The word-by-word code sends the same messages; extra ones, not
+    // returned by the call, are always sent without retries
+    unsigned short replies[MAX_MESSAGES * SPI_MESSAGE_WORDS];
+    SpiCheckCounts by_word_counts = {0, 0, 0, 0};
+    if (n_extra > 0) {
+        by_word_counts += transfer_messages_by_word(by_word, extra, replies,
+                n_extra, NEVER_RETRY);
+    }
+    by_word_counts += transfer_messages_by_word(by_word, spi_command,
+            replies, n, retry_policy);
+
+    bool same = same_bytes("sent", batched.sent, batched_start, by_word.sent,
+            by_word_start);
+    same = same_bytes("received", batched.received, batched_start,
+            by_word.received, by_word_start) && same;
+    for (int i = 0; i < n * SPI_MESSAGE_WORDS; i++) {
+        if (spi_data[i] != replies[i]) {
+            std::cout << "  reply word " << i << " is " << spi_data[i]
+                << ", not " << replies[i] << std::endl;
+            same = false;
+            break;
+        }
+    }
+    if ((counts.failed != by_word_counts.failed)
+            || (counts.retried != by_word_counts.retried)
+            || (counts.recovered != by_word_counts.recovered)
+            || (counts.unrecovered != by_word_counts.unrecovered)) {
+        std::cout << "  check counts " << counts.failed << "/"
+            << counts.retried << "/" << counts.recovered << "/"
+            << counts.unrecovered << ", not " << by_word_counts.failed
+            << "/" << by_word_counts.retried << "/"
+            << by_word_counts.recovered << "/" << by_word_counts.unrecovered
+            << std::endl;
+        same = false;
+    }
+    if ((corrupt >= 0) && (counts.failed == 0)) {
+        std::cout << "  corrupted reply not detected" << std::endl;
+        same = false;
+    }
+    // With a gap, each word is a transfer of its own; without, each
+    // transfer carries whole frames
+    for (std::size_t i = first_transfer; i < batched.transfer_lengths.size();
+            i++) {
+        unsigned int length = batched.transfer_lengths[i];
+        if (comparison.word_gap ? (length != 2)
+                : (length % (2 * SPI_FRAME_WORDS) != 0)) {
+            std::cout << "  transfer of " << length << " bytes" << std::endl;
+            same = false;
+            break;
+        }
+    }
+    if (!same) {
+        std::cout << "FAIL: " << name << (comparison.word_gap ? " with gap"
+                : "") << (corrupt >= 0 ? " corrupted" : "") << std::endl;
+        comparison.n_failed++;
+    }
+}
+
+// Send every message and multi-message call, corrupting a reply in each if
+// asked
+void check_all(Comparison &comparison, bool corrupt)
+{
+    // Parameters differing each time, so that settings change
+    static unsigned short parameter = 0x1357;
+    unsigned short parameters[8];
+    unsigned short trigger_adcs[SPI_MESSAGE_WORDS];
+    for (int message = 0; message < NUM_SPI_MESSAGES; message++) {
+        for (int i = 0; i < 8; i++) {
+            parameters[i] = parameter++;
+        }
+        check(comparison, message_names[message],
+                [&](unsigned short spi_command[], unsigned short spi_data[]) {
+                    int n = send_message(message, parameters, spi_command,
+                            spi_data);
+                    // Kept to check housekeeping reads, which send it first
+                    if (message == SPI_MSG_TRIGGER_ADCS) {
+                        std::copy(spi_command,
+                                spi_command + SPI_MESSAGE_WORDS,
+                                trigger_adcs);
+                    }
+                    return n;
+                }, message_retry_policies[message], corrupt ? 0 : -1);
+    }
+
+    // Power some modules so that the reads return more than noise
+    unsigned short power[2] = {0x00FF, (unsigned short)(corrupt ? 0xF0F0
+            : 0x0F0F)};
+    check(comparison, "power_control_modules",
+            [&](unsigned short spi_command[], unsigned short spi_data[]) {
+                return power_control_modules(power, spi_command, spi_data);
+            }, RETRY_IF_FAILED, -1);
+
+    check(comparison, "read_housekeeping",
+            [](unsigned short spi_command[], unsigned short spi_data[]) {
+                float voltages[32];
+                float currents[32];
+                return read_housekeeping(voltages, currents, spi_command,
+                        spi_data);
+            }, RETRY_IF_FAILED, corrupt ? 3 : -1, 1, trigger_adcs);
+    check(comparison, "read_hit_pattern",
+            [](unsigned short spi_command[], unsigned short spi_data[]) {
+                unsigned short hit_pattern[NUM_HIT_PATTERN_WORDS];
+                return read_hit_pattern(hit_pattern, spi_command, spi_data);
+            }, RETRY_IF_FAILED, corrupt ? 1 : -1);
+    unsigned short trigger_mask[NUM_TRIGGER_MASKS];
+    for (int i = 0; i < NUM_TRIGGER_MASKS; i++) {
+        trigger_mask[i] = parameter++;
+    }
+    check(comparison, "set_trigger_mask",
+            [&](unsigned short spi_command[], unsigned short spi_data[]) {
+                unsigned short applied[NUM_TRIGGER_MASKS];
+                return set_trigger_mask(trigger_mask, applied, spi_command,
+                        spi_data);
+            }, RETRY_IF_FAILED, corrupt ? 2 : -1);
+    check(comparison, "sync",
+            [](unsigned short spi_command[], unsigned short spi_data[]) {
+                return sync(spi_command, spi_data);
+            }, NEVER_RETRY, corrupt ? 1 : -1);
+}
+
+int main()
+{
+    set_adc_conversion_time(0);
+    int n_failed = 0;
+    for (int gap = 0; gap <= 1; gap++) {
+        // A backplane of its own for each, so that no trigger masks are
+        // known to be applied yet
+        Comparison comparison;
+        comparison.batched = new TapBackend();
+        comparison.word_gap = (gap > 0);
+        comparison.n_failed = 0;
+        int index = add_backplane_backend(comparison.batched);
+        if (index < 0) {
+            return 1;
+        }
+        select_backplane(index);
+        set_spi_word_gap(gap);
+        check_all(comparison, false);
+        check_all(comparison, true);
+        std::cout << (comparison.word_gap ? "With a 1 us gap: "
+                : "Without a gap: ") << comparison.batched->sent.size()
+            << " bytes sent in " << comparison.batched->transfer_lengths.size()
+            << " transfers, " << comparison.by_word.transfer_lengths.size()
+            << " word by word" << std::endl;
+        n_failed += comparison.n_failed;
+    }
+    if (n_failed > 0) {
+        std::cout << n_failed << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All transfers bit-exact with the word-by-word code"
+        << std::endl;
+    return 0;
+}
@@ -0,0 +1,120 @@
+// clock_sync.cc
+// Implementation of the estimation of client clock offsets and of the
+// correlation of the nsTimer with the server's clock
+
+#include "clock_sync.h"
+#include "slow_control.pb.h"
+
+// Span of nsTimer readings over which its rate is worth reporting
+const int64_t NSTIMER_MIN_SPAN_USEC = 10000000;
+
+void fill_clock_echo(int64_t server_send_usec, int64_t client_receive_usec,
+        slow_control::ClockEcho &echo)
+{
+    echo.set_server_send_usec(server_send_usec);
+    echo.set_client_receive_usec(client_receive_usec);
+    echo.set_client_send_unix_usec(unix_time_usec());
+    echo.set_client_send_usec(monotonic_time_usec());
+}
+
+bool ClockOffsetEstimator::add(const slow_control::ClockEcho &echo,
+        int64_t server_receive_usec)
+{
+    // Round trip less the time held by the client, and the offset which
+    // puts the client's receipt and sending each halfway along its leg
+    int64_t held_usec = echo.client_send_usec() - echo.client_receive_usec();
+    int64_t round_trip_usec = server_receive_usec - echo.server_send_usec()
+        - held_usec;
+    if ((echo.server_send_usec() == 0) || (held_usec < 0)
+            || (round_trip_usec < 0)) {
+        return false;
+    }
+    Exchange &exchange = exchanges[next];
+    exchange.offset_usec = ((echo.server_send_usec()
+                - echo.client_receive_usec())
+            + (server_receive_usec - echo.client_send_usec())) / 2;
+    exchange.round_trip_usec = round_trip_usec;
+    next = (next + 1) % CLOCK_FILTER_SIZE;
+    if (n_exchanges < CLOCK_FILTER_SIZE) {
+        n_exchanges++;
+    }
+    unix_less_monotonic_usec = echo.client_send_unix_usec()
+        - echo.client_send_usec();
+    return true;
+}
+
+const ClockOffsetEstimator::Exchange *ClockOffsetEstimator::best() const
+{
+    if (n_exchanges == 0) {
+        return nullptr;
+    }
+    const Exchange *shortest = &exchanges[0];
+    for (int i = 1; i < n_exchanges; i++) {
+        if (exchanges[i].round_trip_usec < shortest->round_trip_usec) {
+            shortest = &exchanges[i];
+        }
+    }
+    return shortest;
+}
+
+int64_t ClockOffsetEstimator::offset_usec() const
+{
+    const Exchange *shortest = best();
+    return shortest ? shortest->offset_usec : 0;
+}
+
+int64_t ClockOffsetEstimator::error_usec() const
+{
+    const Exchange *shortest = best();
+    return shortest ? shortest->round_trip_usec / 2 : 0;
+}
+
+int64_t ClockOffsetEstimator::to_server_time(int64_t client_unix_usec,
+        int64_t client_monotonic_usec) const
+{
+    if (!estimated()) {
+        return client_unix_usec;
+    }
+    if (client_monotonic_usec == 0) {
+        client_monotonic_usec = client_unix_usec - unix_less_monotonic_usec;
+    }
+    return client_monotonic_usec + offset_usec();
+}
+
+void NsTimerCorrelation::add(int64_t time_usec, uint64_t nstimer)
+{
+    // The timer starts again from zero when the TFPGA is reset
+    if (!started || (nstimer < last_nstimer)) {
+        started = true;
+        first_time_usec = time_usec;
+        first_nstimer = nstimer;
+    }
+    last_time_usec = time_usec;
+    last_nstimer = nstimer;
+}
+
+bool NsTimerCorrelation::zero_time(int64_t &time_usec) const
+{
+    if (!started) {
+        return false;
+    }
+    time_usec = last_time_usec - (int64_t)(last_nstimer / 1000);
+    return true;
+}
+
+bool NsTimerCorrelation::report(std::ostream &out) const
+{
+    int64_t zero_usec;
+    if (!zero_time(zero_usec)) {
+        return false;
+    }
+    out << "  nsTimer zero at " << zero_usec << " us since the epoch";
+    int64_t span_usec = last_time_usec - first_time_usec;
+    if (span_usec >= NSTIMER_MIN_SPAN_USEC) {
+        double timer_usec = 1e-3 * (last_nstimer - first_nstimer);
+        out << ", running " << 1e6 * (timer_usec - span_usec) / span_usec
+            << " ppm fast over " << 1e-6 * span_usec << " s";
+    }
+    out << std::endl;
+    return true;
+}
@@ -0,0 +1,103 @@
+// clock_sync.h
+// Estimation on the server of the offset of each client's clock from its
+// own, from the times of commands sent and echoed back, and correlation of
+// the backplane's nsTimer with the server's clock
+
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <cstdint>
+#include <chrono>
+#include <ostream>
+
+// Defined in slow_control.pb.h, which only clock_sync.cc needs, so that the
+// clock helpers below can be used without the protobuf messages
+namespace slow_control {
+class ClockEcho;
+}
+
+// Exchanges kept, the one with the shortest round trip giving the offset
+const int CLOCK_FILTER_SIZE = 8;
+
+// Current time since the epoch, and on the monotonic clock, in us; every
+// wall clock time sent by the Pi is taken with unix_time_usec()
+inline int64_t unix_time_usec()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline int64_t monotonic_time_usec()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Fill in the echo of a command's server time, received at the given time
+// on the client's monotonic clock, just before sending it back
+void fill_clock_echo(int64_t server_send_usec, int64_t client_receive_usec,
+        slow_control::ClockEcho &echo);
+
+// Offset of one client's monotonic clock from the server's clock. Each echo
+// gives the offset to within half its round trip, less the time the client
+// held the command; as in NTP, the exchange with the shortest round trip of
+// the latest few is taken as the most accurate. Times taken on the client's
+// own clock since the epoch are converted through the difference between
+// its two clocks as last echoed, so that a client whose clock is far off,
+// or stepped, is still placed in time.
+class ClockOffsetEstimator {
+protected:
+    struct Exchange {
+        int64_t offset_usec; // server time less client monotonic time
+        int64_t round_trip_usec;
+    };
+    Exchange exchanges[CLOCK_FILTER_SIZE];
+    int n_exchanges; // kept, up to CLOCK_FILTER_SIZE
+    int next; // to replace
+    int64_t unix_less_monotonic_usec; // on the client, as last echoed
+    const Exchange *best() const;
+public:
+    ClockOffsetEstimator() : n_exchanges(0), next(0),
+        unix_less_monotonic_usec(0) {}
+    // Add an echo, received at the given time on the server's clock
+    // Return false, adding nothing, if its times are inconsistent
+    bool add(const slow_control::ClockEcho &echo, int64_t server_receive_usec);
+    bool estimated() const { return n_exchanges > 0; }
+    // Server time less client monotonic time, and the most it may be off
+    int64_t offset_usec() const;
+    int64_t error_usec() const;
+    // Server time less client time since the epoch, as last echoed
+    int64_t unix_offset_usec() const {
+        return offset_usec() - unix_less_monotonic_usec;
+    }
+    // Convert a time on the client to the server's clock, from its
+    // monotonic time if given (not 0), else from its time since the epoch;
+    // unconverted until anything is estimated
+    int64_t to_server_time(int64_t client_unix_usec,
+            int64_t client_monotonic_usec = 0) const;
+};
+
+// Relation of the backplane's nsTimer to the server's clock, from readings
+// of the timer paired with their times: when the timer read zero, and how
+// fast it runs against the server's clock, since it was last reset
+class NsTimerCorrelation {
+protected:
+    bool started;
+    int64_t first_time_usec; // server time of the first reading since reset
+    uint64_t first_nstimer;
+    int64_t last_time_usec;
+    uint64_t last_nstimer;
+public:
+    NsTimerCorrelation() : started(false) {}
+    // Add a reading of the timer, at the given time on the server's clock
+    void add(int64_t time_usec, uint64_t nstimer);
+    // Server time at which the timer read zero, from the latest reading
+    // Return false if there is none
+    bool zero_time(int64_t &time_usec) const;
+    // Write when the timer read zero and its rate against the server's
+    // clock, once it has run long enough to tell
+    // Return false, writing nothing, if there is no reading
+    bool report(std::ostream &out) const;
+};
+
+#endif
@@ -0,0 +1,496 @@
+// command_sequence.cc
+// Compilation and running of high level command sequences
+
+#include <cstring>
+
+#include <iostream>
+#include <sstream>
+
+#include "command_sequence.h"
+#include "command_table.h"
+
+// Maximum number of instructions run in one call, as a guard against a
+// corrupt sequence; loops are bounded by their 32 bit masks anyway
+const int MAX_SEQUENCE_STEPS = 65536;
+
+// Maximum depth of nested FOR and IF blocks
+const std::size_t MAX_BLOCK_DEPTH = 8;
+
+// Parse a decimal or 0x-prefixed hexadecimal unsigned integer
+// Return true on success, false otherwise
+bool parse_literal(const std::string &word, uint32_t &value)
+{
+    int base = 10;
+    std::string digits = word;
+    if ((word.size() > 2) && (word[0] == '0') &&
+            ((word[1] == 'x') || (word[1] == 'X'))) {
+        base = 16;
+        digits = word.substr(2);
+    }
+    if (digits.empty() || (digits.find_first_not_of(
+                    (base == 16) ? "0123456789abcdefABCDEF" : "0123456789")
+                != std::string::npos)) {
+        return false;
+    }
+    try {
+        unsigned long parsed = std::stoul(digits, NULL, base);
+        if (parsed > 0xFFFFFFFFUL) {
+            return false;
+        }
+        value = parsed;
+    } catch (...) {
+        return false;
+    }
+    return true;
+}
+
+// Make an instruction with all fields zeroed, so cached bytes are repeatable
+SequenceInstruction make_instruction(SequenceOpcode opcode)
+{
+    SequenceInstruction instruction;
+    memset(&instruction, 0, sizeof(instruction));
+    instruction.opcode = opcode;
+    return instruction;
+}
+
+uint32_t SequenceCompiler::add_register(std::string name)
+{
+    auto it = registers.find(name);
+    if (it != registers.end()) {
+        return it->second;
+    }
+    uint32_t index = registers.size();
+    registers[name] = index;
+    return index;
+}
+
+bool SequenceCompiler::begin(const std::vector<std::string> &words,
+        HighLevelCommand &sequence)
+{
+    registers.clear();
+    blocks.clear();
+    sequence.command_name = words[0];
+    for (std::size_t i = 1; i < words.size(); i++) {
+        if (registers.count(words[i])) {
+            std::cerr << "parameter " << words[i] << " repeated" << std::endl;
+            return false;
+        }
+        sequence.parameters.push_back(words[i]);
+        add_register(words[i]);
+    }
+    return true;
+}
+
+bool SequenceCompiler::parse_operand(const std::string &word,
+        SequenceOperand &operand)
+{
+    memset(&operand, 0, sizeof(operand));
+    if (parse_literal(word, operand.value)) {
+        operand.kind = OPERAND_LITERAL;
+        operand.transform = OPERAND_VALUE;
+        return true;
+    }
+    // Split off any transform
+    std::string name = word;
+    operand.transform = OPERAND_VALUE;
+    const char *transforms[] = {"hi(", "lo(", "bit("};
+    const SequenceOperandTransform transform_codes[] = {OPERAND_HIGH_WORD,
+        OPERAND_LOW_WORD, OPERAND_BIT};
+    for (int i = 0; i < 3; i++) {
+        std::string prefix = transforms[i];
+        if ((word.compare(0, prefix.size(), prefix) == 0)
+                && (word.back() == ')')) {
+            name = word.substr(prefix.size(),
+                    word.size() - prefix.size() - 1);
+            operand.transform = transform_codes[i];
+            break;
+        }
+    }
+    // Look up the register
+    if ((name.size() < 2) || (name[0] != '$')) {
+        std::cerr << "could not parse value " << word << std::endl;
+        return false;
+    }
+    auto it = registers.find(name.substr(1));
+    if (it == registers.end()) {
+        std::cerr << "unknown parameter or variable " << name << std::endl;
+        return false;
+    }
+    operand.kind = OPERAND_REGISTER;
+    operand.value = it->second;
+    return true;
+}
+
+bool SequenceCompiler::compile_statement(const std::vector<std::string> &words,
+        HighLevelCommand &sequence, bool &error)
+{
+    error = false;
+    const std::string &keyword = words[0];
+    if ((keyword == "SET") || (keyword == "OR")) {
+        // SET name value, OR name value
+        SequenceInstruction instruction = make_instruction(
+                (keyword == "SET") ? SEQ_SET : SEQ_OR);
+        if ((words.size() != 3) || !parse_operand(words[2], instruction.a)) {
+            error = true;
+            return true;
+        }
+        if ((keyword == "OR") && !registers.count(words[1])) {
+            std::cerr << "variable " << words[1] << " used before SET"
+                << std::endl;
+            error = true;
+            return true;
+        }
+        instruction.reg = add_register(words[1]);
+        sequence.code.push_back(instruction);
+    } else if (keyword == "FOR") {
+        // FOR name IN value
+        SequenceInstruction init = make_instruction(SEQ_LOOP_INIT);
+        if ((words.size() != 4) || (words[2] != "IN")
+                || (blocks.size() >= MAX_BLOCK_DEPTH)
+                || !parse_operand(words[3], init.a)) {
+            error = true;
+            return true;
+        }
+        // Each loop keeps its remaining bits in an unnamed register
+        init.reg = add_register(" loop " + std::to_string(blocks.size()) +
+                ' ' + std::to_string(sequence.code.size()));
+        sequence.code.push_back(init);
+        SequenceInstruction next = make_instruction(SEQ_LOOP_NEXT);
+        next.reg = init.reg;
+        next.reg2 = add_register(words[1]);
+        Block block;
+        block.loop = true;
+        block.start = sequence.code.size();
+        block.branch = sequence.code.size();
+        blocks.push_back(block);
+        sequence.code.push_back(next);
+    } else if (keyword == "IF") {
+        // IF variable index op value
+        SequenceInstruction instruction = make_instruction(SEQ_IF);
+        const char *variables[] = {"present", "voltage", "current"};
+        const char *comparisons[] = {"==", "!=", "<", "<=", ">", ">="};
+        int variable = -1;
+        int comparison = -1;
+        if (words.size() == 5) {
+            for (int i = 0; i < 3; i++) {
+                if (words[1] == variables[i]) {
+                    variable = i;
+                }
+            }
+            for (int i = 0; i < 6; i++) {
+                if (words[3] == comparisons[i]) {
+                    comparison = i;
+                }
+            }
+        }
+        if ((variable < 0) || (comparison < 0)
+                || (blocks.size() >= MAX_BLOCK_DEPTH)
+                || !parse_operand(words[2], instruction.a)) {
+            error = true;
+            return true;
+        }
+        // The value may be a decimal number as well as an integer operand
+        if (words[4].find('$') != std::string::npos) {
+            if (!parse_operand(words[4], instruction.b)) {
+                error = true;
+                return true;
+            }
+        } else if (!parse_literal(words[4], instruction.b.value)) {
+            float value;
+            try {
+                std::size_t pos;
+                value = std::stof(words[4], &pos);
+                if (pos != words[4].size()) {
+                    throw std::invalid_argument(words[4]);
+                }
+            } catch (...) {
+                error = true;
+                return true;
+            }
+            memset(&instruction.b, 0, sizeof(instruction.b));
+            instruction.b.kind = OPERAND_FLOAT;
+            memcpy(&instruction.b.value, &value, sizeof(value));
+        }
+        instruction.variable = variable;
+        instruction.comparison = comparison;
+        Block block;
+        block.loop = false;
+        block.start = sequence.code.size();
+        block.branch = sequence.code.size();
+        blocks.push_back(block);
+        sequence.code.push_back(instruction);
+    } else if (keyword == "ELSE") {
+        if ((words.size() != 1) || blocks.empty() || blocks.back().loop
+                || (blocks.back().branch != blocks.back().start)) {
+            error = true;
+            return true;
+        }
+        // End of the IF part jumps past the ELSE part
+        sequence.code.push_back(make_instruction(SEQ_JUMP));
+        sequence.code[blocks.back().branch].jump = sequence.code.size();
+        blocks.back().branch = sequence.code.size() - 1;
+    } else if ((keyword == "END") && (words.size() == 2)
+            && ((words[1] == "FOR") || (words[1] == "IF"))) {
+        if (blocks.empty() || (blocks.back().loop != (words[1] == "FOR"))) {
+            error = true;
+            return true;
+        }
+        if (blocks.back().loop) {
+            SequenceInstruction jump = make_instruction(SEQ_JUMP);
+            jump.jump = blocks.back().start;
+            sequence.code.push_back(jump);
+        }
+        sequence.code[blocks.back().branch].jump = sequence.code.size();
+        blocks.pop_back();
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void SequenceCompiler::add_command(const LowLevelCommand &command,
+        const std::vector<SequenceOperand> &int_operands,
+        HighLevelCommand &sequence)
+{
+    SequenceInstruction instruction = make_instruction(SEQ_EMIT);
+    instruction.reg = sequence.commands.size();
+    sequence.code.push_back(instruction);
+    sequence.first_int_operand.push_back(sequence.int_operands.size());
+    sequence.int_operands.insert(sequence.int_operands.end(),
+            int_operands.begin(), int_operands.end());
+    sequence.commands.push_back(command);
+}
+
+bool SequenceCompiler::finish(HighLevelCommand &sequence)
+{
+    if (!blocks.empty()) {
+        std::cerr << "FOR or IF without END" << std::endl;
+        return false;
+    }
+    sequence.n_registers = registers.size();
+    sequence.emergency = false;
+    for (auto it = sequence.commands.begin(); it != sequence.commands.end();
+            ++it) {
+        if (it->priority == EMERGENCY_PRIORITY) {
+            sequence.emergency = true;
+        }
+    }
+    return true;
+}
+
+// Check that an operand refers to an existing register
+bool validate_operand(const SequenceOperand &operand, uint32_t n_registers)
+{
+    return ((operand.kind != OPERAND_REGISTER)
+            || (operand.value < n_registers));
+}
+
+bool validate_sequence(const HighLevelCommand &sequence)
+{
+    if ((sequence.parameters.size() > sequence.n_registers)
+            || (sequence.first_int_operand.size() !=
+                sequence.commands.size())) {
+        return false;
+    }
+    for (std::size_t i = 0; i < sequence.commands.size(); i++) {
+        if (sequence.first_int_operand[i] +
+                sequence.commands[i].int_args.size() >
+                sequence.int_operands.size()) {
+            return false;
+        }
+    }
+    for (auto it = sequence.int_operands.begin();
+            it != sequence.int_operands.end(); ++it) {
+        if (!validate_operand(*it, sequence.n_registers)) {
+            return false;
+        }
+    }
+    for (auto it = sequence.code.begin(); it != sequence.code.end(); ++it) {
+        bool valid = (validate_operand(it->a, sequence.n_registers)
+                && validate_operand(it->b, sequence.n_registers)
+                && (it->jump <= sequence.code.size()));
+        switch (it->opcode) {
+            case SEQ_EMIT:
+                valid = valid && (it->reg < sequence.commands.size());
+                break;
+            case SEQ_SET:
+            case SEQ_OR:
+            case SEQ_LOOP_INIT:
+                valid = valid && (it->reg < sequence.n_registers);
+                break;
+            case SEQ_LOOP_NEXT:
+                valid = valid && (it->reg < sequence.n_registers)
+                    && (it->reg2 < sequence.n_registers);
+                break;
+            case SEQ_JUMP:
+                break;
+            case SEQ_IF:
+                valid = valid && (it->variable <= READBACK_CURRENT)
+                    && (it->comparison <= COMPARE_GE);
+                break;
+            default:
+                valid = false;
+                break;
+        }
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool start_sequence(const HighLevelCommand &sequence,
+        const std::string &parameters, SequenceState &state)
+{
+    state.registers.assign(sequence.n_registers, 0);
+    state.pc = 0;
+    std::string parameter_list = parameters;
+    for (auto it = parameter_list.begin(); it != parameter_list.end(); ++it) {
+        if (*it == ',') {
+            *it = ' ';
+        }
+    }
+    std::istringstream ss(parameter_list);
+    std::string word;
+    std::size_t n_given = 0;
+    while (ss >> word) {
+        if ((n_given >= sequence.parameters.size())
+                || !parse_literal(word, state.registers[n_given])) {
+            std::cerr << "Error: invalid parameters \"" << parameters
+                << "\" for " << sequence.command_name << std::endl;
+            return false;
+        }
+        n_given++;
+    }
+    if (n_given != sequence.parameters.size()) {
+        std::cerr << "Error: " << sequence.command_name << " takes "
+            << sequence.parameters.size() << " parameters" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Get the value of an integer operand
+uint32_t resolve_operand(const SequenceOperand &operand,
+        const SequenceState &state)
+{
+    uint32_t value = operand.value;
+    if (operand.kind == OPERAND_REGISTER) {
+        value = state.registers[operand.value];
+    }
+    switch (operand.transform) {
+        case OPERAND_HIGH_WORD:
+            return value >> 16;
+        case OPERAND_LOW_WORD:
+            return value & 0xFFFF;
+        case OPERAND_BIT:
+            return (value < 32) ? (1u << value) : 0;
+        default:
+            return value;
+    }
+}
+
+// Evaluate the condition of an IF instruction
+bool evaluate_condition(const SequenceInstruction &instruction,
+        const SequenceState &state, const ReadbackValues &readback)
+{
+    uint32_t index = resolve_operand(instruction.a, state);
+    if (index >= (uint32_t)NUM_READBACK_FEES) {
+        std::cerr << "Warning: module index " << index
+            << " out of range in condition" << std::endl;
+        return false;
+    }
+    const float *values = readback.present;
+    if (instruction.variable == READBACK_VOLTAGE) {
+        values = readback.voltage;
+    } else if (instruction.variable == READBACK_CURRENT) {
+        values = readback.current;
+    }
+    double lhs = values[index];
+    double rhs;
+    if (instruction.b.kind == OPERAND_FLOAT) {
+        float value;
+        memcpy(&value, &instruction.b.value, sizeof(value));
+        rhs = value;
+    } else {
+        rhs = resolve_operand(instruction.b, state);
+    }
+    switch (instruction.comparison) {
+        case COMPARE_EQ: return (lhs == rhs);
+        case COMPARE_NE: return (lhs != rhs);
+        case COMPARE_LT: return (lhs < rhs);
+        case COMPARE_LE: return (lhs <= rhs);
+        case COMPARE_GT: return (lhs > rhs);
+        case COMPARE_GE: return (lhs >= rhs);
+        default: return false;
+    }
+}
+
+SequenceStatus run_sequence(const HighLevelCommand &sequence,
+        SequenceState &state, const ReadbackValues &readback,
+        bool commands_pending, std::vector<LowLevelCommand> &emitted)
+{
+    for (int step = 0; step < MAX_SEQUENCE_STEPS; step++) {
+        if (state.pc >= sequence.code.size()) {
+            return SEQUENCE_DONE;
+        }
+        const SequenceInstruction &instruction = sequence.code[state.pc];
+        state.pc++;
+        switch (instruction.opcode) {
+            case SEQ_EMIT:
+            {
+                LowLevelCommand command = sequence.commands[instruction.reg];
+                uint32_t first = sequence.first_int_operand[instruction.reg];
+                for (std::size_t i = 0; i < command.int_args.size(); i++) {
+                    command.int_args[i] = resolve_operand(
+                            sequence.int_operands[first + i], state);
+                }
+                emitted.push_back(command);
+                break;
+            }
+            case SEQ_SET:
+                state.registers[instruction.reg] =
+                    resolve_operand(instruction.a, state);
+                break;
+            case SEQ_OR:
+                state.registers[instruction.reg] |=
+                    resolve_operand(instruction.a, state);
+                break;
+            case SEQ_LOOP_INIT:
+                state.registers[instruction.reg] =
+                    resolve_operand(instruction.a, state);
+                break;
+            case SEQ_LOOP_NEXT:
+            {
+                uint32_t &remaining = state.registers[instruction.reg];
+                if (remaining == 0) {
+                    state.pc = instruction.jump;
+                } else {
+                    state.registers[instruction.reg2] =
+                        __builtin_ctz(remaining);
+                    remaining &= remaining - 1;
+                }
+                break;
+            }
+            case SEQ_JUMP:
+                state.pc = instruction.jump;
+                break;
+            case SEQ_IF:
+                // Conditions test the results of all earlier commands,
+                // including those emitted on this run, still to be queued
+                if (commands_pending || !emitted.empty()) {
+                    state.pc--;
+                    return SEQUENCE_WAITING;
+                }
+                if (!evaluate_condition(instruction, state, readback)) {
+                    state.pc = instruction.jump;
+                }
+                break;
+            default:
+                return SEQUENCE_ERROR;
+        }
+    }
+    std::cerr << "Error: sequence " << sequence.command_name
+        << " exceeded " << MAX_SEQUENCE_STEPS << " steps" << std::endl;
+    return SEQUENCE_ERROR;
+}
@@ -0,0 +1,172 @@
+// command_sequence.h
+// Bytecode for high level command sequences, which may take parameters and
+// contain loops and conditionals. Sequences are compiled when the command
+// configuration file is loaded and run by the server.
+
+#ifndef COMMAND_SEQUENCE_H
+#define COMMAND_SEQUENCE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "backplane_commands.h"
+
+struct LowLevelCommand;
+struct HighLevelCommand;
+
+// Number of modules for which values are read back, 32 for each backplane
+// of the Pi, those of backplane n from 32n
+const int NUM_READBACK_FEES = 32 * MAX_BACKPLANES;
+
+enum SequenceOpcode {
+    SEQ_EMIT, // queue command number reg, taking int args from its operands
+    SEQ_SET, // registers[reg] = a
+    SEQ_OR, // registers[reg] |= a
+    SEQ_LOOP_INIT, // registers[reg] = a, the set bits remaining to loop over
+    SEQ_LOOP_NEXT, // if registers[reg] == 0 go to jump, else move its lowest
+                   // set bit from registers[reg] to registers[reg2] as index
+    SEQ_JUMP, // go to jump
+    SEQ_IF // wait for pending commands, then go to jump unless
+           // variable[a] <comparison> b
+};
+
+enum SequenceOperandKind {
+    OPERAND_LITERAL, // value is the operand
+    OPERAND_REGISTER, // value is the index of the register holding the operand
+    OPERAND_FLOAT // value holds the bits of a float (conditionals only)
+};
+
+enum SequenceOperandTransform {
+    OPERAND_VALUE, // name or number: the value itself
+    OPERAND_HIGH_WORD, // hi(name): bits 31-16
+    OPERAND_LOW_WORD, // lo(name): bits 15-0
+    OPERAND_BIT // bit(name): 1 shifted left by the value
+};
+
+// Values read back from the backplane that conditionals may test
+enum ReadbackVariable {
+    READBACK_PRESENT, // present
+    READBACK_VOLTAGE, // voltage
+    READBACK_CURRENT // current
+};
+
+enum SequenceComparison {
+    COMPARE_EQ, // ==
+    COMPARE_NE, // !=
+    COMPARE_LT, // <
+    COMPARE_LE, // <=
+    COMPARE_GT, // >
+    COMPARE_GE // >=
+};
+
+// Fixed size layouts, so that compiled sequences can be cached as they are
+struct SequenceOperand {
+    uint8_t kind;
+    uint8_t transform;
+    uint16_t padding;
+    uint32_t value;
+};
+
+struct SequenceInstruction {
+    uint8_t opcode;
+    uint8_t variable;
+    uint8_t comparison;
+    uint8_t padding;
+    uint32_t reg;
+    uint32_t reg2;
+    uint32_t jump;
+    SequenceOperand a;
+    SequenceOperand b;
+};
+
+// Latest values read back from the backplane, for testing in conditionals
+// Values are zero until first read
+struct ReadbackValues {
+    float present[NUM_READBACK_FEES];
+    float voltage[NUM_READBACK_FEES];
+    float current[NUM_READBACK_FEES];
+    ReadbackValues() : present(), voltage(), current() {}
+};
+
+// Position and register values of a sequence being run
+struct SequenceState {
+    std::vector<uint32_t> registers;
+    std::size_t pc = 0;
+};
+
+enum SequenceStatus {
+    SEQUENCE_DONE,
+    SEQUENCE_WAITING, // at a conditional while commands are still pending
+    SEQUENCE_ERROR
+};
+
+// Compiles the lines of one sequence in the command configuration file
+//
+// The first line names the sequence and its parameters, which are given when
+// the sequence is requested. Other lines are commands, whose INT arguments
+// may be a number (decimal or 0x hex), $name, hi($name), lo($name), or
+// bit($name), or one of the statements:
+//   SET name value          set a variable
+//   OR name value           set bits of a variable
+//   FOR name IN value       loop over the indices of the bits set in value
+//   END FOR
+//   IF variable index op value   test the latest present, voltage, or
+//   ELSE                         current of a module; waits until all
+//   END IF                       pending commands are done
+class SequenceCompiler {
+protected:
+    std::unordered_map<std::string, uint32_t> registers;
+    struct Block {
+        bool loop; // FOR if true, else IF
+        std::size_t start; // instruction to return to at END FOR
+        std::size_t branch; // instruction whose jump to set at the end
+    };
+    std::vector<Block> blocks;
+    uint32_t add_register(std::string name);
+public:
+    // Start a sequence from its first line: name, then parameter names
+    // Return true on success, false otherwise
+    bool begin(const std::vector<std::string> &words,
+            HighLevelCommand &sequence);
+
+    // Compile a statement line
+    // Return true if the line is a statement, setting error if it's invalid
+    bool compile_statement(const std::vector<std::string> &words,
+            HighLevelCommand &sequence, bool &error);
+
+    // Parse an INT argument
+    // Return true on success, false otherwise
+    bool parse_operand(const std::string &word, SequenceOperand &operand);
+
+    // Add a command, with its INT arguments given by operands
+    void add_command(const LowLevelCommand &command,
+            const std::vector<SequenceOperand> &int_operands,
+            HighLevelCommand &sequence);
+
+    // Finish the sequence
+    // Return true on success, false if a block was left open
+    bool finish(HighLevelCommand &sequence);
+};
+
+// Check that a compiled sequence only refers to registers, commands, and
+// instructions that exist, as for one loaded from a cache
+// Return true if valid, false otherwise
+bool validate_sequence(const HighLevelCommand &sequence);
+
+// Set up the state for running a sequence, with its parameters given as a
+// string of numbers separated by spaces or commas
+// Return true on success, false if the parameters don't match
+bool start_sequence(const HighLevelCommand &sequence,
+        const std::string &parameters, SequenceState &state);
+
+// Run a sequence until it finishes, or reaches a conditional while commands
+// are still pending or have been emitted on this run, appending the commands
+// to be queued to emitted, which the caller queues whatever the status
+// Return the status of the sequence
+SequenceStatus run_sequence(const HighLevelCommand &sequence,
+        SequenceState &state, const ReadbackValues &readback,
+        bool commands_pending, std::vector<LowLevelCommand> &emitted);
+
+#endif
@@ -0,0 +1,479 @@
+// command_table.cc
+// Implementation of the compiled binary cache of the command table
+
+#include <cstdio>
+#include <cstring>
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+#include "command_table.h"
+#include "backplane_commands.h"
+#include "network.h"
+
+// Identifies a command cache file and the version of its layout
+const char CACHE_MAGIC[8] = {'S', 'C', 'T', 'C', 'M', 'D', 'S', '\0'};
+const uint32_t CACHE_VERSION = 5;
+
+// FNV-1a hash parameters
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+// The cache file is a header followed by arrays of fixed size records, the
+// argument values, the compiled sequences, and a table of null terminated
+// strings. Records refer to strings by offset into the string table and to
+// arguments by index into the argument arrays, so loading the file takes
+// one read and bounds checks, and no parsing of text.
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_definitions;
+    uint32_t n_high_level_commands;
+    uint32_t n_commands;
+    uint32_t n_int_operands;
+    uint32_t n_float_args;
+    uint32_t n_string_args;
+    uint32_t n_parameters;
+    uint32_t n_instructions;
+    uint32_t n_polls;
+    uint32_t string_table_size;
+    uint64_t source_checksum; // checksum of the configuration file
+    uint64_t body_checksum; // checksum of everything following the header
+};
+
+struct CachedDefinition {
+    uint32_t name; // offset into string table
+    int32_t code;
+    int32_t device;
+    int32_t n_ints;
+    int32_t n_floats;
+    int32_t n_strings;
+    int32_t timeout_msec;
+    int32_t max_retries;
+};
+
+struct CachedHighLevelCommand {
+    uint32_t name; // offset into string table
+    uint32_t first_command; // index into commands
+    uint32_t n_commands;
+    uint32_t first_parameter; // index into parameter names
+    uint32_t n_parameters;
+    uint32_t first_instruction; // index into instructions
+    uint32_t n_instructions;
+    uint32_t n_registers;
+};
+
+struct CachedPoll {
+    uint32_t definition; // index into definitions
+    int32_t period_msec;
+    int32_t backplane;
+};
+
+// Numbers of arguments are given by the command's definition
+struct CachedCommand {
+    uint32_t definition; // index into definitions
+    int32_t priority;
+    int32_t backplane;
+    uint32_t first_int_operand; // index into int operands
+    uint32_t first_float_arg; // index into float args
+    uint32_t first_string_arg; // index into string args
+};
+
+// Update a FNV-1a hash with a block of data
+uint64_t fnv1a(const char *data, std::size_t length,
+        uint64_t hash=FNV_OFFSET_BASIS)
+{
+    for (std::size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+std::string definition_key(int device, std::string command_name)
+{
+    return std::to_string(device) + ' ' + command_name;
+}
+
+bool checksum_file(std::string file_name, uint64_t &checksum)
+{
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    char buffer[4096];
+    checksum = FNV_OFFSET_BASIS;
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        checksum = fnv1a(buffer, file.gcount(), checksum);
+    }
+    return true;
+}
+
+// Add a string to the string table, reusing an identical one if present
+// Return its offset in the table
+uint32_t add_string(std::string s, std::string &string_table,
+        std::unordered_map<std::string, uint32_t> &string_offsets)
+{
+    auto it = string_offsets.find(s);
+    if (it != string_offsets.end()) {
+        return it->second;
+    }
+    uint32_t offset = string_table.size();
+    string_table.append(s.c_str(), s.length() + 1); // keep null terminator
+    string_offsets[s] = offset;
+    return offset;
+}
+
+bool write_command_cache(std::string cache_file, const CommandTable &table,
+        uint64_t source_checksum)
+{
+    std::vector<CachedDefinition> definitions;
+    std::vector<CachedHighLevelCommand> high_level_commands;
+    std::vector<CachedCommand> commands;
+    std::vector<SequenceOperand> int_operands;
+    std::vector<float> float_args;
+    std::vector<uint32_t> string_args;
+    std::vector<uint32_t> parameters;
+    std::vector<SequenceInstruction> instructions;
+    std::vector<CachedPoll> polls;
+    std::string string_table;
+    std::unordered_map<std::string, uint32_t> string_offsets;
+
+    // Flatten the table into records
+    for (auto it = table.command_definitions.begin();
+            it != table.command_definitions.end(); ++it) {
+        CachedDefinition def;
+        def.name = add_string(it->command_name, string_table, string_offsets);
+        def.code = it->code;
+        def.device = it->device;
+        def.n_ints = it->n_ints;
+        def.n_floats = it->n_floats;
+        def.n_strings = it->n_strings;
+        def.timeout_msec = it->timeout_msec;
+        def.max_retries = it->max_retries;
+        definitions.push_back(def);
+    }
+    for (auto hl_it = table.high_level_commands.begin();
+            hl_it != table.high_level_commands.end(); ++hl_it) {
+        CachedHighLevelCommand hl_cmd;
+        hl_cmd.name = add_string(hl_it->command_name, string_table,
+                string_offsets);
+        hl_cmd.first_command = commands.size();
+        hl_cmd.n_commands = hl_it->commands.size();
+        hl_cmd.first_parameter = parameters.size();
+        hl_cmd.n_parameters = hl_it->parameters.size();
+        hl_cmd.first_instruction = instructions.size();
+        hl_cmd.n_instructions = hl_it->code.size();
+        hl_cmd.n_registers = hl_it->n_registers;
+        high_level_commands.push_back(hl_cmd);
+        for (auto param_it = hl_it->parameters.begin();
+                param_it != hl_it->parameters.end(); ++param_it) {
+            parameters.push_back(add_string(*param_it, string_table,
+                        string_offsets));
+        }
+        instructions.insert(instructions.end(), hl_it->code.begin(),
+                hl_it->code.end());
+        for (std::size_t i = 0; i < hl_it->commands.size(); i++) {
+            const LowLevelCommand &ll_cmd = hl_it->commands[i];
+            CachedCommand cmd;
+            cmd.definition = table.command_definition_index.at(
+                    definition_key(ll_cmd.def.device,
+                        ll_cmd.def.command_name));
+            cmd.priority = ll_cmd.priority;
+            cmd.backplane = ll_cmd.backplane;
+            cmd.first_int_operand = int_operands.size();
+            cmd.first_float_arg = float_args.size();
+            cmd.first_string_arg = string_args.size();
+            auto first_operand = hl_it->int_operands.begin() +
+                hl_it->first_int_operand[i];
+            int_operands.insert(int_operands.end(), first_operand,
+                    first_operand + ll_cmd.int_args.size());
+            float_args.insert(float_args.end(), ll_cmd.float_args.begin(),
+                    ll_cmd.float_args.end());
+            for (auto str_it = ll_cmd.string_args.begin();
+                    str_it != ll_cmd.string_args.end(); ++str_it) {
+                string_args.push_back(add_string(*str_it, string_table,
+                            string_offsets));
+            }
+            commands.push_back(cmd);
+        }
+    }
+
+    for (auto it = table.polls.begin(); it != table.polls.end(); ++it) {
+        CachedPoll poll;
+        poll.definition = it->definition;
+        poll.period_msec = it->period_msec;
+        poll.backplane = it->backplane;
+        polls.push_back(poll);
+    }
+
+    // Assemble the body following the header
+    std::string body;
+    body.append((const char *)definitions.data(),
+            definitions.size() * sizeof(CachedDefinition));
+    body.append((const char *)high_level_commands.data(),
+            high_level_commands.size() * sizeof(CachedHighLevelCommand));
+    body.append((const char *)commands.data(),
+            commands.size() * sizeof(CachedCommand));
+    body.append((const char *)int_operands.data(),
+            int_operands.size() * sizeof(SequenceOperand));
+    body.append((const char *)float_args.data(),
+            float_args.size() * sizeof(float));
+    body.append((const char *)string_args.data(),
+            string_args.size() * sizeof(uint32_t));
+    body.append((const char *)parameters.data(),
+            parameters.size() * sizeof(uint32_t));
+    body.append((const char *)instructions.data(),
+            instructions.size() * sizeof(SequenceInstruction));
+    body.append((const char *)polls.data(), polls.size() * sizeof(CachedPoll));
+    body.append(string_table);
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.n_definitions = definitions.size();
+    header.n_high_level_commands = high_level_commands.size();
+    header.n_commands = commands.size();
+    header.n_int_operands = int_operands.size();
+    header.n_float_args = float_args.size();
+    header.n_string_args = string_args.size();
+    header.n_parameters = parameters.size();
+    header.n_instructions = instructions.size();
+    header.n_polls = polls.size();
+    header.string_table_size = string_table.size();
+    header.source_checksum = source_checksum;
+    header.body_checksum = fnv1a(body.data(), body.size());
+
+    // Write to a temporary file and rename, so the cache is never partial
+    std::string temp_file = cache_file + ".tmp";
+    std::ofstream file(temp_file, std::ios::binary | std::ios::trunc);
+    file.write((const char *)&header, sizeof(header));
+    file.write(body.data(), body.size());
+    file.close();
+    if (!file) {
+        std::cerr << "Error: could not write " << temp_file << std::endl;
+        return false;
+    }
+    if (rename(temp_file.c_str(), cache_file.c_str()) == -1) {
+        perror("rename");
+        return false;
+    }
+    return true;
+}
+
+// Get a pointer to the next section of count records in a cache read,
+// advancing the offset past it
+// Return NULL if the section would extend past the end of the cache
+template <typename T>
+const T *next_section(const char *data, std::size_t size,
+        std::size_t &offset, uint32_t count)
+{
+    std::size_t length = (std::size_t)count * sizeof(T);
+    if (length > size - offset) {
+        return NULL;
+    }
+    const T *section = (const T *)(data + offset);
+    offset += length;
+    return section;
+}
+
+// Convert the cache contents, read whole, into the command table
+// Return true on success, false if the cache is invalid
+bool parse_command_cache(const char *data, std::size_t size,
+        uint64_t source_checksum, CommandTable &table)
+{
+    if (size < sizeof(CacheHeader)) {
+        return false;
+    }
+    const CacheHeader *header = (const CacheHeader *)data;
+    if ((memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0)
+            || (header->version != CACHE_VERSION)
+            || (header->source_checksum != source_checksum)
+            || (header->body_checksum != fnv1a(data + sizeof(CacheHeader),
+                    size - sizeof(CacheHeader)))) {
+        return false;
+    }
+
+    // Locate each section
+    std::size_t offset = sizeof(CacheHeader);
+    const CachedDefinition *definitions = next_section<CachedDefinition>(
+            data, size, offset, header->n_definitions);
+    const CachedHighLevelCommand *high_level_commands =
+        next_section<CachedHighLevelCommand>(data, size, offset,
+                header->n_high_level_commands);
+    const CachedCommand *commands = next_section<CachedCommand>(data, size,
+            offset, header->n_commands);
+    const SequenceOperand *int_operands = next_section<SequenceOperand>(data,
+            size, offset, header->n_int_operands);
+    const float *float_args = next_section<float>(data, size, offset,
+            header->n_float_args);
+    const uint32_t *string_args = next_section<uint32_t>(data, size, offset,
+            header->n_string_args);
+    const uint32_t *parameters = next_section<uint32_t>(data, size, offset,
+            header->n_parameters);
+    const SequenceInstruction *instructions =
+        next_section<SequenceInstruction>(data, size, offset,
+                header->n_instructions);
+    const CachedPoll *polls = next_section<CachedPoll>(data, size, offset,
+            header->n_polls);
+    const char *string_table = next_section<char>(data, size, offset,
+            header->string_table_size);
+    if (!definitions || !high_level_commands || !commands || !int_operands
+            || !float_args || !string_args || !parameters || !instructions
+            || !polls || !string_table
+            || (offset != size) || (header->string_table_size == 0)
+            || (string_table[header->string_table_size - 1] != '\0')) {
+        return false;
+    }
+
+    // Rebuild the table
+    table = CommandTable();
+    int n_backplane_commands = 0;
+    for (uint32_t i = 0; i < header->n_definitions; i++) {
+        if (definitions[i].name >= header->string_table_size) {
+            return false;
+        }
+        CommandDefinition def;
+        def.command_name = string_table + definitions[i].name;
+        def.code = definitions[i].code;
+        def.device = definitions[i].device;
+        def.n_ints = definitions[i].n_ints;
+        def.n_floats = definitions[i].n_floats;
+        def.n_strings = definitions[i].n_strings;
+        def.timeout_msec = definitions[i].timeout_msec;
+        def.max_retries = definitions[i].max_retries;
+        if ((def.timeout_msec <= 0) || (def.max_retries < 0)) {
+            return false;
+        }
+        // The Pi's commands are defined by the server's own table of them,
+        // so a cache made by a server with a different table is stale even
+        // if the file is unchanged
+        if (def.device == PI) {
+            if ((backplane_command_code(def.command_name) != def.code)
+                    || (backplane_command_n_ints(def.code) != def.n_ints)) {
+                return false;
+            }
+            n_backplane_commands++;
+        }
+        table.command_definition_index[definition_key(def.device,
+                def.command_name)] = table.command_definitions.size();
+        table.command_definitions.push_back(def);
+    }
+    if (n_backplane_commands != NUM_BACKPLANE_COMMANDS - 1) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->n_high_level_commands; i++) {
+        const CachedHighLevelCommand &cached_hl = high_level_commands[i];
+        if ((cached_hl.name >= header->string_table_size)
+                || (cached_hl.first_command > header->n_commands)
+                || (cached_hl.n_commands >
+                    header->n_commands - cached_hl.first_command)
+                || (cached_hl.first_parameter > header->n_parameters)
+                || (cached_hl.n_parameters >
+                    header->n_parameters - cached_hl.first_parameter)
+                || (cached_hl.first_instruction > header->n_instructions)
+                || (cached_hl.n_instructions >
+                    header->n_instructions - cached_hl.first_instruction)) {
+            return false;
+        }
+        HighLevelCommand hl_cmd;
+        hl_cmd.command_name = string_table + cached_hl.name;
+        for (uint32_t j = cached_hl.first_parameter;
+                j < cached_hl.first_parameter + cached_hl.n_parameters; j++) {
+            if (parameters[j] >= header->string_table_size) {
+                return false;
+            }
+            hl_cmd.parameters.push_back(string_table + parameters[j]);
+        }
+        hl_cmd.n_registers = cached_hl.n_registers;
+        hl_cmd.code.assign(instructions + cached_hl.first_instruction,
+                instructions + cached_hl.first_instruction +
+                cached_hl.n_instructions);
+        for (uint32_t j = cached_hl.first_command;
+                j < cached_hl.first_command + cached_hl.n_commands; j++) {
+            const CachedCommand &cached = commands[j];
+            if ((cached.definition >= header->n_definitions)
+                    || (cached.backplane < 0)
+                    || (cached.backplane >= MAX_BACKPLANES)) {
+                return false;
+            }
+            LowLevelCommand command;
+            command.def = table.command_definitions[cached.definition];
+            command.priority = cached.priority;
+            command.backplane = cached.backplane;
+            if ((cached.first_int_operand + command.def.n_ints >
+                        header->n_int_operands)
+                    || (cached.first_float_arg + command.def.n_floats >
+                        header->n_float_args)
+                    || (cached.first_string_arg + command.def.n_strings >
+                        header->n_string_args)) {
+                return false;
+            }
+            // Arguments given by literals keep their values in the command
+            hl_cmd.first_int_operand.push_back(hl_cmd.int_operands.size());
+            for (int k = 0; k < command.def.n_ints; k++) {
+                const SequenceOperand &operand =
+                    int_operands[cached.first_int_operand + k];
+                hl_cmd.int_operands.push_back(operand);
+                command.int_args.push_back(operand.value);
+            }
+            command.float_args.assign(float_args + cached.first_float_arg,
+                    float_args + cached.first_float_arg +
+                    command.def.n_floats);
+            for (int k = 0; k < command.def.n_strings; k++) {
+                uint32_t name = string_args[cached.first_string_arg + k];
+                if (name >= header->string_table_size) {
+                    return false;
+                }
+                command.string_args.push_back(string_table + name);
+            }
+            if (command.priority == EMERGENCY_PRIORITY) {
+                hl_cmd.emergency = true;
+            }
+            hl_cmd.commands.push_back(command);
+        }
+        if (!validate_sequence(hl_cmd)) {
+            return false;
+        }
+        table.high_level_command_index[hl_cmd.command_name] =
+            table.high_level_commands.size();
+        table.high_level_commands.push_back(hl_cmd);
+    }
+    for (uint32_t i = 0; i < header->n_polls; i++) {
+        if ((polls[i].definition >= header->n_definitions)
+                || (polls[i].period_msec <= 0) || (polls[i].backplane < 0)
+                || (polls[i].backplane >= MAX_BACKPLANES)) {
+            return false;
+        }
+        PollDefinition poll;
+        poll.definition = polls[i].definition;
+        poll.period_msec = polls[i].period_msec;
+        poll.backplane = polls[i].backplane;
+        table.polls.push_back(poll);
+    }
+    return true;
+}
+
+bool read_command_cache(std::string cache_file, uint64_t source_checksum,
+        CommandTable &table)
+{
+    std::ifstream file(cache_file, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    std::streamoff size = file.tellg();
+    if (size <= 0) {
+        return false;
+    }
+    // Heap allocated, so aligned for the records
+    std::vector<char> data(size);
+    file.seekg(0);
+    if (!file.read(data.data(), size)) {
+        return false;
+    }
+    return parse_command_cache(data.data(), data.size(), source_checksum,
+            table);
+}
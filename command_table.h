@@ -0,0 +1,118 @@
+// command_table.h
+// Definitions of low level and high level commands loaded from the command
+// configuration file, and their compiled binary cache
+
+#ifndef COMMAND_TABLE_H
+#define COMMAND_TABLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <unordered_map>
+
+#include "command_sequence.h"
+
+// Priority (CHK) level of commands that bypass the command queue and any
+// blocking active commands, such as an emergency stop
+const int EMERGENCY_PRIORITY = 3;
+// Time a command is given to be confirmed by its device, unless its
+// definition gives another
+const int DEFAULT_COMMAND_TIMEOUT_MSEC = 10000;
+
+struct CommandDefinition {
+    std::string command_name;
+    int code; // command code, unique for each device, assigned on loading
+    int device; // code for device to send to (PI or TM)
+    int n_ints; // number of integer arguments
+    int n_floats; // number of float arguments
+    int n_strings; // number of string arguments
+    // Time to wait for the device to confirm the command before giving up
+    // on it, which the Pi also takes as the command's deadline, and times to
+    // send it again after giving up; how a command is handled, not which
+    // command it is, so not compared
+    int timeout_msec = DEFAULT_COMMAND_TIMEOUT_MSEC;
+    int max_retries = 0;
+    bool operator==(const CommandDefinition& rhs) const {
+        return ((code == rhs.code)
+                && (device == rhs.device)
+                && (n_ints == rhs.n_ints)
+                && (n_floats == rhs.n_floats)
+                && (n_strings == rhs.n_strings));
+    }
+};
+
+struct LowLevelCommand {
+    CommandDefinition def;
+    int priority = 0; // code for command priority; default is lowest priority
+    std::vector<unsigned int> int_args;
+    std::vector<float> float_args;
+    std::vector<std::string> string_args;
+    // time the high level command was received, for latency measurement
+    std::chrono::steady_clock::time_point time_received;
+    int poll = -1; // index of the poll that sent the command, or -1
+    int backplane = 0; // of the Pi, for commands to the Pi
+    // time the command was last sent, and times it has been sent again
+    std::chrono::steady_clock::time_point time_sent;
+    int n_retries = 0;
+    bool operator==(const LowLevelCommand& rhs) const {
+        return ((def == rhs.def)
+                && (priority == rhs.priority)
+                && (backplane == rhs.backplane)
+                && (int_args == rhs.int_args)
+                && (float_args == rhs.float_args) 
+                && (string_args == rhs.string_args));
+    }
+};
+
+struct HighLevelCommand {
+    std::string command_name;
+    // commands that may be queued; int args are given by int_operands
+    std::vector<LowLevelCommand> commands;
+    // Compiled sequence (see command_sequence.h)
+    std::vector<std::string> parameters; // names, in the order given
+    uint32_t n_registers = 0; // parameters first, then variables
+    std::vector<SequenceOperand> int_operands; // int args of all commands
+    std::vector<uint32_t> first_int_operand; // index for each command
+    std::vector<SequenceInstruction> code;
+    bool emergency = false; // has emergency commands, so run on receipt
+};
+
+// A command the server sends periodically by itself, such as a housekeeping
+// read
+struct PollDefinition {
+    std::size_t definition; // index into command definitions
+    int period_msec; // target time between polls
+    int backplane; // of the Pi, for commands to the Pi
+};
+
+// All commands loaded from a command configuration file
+struct CommandTable {
+    std::vector<CommandDefinition> command_definitions;
+    std::vector<HighLevelCommand> high_level_commands;
+    std::vector<PollDefinition> polls;
+    // Indices into the above, by device code and command name
+    std::unordered_map<std::string, std::size_t> command_definition_index;
+    std::unordered_map<std::string, std::size_t> high_level_command_index;
+};
+
+// Get the key identifying a command definition by device and name
+std::string definition_key(int device, std::string command_name);
+
+// Compute a checksum (64 bit FNV-1a) of the contents of a file
+// Return true on success, false if the file can't be read
+bool checksum_file(std::string file_name, uint64_t &checksum);
+
+// Write a command table to a binary cache file, tagged with the checksum of
+// the configuration file it was parsed from
+// Return true on success, false otherwise
+bool write_command_cache(std::string cache_file, const CommandTable &table,
+        uint64_t source_checksum);
+
+// Load a command table from a binary cache file, read whole into memory
+// Return true on success, false if the cache is missing, corrupt, or was
+// made from a configuration file with a different checksum
+bool read_command_cache(std::string cache_file, uint64_t source_checksum,
+        CommandTable &table);
+
+#endif
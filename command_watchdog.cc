@@ -0,0 +1,91 @@
+// command_watchdog.cc
+// Implementation of the watchdog over the commands performed on a backplane
+
+#include <iostream>
+
+#include "command_watchdog.h"
+#include "backplane_commands.h"
+
+CommandWatchdog::CommandWatchdog(int backplane_index,
+        std::function<void()> on_deadline) :
+    backplane(backplane_index), on_expiry(on_deadline), watching(false),
+    command_code(0), deadline_msec(0), quit(false), deadline_passed(false)
+{
+    thread = std::thread(&CommandWatchdog::run, this);
+}
+
+CommandWatchdog::~CommandWatchdog()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    changed.notify_one();
+    thread.join();
+}
+
+void CommandWatchdog::watch(int code,
+        std::chrono::steady_clock::time_point received, int msec)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        watching = true;
+        command_code = code;
+        deadline = received + std::chrono::milliseconds(msec);
+        deadline_msec = msec;
+        deadline_passed.store(false, std::memory_order_relaxed);
+    }
+    changed.notify_one();
+}
+
+bool CommandWatchdog::finish()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // A command finishing late, but before the thread woke, overran too
+    bool overran = watching
+        && (std::chrono::steady_clock::now() > deadline);
+    watching = false;
+    // Left set, a later command without a deadline would be cut short
+    return deadline_passed.exchange(false, std::memory_order_relaxed)
+        || overran;
+}
+
+void CommandWatchdog::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto next_report = deadline;
+    while (!quit) {
+        if (!watching) {
+            changed.wait(lock);
+            continue;
+        }
+        auto due = deadline_passed ? next_report : deadline;
+        if (changed.wait_until(lock, due) != std::cv_status::timeout) {
+            continue;
+        }
+        // The command may have finished, or another started, just as the
+        // wait timed out
+        auto now = std::chrono::steady_clock::now();
+        if (!watching || (now < due)) {
+            continue;
+        }
+        long long late_msec = std::chrono::duration_cast<
+            std::chrono::milliseconds>(now - deadline).count();
+        if (!deadline_passed) {
+            deadline_passed = true;
+            if (on_expiry) {
+                on_expiry();
+            }
+            std::cerr << "Warning: " << backplane_command_name(command_code)
+                << " on backplane " << backplane << " overran its deadline of "
+                << deadline_msec << " ms, and is cut short if a read"
+                << std::endl;
+        } else {
+            std::cerr << "Warning: " << backplane_command_name(command_code)
+                << " on backplane " << backplane << " still running "
+                << late_msec << " ms past its deadline" << std::endl;
+        }
+        next_report = now + std::chrono::milliseconds(
+                WATCHDOG_REPORT_INTERVAL_MSEC);
+    }
+}
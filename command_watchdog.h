@@ -0,0 +1,61 @@
+// command_watchdog.h
+// Watch over the commands performed on one backplane, cutting short those
+// that overrun their deadlines and reporting any that stay stuck
+
+#ifndef COMMAND_WATCHDOG_H
+#define COMMAND_WATCHDOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Interval between reports of a command still running past its deadline
+const int WATCHDOG_REPORT_INTERVAL_MSEC = 1000;
+
+// Thread waking at the deadline of the command being performed. Once it
+// passes, expired() turns true, which the command thread checks along with
+// emergency commands, so that reads stop at their next check, or at once if
+// waiting for a conversion (see
+// interrupt_requested() in backplane_spi.h); settings aren't left half
+// applied, so other commands run to the end. A command that still doesn't
+// finish, as when stuck in a transfer, is reported every
+// WATCHDOG_REPORT_INTERVAL_MSEC, since nothing can safely abort it.
+class CommandWatchdog {
+protected:
+    int backplane; // index of the backplane watched
+    std::function<void()> on_expiry; // called as the deadline passes
+    std::thread thread;
+    // Command being watched, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool watching;
+    int command_code;
+    std::chrono::steady_clock::time_point deadline;
+    long long deadline_msec; // from receipt to the deadline
+    bool quit;
+    std::atomic<bool> deadline_passed;
+
+    // Watch commands until told to quit
+    void run();
+public:
+    // on_deadline is called from the watchdog's thread as each command's
+    // deadline passes, to wake the command thread if waiting
+    CommandWatchdog(int backplane_index, std::function<void()> on_deadline);
+    ~CommandWatchdog();
+    // Watch a command about to be performed, which was received at the
+    // given time and should finish within deadline_msec of it
+    void watch(int code, std::chrono::steady_clock::time_point received,
+            int msec);
+    // Stop watching the command once finished
+    // Return true if it overran its deadline
+    bool finish();
+    // Return true if the command being watched has passed its deadline
+    bool expired() const {
+        return deadline_passed.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
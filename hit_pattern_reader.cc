@@ -0,0 +1,24 @@
+// hit_pattern_reader.cc
+// Implementation of high rate hit pattern reading on the Pi
+
+#include "hit_pattern_reader.h"
+#include "clock_sync.h"
+#include "spi_journal.h"
+#include "spi_protocol.h"
+
+HitPatternReader::HitPatternReader(std::mutex &spi_bus_mutex,
+        int backplane_index) :
+    reader(spi_bus_mutex, backplane_index, SPI_SOURCE_HIT_PATTERNS,
+            HIT_PATTERN_BUFFER_SIZE, read_frame)
+{
+}
+
+bool HitPatternReader::read_frame(HitPatternFrame &frame)
+{
+    unsigned short spi_command[4 * SPI_MESSAGE_WORDS];
+    unsigned short spi_data[4 * SPI_MESSAGE_WORDS];
+    read_hit_pattern(frame.pattern, spi_command, spi_data);
+    frame.time_usec = unix_time_usec();
+    // Frames read with replies failing their checks are left out
+    return take_thread_check_counts().unrecovered == 0;
+}
@@ -0,0 +1,44 @@
+// hit_pattern_reader.h
+// High rate reading of trigger hit patterns on the Pi, independent of
+// commands from the server, into a buffer drained by the network loop
+
+#ifndef HIT_PATTERN_READER_H
+#define HIT_PATTERN_READER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+#include "backplane_spi.h"
+#include "periodic_spi_reader.h"
+
+// Frames held awaiting sending, about 4 s at 1 kHz
+const std::size_t HIT_PATTERN_BUFFER_SIZE = 4096;
+
+// The hit patterns of all modules from one read
+struct HitPatternFrame {
+    int64_t time_usec; // since the epoch, when the patterns were read
+    unsigned short pattern[NUM_HIT_PATTERN_WORDS];
+};
+
+// Thread reading hit patterns at a set period (see PeriodicSpiReader)
+class HitPatternReader {
+protected:
+    PeriodicSpiReader<HitPatternFrame> reader;
+
+    // Read the patterns of all modules
+    // Return false if a reply failed its checks, even once retried
+    static bool read_frame(HitPatternFrame &frame);
+public:
+    HitPatternReader(std::mutex &spi_bus_mutex, int backplane_index);
+    // Start reading every period_usec us, or pause if 0
+    void set_period(int usec) { reader.set_period(usec); }
+    // Take the oldest frame not yet taken
+    // Return false if there is none
+    bool next_frame(HitPatternFrame &frame) { return reader.pop(frame); }
+    // Return the number of frames dropped because the buffer was full since
+    // the last call, and reset the count
+    uint32_t take_dropped_count() { return reader.take_dropped_count(); }
+};
+
+#endif
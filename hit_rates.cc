@@ -0,0 +1,97 @@
+// hit_rates.cc
+// Implementation of the per-pixel hit rate accumulator
+
+#include <algorithm>
+
+#include "hit_rates.h"
+#include "backplane_encoding.h"
+
+void HitRateAccumulator::clear()
+{
+    std::fill(hits, hits + NUM_HIT_PIXELS, 0);
+    n_frames = 0;
+    n_dropped = 0;
+    first_time_usec = 0;
+    last_time_usec = 0;
+}
+
+bool HitRateAccumulator::add(const slow_control::HitPatterns &patterns)
+{
+    const std::string &frames = patterns.frames();
+    int n = patterns.time_offset_usec_size();
+    if (frames.size() != (std::size_t)n * HIT_PATTERN_FRAME_BYTES) {
+        return false;
+    }
+    n_dropped += patterns.frames_dropped();
+    for (int i = 0; i < n; i++) {
+        for (int module = 0; module < NUM_HIT_PATTERN_MODULES; module++) {
+            unsigned short pattern = packed_word(frames,
+                    NUM_HIT_PATTERN_MODULES * i + module);
+            for (uint32_t *pixel = hits + HIT_PIXELS_PER_MODULE * module;
+                    pattern != 0; pattern >>= 1, pixel++) {
+                *pixel += pattern & 1;
+            }
+        }
+    }
+    if (n > 0) {
+        int64_t first = patterns.first_time_usec();
+        if (n_frames == 0) {
+            first_time_usec = first;
+        }
+        last_time_usec = first + patterns.time_offset_usec(n - 1);
+        n_frames += n;
+    }
+    return true;
+}
+
+bool HitRateAccumulator::pixel_rates(float rates[]) const
+{
+    // The frames stand for the time from the first to one period past the
+    // last
+    if ((n_frames < 2) || (last_time_usec <= first_time_usec)) {
+        return false;
+    }
+    double seconds = 1e-6 * (last_time_usec - first_time_usec) * n_frames
+        / (n_frames - 1);
+    for (int i = 0; i < NUM_HIT_PIXELS; i++) {
+        rates[i] = hits[i] / seconds;
+    }
+    return true;
+}
+
+bool HitRateAccumulator::report(std::ostream &out) const
+{
+    if (n_frames == 0) {
+        return false;
+    }
+    float rates[NUM_HIT_PIXELS];
+    if (!pixel_rates(rates)) {
+        out << "  " << n_frames << " frames" << std::endl;
+        return true;
+    }
+    double seconds = 1e-6 * (last_time_usec - first_time_usec);
+    out << "  " << n_frames << " frames, " << (n_frames - 1) / seconds
+        << " Hz";
+    if (n_dropped > 0) {
+        out << " (" << n_dropped << " dropped on the Pi)";
+    }
+    out << std::endl;
+
+    // List the busiest pixels that were hit at all
+    int order[NUM_HIT_PIXELS];
+    for (int i = 0; i < NUM_HIT_PIXELS; i++) {
+        order[i] = i;
+    }
+    std::partial_sort(order, order + HIT_RATE_REPORT_PIXELS,
+            order + NUM_HIT_PIXELS,
+            [this](int a, int b) { return hits[a] > hits[b]; });
+    for (int i = 0; (i < HIT_RATE_REPORT_PIXELS) && (hits[order[i]] > 0);
+            i++) {
+        int pixel = order[i];
+        out << "  module " << pixel / HIT_PIXELS_PER_MODULE << " pixel "
+            << pixel % HIT_PIXELS_PER_MODULE << ": " << rates[pixel]
+            << " Hz, in " << 100.0 * hits[pixel] / n_frames
+            << "% of frames" << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,47 @@
+// hit_rates.h
+// Per-pixel hit rates accumulated on the server from the hit patterns
+// streamed by the Pi
+
+#ifndef HIT_RATES_H
+#define HIT_RATES_H
+
+#include <cstdint>
+#include <ostream>
+
+#include "slow_control.pb.h"
+
+// Trigger pixels in each module's hit pattern, one per bit, and in all;
+// pixel p of module m is numbered 16 * m + p
+const int HIT_PIXELS_PER_MODULE = 16;
+const int NUM_HIT_PATTERN_MODULES = 32;
+const int NUM_HIT_PIXELS = HIT_PIXELS_PER_MODULE * NUM_HIT_PATTERN_MODULES;
+// Bytes of each frame in HitPatterns.frames
+const int HIT_PATTERN_FRAME_BYTES = 2 * NUM_HIT_PATTERN_MODULES;
+// Busiest pixels listed in each report
+const int HIT_RATE_REPORT_PIXELS = 8;
+
+class HitRateAccumulator {
+protected:
+    uint32_t hits[NUM_HIT_PIXELS];
+    long long n_frames;
+    long long n_dropped;
+    // Pi times of the first and last frames counted
+    int64_t first_time_usec;
+    int64_t last_time_usec;
+public:
+    HitRateAccumulator() { clear(); }
+    // Count the hits in a batch of frames
+    // Return false, counting nothing, if the batch is malformed
+    bool add(const slow_control::HitPatterns &patterns);
+    // Number of frames counted since cleared
+    long long frames() const { return n_frames; }
+    // Fill in the rate of each pixel in Hz, over the time the frames span
+    // Return false if the frames don't span enough time to tell
+    bool pixel_rates(float rates[]) const;
+    // Write the frame rate and the busiest pixels
+    // Return false, writing nothing, if no frames were counted
+    bool report(std::ostream &out) const;
+    void clear();
+};
+
+#endif
@@ -0,0 +1,29 @@
+// housekeeping_sampler.cc
+// Implementation of continuous housekeeping sampling on the Pi
+
+#include "housekeeping_sampler.h"
+#include "clock_sync.h"
+#include "spi_protocol.h"
+
+HousekeepingSampler::HousekeepingSampler(std::mutex &spi_bus_mutex,
+        int backplane_index) :
+    reader(spi_bus_mutex, backplane_index, SPI_SOURCE_SAMPLER,
+            SAMPLE_BUFFER_SIZE, take_sample)
+{
+}
+
+bool HousekeepingSampler::take_sample(HousekeepingSample &sample)
+{
+    unsigned short spi_command[8 * SPI_MESSAGE_WORDS];
+    unsigned short spi_data[8 * SPI_MESSAGE_WORDS];
+    read_housekeeping(sample.voltage, sample.current, spi_command, spi_data);
+    sample.time_usec = unix_time_usec();
+
+    read_nstimer_trigger_rate(spi_command, spi_data);
+    TriggerCounters counters;
+    decode_trigger_counters(spi_data, counters);
+    sample.nstimer = counters.nstimer;
+    sample.tack_count = counters.tack_count;
+    sample.trigger_count = counters.trigger_count;
+    return take_thread_check_counts().unrecovered == 0;
+}
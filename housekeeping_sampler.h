@@ -0,0 +1,49 @@
+// housekeeping_sampler.h
+// Continuous sampling of backplane housekeeping on the Pi, independent of
+// commands from the server, into a buffer drained by the network loop
+
+#ifndef HOUSEKEEPING_SAMPLER_H
+#define HOUSEKEEPING_SAMPLER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+#include "periodic_spi_reader.h"
+
+// Number of modules sampled
+const int SAMPLE_NUM_FEES = 32;
+// Samples held awaiting sending, about 7 minutes at 10 Hz
+const std::size_t SAMPLE_BUFFER_SIZE = 4096;
+
+// One reading of all housekeeping values
+struct HousekeepingSample {
+    int64_t time_usec; // since the epoch, when the ADCs were read
+    float voltage[SAMPLE_NUM_FEES];
+    float current[SAMPLE_NUM_FEES];
+    uint64_t nstimer; // TFPGA timer, in ns
+    uint32_t tack_count;
+    uint32_t trigger_count;
+};
+
+// Thread taking a sample at a set period (see PeriodicSpiReader)
+class HousekeepingSampler {
+protected:
+    PeriodicSpiReader<HousekeepingSample> reader;
+
+    // Read all housekeeping values
+    // Return false if a reply failed its checks, even once retried
+    static bool take_sample(HousekeepingSample &sample);
+public:
+    HousekeepingSampler(std::mutex &spi_bus_mutex, int backplane_index);
+    // Start sampling every period_msec ms, or pause if 0
+    void set_period(int msec) { reader.set_period(1000LL * msec); }
+    // Take the oldest sample not yet taken
+    // Return false if there is none
+    bool next_sample(HousekeepingSample &sample) { return reader.pop(sample); }
+    // Return the number of samples dropped because the buffer was full since
+    // the last call, and reset the count
+    uint32_t take_dropped_count() { return reader.take_dropped_count(); }
+};
+
+#endif
@@ -12,6 +12,7 @@
 #include <algorithm>
 
 #include "interfacecontrol.h"
+#include "backplane_encoding.h"
 
 // Read in and store a command from the user from stdin
 // Return true if the command is valid, false otherwise
@@ -243,6 +244,22 @@ bool read_command(std::string &command, std::string &value)
     return true;
 }
 
+// Readings of the latest backplane variables, unpacked
+unsigned short spi_data_word(int i)
+{
+    return packed_word(backplane_variables_message().spi_data(), i);
+}
+
+int fee_present(int i)
+{
+    return mask_flag(backplane_variables_message().present(), i);
+}
+
+unsigned short fee_trigger_mask(int i)
+{
+    return packed_word(backplane_variables_message().trigger_mask(), i);
+}
+
 // Display SPI data
 void display_spi_data()
 {
@@ -250,15 +267,15 @@ void display_spi_data()
         << std::endl;
     std::cout << std::setfill('0');
     std::cout << "\033[1;34m" << std::hex << std::setw(4)
-        << backplane_variables_message().spi_data(0) << "\033[0m ";
+        << spi_data_word(0) << "\033[0m ";
     std::cout << "\033[1;33m" << std::hex << std::setw(4)
-        << backplane_variables_message().spi_data(1) << "\033[0m ";
+        << spi_data_word(1) << "\033[0m ";
     for (int i = 2; i < 10; i++) {
         std::cout << std::hex << std::setw(4)
-            << backplane_variables_message().spi_data(i) << " ";
+            << spi_data_word(i) << " ";
     }
     std::cout << "\033[1;34m" << std::hex << std::setw(4)
-        << backplane_variables_message().spi_data(10) << "\033[0m "
+        << spi_data_word(10) << "\033[0m "
         << std::endl << std::endl;
     std::cout << std::setfill(' '); // clear fill
 }
@@ -278,13 +295,13 @@ void print_data(int data_type)
             for (int i = 0; i < N_FEES; i++) {
                 if (i == 0 || i == 28) {
                     std::cout << "   " << std::setw(2)
-                        << backplane_variables_message().present(i) << " ";
+                        << fee_present(i) << " ";
                 } else if (i == 3 || i == 31) {
                     std::cout << std::setw(2)
-                        << backplane_variables_message().present(i) << "   ";
+                        << fee_present(i) << "   ";
                 } else {
                     std::cout << std::setw(2)
-                        << backplane_variables_message().present(i) << " ";
+                        << fee_present(i) << " ";
                 }
                 if (i == 3 || i == 9 || i == 15 || i == 21 || i == 27 || 
                         i == 31) {
@@ -300,14 +317,14 @@ void print_data(int data_type)
             for (int i = 0; i < N_FEES; i++) {
                 if (i == 0 || i == 28) {
                     std::cout << "     " << std::hex << std::setw(4)
-                        << backplane_variables_message().trigger_mask(i) << " ";
+                        << fee_trigger_mask(i) << " ";
                 } else if (i == 3 || i == 31) {
                     std::cout << std::hex << std::setw(4) 
-                        << backplane_variables_message().trigger_mask(i)
+                        << fee_trigger_mask(i)
                         << "     ";
                 } else {
                     std::cout << std::hex << std::setw(4)
-                        << backplane_variables_message().trigger_mask(i) << " ";
+                        << fee_trigger_mask(i) << " ";
                 }
                 if (i == 3 || i == 9 || i == 15 || i == 21 || i == 27 || 
                         i == 31) {
@@ -379,20 +396,20 @@ void print_data(int data_type)
             float trigger_rate;
 
             nstimer = (((unsigned long long)
-                        backplane_variables_message().spi_data(2) << 48) |
+                        spi_data_word(2) << 48) |
                     ((unsigned long long)
-                     backplane_variables_message().spi_data(3) << 32) |
+                     spi_data_word(3) << 32) |
                     ((unsigned long long)
-                     backplane_variables_message().spi_data(4) << 16) |
+                     spi_data_word(4) << 16) |
                     ((unsigned long long)
-                     backplane_variables_message().spi_data(5)));
+                     spi_data_word(5)));
             //TFPGA adds one extra on reset
-            tack_count = ((backplane_variables_message().spi_data(6) << 16) |
-                    backplane_variables_message().spi_data(7)) - 1;
+            tack_count = ((spi_data_word(6) << 16) |
+                    spi_data_word(7)) - 1;
             tack_rate = (float) nstimer / 1000000000;
             tack_rate = tack_count / tack_rate;
-            trigger_count = ((backplane_variables_message().spi_data(8) << 16) |
-                    backplane_variables_message().spi_data(9)) - 1;
+            trigger_count = ((spi_data_word(8) << 16) |
+                    spi_data_word(9)) - 1;
             trigger_rate = (float) nstimer / 1000000000;
             trigger_rate = trigger_count / trigger_rate;
 
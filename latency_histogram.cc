@@ -0,0 +1,55 @@
+// latency_histogram.cc
+// Implementation of the latency histogram
+
+#include "latency_histogram.h"
+
+LatencyHistogram::LatencyHistogram() : max_usec(0)
+{
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        counts[i] = 0;
+    }
+}
+
+void LatencyHistogram::record(long long usec)
+{
+    int bucket = 0;
+    for (long long rest = usec; (rest > 0)
+            && (bucket < NUM_LATENCY_BUCKETS - 1); rest >>= 1) {
+        bucket++;
+    }
+    counts[bucket]++;
+    long long longest = max_usec.load();
+    while ((usec > longest) && !max_usec.compare_exchange_weak(longest, usec)) {
+    }
+}
+
+bool LatencyHistogram::report(std::ostream &out)
+{
+    unsigned int taken[NUM_LATENCY_BUCKETS];
+    unsigned int total = 0;
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        taken[i] = counts[i].exchange(0);
+        total += taken[i];
+    }
+    long long longest = max_usec.exchange(0);
+    if (total == 0) {
+        return false;
+    }
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        if (taken[i] == 0) {
+            continue;
+        }
+        out << "  ";
+        if (i == 0) {
+            out << "< 1 us";
+        } else if (i == NUM_LATENCY_BUCKETS - 1) {
+            out << ">= " << (1LL << (i - 1)) << " us";
+        } else {
+            out << (1LL << (i - 1)) << "-" << (1LL << i) << " us";
+        }
+        out << ": " << taken[i] << std::endl;
+    }
+    out << "  longest " << longest << " us, " << total << " in all"
+        << std::endl;
+    return true;
+}
@@ -0,0 +1,27 @@
+// latency_histogram.h
+// Histogram of latencies recorded by one thread and reported by another
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <ostream>
+
+// Bucket i counts latencies of 2^(i-1) to 2^i us, bucket 0 those under 1 us,
+// and the last bucket everything longer
+const int NUM_LATENCY_BUCKETS = 24;
+
+class LatencyHistogram {
+protected:
+    std::atomic<unsigned int> counts[NUM_LATENCY_BUCKETS];
+    std::atomic<long long> max_usec;
+public:
+    LatencyHistogram();
+    // Count a latency, without locking or allocating
+    void record(long long usec);
+    // Write the counts since the last report and clear them
+    // Return false, writing nothing, if nothing was recorded
+    bool report(std::ostream &out);
+};
+
+#endif
@@ -0,0 +1,137 @@
+// periodic_spi_reader.h
+// Thread reading a backplane at a set period, independent of commands from
+// the server, into a buffer drained by the network loop
+
+#ifndef PERIODIC_SPI_READER_H
+#define PERIODIC_SPI_READER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "backplane_spi.h"
+#include "spi_journal.h"
+#include "spsc_ring.h"
+
+// The backplane is shared with the commands performed by the Pi, so each
+// read is made holding spi_mutex; a command waits for at most one read to
+// finish. What is read, and what is queued, is up to the read step, which
+// runs on the reader's thread only; items it queues are kept until taken,
+// or dropped and counted if the buffer is full.
+template <typename Item>
+class PeriodicSpiReader {
+public:
+    // Read once, holding the bus, filling in the item
+    // Return true to queue the item, false to leave it out
+    typedef std::function<bool(Item &item)> ReadStep;
+    // Called on the reader's thread each time the period is set, before the
+    // first read with it
+    typedef std::function<void()> StartStep;
+protected:
+    std::mutex &spi_mutex;
+    int backplane; // index of the backplane read
+    int journal_source; // of the messages sent (see spi_journal.h)
+    ReadStep read_step;
+    StartStep start_step;
+    SpscRing<Item> ring;
+    std::atomic<uint32_t> n_dropped; // since last taken
+    // Reading period in us, 0 to pause, guarded by settings_mutex
+    std::mutex settings_mutex;
+    std::condition_variable settings_changed;
+    int64_t period_usec;
+    bool restart; // set with a new period
+    bool quit;
+    std::thread thread; // last, so started once all else is set up
+
+    // Read until told to quit
+    void run()
+    {
+        select_backplane(backplane);
+        set_spi_journal_source(journal_source);
+        Item item;
+        auto next_due = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(settings_mutex);
+        while (!quit) {
+            if (restart) {
+                restart = false;
+                if (start_step) {
+                    start_step();
+                }
+                next_due = std::chrono::steady_clock::now();
+                continue;
+            }
+            if (period_usec == 0) {
+                settings_changed.wait(lock);
+                continue;
+            }
+            // Wait for the next read, unless the settings change first
+            if (settings_changed.wait_until(lock, next_due) !=
+                    std::cv_status::timeout) {
+                continue;
+            }
+            std::chrono::microseconds period(period_usec);
+            lock.unlock();
+
+            bool queue;
+            {
+                std::lock_guard<std::mutex> spi_lock(spi_mutex);
+                queue = read_step(item);
+            }
+            if (queue && !ring.push(item)) {
+                n_dropped++;
+            }
+
+            // Keep to the schedule, unless too far behind to catch up
+            auto now = std::chrono::steady_clock::now();
+            next_due += period;
+            if (next_due < now) {
+                next_due = now + period;
+            }
+            lock.lock();
+        }
+    }
+public:
+    PeriodicSpiReader(std::mutex &spi_bus_mutex, int backplane_index,
+            int source, std::size_t buffer_size, ReadStep read,
+            StartStep start = StartStep()) :
+        spi_mutex(spi_bus_mutex), backplane(backplane_index),
+        journal_source(source), read_step(read), start_step(start),
+        ring(buffer_size), n_dropped(0), period_usec(0), restart(false),
+        quit(false), thread(&PeriodicSpiReader::run, this) {}
+
+    ~PeriodicSpiReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            quit = true;
+        }
+        settings_changed.notify_one();
+        thread.join();
+    }
+
+    // Start reading every usec us, or pause if 0
+    void set_period(int64_t usec)
+    {
+        {
+            std::lock_guard<std::mutex> lock(settings_mutex);
+            period_usec = (usec > 0) ? usec : 0;
+            restart = true;
+        }
+        settings_changed.notify_one();
+    }
+
+    // Take the oldest item not yet taken
+    // Return false if there is none
+    bool pop(Item &item) { return ring.pop(item); }
+
+    // Return the number of items dropped because the buffer was full since
+    // the last call, and reset the count
+    uint32_t take_dropped_count() { return n_dropped.exchange(0); }
+};
+
+#endif
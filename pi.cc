@@ -2,30 +2,125 @@
 /* Listen for and execute remote user commands for the backplane. Continually
  * send out a status report back to the user for display by the GUI. */
 
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <unistd.h>
 
 #include "pi_control.h"
 
+void print_usage()
+{
+    std::cerr << "usage: slow_control_pi "
+        << "[-b spi_backend [-f adc_calibration_file]]..." << std::endl
+        << "                       [-g word_gap_usec] [-a adc_conversion_usec]"
+        << std::endl
+        << "                       [-c cpu] [-p priority] [-m] "
+        << "[-r capture_file]" << std::endl
+        << "                       hostname" << std::endl;
+    std::cerr << "  -b  bcm2835[:cs[:divider]], spidev[:device[:hz]], "
+        << "simulated, or" << std::endl
+        << "      replay:capture_file, once for each backplane, numbered "
+        << "from 0 in order" << std::endl;
+    std::cerr << "  -f  ADC channel map and calibration for the backplane "
+        << "before" << std::endl;
+    std::cerr << "  -g  gap between the words of SPI messages" << std::endl;
+    std::cerr << "  -a  time the ADCs are given to convert" << std::endl;
+    std::cerr << "  -c  CPU to pin the command threads to" << std::endl;
+    std::cerr << "  -p  SCHED_FIFO priority of the command threads (1-99)"
+        << std::endl;
+    std::cerr << "  -m  lock the program in memory" << std::endl;
+    std::cerr << "  -r  capture SPI transfers and commands to the file, "
+        << "followed by _n" << std::endl
+        << "      for backplane n after the first" << std::endl;
+}
+
+// A backplane as given on the command line
+struct BackplaneOptions {
+    std::string spi_backend;
+    std::string calibration_file;
+};
+
 int main(int argc, char *argv[])
 {
     // Parse command line arguments
-    if (argc != 2) {
-        std::cerr << "usage: slow_control_pi hostname" << std::endl;
+    std::vector<BackplaneOptions> backplanes;
+    CommandThreadSettings settings;
+    int option;
+    while ((option = getopt(argc, argv, "b:g:a:f:c:p:mr:")) != -1) {
+        switch (option) {
+            case 'b':
+                backplanes.push_back(BackplaneOptions());
+                backplanes.back().spi_backend = optarg;
+                break;
+            case 'g':
+                set_spi_word_gap(std::atoi(optarg));
+                break;
+            case 'a':
+                set_adc_conversion_time(std::atoi(optarg));
+                break;
+            case 'f':
+                // Before any -b, for the default backplane
+                if (backplanes.empty()) {
+                    backplanes.push_back(BackplaneOptions());
+                }
+                backplanes.back().calibration_file = optarg;
+                break;
+            case 'c':
+                settings.cpu = std::atoi(optarg);
+                break;
+            case 'p':
+                settings.priority = std::atoi(optarg);
+                break;
+            case 'm':
+                settings.lock_memory = true;
+                break;
+            case 'r':
+                set_spi_capture(optarg);
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage();
         return 1;
     }
-    std::string hostname = argv[1];
+    std::string hostname = argv[optind];
+    if (backplanes.empty()) {
+        backplanes.push_back(BackplaneOptions());
+    }
+
+    // Connect to the backplanes
+    for (std::size_t i = 0; i < backplanes.size(); i++) {
+        int index = add_backplane(backplanes[i].spi_backend);
+        if (index < 0) {
+            std::cerr << "Error: could not initialize SPI for backplane " << i
+                << std::endl;
+            return 1;
+        }
+        if (!backplanes[i].calibration_file.empty()) {
+            AdcCalibration calibration;
+            if (!load_adc_calibration(backplanes[i].calibration_file,
+                        calibration)) {
+                return 1;
+            }
+            select_backplane(index);
+            set_adc_calibration(calibration);
+        }
+    }
+    select_backplane(0);
+
+    PiControl pi_control(hostname, backplanes.size());
+    pi_control.start_command_threads(settings);
 
-    PiControl pi_control(hostname);
-    
-    // Communicate with the server: on each loop send updated data and 
-    // receive updated settings
+    // Communicate with the server: on each loop send updated data and
+    // receive updated settings, which the command thread applies
     std::cout << "communicating with the server..." << std::endl;
     while (true) {
-        // Receive commands and return backplane variables
         pi_control.synchronize_network();
-        // Apply new settings, if a command was received
-        pi_control.update_backplane_variables();
     }
 
     return 0;
@@ -1,152 +1,200 @@
 // pi_control.cc
 // File containing the implementation for the class for mid-level pi control
 
+#include <cerrno>
+#include <cstring>
 #include <iostream>
-#include <algorithm>
+#include <sstream>
+#include <sys/mman.h>
 
 #include "pi_control.h"
+#include "clock_sync.h"
 
-// number of uint parameters to send to backplane low level code
-const int NUM_COMMAND_PARAMETERS = 4; 
+PiControl::PiControl(std::string hostname, int n_backplanes) :
+    netinfo(PI, hostname),
+    jitter_report_time(std::chrono::steady_clock::now()), next_backplane(0),
+    echo_server_send_usec(0), echo_receive_usec(0)
+{
+    // Verify that the version of the Protocol Buffer library we linked
+    // against is compatible with the version of the headers we compiled
+    // against.
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+    for (int i = 0; i < n_backplanes; i++) {
+        backplanes.emplace_back(new BackplaneControl(i));
+    }
+}
+
+bool PiControl::start_command_threads(const CommandThreadSettings &settings)
+{
+    bool success = true;
+    if (settings.lock_memory && (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)) {
+        std::cerr << "Error: could not lock memory: " << strerror(errno)
+            << std::endl;
+        success = false;
+    }
+    for (auto it = backplanes.begin(); it != backplanes.end(); ++it) {
+        success = (*it)->start_command_thread(settings) && success;
+    }
+    return success;
+}
 
 bool PiControl::synchronize_network()
 {
-    // Send data to and receive settings from server
-    if (updates_to_send) {
+    // Send the result of a command, if one is done, to the server along with
+    // any samples taken since the last update; samples are kept while not
+    // connected. Each update is of one backplane, taken in turn from those
+    // with anything to send.
+    bool to_send = false;
+    slow_control::BackplaneVariables &update = outgoing.variables;
+    int n_backplanes = backplanes.size();
+    for (int i = 0; (i < n_backplanes) && !to_send; i++) {
+        int index = (next_backplane + i) % n_backplanes;
+        BackplaneControl &backplane = *backplanes[index];
+        bool result_to_send = backplane.next_result(outgoing);
+        if (result_to_send) {
+            // Report how long an emergency command waited to reach the SPI
+            // bus
+            if (update.command().priority() == EMERGENCY_PRIORITY) {
+                std::cout << "Emergency command "
+                    << backplane_command_name(update.command().code())
+                    << " started " << outgoing.start_latency_usec
+                    << " us after receipt." << std::endl;
+            }
+        } else {
+            update.Clear();
+        }
+        bool samples_to_send = false;
+        if (!netinfo.connections.empty()) {
+            samples_to_send = backplane.add_samples(update);
+            samples_to_send = backplane.add_hit_patterns(update)
+                || samples_to_send;
+            samples_to_send = backplane.add_trigger_rates(update)
+                || samples_to_send;
+        }
+        to_send = result_to_send || samples_to_send;
+        if (to_send) {
+            if (index > 0) {
+                update.set_backplane(index);
+            }
+            next_backplane = (index + 1) % n_backplanes;
+        }
+    }
+    // Echo the server's clock as soon as a command is received, on its own
+    // if there's nothing else to send, with the time sent taken as late as
+    // possible
+    if ((echo_server_send_usec != 0) && !netinfo.connections.empty()) {
+        if (!to_send) {
+            update.Clear();
+            to_send = true;
+        }
+        fill_clock_echo(echo_server_send_usec, echo_receive_usec,
+                *update.mutable_clock_echo());
+        echo_server_send_usec = 0;
+    }
+    if (to_send) {
         std::string backplane_variables_message;
-        backplane_variables.SerializeToString(&backplane_variables_message);
+        update.SerializeToString(&backplane_variables_message);
         if (!update_network(netinfo, backplane_variables_message)) {
             return false;
         }
-        updates_to_send = false;
     } else {
         if (!update_network(netinfo)) {
             return false;
         }
     }
-    // Store received settings
+    if (std::chrono::steady_clock::now() - jitter_report_time >=
+            std::chrono::seconds(JITTER_REPORT_INTERVAL_SEC)) {
+        report_spi_checks();
+        report_start_latency();
+    }
+    return receive_commands();
+}
+
+bool PiControl::receive_commands()
+{
+    // Pass received commands to the command thread of their backplane
+    bool received[MAX_BACKPLANES] = {false};
     for (auto it = netinfo.connections.begin();
             it != netinfo.connections.end(); ++it) {
         if ((it->device == SERVER) && (it->recv_status == MSG_DONE)) {
             it->recv_status = MSG_STANDBY;
-            if (!backplane_command.ParseFromString(it->message)) {
+            PendingCommand pending;
+            pending.time_received = std::chrono::steady_clock::now();
+            if (!pending.command.ParseFromString(it->message)) {
                 return false;
             }
+            if (pending.command.has_server_time_usec()) {
+                echo_server_send_usec = pending.command.server_time_usec();
+                echo_receive_usec = std::chrono::duration_cast<
+                    std::chrono::microseconds>(
+                            pending.time_received.time_since_epoch()).count();
+            }
+            // A command with no code is sent only to have the clock echoed
+            if (!pending.command.has_code()) {
+                continue;
+            }
+            unsigned int index = pending.command.backplane();
+            if (index >= backplanes.size()) {
+                std::cerr << "Error: no backplane " << index << ", "
+                    << backplane_command_name(pending.command.code())
+                    << " dropped" << std::endl;
+                continue;
+            }
+            capture_command(index, it->message);
+            if (!backplanes[index]->queue_command(pending)) {
+                std::cerr << "Error: command queue full, "
+                    << backplane_command_name(pending.command.code())
+                    << " dropped" << std::endl;
+                continue;
+            }
+            received[index] = true;
             std::cout << "Received command." << std::endl; 
         }
     }
+    for (std::size_t i = 0; i < backplanes.size(); i++) {
+        if (received[i]) {
+            backplanes[i]->wake_command_thread();
+        }
+    }
     return true;
 }
 
-void PiControl::update_backplane_variables()
+void PiControl::report_start_latency()
 {
-    // Only update if a command was received
-    bool command_received = false;
-    for (auto it = netinfo.connections.begin();
-            it != netinfo.connections.end(); ++it) {
-        // Proceed to update if a command was received
-        if ((it->device == SERVER) && (it->recv_status == MSG_DONE)) {
-            command_received = true;
-            break;
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - jitter_report_time;
+    jitter_report_time = now;
+    for (std::size_t i = 0; i < backplanes.size(); i++) {
+        std::ostringstream report;
+        if (backplanes[i]->report_start_latency(report)) {
+            std::cout << "Command start latency";
+            if (backplanes.size() > 1) {
+                std::cout << " on backplane " << i;
+            }
+            std::cout << " over the last " << elapsed.count() << " s:"
+                << std::endl << report.str();
         }
     }
-    if (!command_received) { 
-        // Nothing to do
+}
+
+void PiControl::report_spi_checks()
+{
+    SpiCheckTotals counts;
+    take_spi_check_counts(counts);
+    if (counts.empty()) {
         return;
     }
-    
-    std::string command_name = backplane_command.command_name();
-    unsigned short command_parameters[NUM_COMMAND_PARAMETERS] = {0};
-    
-    int num_spi_messages_sent = 0;
-    unsigned short spi_command[SPI_MESSAGE_LENGTH * MAX_NUM_SPI_MESSAGES] = {0};
-    unsigned short spi_data[SPI_MESSAGE_LENGTH * MAX_NUM_SPI_MESSAGES] = {0};
-    
-    // Take appropriate action depending on received command
-    if (command_name == "read_module_voltages") {
-        float voltages[NUM_FEES];
-        num_spi_messages_sent = read_voltages(voltages, spi_command, spi_data);
-        for (int i = 0; i < NUM_FEES; i++) {
-            backplane_variables.set_voltage(i, voltages[i]);
-        }
-    } else if (command_name == "read_module_currents") {
-        float currents[NUM_FEES];
-        num_spi_messages_sent = read_currents(currents, spi_command, spi_data);
-        for (int i = 0; i < NUM_FEES; i++) {
-            backplane_variables.set_current(i, currents[i]);
-        }
-    } else if (command_name == "read_modules_present") {
-        unsigned short fees_present[NUM_FEES];
-        num_spi_messages_sent = read_fees_present(fees_present, spi_command,
-                spi_data);
-        for (int i = 0; i < NUM_FEES; i++) {
-            backplane_variables.set_present(i, fees_present[i]);
-        }
-    } else if (command_name == "set_trigger_mask") {
-        unsigned short trigger_mask[NUM_FEES];
-        num_spi_messages_sent = set_trigger_mask(trigger_mask, spi_command,
-                spi_data);
-        for (int i = 0; i < NUM_FEES; i++) {
-            backplane_variables.set_trigger_mask(i, trigger_mask[i]);
+    std::cout << "SPI replies failing their checks since the last report:"
+        << std::endl;
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+        std::cout << "  ";
+        if (backplanes.size() > 1) {
+            std::cout << "backplane " << it->first.first << ", ";
         }
-    } else if ((command_name == "set_trigger")
-            && (backplane_command.int_args_size() == 4)) {
-        for (int i = 0; i < 4; i++) {
-            command_parameters[i] = backplane_command.int_args(i);
-        }
-        num_spi_messages_sent = set_trigger(command_parameters,
-                spi_command, spi_data);
-    } else if ((command_name == "toggle_trigger_tack")
-            && (backplane_command.int_args_size() == 7)) {
-        command_parameters[0] = 0;
-        for (int i = 0; i < 7; i++) {
-            // each argument must be 0 or 1 - enforce this with min
-            command_parameters[0] = (command_parameters[0] & ~(1 << i))
-                | (std::min(backplane_command.int_args(i), 1u) << i);
-        }
-        num_spi_messages_sent = enable_disable_trigger(command_parameters,
-                spi_command, spi_data);
-    } else if ((command_name == "set_holdoff_time")
-            && (backplane_command.int_args_size() == 1)) {
-        command_parameters[0] = backplane_command.int_args(0);
-        num_spi_messages_sent = set_holdoff_time(command_parameters,
-                spi_command, spi_data);
-    } else if ((command_name == "set_tack_type_and_mode")
-            && (backplane_command.int_args_size() == 2)) {
-        // type and mode must be 0-3 - enforce this with min
-        unsigned int tack_type = std::min(backplane_command.int_args(0), 3u);
-        unsigned int tack_mode = std::min(backplane_command.int_args(1), 3u);
-        command_parameters[0] = ((tack_type << 2) | tack_mode);
-        num_spi_messages_sent = set_tack_type_and_mode(command_parameters,
-                spi_command, spi_data);
-    } else if ((command_name == "power_control_modules")
-            && (backplane_command.int_args_size() == 2)) {
-        command_parameters[0] = backplane_command.int_args(0);
-        command_parameters[1] = backplane_command.int_args(1);
-        num_spi_messages_sent = power_control_modules(command_parameters,
-                spi_command, spi_data);
-    } else if (command_name == "read_timer_and_trigger_rate") {
-        num_spi_messages_sent = read_nstimer_trigger_rate(spi_command,
-                spi_data);
-    } else if (command_name == "reset_trigger_counter_and_timer") {
-        num_spi_messages_sent = reset_trigger_and_nstimer(spi_command,
-                spi_data);
-    } else if (command_name == "reset_dacq1_power") {
-        num_spi_messages_sent = reset_dacq1_power(spi_command, spi_data);
-    } else if (command_name == "reset_dacq2_power") {
-        num_spi_messages_sent = reset_dacq2_power(spi_command, spi_data);
-    } else if (command_name == "sync") {
-        num_spi_messages_sent = sync(spi_command, spi_data);
-    } else {
-        std::cerr << "Error: command name " << command_name <<
-            " not recognized" << std::endl;
-        return;
-    }
-    backplane_variables.set_allocated_command(&backplane_command);
-    backplane_variables.set_n_spi_messages(num_spi_messages_sent);
-    for (int i = 0; i < SPI_MESSAGE_LENGTH * num_spi_messages_sent; i++) {
-        backplane_variables.set_spi_command(i, spi_command[i]);
-        backplane_variables.set_spi_data(i, spi_data[i]);
+        std::cout << "command word 0x" << std::hex << it->first.second
+            << std::dec << ": " << it->second.failed << " failed, "
+            << it->second.retried << " messages retried, "
+            << it->second.recovered << " recovered, "
+            << it->second.unrecovered << " not recovered" << std::endl;
     }
-    updates_to_send = true;
 }
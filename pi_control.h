@@ -4,45 +4,55 @@
 #ifndef PI_CONTROL_H
 #define PI_CONTROL_H
 
+#include <cstdint>
 #include <string>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 #include "network.h"
 #include "slow_control.pb.h"
-#include "backplane_spi.h"
+#include "backplane_control.h"
 
-// TODO: load constants from config file
-const int NUM_FEES = 32; // number of modules allowed for in underlying code
-const int SPI_MESSAGE_LENGTH = 11;
-const int MAX_NUM_SPI_MESSAGES = 4; // none of the commands here will send more
+// Interval between reports of how long commands waited to start
+const int JITTER_REPORT_INTERVAL_SEC = 60;
 
+// Commands are received and results sent by the network loop, which calls
+// synchronize_network(), and performed by the BackplaneControl of the
+// backplane each names (see backplane_control.h). Results and samples are
+// sent tagged with their backplane, one backplane's at a time in turn. The
+// server's clock is echoed with the first update after each command, so that
+// it can place the Pi's times on its own clock.
 class PiControl {
 protected:
+    // Used by the network loop only
     Network_info netinfo;
-    slow_control::BackplaneVariables backplane_variables;
-    slow_control::LowLevelCommand backplane_command;
-    bool updates_to_send;
+    CommandResult outgoing; // reused to keep its buffers
+    std::chrono::steady_clock::time_point jitter_report_time;
+    int next_backplane; // to send an update of first
+    // Time the server sent the latest command, and the time it was received
+    // on the monotonic clock, to echo with the next update (see
+    // clock_sync.h); 0 once echoed
+    int64_t echo_server_send_usec;
+    int64_t echo_receive_usec;
+
+    // One for each backplane added (see backplane_spi.h), in order
+    std::vector<std::unique_ptr<BackplaneControl>> backplanes;
+
+    // Parse and queue any commands received from the server
+    bool receive_commands();
+    // Write how long commands waited to start since the last report
+    void report_start_latency();
+    // Write the counts of SPI replies failing their checks since the last
+    // report, if any did
+    void report_spi_checks();
 public:
-    PiControl(std::string hostname) : netinfo(PI, hostname)
-    {
-        // Verify that the version of the Protocol Buffer library we linked
-        // against is compatible with the version of the headers we compiled
-        // against.
-        GOOGLE_PROTOBUF_VERIFY_VERSION;
-        updates_to_send = false;
-        initialize_lowlevel();
-        for (int i = 0; i < SPI_MESSAGE_LENGTH * MAX_NUM_SPI_MESSAGES; i++) {
-            backplane_variables.add_spi_command(0);
-            backplane_variables.add_spi_data(0);
-        }
-        for (int i = 0; i < NUM_FEES; i++) {
-            backplane_variables.add_voltage(0.0);
-            backplane_variables.add_current(0.0);
-            backplane_variables.add_present(0);
-            backplane_variables.add_trigger_mask(0);
-        }
-    }
+    PiControl(std::string hostname, int n_backplanes);
+    // Start the threads performing commands
+    // Return false if they could not be set up as asked; they run regardless
+    bool start_command_threads(const CommandThreadSettings &settings);
+    // Send any results and samples, and pass on any commands received
     bool synchronize_network();
-    void update_backplane_variables();
 };
 
 #endif
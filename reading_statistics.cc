@@ -0,0 +1,54 @@
+// reading_statistics.cc
+// Implementation of the statistics of readings over several conversions
+
+#include <algorithm>
+#include <cmath>
+
+#include "reading_statistics.h"
+
+void ReadingStatistics::clear()
+{
+    n = 0;
+    std::fill(shift, shift + STATISTICS_NUM_FEES, 0.0f);
+    std::fill(sum, sum + STATISTICS_NUM_FEES, 0.0f);
+    std::fill(sum_squares, sum_squares + STATISTICS_NUM_FEES, 0.0f);
+    std::fill(minimum, minimum + STATISTICS_NUM_FEES, 0.0f);
+    std::fill(maximum, maximum + STATISTICS_NUM_FEES, 0.0f);
+}
+
+void ReadingStatistics::add(const float readings[])
+{
+    if (n == 0) {
+        std::copy(readings, readings + STATISTICS_NUM_FEES, shift);
+        std::copy(readings, readings + STATISTICS_NUM_FEES, minimum);
+        std::copy(readings, readings + STATISTICS_NUM_FEES, maximum);
+    }
+    // The extremes are selected by value, not by std::min and std::max,
+    // whose references would be loads from a selected address, which keep
+    // the loop from vectorizing
+    for (int i = 0; i < STATISTICS_NUM_FEES; i++) {
+        float reading = readings[i];
+        float difference = reading - shift[i];
+        sum[i] += difference;
+        sum_squares[i] += difference * difference;
+        minimum[i] = (reading < minimum[i]) ? reading : minimum[i];
+        maximum[i] = (reading > maximum[i]) ? reading : maximum[i];
+    }
+    n++;
+}
+
+void ReadingStatistics::finish(float mean[], float min[], float max[],
+        float std_dev[]) const
+{
+    float scale = (n > 0) ? 1.0f / n : 0.0f;
+    for (int i = 0; i < STATISTICS_NUM_FEES; i++) {
+        float mean_difference = sum[i] * scale;
+        // Rounding can leave the variance of a steady reading just below 0
+        float variance = std::max(sum_squares[i] * scale
+                - mean_difference * mean_difference, 0.0f);
+        mean[i] = shift[i] + mean_difference;
+        min[i] = minimum[i];
+        max[i] = maximum[i];
+        std_dev[i] = std::sqrt(variance);
+    }
+}
@@ -0,0 +1,39 @@
+// reading_statistics.h
+// Statistics of the voltage or current of every module over several ADC
+// conversions, accumulated on the Pi for oversampled housekeeping reads
+
+#ifndef READING_STATISTICS_H
+#define READING_STATISTICS_H
+
+// Number of modules accumulated
+const int STATISTICS_NUM_FEES = 32;
+
+// Mean, extremes, and spread of one reading of every module. The channels
+// are accumulated together in fixed length loops over contiguous arrays
+// without branches, which the compiler vectorizes when optimizing. Each
+// reading is accumulated as its difference from the first conversion's, so
+// the sums stay small and single precision keeps the variance of readings
+// whose noise is far smaller than their value.
+class ReadingStatistics {
+protected:
+    int n;
+    float shift[STATISTICS_NUM_FEES]; // first reading of each channel
+    float sum[STATISTICS_NUM_FEES]; // of differences from shift
+    float sum_squares[STATISTICS_NUM_FEES];
+    float minimum[STATISTICS_NUM_FEES];
+    float maximum[STATISTICS_NUM_FEES];
+public:
+    ReadingStatistics() { clear(); }
+    void clear();
+    // Add one conversion's reading of every module
+    void add(const float readings[]);
+    // Number of conversions added since cleared
+    int count() const { return n; }
+    // Write the statistics of each module, of all conversions added; the
+    // standard deviation is that of the readings (not of their mean), and 0
+    // for a single conversion
+    void finish(float mean[], float min[], float max[],
+            float std_dev[]) const;
+};
+
+#endif
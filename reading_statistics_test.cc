@@ -0,0 +1,141 @@
+// reading_statistics_test.cc
+/* Check the accuracy of ReadingStatistics (see reading_statistics.h), kept in
+ * single precision, against the same statistics computed in double precision
+ * from the same readings. The readings have large offsets and noise far
+ * smaller than them, as ADC readings do, where summing the squares of the
+ * readings themselves in single precision would lose the spread entirely.
+ * A single conversion, and a reading that never changes, must have a
+ * standard deviation of exactly 0.
+ * Exits with status 1 if any statistic is off by more than allowed. */
+
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "reading_statistics.h"
+
+const int N = STATISTICS_NUM_FEES;
+
+// Largest errors allowed: of the mean, relative to the offset, and of the
+// standard deviation, relative to the standard deviation
+const double MEAN_TOLERANCE = 1e-6;
+const double STD_TOLERANCE = 1e-3;
+
+int n_failed = 0;
+
+void check(bool passed, const std::string &what)
+{
+    if (!passed) {
+        std::cout << "FAIL: " << what << std::endl;
+        n_failed++;
+    }
+}
+
+// Add conversions to statistics, each reading given for every channel, and
+// compare the statistics with those computed in double precision
+// Return the largest relative error of the standard deviations
+double check_statistics(const std::vector<std::vector<float>> &conversions,
+        const double offsets[], const std::string &name)
+{
+    ReadingStatistics statistics;
+    for (std::size_t i = 0; i < conversions.size(); i++) {
+        statistics.add(conversions[i].data());
+    }
+    check(statistics.count() == (int)conversions.size(), name + ": count");
+    float mean[N], min[N], max[N], std_dev[N];
+    statistics.finish(mean, min, max, std_dev);
+
+    double worst_std_error = 0;
+    for (int channel = 0; channel < N; channel++) {
+        double sum = 0;
+        double reference_min = conversions[0][channel];
+        double reference_max = conversions[0][channel];
+        for (std::size_t i = 0; i < conversions.size(); i++) {
+            double reading = conversions[i][channel];
+            sum += reading;
+            reference_min = std::min(reference_min, reading);
+            reference_max = std::max(reference_max, reading);
+        }
+        double reference_mean = sum / conversions.size();
+        double sum_squares = 0;
+        for (std::size_t i = 0; i < conversions.size(); i++) {
+            double deviation = conversions[i][channel] - reference_mean;
+            sum_squares += deviation * deviation;
+        }
+        double reference_std = std::sqrt(sum_squares / conversions.size());
+
+        std::string what = name + ", channel " + std::to_string(channel);
+        check(std::fabs(mean[channel] - reference_mean)
+                <= MEAN_TOLERANCE * std::fabs(offsets[channel]),
+                what + ": mean " + std::to_string(mean[channel]) + ", not "
+                + std::to_string(reference_mean));
+        check((min[channel] == reference_min)
+                && (max[channel] == reference_max), what + ": extremes");
+        double std_error = (reference_std > 0)
+            ? std::fabs(std_dev[channel] - reference_std) / reference_std
+            : std_dev[channel];
+        worst_std_error = std::max(worst_std_error, std_error);
+        check(std_error <= STD_TOLERANCE, what + ": standard deviation "
+                + std::to_string(std_dev[channel]) + ", not "
+                + std::to_string(reference_std));
+    }
+    return worst_std_error;
+}
+
+int main()
+{
+    std::mt19937 random(1);
+    std::normal_distribution<double> noise(0.0, 1.0);
+
+    // Offsets from 0.45 (A) through 12 (V) to 4095 (ADC counts) and beyond,
+    // with noise 1e-3 to 1e-5 of each
+    double offsets[N];
+    double noise_scales[N];
+    const double base_offsets[4] = {0.45, 12.0, 4095.0, 1.0e5};
+    const double noise_fractions[3] = {1e-3, 1e-4, 1e-5};
+    for (int channel = 0; channel < N; channel++) {
+        offsets[channel] = base_offsets[channel % 4] * (1 + 0.01 * channel);
+        noise_scales[channel] = offsets[channel]
+            * noise_fractions[channel % 3];
+    }
+
+    const int n_conversions[3] = {2, 10, 1000};
+    for (int k = 0; k < 3; k++) {
+        std::vector<std::vector<float>> conversions(n_conversions[k],
+                std::vector<float>(N));
+        for (int i = 0; i < n_conversions[k]; i++) {
+            for (int channel = 0; channel < N; channel++) {
+                conversions[i][channel] = offsets[channel]
+                    + noise_scales[channel] * noise(random);
+            }
+        }
+        std::string name = std::to_string(n_conversions[k]) + " conversions";
+        double worst = check_statistics(conversions, offsets, name);
+        std::cout << name << ": standard deviations within " << worst
+            << " of double precision" << std::endl;
+    }
+
+    // A single conversion, and a reading that never changes, have no spread
+    std::vector<std::vector<float>> single(1, std::vector<float>(N));
+    for (int channel = 0; channel < N; channel++) {
+        single[0][channel] = offsets[channel] + noise_scales[channel];
+    }
+    check_statistics(single, offsets, "1 conversion");
+    std::vector<std::vector<float>> steady(100, single[0]);
+    check_statistics(steady, offsets, "steady reading");
+
+    // Clearing starts over
+    ReadingStatistics statistics;
+    statistics.add(single[0].data());
+    statistics.clear();
+    check(statistics.count() == 0, "count after clear");
+
+    if (n_failed > 0) {
+        std::cout << n_failed << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All statistics within tolerance" << std::endl;
+    return 0;
+}
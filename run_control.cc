@@ -2,6 +2,11 @@
 // Implementation of the class for mid-level server control and logging
 
 #include <iterator>
+#include <algorithm>
+
+#include <cstdio>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #include <iostream>
 #include <fstream>
@@ -15,6 +20,9 @@
 #include <cppconn/prepared_statement.h>
 
 #include "run_control.h"
+#include "backplane_commands.h"
+#include "backplane_encoding.h"
+#include "spi_journal.h"
 
 // TODO: load constants from config file
 const int NUM_FEES = 32; // number of modules allowed for in underlying code
@@ -26,6 +34,8 @@ bool RunControl::synchronize_network()
         return false;
     }
     outgoing_message = "";
+    // Echoes of the server's clock are timed from here (see clock_sync.h)
+    receive_usec = unix_time_usec();
     // Store received messages
     for (auto it = netinfo.connections.begin();
             it != netinfo.connections.end(); ++it) {
@@ -40,12 +50,18 @@ bool RunControl::synchronize_network()
             if (!backplane_variables.ParseFromString(it->message)) {
                 return false;
             }
+            if (backplane_variables.has_clock_echo()) {
+                pi_clock.add(backplane_variables.clock_echo(), receive_usec);
+            }
             received_messages.push_back(PI);
         } else if ((it->device == TM) && (it->recv_status == MSG_DONE)) {
             it->recv_status = MSG_STANDBY;
             if (!target_variables.ParseFromString(it->message)) {
                 return false;
             }
+            if (target_variables.has_clock_echo()) {
+                tm_clock.add(target_variables.clock_echo(), receive_usec);
+            }
             received_messages.push_back(TM);
         }
     }
@@ -79,19 +95,113 @@ bool get_device_code(std::string code_string, int &device_code)
     return true;
 }
 
+// Get the index of the Pi's backplane given by a BP label, which only
+// commands to the Pi take
+// Return true if valid, false otherwise
+bool get_backplane(std::string index_string, int device_code, int &backplane)
+{
+    if (device_code != PI) {
+        std::cerr << "only commands to the PI take a backplane" << std::endl;
+        return false;
+    }
+    try {
+        backplane = std::stoi(index_string);
+    } catch (...) {
+        std::cerr << "could not convert " << index_string << " to int"
+            << std::endl;
+        return false;
+    }
+    if ((backplane < 0) || (backplane >= MAX_BACKPLANES)) {
+        std::cerr << "backplane must be from 0 to " << MAX_BACKPLANES - 1
+            << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Get the code of the named run control command
+// Return true if match found, false otherwise
+bool get_run_control_code(std::string command_name, int &command_code)
+{
+    if (command_name == "cancel_pending_commands") {
+        command_code = RC_CANCEL_PENDING_COMMANDS;
+    } else if (command_name == "sleep") {
+        command_code = RC_SLEEP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Define the commands performed by the Pi, from the table of them compiled
+// into both programs (see backplane_commands.h)
+void define_backplane_commands(CommandTable &table)
+{
+    for (int code = BP_UNKNOWN_COMMAND + 1; code < NUM_BACKPLANE_COMMANDS;
+            code++) {
+        CommandDefinition def;
+        def.command_name = backplane_command_name(code);
+        def.code = code;
+        def.device = PI;
+        def.n_ints = backplane_command_n_ints(code);
+        def.n_floats = 0;
+        def.n_strings = 0;
+        table.command_definition_index[definition_key(PI,
+                def.command_name)] = table.command_definitions.size();
+        table.command_definitions.push_back(def);
+    }
+}
+
+// Parse the options following the counts of arguments in a command
+// definition, TIMEOUT msec and RETRY n, into the definition
+// Return true if successful, false otherwise
+bool parse_definition_options(const std::vector<std::string> &words,
+        CommandDefinition &def)
+{
+    for (std::size_t i = 5; i < words.size(); i += 2) {
+        if (i + 1 == words.size()) {
+            std::cerr << "no value given for " << words[i] << std::endl;
+            return false;
+        }
+        int value;
+        try {
+            value = std::stoi(words[i + 1]);
+        } catch (...) {
+            std::cerr << "could not convert " << words[i + 1] << " to int"
+                << std::endl;
+            return false;
+        }
+        if ((words[i] == "TIMEOUT") && (value > 0)) {
+            def.timeout_msec = value;
+        } else if ((words[i] == "RETRY") && (value >= 0)) {
+            def.max_retries = value;
+        } else {
+            std::cerr << "invalid option " << words[i] << ' ' << words[i + 1]
+                << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 // Parse the high level command configuration file, storing a vector of 
 // high level command objects, each containing the corresponding vector
 // of low level commands
-bool RunControl::parse_command_config(std::string command_config_file)
+bool parse_command_config(std::string command_config_file,
+        CommandTable &table)
 {
     // Set the initial mode
     enum Mode {
         READ_FILE,
         COMMAND,
         HIGH_LEVEL_COMMAND_NAME,
-        HIGH_LEVEL_COMMAND
+        HIGH_LEVEL_COMMAND,
+        POLLING
     };
     Mode mode = READ_FILE;
+    SequenceCompiler compiler;
+    int n_tm_commands = 0; // target module commands are numbered in order
+    define_backplane_commands(table);
 
     // Load the command config file
     std::ifstream ccfile(command_config_file);
@@ -137,6 +247,8 @@ bool RunControl::parse_command_config(std::string command_config_file)
                     mode = COMMAND;
                 } else if (line == "BEGIN SEQUENCE") {
                     mode = HIGH_LEVEL_COMMAND_NAME;
+                } else if (line == "BEGIN POLLING") {
+                    mode = POLLING;
                 } else {
                     // Not a valid line
                     error_on_line = true;
@@ -147,7 +259,7 @@ bool RunControl::parse_command_config(std::string command_config_file)
             {
                 if (line == "END DEFINITIONS") {
                     mode = READ_FILE;
-                } else if (words.size() == 5) {
+                } else if (words.size() >= 5) {
                     // Define a new command
                     CommandDefinition new_command;
                     // Parse command name
@@ -186,8 +298,70 @@ bool RunControl::parse_command_config(std::string command_config_file)
                         error_on_line = true;
                         break;
                     }
+                    // Parse any timeout and retries
+                    if (!parse_definition_options(words, new_command)) {
+                        error_on_line = true;
+                        break;
+                    }
+                    // The Pi's commands are already defined, and may only
+                    // be listed again as defined, optionally with a timeout
+                    // and retries
+                    if (new_command.device == PI) {
+                        new_command.code = backplane_command_code(
+                                new_command.command_name);
+                        if (new_command.code == BP_UNKNOWN_COMMAND) {
+                            std::cerr << "command "
+                                << new_command.command_name
+                                << " not implemented by device PI"
+                                << std::endl;
+                            error_on_line = true;
+                        } else if ((new_command.n_ints !=
+                                    backplane_command_n_ints(new_command.code))
+                                || (new_command.n_floats != 0)
+                                || (new_command.n_strings != 0)) {
+                            std::cerr << "command " << new_command.command_name
+                                << " takes "
+                                << backplane_command_n_ints(new_command.code)
+                                << " integer and no other arguments on the Pi"
+                                << std::endl;
+                            error_on_line = true;
+                        } else {
+                            CommandDefinition &defined =
+                                table.command_definitions[
+                                table.command_definition_index[definition_key(
+                                        PI, new_command.command_name)]];
+                            defined.timeout_msec = new_command.timeout_msec;
+                            defined.max_retries = new_command.max_retries;
+                        }
+                        break;
+                    }
+                    // Assign the command code, which must be known to the
+                    // device performing the command
+                    if (new_command.device == SERVER) {
+                        new_command.code = RC_UNKNOWN_COMMAND;
+                        get_run_control_code(new_command.command_name,
+                                new_command.code);
+                    } else {
+                        new_command.code = ++n_tm_commands;
+                    }
+                    if (new_command.code == 0) {
+                        std::cerr << "command " << new_command.command_name
+                            << " not implemented by device " << words[0]
+                            << std::endl;
+                        error_on_line = true;
+                        break;
+                    }
                     // Record the new command definition
-                    command_definitions.push_back(new_command);
+                    std::string key = definition_key(new_command.device,
+                            new_command.command_name);
+                    if (table.command_definition_index.count(key)) {
+                        std::cerr << "command already defined" << std::endl;
+                        error_on_line = true;
+                        break;
+                    }
+                    table.command_definition_index[key] =
+                        table.command_definitions.size();
+                    table.command_definitions.push_back(new_command);
                 } else {
                     // Not a valid line
                     error_on_line = true;
@@ -196,37 +370,39 @@ bool RunControl::parse_command_config(std::string command_config_file)
             }
             case HIGH_LEVEL_COMMAND_NAME:
             {
-                if (words.size() == 1) {
-                    // Check that high level command name isn't already used
-                    std::string high_level_command_name = words[0];
-                    for (auto it = high_level_commands.begin();
-                            it != high_level_commands.end(); ++it) {
-                        if (it->command_name == high_level_command_name) {
-                            std::cerr << "high level command name already used"
-                                << std::endl;
-                            error_on_line = true;
-                            break;
-                        }
-                    }
-                    if (error_on_line) {
-                        break;
-                    }
-                    // Create a new high level command
-                    HighLevelCommand new_high_level_command;
-                    new_high_level_command.command_name =
-                        high_level_command_name;
-                    high_level_commands.push_back(new_high_level_command);
-                    mode = HIGH_LEVEL_COMMAND;
-                } else {
-                    // Invalid high level command name
+                // Name of the high level command, then of its parameters
+                std::string high_level_command_name = words[0];
+                if (table.high_level_command_index.count(
+                            high_level_command_name)) {
+                    std::cerr << "high level command name already used"
+                        << std::endl;
                     error_on_line = true;
+                    break;
+                }
+                // Create a new high level command
+                HighLevelCommand new_high_level_command;
+                if (!compiler.begin(words, new_high_level_command)) {
+                    error_on_line = true;
+                    break;
                 }
+                table.high_level_command_index[high_level_command_name] =
+                    table.high_level_commands.size();
+                table.high_level_commands.push_back(new_high_level_command);
+                mode = HIGH_LEVEL_COMMAND;
                 break;
             }
             case HIGH_LEVEL_COMMAND:
             {
                 if (line == "END SEQUENCE") {
+                    if (!compiler.finish(table.high_level_commands.back())) {
+                        error_on_line = true;
+                        break;
+                    }
                     mode = READ_FILE;
+                } else if (compiler.compile_statement(words,
+                            table.high_level_commands.back(), error_on_line)) {
+                    // Loops, conditionals, and variables are compiled above
+                    break;
                 } else if ((words.size() >= 2) && !(words.size() % 2)) {
                     // Parse device code
                     int device_code;
@@ -241,6 +417,7 @@ bool RunControl::parse_command_config(std::string command_config_file)
                     // Require device, command name, and even number of
                     // arguments (label-value pairs)
                     LowLevelCommand new_low_level_command;
+                    std::vector<SequenceOperand> int_operands;
                     int len_words = words.size();
                     for (int i = 2; i < len_words; i+=2) {
                         if ((i == 2) && (words[i] == "CHK")) {
@@ -254,17 +431,25 @@ bool RunControl::parse_command_config(std::string command_config_file)
                                 error_on_line = true;
                                 break;
                             }
+                        } else if (words[i] == "BP") {
+                            // Parse optional backplane of the Pi
+                            if (!get_backplane(words[i + 1], device_code,
+                                        new_low_level_command.backplane)) {
+                                error_on_line = true;
+                                break;
+                            }
                         } else if (words[i] == "INT") {
-                            // Parse optional unsigned integer argument
-                            try {
-                                new_low_level_command.int_args.push_back(
-                                        std::stoi(words[i + 1]));
-                            } catch (...) {
-                                std::cerr << "could not convert "
-                                    << words[i + 1] << " to int" << std::endl;
+                            // Parse optional unsigned integer argument, which
+                            // may be given by a parameter or variable
+                            SequenceOperand operand;
+                            if (!compiler.parse_operand(words[i + 1],
+                                        operand)) {
                                 error_on_line = true;
                                 break;
                             }
+                            new_low_level_command.int_args.push_back(
+                                    operand.value);
+                            int_operands.push_back(operand);
                         } else if (words[i] == "FLT") {
                             // Parse optional float argument
                             try {
@@ -288,23 +473,23 @@ bool RunControl::parse_command_config(std::string command_config_file)
                     }
                     // Match command to a known definition
                     bool match_found = false;
-                    for (std::vector<CommandDefinition>::iterator iter =
-                            command_definitions.begin();
-                            iter != command_definitions.end(); ++iter) {
-                        if ((command_name == iter->command_name)
-                                && (device_code == iter->device)
-                                && (new_low_level_command.int_args.size() ==
-                                    (std::size_t) iter->n_ints)
+                    auto def_it = table.command_definition_index.find(
+                            definition_key(device_code, command_name));
+                    if (def_it != table.command_definition_index.end()) {
+                        const CommandDefinition &def =
+                            table.command_definitions[def_it->second];
+                        if ((new_low_level_command.int_args.size() ==
+                                    (std::size_t) def.n_ints)
                                 && (new_low_level_command.float_args.size() ==
-                                    (std::size_t) iter->n_floats)
+                                    (std::size_t) def.n_floats)
                                 && (new_low_level_command.string_args.size() ==
-                                    (std::size_t) iter->n_strings)) {
+                                    (std::size_t) def.n_strings)) {
                             match_found = true;
-                            new_low_level_command.def = *iter;
+                            new_low_level_command.def = def;
                             // Add to the current high level command
-                            high_level_commands.back().commands.push_back(
-                                    new_low_level_command);
-                            break;
+                            compiler.add_command(new_low_level_command,
+                                    int_operands,
+                                    table.high_level_commands.back());
                         }
                     }
                     if (!match_found) {
@@ -319,6 +504,68 @@ bool RunControl::parse_command_config(std::string command_config_file)
                 }
                 break;
             }
+            case POLLING:
+            {
+                if (line == "END POLLING") {
+                    mode = READ_FILE;
+                } else if ((words.size() == 3) || ((words.size() == 5)
+                            && (words[3] == "BP"))) {
+                    // Poll a defined command without arguments, optionally
+                    // on a given backplane of the Pi
+                    int device_code;
+                    if (!get_device_code(words[0], device_code)) {
+                        std::cerr << "unknown device code " << words[0]
+                            << std::endl;
+                        error_on_line = true;
+                        break;
+                    }
+                    auto def_it = table.command_definition_index.find(
+                            definition_key(device_code, words[1]));
+                    if ((def_it == table.command_definition_index.end())
+                            || (device_code == SERVER)) {
+                        std::cerr << "no match found for command "
+                            << words[1] << " on specified device" << std::endl;
+                        error_on_line = true;
+                        break;
+                    }
+                    const CommandDefinition &def =
+                        table.command_definitions[def_it->second];
+                    if (def.n_ints || def.n_floats || def.n_strings) {
+                        std::cerr << "polled commands can't take arguments"
+                            << std::endl;
+                        error_on_line = true;
+                        break;
+                    }
+                    // Parse polling period
+                    PollDefinition poll;
+                    poll.definition = def_it->second;
+                    poll.backplane = 0;
+                    if ((words.size() == 5) && !get_backplane(words[4],
+                                device_code, poll.backplane)) {
+                        error_on_line = true;
+                        break;
+                    }
+                    try {
+                        poll.period_msec = std::stoi(words[2]);
+                    } catch (...) {
+                        std::cerr << "could not convert " << words[2]
+                            << " to int" << std::endl;
+                        error_on_line = true;
+                        break;
+                    }
+                    if (poll.period_msec <= 0) {
+                        std::cerr << "polling period must be positive"
+                            << std::endl;
+                        error_on_line = true;
+                        break;
+                    }
+                    table.polls.push_back(poll);
+                } else {
+                    // Not a valid line
+                    error_on_line = true;
+                }
+                break;
+            }
         }
         if (error_on_line) {
             std::cerr << "Error: could not parse line " << line_counter << ':'
@@ -334,17 +581,126 @@ bool RunControl::parse_command_config(std::string command_config_file)
     return true;
 }
 
+RunControl::~RunControl()
+{
+    if (command_config_watch != -1) {
+        close(command_config_watch);
+    }
+}
+
+bool RunControl::load_command_config(std::string config_file)
+{
+    command_config_file = config_file;
+    if (!checksum_file(command_config_file, command_config_checksum)) {
+        std::cerr << "Error: could not read " << command_config_file
+            << std::endl;
+        return false;
+    }
+
+    // Use the compiled cache if it was made from this version of the file
+    std::string cache_file = command_config_file + ".cache";
+    std::shared_ptr<CommandTable> table(new CommandTable);
+    if (read_command_cache(cache_file, command_config_checksum, *table)) {
+        std::cout << "Loaded commands from " << cache_file << std::endl;
+    } else {
+        if (!parse_command_config(command_config_file, *table)) {
+            return false;
+        }
+        if (!write_command_cache(cache_file, *table,
+                    command_config_checksum)) {
+            std::cerr << "Warning: could not write command cache"
+                << std::endl;
+        }
+    }
+    command_table = table;
+    reset_polls();
+
+    // Watch the directory, since editors often replace the file
+    if (command_config_watch == -1) {
+        std::string directory = ".";
+        auto pos = command_config_file.find_last_of('/');
+        if (pos != std::string::npos) {
+            directory = command_config_file.substr(0, pos);
+        }
+        command_config_watch = inotify_init1(IN_NONBLOCK);
+        if ((command_config_watch == -1) ||
+                (inotify_add_watch(command_config_watch, directory.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO) == -1)) {
+            perror("inotify");
+            std::cerr << "Warning: command config changes won't be reloaded"
+                << std::endl;
+        }
+    }
+    return true;
+}
+
+void RunControl::reload_command_config_if_changed()
+{
+    if (command_config_watch == -1) {
+        return;
+    }
+
+    // Check for events on the config file, without waiting
+    std::string file_name = command_config_file.substr(
+            command_config_file.find_last_of('/') + 1);
+    bool changed = false;
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(command_config_watch, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + length;
+                ptr += sizeof(struct inotify_event) +
+                ((struct inotify_event *)ptr)->len) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if ((event->len > 0) && (file_name == event->name)) {
+                changed = true;
+            }
+        }
+    }
+    if (!changed) {
+        return;
+    }
+
+    // Skip reloading if the contents are the same
+    uint64_t checksum;
+    if (!checksum_file(command_config_file, checksum)
+            || (checksum == command_config_checksum)) {
+        return;
+    }
+
+    // Replace the table only if the new file parses completely
+    std::cout << "Reloading commands..." << std::endl;
+    std::shared_ptr<CommandTable> table(new CommandTable);
+    if (!parse_command_config(command_config_file, *table)) {
+        std::cerr << "Keeping previously loaded commands." << std::endl;
+        return;
+    }
+    write_command_cache(command_config_file + ".cache", *table, checksum);
+    command_config_checksum = checksum;
+    command_table = table;
+    reset_polls();
+    std::cout << "Commands reloaded." << std::endl;
+}
+
 // Translate a low level command protocol buffer into the corresponding struct
 void write_command_buffer_to_struct(
         slow_control::LowLevelCommand command_buffer,
         LowLevelCommand &command_struct)
 {
-    command_struct.def.command_name = command_buffer.command_name();
+    command_struct.def.code = command_buffer.code();
     command_struct.def.device = command_buffer.device();
+    // Commands to the Pi are identified by code only
+    if (command_struct.def.device == PI) {
+        command_struct.def.command_name =
+            backplane_command_name(command_struct.def.code);
+    } else {
+        command_struct.def.command_name = command_buffer.command_name();
+    }
     command_struct.def.n_ints = command_buffer.int_args_size();
     command_struct.def.n_floats = command_buffer.float_args_size();
     command_struct.def.n_strings = command_buffer.string_args_size();
     command_struct.priority = command_buffer.priority();
+    command_struct.backplane = command_buffer.backplane();
     for (int i = 0; i < command_struct.def.n_ints; i++) {
         command_struct.int_args.push_back(command_buffer.int_args(i));
     }
@@ -359,9 +715,25 @@ void write_command_buffer_to_struct(
 void write_command_struct_to_buffer(LowLevelCommand command_struct,
         slow_control::LowLevelCommand &command_buffer)
 {
-    command_buffer.set_command_name(command_struct.def.command_name);
+    command_buffer.set_code(command_struct.def.code);
+    // Commands to the Pi are identified by code only
+    if (command_struct.def.device == PI) {
+        command_buffer.clear_command_name();
+    } else {
+        command_buffer.set_command_name(command_struct.def.command_name);
+    }
     command_buffer.set_device(command_struct.def.device);
     command_buffer.set_priority(command_struct.priority);
+    if (command_struct.backplane > 0) {
+        command_buffer.set_backplane(command_struct.backplane);
+    } else {
+        command_buffer.clear_backplane();
+    }
+    if (command_struct.def.device == PI) {
+        command_buffer.set_deadline_msec(command_struct.def.timeout_msec);
+    } else {
+        command_buffer.clear_deadline_msec();
+    }
     command_buffer.clear_int_args();
     command_buffer.clear_float_args();
     command_buffer.clear_string_args();
@@ -376,70 +748,453 @@ void write_command_struct_to_buffer(LowLevelCommand command_struct,
     }
 }
 
+bool RunControl::dispatch_command(std::queue<LowLevelCommand> &queue)
+{
+    // Run control commands are performed here rather than sent
+    if (queue.front().def.device == SERVER) {
+        perform_run_control_command(queue.front());
+        queue.pop();
+        return false;
+    }
+
+    // Set as outgoing message for next synchronization, which follows
+    // directly, stamped with the time for the device to echo
+    if (queue.front().def.device == PI) {
+        write_command_struct_to_buffer(queue.front(), backplane_command);
+        backplane_command.set_server_time_usec(unix_time_usec());
+        backplane_command.SerializeToString(&outgoing_message);
+        pi_send_time = std::chrono::steady_clock::now();
+    } else if (queue.front().def.device == TM) {
+        write_command_struct_to_buffer(queue.front(), target_command);
+        target_command.set_server_time_usec(unix_time_usec());
+        target_command.SerializeToString(&outgoing_message);
+    }
+    outgoing_message_device = queue.front().def.device;
+
+    // Move the command to active commands vector
+    queue.front().time_sent = std::chrono::steady_clock::now();
+    active_commands.push_back(queue.front());
+    queue.pop();
+    return true;
+}
+
+void RunControl::perform_run_control_command(const LowLevelCommand &command)
+{
+    switch (command.def.code) {
+        case RC_CANCEL_PENDING_COMMANDS:
+            std::cout << "Cancelling " << command_queue.size()
+                << " pending commands and " << running_sequences.size()
+                << " sequences." << std::endl;
+            command_queue = std::queue<LowLevelCommand>();
+            retry_queue = std::queue<LowLevelCommand>();
+            running_sequences.clear();
+            command_queue_hold_until = std::chrono::steady_clock::time_point();
+            // Polling carries on
+            poll_queue = std::queue<LowLevelCommand>();
+            for (auto it = polls.begin(); it != polls.end(); ++it) {
+                it->outstanding = false;
+            }
+            break;
+        case RC_SLEEP:
+            // Hold back the following commands without blocking the server
+            command_queue_hold_until = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(command.int_args[0]);
+            break;
+        default:
+            std::cerr << "Error: run control command "
+                << command.def.command_name << " not recognized"
+                << std::endl;
+            break;
+    }
+}
+
+bool RunControl::advance_sequence(SequenceRun &run)
+{
+    const HighLevelCommand &sequence =
+        run.table->high_level_commands[run.index];
+    bool commands_pending = (!command_queue.empty()
+            || !emergency_queue.empty() || !retry_queue.empty()
+            || !active_commands.empty()
+            || (std::chrono::steady_clock::now() < command_queue_hold_until));
+    std::vector<LowLevelCommand> emitted;
+    SequenceStatus status = run_sequence(sequence, run.state,
+            readback_values, commands_pending, emitted);
+    // Queue the commands emitted before any wait, so that the conditional
+    // waited at tests their results
+    for (auto it = emitted.begin(); it != emitted.end(); ++it) {
+        it->time_received = run.time_received;
+        if (it->priority == EMERGENCY_PRIORITY) {
+            emergency_queue.push(*it);
+        } else {
+            command_queue.push(*it);
+        }
+    }
+    if (status == SEQUENCE_ERROR) {
+        std::cerr << "Error: sequence " << sequence.command_name
+            << " stopped" << std::endl;
+    }
+    return (status != SEQUENCE_WAITING);
+}
+
+void RunControl::run_sequences()
+{
+    while (!running_sequences.empty()
+            && advance_sequence(running_sequences.front())) {
+        running_sequences.pop_front();
+    }
+}
+
 void RunControl::send_next_command()
 {
-    // If no commands to perform, nothing to do
-    if (command_queue.empty()) {
+    // Emergency commands bypass both the queue and the priority checks
+    // Run control commands don't occupy the network, so keep going after them
+    while (!emergency_queue.empty()) {
+        if (dispatch_command(emergency_queue)) {
+            return;
+        }
+    }
+
+    // Commands sent again were sent before anything still queued, and
+    // before any sleep started
+    while (!retry_queue.empty() && !command_blocked(retry_queue.front())) {
+        if (dispatch_command(retry_queue)) {
+            return;
+        }
+    }
+    if (!retry_queue.empty()) {
         return;
     }
 
-    // If any active commands have a priority overriding the next one, don't 
-    // send anything
+    while (!command_queue.empty()) {
+        // Wait out any sleep
+        if (std::chrono::steady_clock::now() < command_queue_hold_until) {
+            return;
+        }
+        // If any active commands have a priority overriding the next one,
+        // don't send anything
+        if (command_blocked(command_queue.front())) {
+            return;
+        }
+
+        // OK to send command
+        if (dispatch_command(command_queue)) {
+            return;
+        }
+    }
+
+    // Polls go at lowest priority, once no other commands are waiting
+    if (!poll_queue.empty() && !command_blocked(poll_queue.front())) {
+        dispatch_command(poll_queue);
+    }
+}
+
+void RunControl::probe_clocks()
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now - clock_report_time >=
+            std::chrono::seconds(CLOCK_REPORT_INTERVAL_SEC)) {
+        report_clocks();
+    }
+    if (!outgoing_message.empty() || (now - pi_send_time <
+                std::chrono::seconds(CLOCK_PROBE_INTERVAL_SEC))) {
+        return;
+    }
+    bool pi_connected = false;
+    for (auto it = netinfo.connections.begin();
+            it != netinfo.connections.end(); ++it) {
+        pi_connected = pi_connected || (it->device == PI);
+    }
+    if (!pi_connected) {
+        return;
+    }
+    slow_control::LowLevelCommand probe;
+    probe.set_server_time_usec(unix_time_usec());
+    probe.SerializeToString(&outgoing_message);
+    outgoing_message_device = PI;
+    pi_send_time = now;
+}
+
+void RunControl::report_clocks()
+{
+    clock_report_time = std::chrono::steady_clock::now();
+    const ClockOffsetEstimator *clocks[2] = {&pi_clock, &tm_clock};
+    const char *names[2] = {"Pi", "TM"};
+    for (int i = 0; i < 2; i++) {
+        if (clocks[i]->estimated()) {
+            std::cout << names[i] << " clock behind the server's by "
+                << clocks[i]->unix_offset_usec() << " us, to within "
+                << clocks[i]->error_usec() << " us" << std::endl;
+        }
+    }
+    for (int backplane = 0; backplane < MAX_BACKPLANES; backplane++) {
+        std::ostringstream report;
+        if (backplane_nstimers[backplane].report(report)) {
+            std::cout << "Backplane " << backplane << " nsTimer, on the "
+                << "server's clock:" << std::endl << report.str();
+        }
+    }
+}
+
+int64_t RunControl::pi_reading_time(int64_t pi_unix_usec,
+        int64_t pi_monotonic_usec) const
+{
+    if (pi_unix_usec == 0) {
+        return receive_usec;
+    }
+    return pi_clock.to_server_time(pi_unix_usec, pi_monotonic_usec);
+}
+
+bool RunControl::command_blocked(const LowLevelCommand &command)
+{
     for (auto it = active_commands.begin(); it != active_commands.end();
             ++it) {
-        // priority level 1: block new commands from same device
-        // priority level 2: block new commands from any device
-        if ((it->priority == 2)
-                || ((it->def.device == command_queue.front().def.device)
+        // priority level 1: block new commands from same device (each
+        // backplane of the Pi counting as one)
+        // priority level 2 (or emergency): block new commands from any
+        // device
+        if ((it->priority >= 2)
+                || ((it->def.device == command.def.device)
+                    && (it->backplane == command.backplane)
                     && (it->priority == 1))) {
-            return;
+            return true;
         }
     }
+    return false;
+}
 
-    // OK to send command. Set as outgoing message for next synchronization
-    if (command_queue.front().def.device == PI) {
-        write_command_struct_to_buffer(command_queue.front(),
-                backplane_command);
-        backplane_command.SerializeToString(&outgoing_message);
-    } else if (command_queue.front().def.device == TM) {
-        write_command_struct_to_buffer(command_queue.front(),
-                target_command);
-        target_command.SerializeToString(&outgoing_message);
+void RunControl::reset_polls()
+{
+    polls.clear();
+    poll_queue = std::queue<LowLevelCommand>();
+    auto now = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < command_table->polls.size(); i++) {
+        const PollDefinition &def = command_table->polls[i];
+        PollState poll;
+        poll.command.def = command_table->command_definitions[def.definition];
+        poll.command.poll = i;
+        poll.command.backplane = def.backplane;
+        poll.period_msec = def.period_msec;
+        poll.backoff = 1;
+        poll.outstanding = false;
+        poll.next_due = now;
+        poll.n_confirmed = 0;
+        poll.n_deferred = 0;
+        poll.n_timed_out = 0;
+        poll.total_duration_usec = 0;
+        polls.push_back(poll);
     }
-    outgoing_message_device = command_queue.front().def.device;
+    poll_report_time = now;
+}
 
-    // Move the command to active commands vector
-    active_commands.push_back(command_queue.front());
-    command_queue.pop();
+bool RunControl::device_busy(int device)
+{
+    if (!emergency_queue.empty() || !command_queue.empty()
+            || !retry_queue.empty() || !running_sequences.empty()
+            || (std::chrono::steady_clock::now() < command_queue_hold_until)) {
+        return true;
+    }
+    for (auto it = active_commands.begin(); it != active_commands.end();
+            ++it) {
+        if ((it->def.device == device) && (it->poll < 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RunControl::schedule_polls()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = polls.begin(); it != polls.end(); ++it) {
+        if (now < it->next_due) {
+            continue;
+        }
+        std::chrono::milliseconds period(it->period_msec);
+        if (it->outstanding || device_busy(it->command.def.device)) {
+            // Poll less often while the device is busy or slow to answer
+            it->backoff = std::min(it->backoff * 2, MAX_POLL_BACKOFF);
+            it->n_deferred++;
+            it->next_due = now + period * it->backoff;
+            continue;
+        }
+        poll_queue.push(it->command);
+        it->outstanding = true;
+        it->backoff = std::max(it->backoff / 2, 1);
+        // Keep to the schedule, unless too far behind to catch up
+        it->next_due += period * it->backoff;
+        if (it->next_due < now) {
+            it->next_due = now + period * it->backoff;
+        }
+    }
+    if (now - poll_report_time >=
+            std::chrono::seconds(POLL_REPORT_INTERVAL_SEC)) {
+        report_poll_rates();
+    }
+}
+
+void RunControl::report_poll_rates()
+{
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(
+            now - poll_report_time).count();
+    poll_report_time = now;
+    if (polls.empty() || (elapsed <= 0)) {
+        return;
+    }
+    std::cout << "Polling rates over the last " << elapsed << " s:"
+        << std::endl;
+    for (auto it = polls.begin(); it != polls.end(); ++it) {
+        std::cout << "  " << it->command.def.command_name << ": "
+            << it->n_confirmed / elapsed << " Hz achieved, "
+            << 1000.0 / it->period_msec << " Hz target";
+        if (it->n_deferred) {
+            std::cout << " (deferred " << it->n_deferred
+                << " times while busy)";
+        }
+        if (it->n_timed_out) {
+            std::cout << " (" << it->n_timed_out << " timed out)";
+        }
+        if (it->n_confirmed && it->total_duration_usec) {
+            std::cout << ", " << 0.001 * it->total_duration_usec /
+                it->n_confirmed << " ms per read";
+        }
+        std::cout << std::endl;
+        it->n_confirmed = 0;
+        it->n_deferred = 0;
+        it->n_timed_out = 0;
+        it->total_duration_usec = 0;
+    }
+}
+
+void RunControl::expire_active_commands()
+{
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = active_commands.begin(); it != active_commands.end(); ) {
+        if (now - it->time_sent <
+                std::chrono::milliseconds(it->def.timeout_msec)) {
+            ++it;
+            continue;
+        }
+        LowLevelCommand expired = *it;
+        it = active_commands.erase(it);
+        // Polls are sent again on schedule, if still polled since a reload
+        int poll = expired.poll;
+        if (poll >= 0) {
+            if (((std::size_t)poll < polls.size())
+                    && (polls[poll].command.def == expired.def)) {
+                polls[poll].outstanding = false;
+                polls[poll].n_timed_out++;
+            }
+            continue;
+        }
+        std::cerr << "Warning: " << expired.def.command_name;
+        if (expired.def.device == PI) {
+            std::cerr << " for backplane " << expired.backplane;
+        }
+        std::cerr << " not confirmed within " << expired.def.timeout_msec
+            << " ms";
+        if (expired.n_retries < expired.def.max_retries) {
+            expired.n_retries++;
+            std::cerr << ", sending again (retry " << expired.n_retries
+                << " of " << expired.def.max_retries << ")" << std::endl;
+            if (expired.priority == EMERGENCY_PRIORITY) {
+                emergency_queue.push(expired);
+            } else {
+                retry_queue.push(expired);
+            }
+        } else {
+            std::cerr << ", given up" << std::endl;
+        }
+    }
+}
+
+// Log a reading in the main table, at the given time on the server's clock
+// and on the device's own
+// Return the id of the reading, for logging its values in the other tables
+int log_reading(sql::Connection *con, sql::Statement *stmt,
+        std::string command_name, int backplane, int64_t time_usec,
+        int64_t device_time_usec)
+{
+    sql::PreparedStatement *pstmt;
+    pstmt = con->prepareStatement("INSERT INTO main(command, backplane,\
+            time_usec, device_time_usec) VALUES (?, ?, ?, ?)");
+    pstmt->setString(1, command_name);
+    pstmt->setInt(2, backplane);
+    pstmt->setInt64(3, time_usec);
+    pstmt->setInt64(4, device_time_usec);
+    pstmt->execute();
+    delete pstmt;
+    sql::ResultSet *res = stmt->executeQuery(
+            "SELECT LAST_INSERT_ID() AS 'id'");
+    res->next();
+    int id = res->getInt("id");
+    delete res;
+    return id;
+}
+
+// Log the time, trigger counters, voltages, and currents of a housekeeping
+// sample as the reading with the given id in the main table
+void log_sample(sql::Connection *con, int id,
+        const slow_control::HousekeepingSample &sample)
+{
+    sql::PreparedStatement *pstmt;
+    pstmt = con->prepareStatement("INSERT INTO sample(id, time_usec,\
+            nstimer, tack_count, trigger_count) VALUES (?, ?, ?, ?, ?)");
+    pstmt->setInt(1, id);
+    pstmt->setInt64(2, sample.time_usec());
+    pstmt->setUInt64(3, sample.nstimer());
+    pstmt->setUInt(4, sample.tack_count());
+    pstmt->setUInt(5, sample.trigger_count());
+    pstmt->executeUpdate();
+    delete pstmt;
+
+    pstmt = con->prepareStatement("INSERT INTO fee_voltage(id,\
+            fee_index, voltage) VALUES (?, ?, ?)");
+    for (int fee_index = 0; fee_index < sample.voltage_size(); fee_index++) {
+        pstmt->setInt(1, id);
+        pstmt->setInt(2, fee_index);
+        pstmt->setDouble(3, sample.voltage(fee_index));
+        pstmt->executeUpdate();
+    }
+    delete pstmt;
+    pstmt = con->prepareStatement("INSERT INTO fee_current(id,\
+            fee_index, current) VALUES (?, ?, ?)");
+    for (int fee_index = 0; fee_index < sample.current_size(); fee_index++) {
+        pstmt->setInt(1, id);
+        pstmt->setInt(2, fee_index);
+        pstmt->setDouble(3, sample.current(fee_index));
+        pstmt->executeUpdate();
+    }
+    delete pstmt;
 }
 
 // Log backplane variables from the pi
 void RunControl::log_backplane_variables()
 {
+    int command_code = backplane_variables.command().code();
+    std::string command_name = backplane_command_name(command_code);
     try {    
         sql::Driver *driver;
         sql::Connection *con;
         sql::Statement *stmt;
         sql::PreparedStatement *pstmt;
-        sql::ResultSet *res;
    
         // Connect to database
         driver = get_driver_instance();
         con = driver->connect(db_host, db_username, db_password);
         stmt = con->createStatement();
         stmt->execute("USE test");
+        // Log everything of the result together, so that a reading is in
+        // the tables whole or not at all
+        con->setAutoCommit(false);
   
-        // Log command name
-        pstmt = con->prepareStatement("INSERT INTO main(command) VALUES (?)");
-        pstmt->setString(1, backplane_variables.command().command_name());
-        pstmt->execute();
-        delete pstmt;
-
-        // Get id for synchronizing tables
-        res = stmt->executeQuery("SELECT LAST_INSERT_ID() AS 'id'");
-        res->next();
-        int id = res->getInt("id");
-        delete res;
+        // Log command name, and the time it reached the SPI bus, getting
+        // the id for synchronizing tables
+        int id = log_reading(con, stmt, command_name,
+                backplane_variables.backplane(),
+                pi_reading_time(backplane_variables.time_usec(),
+                    backplane_variables.monotonic_usec()),
+                backplane_variables.time_usec());
         delete stmt;
         
         // Log SPI data
@@ -454,71 +1209,369 @@ void RunControl::log_backplane_variables()
                 pstmt->setInt(2, spi_index);
                 pstmt->setInt(3, spi_message_index);
                 pstmt->setInt(4,
-                        backplane_variables.spi_command(spi_message_index *
-                            SPI_MESSAGE_LENGTH + spi_index));
-                pstmt->setInt(5, 
-                        backplane_variables.spi_data(spi_message_index *
-                            SPI_MESSAGE_LENGTH + spi_index));
+                        packed_word(backplane_variables.spi_command(),
+                            spi_message_index * SPI_MESSAGE_LENGTH
+                            + spi_index));
+                pstmt->setInt(5,
+                        packed_word(backplane_variables.spi_data(),
+                            spi_message_index * SPI_MESSAGE_LENGTH
+                            + spi_index));
                 pstmt->executeUpdate();
             }
         }
         delete pstmt;
         
         // Log additional data if required by command
-        if (backplane_variables.command().command_name() ==
-                "read_module_voltages") {
+        // Readings from an interrupted command are incomplete, and those of
+        // messages whose replies failed their checks can't be trusted, so
+        // skip them
+        // Housekeeping reads log both voltages and currents, and oversampled
+        // reads their spread too; reading all housekeeping logs presence and
+        // its snapshot as a sample
+        // An interrupted oversampled read still has the statistics of the
+        // conversions it completed
+        bool failed = (backplane_variables.spi_messages_failed() > 0);
+        bool oversampled =
+            (command_code == BP_READ_MODULE_HOUSEKEEPING_OVERSAMPLED);
+        bool partial = oversampled && backplane_variables.interrupted()
+            && (backplane_variables.n_conversions() > 0) && !failed;
+        bool reading_unreliable =
+            (backplane_variables.interrupted() && !partial) || failed;
+        bool housekeeping = (command_code == BP_READ_MODULE_HOUSEKEEPING)
+            || oversampled;
+        if (backplane_variables.timed_out()) {
+            std::cout << "Warning: " << command_name
+                << " overran its deadline on the Pi";
+            if (partial) {
+                std::cout << " and was cut short after "
+                    << backplane_variables.n_conversions() << " conversions";
+            } else if (backplane_variables.interrupted()) {
+                std::cout << " and was cut short, readings not logged";
+            }
+            std::cout << '.' << std::endl;
+        } else if (partial) {
+            std::cout << command_name << " was interrupted after "
+                << backplane_variables.n_conversions() << " conversions."
+                << std::endl;
+        } else if (backplane_variables.interrupted()) {
+            std::cout << command_name
+                << " was interrupted, readings not logged." << std::endl;
+        } else if (reading_unreliable) {
+            std::cout << "Warning: " << command_name << " had "
+                << backplane_variables.spi_messages_failed()
+                << " SPI messages fail their checks, readings not logged."
+                << std::endl;
+        }
+        if (!reading_unreliable && (housekeeping
+                    || (command_code == BP_READ_MODULE_VOLTAGES))) {
             // Log FEE voltages
             pstmt = con->prepareStatement("INSERT INTO fee_voltage(id,\
                     fee_index, voltage) VALUES (?, ?, ?)");
-            for (int fee_index = 0; fee_index < NUM_FEES; fee_index++) {
+            for (int fee_index = 0; fee_index <
+                    backplane_variables.voltage_size(); fee_index++) {
                 pstmt->setInt(1, id);
                 pstmt->setInt(2, fee_index);
                 pstmt->setDouble(3, backplane_variables.voltage(fee_index));
                 pstmt->executeUpdate();
             }
             delete pstmt;
-        } else if (backplane_variables.command().command_name() ==
-                "read_module_currents") {
+        }
+        if (reading_unreliable) {
+            // Nothing more to log
+        } else if (housekeeping || (command_code == BP_READ_MODULE_CURRENTS)) {
             // Log FEE currents
             pstmt = con->prepareStatement("INSERT INTO fee_current(id,\
                   fee_index, current) VALUES (?, ?, ?)");
-            for (int fee_index = 0; fee_index < NUM_FEES; fee_index++) {
+            for (int fee_index = 0; fee_index <
+                    backplane_variables.current_size(); fee_index++) {
                 pstmt->setInt(1, id);
                 pstmt->setInt(2, fee_index);
                 pstmt->setDouble(3, backplane_variables.current(fee_index));
                 pstmt->executeUpdate();
             }
             delete pstmt;
-        } else if (backplane_variables.command().command_name() ==
-                "read_modules_present") {
+            if (oversampled) {
+                // Log the spread of each module's readings
+                const slow_control::ReadingSpread &voltage =
+                    backplane_variables.voltage_spread();
+                const slow_control::ReadingSpread &current =
+                    backplane_variables.current_spread();
+                pstmt = con->prepareStatement("INSERT INTO fee_spread(id,\
+                        fee_index, n_conversions, voltage_min, voltage_max,\
+                        voltage_std, current_min, current_max, current_std)\
+                        VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)");
+                for (int fee_index = 0; (fee_index < voltage.std_size())
+                        && (fee_index < current.std_size()); fee_index++) {
+                    pstmt->setInt(1, id);
+                    pstmt->setInt(2, fee_index);
+                    pstmt->setUInt(3, backplane_variables.n_conversions());
+                    pstmt->setDouble(4, voltage.min(fee_index));
+                    pstmt->setDouble(5, voltage.max(fee_index));
+                    pstmt->setDouble(6, voltage.std(fee_index));
+                    pstmt->setDouble(7, current.min(fee_index));
+                    pstmt->setDouble(8, current.max(fee_index));
+                    pstmt->setDouble(9, current.std(fee_index));
+                    pstmt->executeUpdate();
+                }
+                delete pstmt;
+            }
+        } else if ((command_code == BP_READ_MODULES_PRESENT)
+                || (command_code == BP_READ_ALL_HOUSEKEEPING)) {
             // Log modules present
             pstmt = con->prepareStatement("INSERT INTO fee_present(id,\
                     fee_index, present) VALUES (?, ?, ?)");
             for (int fee_index = 0; fee_index < NUM_FEES; fee_index++) {
                 pstmt->setInt(1, id);
                 pstmt->setInt(2, fee_index);
-                pstmt->setInt(3, backplane_variables.present(fee_index));
+                pstmt->setInt(3,
+                        mask_flag(backplane_variables.present(), fee_index));
                 pstmt->executeUpdate();
             }
             delete pstmt;
-        } else if ((backplane_variables.command().command_name() ==
-                    "set_trigger_mask_from_file")
-                || (backplane_variables.command().command_name() ==
-                    "close_trigger_mask")) {
+            if (backplane_variables.has_snapshot()) {
+                log_sample(con, id, backplane_variables.snapshot());
+            }
+        } else if ((command_code == BP_SET_TRIGGER_MASK)
+                || (command_code == BP_SET_MODULE_TRIGGER_MASK)) {
             // Log trigger mask
             pstmt = con->prepareStatement("INSERT INTO trigger_mask(id,\
                     fee_index, mask) VALUES (?, ?, ?)");
             for (int fee_index = 0; fee_index < NUM_FEES; fee_index++) {
                 pstmt->setInt(1, id);
                 pstmt->setInt(2, fee_index);
-                pstmt->setInt(3, backplane_variables.trigger_mask(fee_index));
+                pstmt->setInt(3,
+                        packed_word(backplane_variables.trigger_mask(),
+                            fee_index));
+                pstmt->executeUpdate();
+            }
+            delete pstmt;
+        } else if (command_code == BP_READ_SPI_JOURNAL) {
+            // Log the journal, and show the messages whose replies failed
+            // their checks
+            pstmt = con->prepareStatement("INSERT INTO spi_journal(id,\
+                    sequence, start_nsec, duration_nsec, command_word,\
+                    source, command_code, checks_passed, backplane) \
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)");
+            int n_failed = 0;
+            for (int i = 0; i < backplane_variables.spi_journal_size(); i++) {
+                const slow_control::SpiJournalEntry &entry =
+                    backplane_variables.spi_journal(i);
+                pstmt->setInt(1, id);
+                pstmt->setUInt64(2, entry.sequence());
+                pstmt->setUInt64(3, entry.start_nsec());
+                pstmt->setUInt(4, entry.duration_nsec());
+                pstmt->setUInt(5, entry.command_word());
+                pstmt->setString(6, spi_journal_source_name(entry.source()));
+                pstmt->setString(7,
+                        backplane_command_name(entry.command_code()));
+                pstmt->setUInt(8, entry.checks_passed());
+                pstmt->setUInt(9, entry.backplane());
+                pstmt->executeUpdate();
+                if (entry.checks_passed() != SPI_CHECK_ALL) {
+                    n_failed++;
+                    std::cout << "SPI message " << entry.sequence()
+                        << " to backplane " << entry.backplane()
+                        << " (command word 0x" << std::hex
+                        << entry.command_word() << ", checks passed 0x"
+                        << entry.checks_passed() << std::dec << ") from "
+                        << spi_journal_source_name(entry.source()) << ' '
+                        << backplane_command_name(entry.command_code())
+                        << " took " << entry.duration_nsec() << " ns"
+                        << std::endl;
+                }
+            }
+            delete pstmt;
+            std::cout << backplane_variables.spi_journal_size()
+                << " SPI messages journaled, " << n_failed
+                << " failing checks." << std::endl;
+        }
+        con->commit();
+        delete con;
+        std::cout << command_name << " logged." << std::endl;
+    } catch (sql::SQLException &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cerr << "MySQL error code: " << e.getErrorCode();
+        std::cerr << ", SQLState: " << e.getSQLState() << std::endl;
+    }
+}
+
+void RunControl::log_housekeeping_samples()
+{
+    if (backplane_variables.samples_dropped() > 0) {
+        std::cerr << "Warning: the pi dropped "
+            << backplane_variables.samples_dropped()
+            << " housekeeping samples while its buffer was full" << std::endl;
+    }
+    if (backplane_variables.samples_size() == 0) {
+        return;
+    }
+    try {
+        sql::Driver *driver;
+        sql::Connection *con;
+        sql::Statement *stmt;
+
+        // Connect to database
+        driver = get_driver_instance();
+        con = driver->connect(db_host, db_username, db_password);
+        stmt = con->createStatement();
+        stmt->execute("USE test");
+
+        for (int i = 0; i < backplane_variables.samples_size(); i++) {
+            const slow_control::HousekeepingSample &sample =
+                backplane_variables.samples(i);
+
+            // Log each sample as a reading of its own
+            int id = log_reading(con, stmt, "housekeeping_sample",
+                    backplane_variables.backplane(),
+                    pi_reading_time(sample.time_usec()), sample.time_usec());
+            log_sample(con, id, sample);
+        }
+        delete stmt;
+        delete con;
+        std::cout << backplane_variables.samples_size()
+            << " housekeeping samples logged." << std::endl;
+    } catch (sql::SQLException &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cerr << "MySQL error code: " << e.getErrorCode();
+        std::cerr << ", SQLState: " << e.getSQLState() << std::endl;
+    }
+}
+
+void RunControl::log_trigger_rates()
+{
+    if (backplane_variables.trigger_rates_dropped() > 0) {
+        std::cerr << "Warning: the pi dropped "
+            << backplane_variables.trigger_rates_dropped()
+            << " trigger rate records while its buffer was full" << std::endl;
+    }
+    int n_records = backplane_variables.trigger_rates_size();
+    if (n_records == 0) {
+        return;
+    }
+    // Show the latest rates as they arrive
+    const slow_control::TriggerRates &latest =
+        backplane_variables.trigger_rates(n_records - 1);
+    std::cout << "Trigger rate " << latest.trigger().mean_hz() << " Hz ("
+        << latest.trigger().smoothed_hz() << " Hz smoothed), TACK rate "
+        << latest.tack().mean_hz() << " Hz (" << latest.tack().smoothed_hz()
+        << " Hz smoothed)" << std::endl;
+    try {
+        sql::Driver *driver;
+        sql::Connection *con;
+        sql::Statement *stmt;
+        sql::PreparedStatement *pstmt;
+
+        // Connect to database
+        driver = get_driver_instance();
+        con = driver->connect(db_host, db_username, db_password);
+        stmt = con->createStatement();
+        stmt->execute("USE test");
+
+        for (int i = 0; i < n_records; i++) {
+            const slow_control::TriggerRates &record =
+                backplane_variables.trigger_rates(i);
+
+            // Log each record as a reading of its own
+            int id = log_reading(con, stmt, "trigger_rates",
+                    backplane_variables.backplane(),
+                    pi_reading_time(record.time_usec()), record.time_usec());
+
+            // Log the rates of the trigger and TACK counters, one row each
+            pstmt = con->prepareStatement("INSERT INTO trigger_rate(id,\
+                    counter, time_usec, window_nsec, n_intervals, count,\
+                    mean_hz, min_hz, max_hz, smoothed_hz) \
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+            const slow_control::CounterRates *rates[2] = {&record.trigger(),
+                &record.tack()};
+            const char *counters[2] = {"trigger", "tack"};
+            for (int j = 0; j < 2; j++) {
+                pstmt->setInt(1, id);
+                pstmt->setString(2, counters[j]);
+                pstmt->setInt64(3, record.time_usec());
+                pstmt->setUInt64(4, record.window_nsec());
+                pstmt->setUInt(5, record.n_intervals());
+                pstmt->setUInt(6, rates[j]->count());
+                pstmt->setDouble(7, rates[j]->mean_hz());
+                pstmt->setDouble(8, rates[j]->min_hz());
+                pstmt->setDouble(9, rates[j]->max_hz());
+                pstmt->setDouble(10, rates[j]->smoothed_hz());
                 pstmt->executeUpdate();
             }
             delete pstmt;
         }
+        delete stmt;
+        delete con;
+        std::cout << n_records << " trigger rate records logged."
+            << std::endl;
+    } catch (sql::SQLException &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cerr << "MySQL error code: " << e.getErrorCode();
+        std::cerr << ", SQLState: " << e.getSQLState() << std::endl;
+    }
+}
+
+void RunControl::report_hit_rates()
+{
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(
+            now - hit_rate_report_time).count();
+    hit_rate_report_time = now;
+    for (int backplane = 0; backplane < MAX_BACKPLANES; backplane++) {
+        report_hit_rates(backplane, elapsed);
+    }
+}
+
+void RunControl::report_hit_rates(int backplane, double elapsed)
+{
+    HitRateAccumulator &hit_rates = backplane_hit_rates[backplane];
+    std::ostringstream report;
+    if (!hit_rates.report(report)) {
+        return;
+    }
+    std::cout << "Hit patterns";
+    if (backplane > 0) {
+        std::cout << " on backplane " << backplane;
+    }
+    std::cout << " over the last " << elapsed << " s:" << std::endl
+        << report.str();
+    float rates[NUM_HIT_PIXELS];
+    if (!hit_rates.pixel_rates(rates)) {
+        hit_rates.clear();
+        return;
+    }
+    hit_rates.clear();
+    try {
+        sql::Driver *driver;
+        sql::Connection *con;
+        sql::Statement *stmt;
+        sql::PreparedStatement *pstmt;
+
+        // Connect to database
+        driver = get_driver_instance();
+        con = driver->connect(db_host, db_username, db_password);
+        stmt = con->createStatement();
+        stmt->execute("USE test");
+
+        // The rates are worked out here, so are timed by the server alone
+        int64_t time_usec = unix_time_usec();
+        int id = log_reading(con, stmt, "hit_rates", backplane, time_usec,
+                time_usec);
+        delete stmt;
+
+        // Log pixels hit, by number (16 * module + pixel)
+        pstmt = con->prepareStatement("INSERT INTO hit_rate(id, pixel, rate)\
+                VALUES (?, ?, ?)");
+        for (int pixel = 0; pixel < NUM_HIT_PIXELS; pixel++) {
+            if (rates[pixel] == 0) {
+                continue;
+            }
+            pstmt->setInt(1, id);
+            pstmt->setInt(2, pixel);
+            pstmt->setDouble(3, rates[pixel]);
+            pstmt->executeUpdate();
+        }
+        delete pstmt;
         delete con;
-        std::cout << backplane_variables.command().command_name()
-            << " logged." << std::endl;
     } catch (sql::SQLException &e) {
         std::cerr << "Error: " << e.what() << std::endl;
         std::cerr << "MySQL error code: " << e.getErrorCode();
@@ -538,6 +1591,83 @@ void RunControl::log_interface_command()
     return;
 }
 
+// Report the time from receiving an emergency command from the interface to
+// receiving confirmation that it was performed
+void report_emergency_latency(const LowLevelCommand &command)
+{
+    auto latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - command.time_received);
+    std::cout << "Emergency command " << command.def.command_name
+        << " confirmed after " << latency.count() << " ms." << std::endl;
+    if (latency.count() > EMERGENCY_LATENCY_LIMIT_MSEC) {
+        std::cerr << "Warning: emergency command latency exceeded "
+            << EMERGENCY_LATENCY_LIMIT_MSEC << " ms" << std::endl;
+    }
+}
+
+// Store the voltages and currents of a sample as those of the first n_fees
+// modules, if it has them
+void copy_sample_readings(const slow_control::HousekeepingSample &sample,
+        int n_fees, float voltage[], float current[])
+{
+    for (int i = 0; (i < sample.voltage_size()) && (i < n_fees); i++) {
+        voltage[i] = sample.voltage(i);
+    }
+    for (int i = 0; (i < sample.current_size()) && (i < n_fees); i++) {
+        current[i] = sample.current(i);
+    }
+}
+
+// Store the readings in backplane variables from the pi, unless interrupted
+// or any of their messages failed their checks, as those of the modules of
+// their backplane
+void update_readback_values(
+        const slow_control::BackplaneVariables &variables,
+        ReadbackValues &readback)
+{
+    const int fees_per_backplane = NUM_READBACK_FEES / MAX_BACKPLANES;
+    if (variables.backplane() >= (uint32_t)MAX_BACKPLANES) {
+        return;
+    }
+    int first = fees_per_backplane * variables.backplane();
+    float *present = readback.present + first;
+    float *voltage = readback.voltage + first;
+    float *current = readback.current + first;
+    // The latest sample holds the latest voltages and currents
+    if (variables.samples_size() > 0) {
+        copy_sample_readings(variables.samples(variables.samples_size() - 1),
+                fees_per_backplane, voltage, current);
+    }
+    if (!variables.has_command() || variables.interrupted()
+            || (variables.spi_messages_failed() > 0)) {
+        return;
+    }
+    int command_code = variables.command().code();
+    if ((command_code == BP_READ_MODULES_PRESENT)
+            || (command_code == BP_READ_ALL_HOUSEKEEPING)) {
+        for (int i = 0; i < fees_per_backplane; i++) {
+            present[i] = mask_flag(variables.present(), i);
+        }
+        copy_sample_readings(variables.snapshot(), fees_per_backplane,
+                voltage, current);
+        return;
+    }
+    bool housekeeping = (command_code == BP_READ_MODULE_HOUSEKEEPING)
+        || (command_code == BP_READ_MODULE_HOUSEKEEPING_OVERSAMPLED);
+    if (housekeeping || (command_code == BP_READ_MODULE_VOLTAGES)) {
+        for (int i = 0; (i < variables.voltage_size())
+                && (i < fees_per_backplane); i++) {
+            voltage[i] = variables.voltage(i);
+        }
+    }
+    if (housekeeping || (command_code == BP_READ_MODULE_CURRENTS)) {
+        for (int i = 0; (i < variables.current_size())
+                && (i < fees_per_backplane); i++) {
+            current[i] = variables.current(i);
+        }
+    }
+}
+
 void RunControl::process_received_messages()
 {
     for (auto it = received_messages.begin();
@@ -546,18 +1676,26 @@ void RunControl::process_received_messages()
         it = received_messages.erase(it);
         // If GUI, break down high level command into low level components
         if (device == GUI) {
-            // Add the low level commands for the received high level
-            // command to queue (if there's a matching entry)
-            for (auto hl_cmd_it = high_level_commands.begin();
-                    hl_cmd_it != high_level_commands.end(); ++hl_cmd_it) {
-                if (run_settings.high_level_command() == 
-                        hl_cmd_it->command_name) {
-                    for (auto ll_cmd_it = hl_cmd_it->commands.begin();
-                            ll_cmd_it != hl_cmd_it->commands.end();
-                            ++ll_cmd_it) {
-                        command_queue.push(*ll_cmd_it);
+            // Start the sequence for the received high level command (if
+            // there's a matching entry), with the parameters given
+            // Sequences with emergency commands are run straight away, and
+            // their emergency commands go to their own queue
+            auto hl_index_it = command_table->high_level_command_index.find(
+                    run_settings.high_level_command());
+            if (hl_index_it != command_table->high_level_command_index.end()) {
+                SequenceRun run;
+                run.table = command_table;
+                run.index = hl_index_it->second;
+                run.time_received = std::chrono::steady_clock::now();
+                const HighLevelCommand &hl_cmd =
+                    command_table->high_level_commands[run.index];
+                if (start_sequence(hl_cmd,
+                            run_settings.high_level_parameter(), run.state)) {
+                    if (!hl_cmd.emergency) {
+                        running_sequences.push_back(run);
+                    } else if (!advance_sequence(run)) {
+                        running_sequences.push_front(run);
                     }
-                    break;
                 }
             }
             // Log high level commands from the interface
@@ -565,6 +1703,47 @@ void RunControl::process_received_messages()
             continue;
         }
         // Since not GUI, it's a client
+        // Relate each backplane's nsTimer to the server's clock, through the
+        // times of the samples and snapshots read with it
+        if ((device == PI) && (backplane_variables.backplane() <
+                    (uint32_t)MAX_BACKPLANES)) {
+            NsTimerCorrelation &nstimer =
+                backplane_nstimers[backplane_variables.backplane()];
+            for (int i = 0; i < backplane_variables.samples_size(); i++) {
+                const slow_control::HousekeepingSample &sample =
+                    backplane_variables.samples(i);
+                nstimer.add(pi_reading_time(sample.time_usec()),
+                        sample.nstimer());
+            }
+            if (backplane_variables.has_snapshot()) {
+                nstimer.add(pi_reading_time(
+                            backplane_variables.snapshot().time_usec()),
+                        backplane_variables.snapshot().nstimer());
+            }
+        }
+        // Samples from the pi may come on their own, without a command
+        if ((device == PI) && ((backplane_variables.samples_size() > 0)
+                    || backplane_variables.has_samples_dropped())) {
+            update_readback_values(backplane_variables, readback_values);
+            log_housekeeping_samples();
+        }
+        // As may trigger rate records
+        if ((device == PI) && ((backplane_variables.trigger_rates_size() > 0)
+                    || backplane_variables.has_trigger_rates_dropped())) {
+            log_trigger_rates();
+        }
+        // As may hit patterns, which are counted for the hit rate reports
+        if ((device == PI) && backplane_variables.has_hit_patterns()
+                && ((backplane_variables.backplane() >=
+                        (uint32_t)MAX_BACKPLANES)
+                    || !backplane_hit_rates[backplane_variables.backplane()]
+                    .add(backplane_variables.hit_patterns()))) {
+            std::cerr << "Warning: malformed hit patterns from the pi ignored"
+                << std::endl;
+        }
+        if ((device == PI) && !backplane_variables.has_command()) {
+            continue;
+        }
         // Extract command for comparison to active commands
         LowLevelCommand received_command;
         if (device == PI) {
@@ -581,11 +1760,33 @@ void RunControl::process_received_messages()
         for (auto active_cmd_it = active_commands.begin();
                 active_cmd_it != active_commands.end(); ++active_cmd_it) {
             if (*active_cmd_it == received_command) {
+                // Report end-to-end latency of emergency commands
+                if (active_cmd_it->priority == EMERGENCY_PRIORITY) {
+                    report_emergency_latency(*active_cmd_it);
+                }
+                // Count confirmed polls, if still polled since a reload
+                int poll = active_cmd_it->poll;
+                if ((poll >= 0) && ((std::size_t)poll < polls.size())
+                        && (polls[poll].command.def == active_cmd_it->def)) {
+                    polls[poll].outstanding = false;
+                    polls[poll].n_confirmed++;
+                    if (device == PI) {
+                        polls[poll].total_duration_usec +=
+                            backplane_variables.command_duration_usec();
+                    }
+                }
                 active_commands.erase(active_cmd_it);
                 break;
             }
         }
-        if (device == PI) {
+        if ((device == PI) && backplane_variables.has_rejected()) {
+            // Nothing was performed, so there's nothing to keep or log
+            std::cerr << "Error: the Pi rejected "
+                << backplane_command_name(received_command.def.code) << ": "
+                << backplane_variables.rejected() << std::endl;
+        } else if (device == PI) {
+            // Keep readings for sequence conditionals
+            update_readback_values(backplane_variables, readback_values);
             // Log backplane variables from the pi
             log_backplane_variables();
         } else if (device == TM) {
@@ -593,4 +1794,8 @@ void RunControl::process_received_messages()
             log_target_variables();
         }
     }
+    if (std::chrono::steady_clock::now() - hit_rate_report_time >=
+            std::chrono::seconds(HIT_RATE_REPORT_INTERVAL_SEC)) {
+        report_hit_rates();
+    }
 }
@@ -7,43 +7,58 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <chrono>
+#include <memory>
 
 #include "network.h"
 #include "slow_control.pb.h"
+#include "command_table.h"
+#include "hit_rates.h"
+#include "backplane_commands.h"
+#include "clock_sync.h"
 
-struct CommandDefinition {
-    std::string command_name;
-    int device; // code for device to send to (PI or TM)
-    int n_ints; // number of integer arguments
-    int n_floats; // number of float arguments
-    int n_strings; // number of string arguments
-    bool operator==(const CommandDefinition& rhs) const {
-        return ((command_name == rhs.command_name)
-                && (device == rhs.device)
-                && (n_ints == rhs.n_ints)
-                && (n_floats == rhs.n_floats)
-                && (n_strings == rhs.n_strings));
-    }
+// Time within which an emergency command should be confirmed by its device
+const int EMERGENCY_LATENCY_LIMIT_MSEC = 250;
+
+// Limit on the factor by which polling slows down while devices are busy
+const int MAX_POLL_BACKOFF = 16;
+// Interval between reports of the achieved polling rates
+const int POLL_REPORT_INTERVAL_SEC = 60;
+// Interval between reports, and logs, of the per-pixel hit rates
+const int HIT_RATE_REPORT_INTERVAL_SEC = 60;
+// Time after which the pi is sent a command of no code, only to have its
+// clock echoed, if it has been sent nothing else
+const int CLOCK_PROBE_INTERVAL_SEC = 5;
+// Interval between reports of the offsets of the clients' clocks
+const int CLOCK_REPORT_INTERVAL_SEC = 60;
+
+// Codes for commands performed by run control itself
+enum RunControlCommandCode {
+    RC_UNKNOWN_COMMAND = 0,
+    RC_CANCEL_PENDING_COMMANDS,
+    RC_SLEEP
 };
 
-struct LowLevelCommand {
-    CommandDefinition def;
-    int priority = 0; // code for command priority; default is lowest priority
-    std::vector<unsigned int> int_args;
-    std::vector<float> float_args;
-    std::vector<std::string> string_args;
-    bool operator==(const LowLevelCommand& rhs) const {
-        return ((def == rhs.def)
-                && (priority == rhs.priority)
-                && (int_args == rhs.int_args)
-                && (float_args == rhs.float_args) 
-                && (string_args == rhs.string_args));
-    }
+// A high level command sequence being run
+struct SequenceRun {
+    std::shared_ptr<const CommandTable> table; // keeps the sequence loaded
+    std::size_t index; // of the sequence in the table's high level commands
+    SequenceState state;
+    std::chrono::steady_clock::time_point time_received;
 };
 
-struct HighLevelCommand {
-    std::string command_name;
-    std::vector<LowLevelCommand> commands;
+// A command being polled, and its achieved rate
+struct PollState {
+    LowLevelCommand command;
+    int period_msec; // target time between polls
+    int backoff; // factor on the period, raised while the device is busy
+    bool outstanding; // queued or sent, and not yet confirmed
+    std::chrono::steady_clock::time_point next_due;
+    int n_confirmed; // since the last report
+    int n_deferred; // since the last report
+    int n_timed_out; // since the last report
+    long long total_duration_usec; // taken on the Pi, since the last report
 };
 
 class RunControl {
@@ -55,10 +70,39 @@ protected:
     slow_control::BackplaneVariables backplane_variables;
     slow_control::LowLevelCommand backplane_command;
 
-    std::vector<CommandDefinition> command_definitions;
-    std::vector<HighLevelCommand> high_level_commands;
+    // Replaced as a whole on reloading; queued and active commands keep
+    // their own copies of the definitions they were created with
+    std::shared_ptr<const CommandTable> command_table;
+    std::string command_config_file;
+    uint64_t command_config_checksum;
+    int command_config_watch; // inotify descriptor, or -1 if not watching
     std::vector<LowLevelCommand> active_commands;
     std::queue<LowLevelCommand> command_queue;
+    std::queue<LowLevelCommand> emergency_queue; // bypasses command_queue
+    // Commands given up on, to send again ahead of command_queue
+    std::queue<LowLevelCommand> retry_queue;
+    // Sequences still to queue commands, run one at a time in order received
+    std::deque<SequenceRun> running_sequences;
+    ReadbackValues readback_values; // latest values for sequence conditionals
+    // Commands from command_queue aren't sent before this time (RC sleep)
+    std::chrono::steady_clock::time_point command_queue_hold_until;
+    // Polls from the command table, sent only when no other commands wait
+    std::vector<PollState> polls;
+    std::queue<LowLevelCommand> poll_queue;
+    std::chrono::steady_clock::time_point poll_report_time;
+    // Hits counted from the hit patterns streamed by the pi since the last
+    // report, for each backplane
+    HitRateAccumulator backplane_hit_rates[MAX_BACKPLANES];
+    std::chrono::steady_clock::time_point hit_rate_report_time;
+    // Offsets of the clients' clocks from the server's, estimated from the
+    // echoes of the times commands were sent, and the relation of each
+    // backplane's nsTimer to the server's clock (see clock_sync.h)
+    ClockOffsetEstimator pi_clock;
+    ClockOffsetEstimator tm_clock;
+    NsTimerCorrelation backplane_nstimers[MAX_BACKPLANES];
+    std::chrono::steady_clock::time_point pi_send_time; // of the last command
+    std::chrono::steady_clock::time_point clock_report_time;
+    int64_t receive_usec; // time the latest messages were received
 
     std::string outgoing_message;
     int outgoing_message_device;
@@ -79,21 +123,100 @@ public:
         db_password = password;
         outgoing_message = "";
         outgoing_message_device = -1;
+        command_config_checksum = 0;
+        command_config_watch = -1;
+        hit_rate_report_time = std::chrono::steady_clock::now();
+        pi_send_time = hit_rate_report_time;
+        clock_report_time = hit_rate_report_time;
+        receive_usec = 0;
     }
-    // Parse the high level command configuration file, storing a vector of 
-    // high level command objects, each containing the corresponding vector
-    // of low level commands
-    bool parse_command_config(std::string command_config_file);
+    ~RunControl();
+
+    // Load the command configuration file, from its compiled cache if that
+    // is up to date, and watch it for changes
+    // Return true on success, false otherwise
+    bool load_command_config(std::string config_file);
+
+    // If the command configuration file has changed, parse it again and
+    // replace the command table, leaving queued commands untouched
+    // Keep the current table if the new file can't be parsed
+    void reload_command_config_if_changed();
 
     bool synchronize_network();
 
+    // Send the command at the front of the queue to the appropriate device
+    // to be performed on next synchronization, or perform it directly if it
+    // is a run control command
+    // Return true if the command was sent, false if performed directly
+    bool dispatch_command(std::queue<LowLevelCommand> &queue);
+
+    // Perform a run control command
+    void perform_run_control_command(const LowLevelCommand &command);
+
+    // Run a sequence until it finishes or must wait, queueing its commands
+    // Return true if the sequence is finished (or failed), false if waiting
+    bool advance_sequence(SequenceRun &run);
+
+    // Run the sequence received first as far as possible, then the next ones
+    // once it finishes
+    void run_sequences();
+
+    // Set up polling of the commands listed in the command table
+    void reset_polls();
+
+    // Check whether a device has operator commands waiting or in progress
+    bool device_busy(int device);
+
+    // Queue the polls that are due in the low priority lane, backing off
+    // those for busy devices, and periodically report the achieved rates
+    void schedule_polls();
+
+    // Report the achieved and target rate of each poll since the last report
+    void report_poll_rates();
+
+    // Give up on active commands their devices haven't confirmed within
+    // their timeouts, so that they block others no longer, queueing those
+    // with retries left to be sent again; polls are sent again on schedule
+    void expire_active_commands();
+
+    // Send the pi a command of no code, only to have its clock echoed, if
+    // nothing else has been sent to it for CLOCK_PROBE_INTERVAL_SEC, and
+    // periodically report the clients' clock offsets
+    void probe_clocks();
+
+    // Report the offsets of the clients' clocks from the server's, and the
+    // relation of each backplane's nsTimer to the server's clock
+    void report_clocks();
+
+    // Time of a reading from the pi on the server's clock, from its times on
+    // the pi's clocks (see ClockOffsetEstimator::to_server_time), or the
+    // time its message was received if it has none
+    int64_t pi_reading_time(int64_t pi_unix_usec,
+            int64_t pi_monotonic_usec = 0) const;
+
+    // Check whether active commands block the command from being sent
+    bool command_blocked(const LowLevelCommand &command);
+
     // If a low level command is awaiting in the queue, send it to the 
     // appropriate device to be performed on next synchronization
+    // Emergency commands are sent first regardless of any active commands
     void send_next_command();
     
     // Log backplane variables from the pi
     void log_backplane_variables();
+
+    // Log the housekeeping samples sent with backplane variables from the pi
+    void log_housekeeping_samples();
+
+    // Log the trigger rate records sent with backplane variables from the pi
+    void log_trigger_rates();
     
+    // Report the hit rates of the busiest pixels since the last report, log
+    // the rate of every pixel hit, and start counting again, for each
+    // backplane
+    void report_hit_rates();
+    void report_hit_rates(int backplane, double elapsed);
+
     // Log target variables from the tm controller
     void log_target_variables();
     
@@ -0,0 +1,81 @@
+-- schema.sql
+-- Tables and columns the server logs to beyond those of the existing slow
+-- control database (main, spi, fee_voltage, fee_current, fee_present, and
+-- trigger_mask), in the order they were added. Each is logged with the id of
+-- its reading in main. Apply those not yet applied to a database, e.g.
+-- mysql test < schema.sql on a database with none of them.
+
+-- Housekeeping samples taken by the Pi (the voltages and currents go to
+-- fee_voltage and fee_current)
+CREATE TABLE sample (
+    id INT NOT NULL PRIMARY KEY,
+    time_usec BIGINT NOT NULL,
+    nstimer BIGINT UNSIGNED NOT NULL,
+    tack_count INT UNSIGNED NOT NULL,
+    trigger_count INT UNSIGNED NOT NULL
+);
+
+-- Rates at which each trigger pixel (16 * module + pixel) was hit, over the
+-- hit patterns streamed from the Pi; pixels not hit are left out
+CREATE TABLE hit_rate (
+    id INT NOT NULL,
+    pixel INT NOT NULL,
+    rate DOUBLE NOT NULL,
+    PRIMARY KEY (id, pixel)
+);
+
+-- Trigger and TACK rates measured on the Pi, one row per counter (trigger
+-- or tack) of each record
+CREATE TABLE trigger_rate (
+    id INT NOT NULL,
+    counter VARCHAR(8) NOT NULL,
+    time_usec BIGINT NOT NULL,
+    window_nsec BIGINT UNSIGNED NOT NULL,
+    n_intervals INT UNSIGNED NOT NULL,
+    count INT UNSIGNED NOT NULL,
+    mean_hz DOUBLE NOT NULL,
+    min_hz DOUBLE NOT NULL,
+    max_hz DOUBLE NOT NULL,
+    smoothed_hz DOUBLE NOT NULL,
+    PRIMARY KEY (id, counter)
+);
+
+-- SPI messages journaled on the Pi, as read back by read_spi_journal; source
+-- is what sent the message, and command_code the command it was sent for
+CREATE TABLE spi_journal (
+    id INT NOT NULL,
+    sequence BIGINT UNSIGNED NOT NULL,
+    start_nsec BIGINT UNSIGNED NOT NULL,
+    duration_nsec INT UNSIGNED NOT NULL,
+    command_word INT UNSIGNED NOT NULL,
+    source VARCHAR(16) NOT NULL,
+    command_code VARCHAR(64) NOT NULL,
+    checks_passed INT UNSIGNED NOT NULL,
+    INDEX (id)
+);
+
+-- Backplane of the Pi each reading and journaled message is of, 0 for
+-- readings of other devices and for those logged before
+ALTER TABLE main ADD COLUMN backplane INT NOT NULL DEFAULT 0;
+ALTER TABLE spi_journal ADD COLUMN backplane INT UNSIGNED NOT NULL DEFAULT 0;
+
+-- Spread of each module's readings over the conversions of an oversampled
+-- housekeeping read (the means go to fee_voltage and fee_current)
+CREATE TABLE fee_spread (
+    id INT NOT NULL,
+    fee_index INT NOT NULL,
+    n_conversions INT UNSIGNED NOT NULL,
+    voltage_min DOUBLE NOT NULL,
+    voltage_max DOUBLE NOT NULL,
+    voltage_std DOUBLE NOT NULL,
+    current_min DOUBLE NOT NULL,
+    current_max DOUBLE NOT NULL,
+    current_std DOUBLE NOT NULL,
+    PRIMARY KEY (id, fee_index)
+);
+
+-- Time of each reading in microseconds since the epoch, on the server's
+-- clock (the device's corrected by its estimated offset) and on the device's
+-- own, NULL for those logged before
+ALTER TABLE main ADD COLUMN time_usec BIGINT;
+ALTER TABLE main ADD COLUMN device_time_usec BIGINT;
@@ -25,7 +25,7 @@ int main(int argc, char *argv[])
 
     // Load available commands from config file
     std::cout << "Loading commands..." << std::endl;
-    if (!run_control.parse_command_config("commands.config")) {
+    if (!run_control.load_command_config("commands.config")) {
         std::cout << "Could not load commands. Exiting..." << std::endl;
         return 1;
     }
@@ -33,16 +33,27 @@ int main(int argc, char *argv[])
 
     // Update network
     while (true) {
+        // Pick up any edits to the command config between iterations
+        run_control.reload_command_config_if_changed();
         // Send and receive commands and variables from clients
         run_control.synchronize_network();
-        // If a high level command was received, populate a queue of the
-        // corresponding low level commands for the pi and target controller
+        // If a high level command was received, start its sequence
         // If a new high level command, updated backplane variables,
         // or updated target variables were received, log them
         run_control.process_received_messages();
+        // Run high level command sequences, queueing their commands as far
+        // as possible
+        run_control.run_sequences();
+        // Queue housekeeping polls that are due, if devices aren't busy
+        run_control.schedule_polls();
+        // Give up on, or retry, commands not confirmed in time
+        run_control.expire_active_commands();
         // If there are low level commands in the queue and the appropriate
         // controller for the first one isn't occupied, send that command
         run_control.send_next_command();
+        // Have the pi echo the server's clock if it's been sent nothing
+        // lately, and periodically report the clients' clock offsets
+        run_control.probe_clocks();
     }
     
     return 0;
@@ -0,0 +1,273 @@
+// simulated_backplane.cc
+// Implementation of the software model of the backplane FPGAs
+
+#include <algorithm>
+
+#include "simulated_backplane.h"
+
+// Default timing: time taken by each transfer beyond clocking its bits, as
+// for a bcm2835 transfer, and time for the ADCs to convert all channels
+const int SIM_TRANSFER_OVERHEAD_NSEC = 2000;
+const int SIM_ADC_CONVERSION_USEC = 2000;
+const double SIM_TRIGGER_RATE_HZ = 100.0;
+
+// ADC counts read from a powered module: about 12 V and 0.45 A
+const int SIM_MODULE_VOLTAGE_COUNTS = 1949;
+const int SIM_MODULE_CURRENT_COUNTS = 385;
+const int SIM_ADC_NOISE_COUNTS = 3;
+
+// Chance of a trigger pixel of a powered module being hit in one hit pattern
+// read, at most; pixels vary from this down to a seventh of it
+const double SIM_PIXEL_HIT_PROBABILITY = 0.02;
+
+// Get which of the four ADC read commands a command word is
+// Return -1 if not an ADC read
+int adc_read_group(unsigned short cw)
+{
+    if (((cw & 0xFF00) != CW_RD_FEE0_I) && ((cw & 0xFF00) != CW_RD_FEE0_V)) {
+        return -1;
+    }
+    switch (cw & 0x00FF) {
+        case (CW_RD_FEE0_I & 0x00FF): return 0;
+        case (CW_RD_FEE8_I & 0x00FF): return 1;
+        case (CW_RD_FEE16_I & 0x00FF): return 2;
+        case (CW_RD_FEE24_I & 0x00FF): return 3;
+        default: return -1;
+    }
+}
+
+SimulatedBackplane::SimulatedBackplane()
+{
+    bit_period_nsec = 1000000000 / SPI_CLOCK_HZ;
+    transfer_overhead_nsec = SIM_TRANSFER_OVERHEAD_NSEC;
+    adc_conversion_usec = SIM_ADC_CONVERSION_USEC;
+    byte_in_word = 0;
+    word_in = 0;
+    word_out = 0;
+    word_index = -1;
+    std::fill(message, message + SPI_FRAME_WORDS, 0);
+    modules_present = 0xFFFFFFFF;
+    modules_powered = 0;
+    std::fill(adc_voltage, adc_voltage + SIM_NUM_FEES, 0);
+    std::fill(adc_current, adc_current + SIM_NUM_FEES, 0);
+    adc_converting = false;
+    nstimer_reset_time = Clock::now();
+    trigger_rate_hz = SIM_TRIGGER_RATE_HZ;
+    triggers_counted = 0;
+    trigger_count_time = nstimer_reset_time;
+    trigger_enabled = true;
+    std::fill(trigger_mask, trigger_mask + SIM_NUM_FEES, 0);
+    std::fill(latched_reply, latched_reply + 8, 0);
+    clock_frozen = false;
+}
+
+bool SimulatedBackplane::initialize()
+{
+    return true;
+}
+
+SimulatedBackplane::Clock::time_point SimulatedBackplane::clock_now()
+{
+    return clock_frozen ? frozen_time : Clock::now();
+}
+
+void SimulatedBackplane::freeze_clock()
+{
+    frozen_time = Clock::now();
+    clock_frozen = true;
+    nstimer_reset_time = frozen_time;
+    trigger_count_time = frozen_time;
+    triggers_counted = 0;
+}
+
+void SimulatedBackplane::transfer(const char *tbuf, char *rbuf,
+        unsigned int length)
+{
+    auto start = Clock::now();
+    for (unsigned int i = 0; i < length; i++) {
+        unsigned char byte_in = tbuf[i];
+        if (byte_in_word == 0) {
+            // The reply word is decided before any of the word is received
+            word_out = next_word_out();
+            rbuf[i] = word_out >> 8;
+            word_in = byte_in << 8;
+            byte_in_word = 1;
+            continue;
+        }
+        rbuf[i] = word_out & 0x00FF;
+        word_in |= byte_in;
+        byte_in_word = 0;
+
+        // Follow the message framing
+        if (word_index < 0) {
+            if ((word_in == SPI_SOM_HKFPGA) || (word_in == SPI_SOM_TFPGA)) {
+                message[0] = word_in;
+                word_index = 1;
+            }
+        } else {
+            message[word_index] = word_in;
+            if (word_index == SPI_FRAME_WORDS - 1) {
+                perform_message();
+                word_index = -1;
+            } else {
+                word_index++;
+            }
+        }
+    }
+
+    // Take as long as the real bus would
+    auto end = start + std::chrono::nanoseconds(transfer_overhead_nsec +
+            (long long)length * 8 * bit_period_nsec);
+    while (Clock::now() < end) {
+    }
+}
+
+unsigned short SimulatedBackplane::next_word_out()
+{
+    if (word_index < 1) {
+        return 0x0000; // nothing to say yet
+    } else if (word_index == 1) {
+        return message[0]; // SOM
+    } else if (word_index == 2) {
+        return message[1]; // CW
+    } else if (word_index < SPI_FRAME_WORDS - 1) {
+        return reply_data(word_index - 3);
+    }
+    return (message[0] == SPI_SOM_HKFPGA) ? SPI_EOM_HKFPGA : SPI_EOM_TFPGA;
+}
+
+unsigned short SimulatedBackplane::reply_data(int i)
+{
+    unsigned short cw = message[1];
+    if (message[0] == SPI_SOM_HKFPGA) {
+        int group = adc_read_group(cw);
+        if (group >= 0) {
+            update_adc();
+            int module = ADC_CHANNEL_MODULES[group][i];
+            return ((cw & 0xFF00) == CW_RD_FEE0_V) ? adc_voltage[module] :
+                adc_current[module];
+        } else if (cw == CW_FEEs_PRESENT) {
+            // J0-15, then J16-31
+            if (i < 2) {
+                return (modules_present >> (16 * i)) & 0xFFFF;
+            }
+            return 0x0000;
+        }
+    } else if ((cw >= SPI_READ_HIT_PATTERN)
+            && (cw <= SPI_READ_HIT_PATTERN3)) {
+        // Hold the block for the whole message, as the FPGA latches it
+        if (i == 0) {
+            latch_hit_pattern(8 * ((cw - SPI_READ_HIT_PATTERN) >> 8));
+        }
+        return latched_reply[i];
+    } else if (cw == SPI_READ_nsTimer_TFPGA) {
+        // Hold the values for the whole message, as the FPGA latches them
+        if (i == 0) {
+            auto now = clock_now();
+            uint64_t nstimer = std::chrono::duration_cast<
+                std::chrono::nanoseconds>(now - nstimer_reset_time).count();
+            // The TFPGA counts one extra on reset
+            uint32_t count = (uint32_t)trigger_count() + 1;
+            for (int j = 0; j < 4; j++) {
+                latched_reply[j] = (nstimer >> (48 - 16 * j)) & 0xFFFF;
+            }
+            // TACK count, then trigger count
+            latched_reply[4] = latched_reply[6] = count >> 16;
+            latched_reply[5] = latched_reply[7] = count & 0xFFFF;
+        }
+        return latched_reply[i];
+    }
+    // Echo the data words of other commands, one word behind
+    return message[i + 2];
+}
+
+void SimulatedBackplane::perform_message()
+{
+    bool hkfpga = (message[0] == SPI_SOM_HKFPGA);
+    unsigned short eom = hkfpga ? SPI_EOM_HKFPGA : SPI_EOM_TFPGA;
+    if (message[SPI_FRAME_WORDS - 1] != eom) {
+        return; // malformed, so ignored
+    }
+    unsigned short cw = message[1];
+    auto now = clock_now();
+    if (hkfpga) {
+        if (cw == CW_FEE_POWER_CTL) {
+            // J16-31, then J0-15
+            modules_powered = ((uint32_t)message[2] << 16) | message[3];
+        } else if (cw == CW_TRG_ADCS) {
+            update_adc();
+            adc_converting = true;
+            adc_trigger_time = now;
+        }
+    } else if (cw == RESET_TRIGGER_COUNT_AND_NSTIMER) {
+        nstimer_reset_time = now;
+        trigger_count_time = now;
+        triggers_counted = 0;
+    } else if (cw == SPI_L1_TRIGGER_EN) {
+        triggers_counted = trigger_count();
+        trigger_count_time = now;
+        trigger_enabled = (message[2] != 0);
+    } else if ((cw >= SPI_TRIGGERMASK_TFPGA)
+            && (cw <= SPI_TRIGGERMASK3_TFPGA)) {
+        int first = 8 * ((cw - SPI_TRIGGERMASK_TFPGA) >> 8);
+        std::copy(message + 2, message + 10, trigger_mask + first);
+    }
+}
+
+void SimulatedBackplane::latch_hit_pattern(int first_module)
+{
+    std::uniform_real_distribution<double> chance(0.0, 1.0);
+    uint32_t on = modules_present & modules_powered;
+    for (int i = 0; i < 8; i++) {
+        int module = first_module + i;
+        latched_reply[i] = 0;
+        if (!trigger_enabled || !((on >> module) & 1)) {
+            continue;
+        }
+        for (int pixel = 0; pixel < 16; pixel++) {
+            double probability = SIM_PIXEL_HIT_PROBABILITY
+                * (1 + (16 * module + pixel) % 7) / 7;
+            if (chance(noise) < probability) {
+                latched_reply[i] |= 1 << pixel;
+            }
+        }
+    }
+}
+
+void SimulatedBackplane::update_adc()
+{
+    if (!adc_converting || (clock_now() - adc_trigger_time <
+                std::chrono::microseconds(adc_conversion_usec))) {
+        return;
+    }
+    adc_converting = false;
+    std::uniform_int_distribution<int> adc_noise(-SIM_ADC_NOISE_COUNTS,
+            SIM_ADC_NOISE_COUNTS);
+    uint32_t on = modules_present & modules_powered;
+    for (int i = 0; i < SIM_NUM_FEES; i++) {
+        int voltage = adc_noise(noise);
+        int current = adc_noise(noise);
+        if (on & (1u << i)) {
+            voltage += SIM_MODULE_VOLTAGE_COUNTS;
+            current += SIM_MODULE_CURRENT_COUNTS;
+        }
+        adc_voltage[i] = std::max(voltage, 0);
+        adc_current[i] = std::max(current, 0);
+    }
+}
+
+double SimulatedBackplane::trigger_count()
+{
+    if (!trigger_enabled) {
+        return triggers_counted;
+    }
+    std::chrono::duration<double> elapsed = clock_now() - trigger_count_time;
+    return triggers_counted + elapsed.count() * trigger_rate_hz;
+}
+
+void SimulatedBackplane::set_trigger_rate(double rate_hz)
+{
+    triggers_counted = trigger_count();
+    trigger_count_time = clock_now();
+    trigger_rate_hz = rate_hz;
+}
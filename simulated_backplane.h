@@ -0,0 +1,98 @@
+// simulated_backplane.h
+// Software model of the backplane housekeeping (HKFPGA) and trigger (TFPGA)
+// FPGAs, used as an SPI backend so the Pi program can be run, tested, and
+// profiled without a backplane
+
+#ifndef SIMULATED_BACKPLANE_H
+#define SIMULATED_BACKPLANE_H
+
+#include <cstdint>
+#include <chrono>
+#include <random>
+
+#include "spi_backend.h"
+#include "spi_protocol.h"
+
+// Number of module slots on the backplane
+const int SIM_NUM_FEES = 32;
+
+// Answers the message protocol of transfer_message() in backplane_spi.cc:
+// the FPGA replies one word behind the Pi, echoing SOM and CW and then
+// sending 8 data words and its EOM. Write commands are acted on once the
+// whole message has been received with the right EOM; their data words are
+// echoed back, which for the trigger mask is the value read back.
+//
+// Timing follows the real bus: each transfer takes as long as its bits at
+// SPI_CLOCK_HZ plus a fixed overhead, and ADC readings only change once a
+// conversion started by CW_TRG_ADCS has had time to finish.
+class SimulatedBackplane : public SpiBackend {
+protected:
+    typedef std::chrono::steady_clock Clock;
+
+    // Bus timing
+    int bit_period_nsec;
+    int transfer_overhead_nsec;
+    int adc_conversion_usec;
+
+    // Message being received
+    int byte_in_word; // 0 or 1
+    unsigned short word_in; // word being received
+    unsigned short word_out; // word being sent
+    int word_index; // position in the current message, or -1 if idle
+    unsigned short message[SPI_FRAME_WORDS];
+
+    // HKFPGA state
+    uint32_t modules_present;
+    uint32_t modules_powered;
+    // ADC counts from the last finished conversion
+    unsigned short adc_voltage[SIM_NUM_FEES];
+    unsigned short adc_current[SIM_NUM_FEES];
+    bool adc_converting;
+    Clock::time_point adc_trigger_time;
+    std::minstd_rand noise;
+
+    // TFPGA state
+    Clock::time_point nstimer_reset_time;
+    double trigger_rate_hz;
+    double triggers_counted; // before trigger_count_time
+    Clock::time_point trigger_count_time;
+    bool trigger_enabled;
+    unsigned short trigger_mask[SIM_NUM_FEES];
+    // Timer and counts, or a block of hit patterns, read together
+    unsigned short latched_reply[8];
+
+    // The model's own clock, which may be stopped
+    bool clock_frozen;
+    Clock::time_point frozen_time;
+    Clock::time_point clock_now();
+
+    // Word to send at the current position of the message
+    unsigned short next_word_out();
+    // Data word i (0-7) of the reply to the current message
+    unsigned short reply_data(int i);
+    // Act on a complete message
+    void perform_message();
+    // Decide the hit patterns of eight modules for a read
+    void latch_hit_pattern(int first_module);
+    // Finish any ADC conversion that has had time to complete
+    void update_adc();
+    // Number of triggers counted since the nsTimer was reset
+    double trigger_count();
+public:
+    SimulatedBackplane();
+    bool initialize();
+    void transfer(const char *tbuf, char *rbuf, unsigned int length);
+
+    // Settings of the model
+    void set_modules_present(uint32_t present) { modules_present = present; }
+    void set_trigger_rate(double rate_hz);
+    void set_adc_conversion_time(int usec) { adc_conversion_usec = usec; }
+    void set_transfer_overhead(int nsec) { transfer_overhead_nsec = nsec; }
+    // Stop the model's clock, restarting its timer and counters, so that its
+    // replies depend only on the messages it's sent (with an ADC conversion
+    // time of 0, conversions finish at once); transfers still take as long
+    // as on the bus
+    void freeze_clock();
+};
+
+#endif
@@ -0,0 +1,207 @@
+// spi_backend.cc
+// Selection of SPI backends, and the spidev backend
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "spi_backend.h"
+#include "simulated_backplane.h"
+#include "spi_capture.h"
+
+const char *DEFAULT_SPIDEV_DEVICE = "/dev/spidev0.0";
+// Most segments handed to spidev in one message, and the longest delay
+// spidev can insert after one (delay_usecs is 16 bits)
+const int SPIDEV_MAX_SEGMENTS = 128;
+const unsigned int SPIDEV_MAX_DELAY_USEC = 65535;
+
+void SpiBackend::transfer_segments(const SpiSegment segments[], int n)
+{
+    for (int i = 0; i < n; i++) {
+        transfer(segments[i].tbuf, segments[i].rbuf, segments[i].length);
+        if ((segments[i].delay_usec > 0) && (i < n - 1)) {
+            std::this_thread::sleep_for(
+                    std::chrono::microseconds(segments[i].delay_usec));
+        }
+    }
+}
+
+SpidevBackend::~SpidevBackend()
+{
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+bool SpidevBackend::initialize()
+{
+    fd = open(device.c_str(), O_RDWR);
+    if (fd == -1) {
+        perror(device.c_str());
+        return false;
+    }
+    // Same settings as the bcm2835 backend: mode 0, MSB first, 8 bit words
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits_per_word = 8;
+    if ((ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1)
+            || (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits_per_word) == -1)
+            || (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) == -1)) {
+        perror("spidev");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void SpidevBackend::transfer(const char *tbuf, char *rbuf, unsigned int length)
+{
+    struct spi_ioc_transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.tx_buf = (unsigned long)tbuf;
+    transfer.rx_buf = (unsigned long)rbuf;
+    transfer.len = length;
+    transfer.speed_hz = speed_hz;
+    transfer.bits_per_word = 8;
+    if (ioctl(fd, SPI_IOC_MESSAGE(1), &transfer) == -1) {
+        perror("spidev transfer");
+        memset(rbuf, 0, length);
+    }
+}
+
+void SpidevBackend::transfer_segments(const SpiSegment segments[], int n)
+{
+    struct spi_ioc_transfer transfers[SPIDEV_MAX_SEGMENTS];
+    int first = 0;
+    while (first < n) {
+        // Gather segments up to the limit, or up to a delay too long for
+        // spidev to insert
+        int n_batch = 0;
+        memset(transfers, 0, sizeof(transfers));
+        while ((first + n_batch < n) && (n_batch < SPIDEV_MAX_SEGMENTS)) {
+            const SpiSegment &segment = segments[first + n_batch];
+            struct spi_ioc_transfer &transfer = transfers[n_batch++];
+            transfer.tx_buf = (unsigned long)segment.tbuf;
+            transfer.rx_buf = (unsigned long)segment.rbuf;
+            transfer.len = segment.length;
+            transfer.speed_hz = speed_hz;
+            transfer.bits_per_word = 8;
+            transfer.cs_change = segment.cs_change;
+            if (segment.delay_usec > SPIDEV_MAX_DELAY_USEC) {
+                break;
+            }
+            transfer.delay_usecs = segment.delay_usec;
+        }
+
+        // After the last transfer of a message, cs_change would leave the
+        // FPGA selected, and the chip select is released anyway; any delay
+        // before the next batch is slept through here
+        struct spi_ioc_transfer &last = transfers[n_batch - 1];
+        last.cs_change = 0;
+        last.delay_usecs = 0;
+        if (ioctl(fd, SPI_IOC_MESSAGE(n_batch), transfers) == -1) {
+            perror("spidev transfer");
+            for (int i = first; i < first + n_batch; i++) {
+                memset(segments[i].rbuf, 0, segments[i].length);
+            }
+        }
+        first += n_batch;
+        unsigned int delay_usec = segments[first - 1].delay_usec;
+        if ((first < n) && (delay_usec > 0)) {
+            std::this_thread::sleep_for(std::chrono::microseconds(delay_usec));
+        }
+    }
+}
+
+// Split a backend name into its fields, separated by colons
+std::vector<std::string> split_backend_name(const std::string &name)
+{
+    std::vector<std::string> fields;
+    std::string::size_type start = 0;
+    while (true) {
+        std::string::size_type end = name.find(':', start);
+        fields.push_back(name.substr(start, end - start));
+        if (end == std::string::npos) {
+            return fields;
+        }
+        start = end + 1;
+    }
+}
+
+// Parse a field of a backend name as a number from min to max
+// Return true if successful, false otherwise
+bool parse_backend_field(const std::string &field, long min, long max,
+        long &value)
+{
+    char *end;
+    value = std::strtol(field.c_str(), &end, 0);
+    return !field.empty() && (*end == '\0') && (value >= min)
+        && (value <= max);
+}
+
+SpiBackend *create_spi_backend(std::string name)
+{
+    if (name.empty()) {
+#ifdef USE_BCM2835
+        name = "bcm2835";
+#else
+        name = "spidev";
+#endif
+    }
+    std::vector<std::string> fields = split_backend_name(name);
+    if (fields[0] == "bcm2835") {
+        long chip_select = 0;
+        long divider = DEFAULT_SPI_CLOCK_DIVIDER;
+        if ((fields.size() > 3)
+                || ((fields.size() > 1)
+                    && !parse_backend_field(fields[1], 0, 1, chip_select))
+                || ((fields.size() > 2)
+                    && (!parse_backend_field(fields[2], 2, 32768, divider)
+                        || (divider % 2 != 0)))) {
+            std::cerr << "Error: invalid SPI backend " << name
+                << ", expected bcm2835[:cs[:divider]]" << std::endl;
+            return NULL;
+        }
+#ifdef USE_BCM2835
+        return new Bcm2835Backend(chip_select, divider);
+#else
+        std::cerr << "Error: built without the bcm2835 library" << std::endl;
+        return NULL;
+#endif
+    } else if (fields[0] == "spidev") {
+        std::string device = DEFAULT_SPIDEV_DEVICE;
+        long speed_hz = SPI_CLOCK_HZ;
+        if ((fields.size() > 3)
+                || ((fields.size() > 1) && fields[1].empty())
+                || ((fields.size() > 2) && !parse_backend_field(fields[2],
+                        1, SPI_CORE_CLOCK_HZ / 2, speed_hz))) {
+            std::cerr << "Error: invalid SPI backend " << name
+                << ", expected spidev[:device[:hz]]" << std::endl;
+            return NULL;
+        }
+        if (fields.size() > 1) {
+            device = fields[1];
+        }
+        return new SpidevBackend(device, speed_hz);
+    } else if (name == "simulated") {
+        return new SimulatedBackplane();
+    } else if (fields[0] == "replay") {
+        if ((fields.size() != 2) || fields[1].empty()) {
+            std::cerr << "Error: invalid SPI backend " << name
+                << ", expected replay:capture_file" << std::endl;
+            return NULL;
+        }
+        return new ReplayBackend(fields[1]);
+    }
+    std::cerr << "Error: unknown SPI backend " << name << std::endl;
+    return NULL;
+}
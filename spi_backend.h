@@ -0,0 +1,95 @@
+// spi_backend.h
+// Interface to the SPI bus between the Pi and the backplane, with one
+// implementation for each way of reaching the bus, so that the backplane code
+// can also run on machines without one
+
+#ifndef SPI_BACKEND_H
+#define SPI_BACKEND_H
+
+#include <cstdint>
+#include <string>
+
+// SPI clock used with the backplane by default: the Pi core clock (250 MHz)
+// divided by 128, giving a 512 ns bit period (the nominal value needed by
+// the backplane is 640 ns; slower works too)
+const int SPI_CORE_CLOCK_HZ = 250000000;
+const int DEFAULT_SPI_CLOCK_DIVIDER = 128;
+const int SPI_CLOCK_HZ = SPI_CORE_CLOCK_HZ / DEFAULT_SPI_CLOCK_DIVIDER;
+
+// One transfer of a batch sent together
+struct SpiSegment {
+    const char *tbuf;
+    char *rbuf;
+    unsigned int length; // bytes
+    unsigned int delay_usec; // wait after this segment before the next
+    bool cs_change; // deselect the FPGA between this segment and the next
+};
+
+class SpiBackend {
+public:
+    virtual ~SpiBackend() {}
+
+    // Set up the bus
+    // Return true on success, false otherwise
+    virtual bool initialize() = 0;
+
+    // Transfer length bytes full duplex, sending tbuf while receiving rbuf
+    virtual void transfer(const char *tbuf, char *rbuf,
+            unsigned int length) = 0;
+
+    // Transfer a batch of segments in order
+    // By default each segment is a transfer of its own, so the chip select
+    // changes between all of them, followed by a sleep for its delay
+    virtual void transfer_segments(const SpiSegment segments[], int n);
+};
+
+// The bcm2835 library driving the Pi's SPI peripheral directly, with the
+// backplane on the given chip select (0 or 1) and the core clock divided by
+// the given divider (even, from 2 to 32768); the chip select and divider are
+// set for each transfer, so backplanes on both chip selects share the
+// peripheral
+// Only available if built with the library (see Makefile)
+class Bcm2835Backend : public SpiBackend {
+protected:
+    int chip_select;
+    int clock_divider;
+public:
+    Bcm2835Backend(int cs, int divider) : chip_select(cs),
+        clock_divider(divider) {}
+    bool initialize();
+    void transfer(const char *tbuf, char *rbuf, unsigned int length);
+};
+
+// The Linux spidev driver
+// A batch of segments is handed to the kernel as one SPI_IOC_MESSAGE, which
+// the driver runs (by DMA where available) with the delays and chip select
+// changes asked for, so the CPU is free and no timing is left to the
+// scheduler
+class SpidevBackend : public SpiBackend {
+protected:
+    std::string device;
+    uint32_t speed_hz;
+    int fd;
+public:
+    SpidevBackend(std::string device_name, uint32_t clock_hz) :
+        device(device_name), speed_hz(clock_hz), fd(-1) {}
+    ~SpidevBackend();
+    bool initialize();
+    void transfer(const char *tbuf, char *rbuf, unsigned int length);
+    void transfer_segments(const SpiSegment segments[], int n);
+};
+
+// Create the backend of the given name:
+//   bcm2835[:cs[:divider]] the bcm2835 library (default, if built with it),
+//                          on chip select 0 and with divider 128 by default
+//   spidev[:device[:hz]]   the spidev driver, on /dev/spidev0.0 and at
+//                          SPI_CLOCK_HZ by default
+//   simulated              a software model of the backplane FPGAs (see
+//                          simulated_backplane.h), one for each backend
+//   replay:capture_file    the replies captured from a backplane (see
+//                          spi_capture.h)
+// Return NULL if the name is unknown or invalid, or the backend isn't
+// available
+SpiBackend *create_spi_backend(std::string name);
+
+#endif
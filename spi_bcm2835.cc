@@ -0,0 +1,39 @@
+// spi_bcm2835.cc
+// SPI backend using the bcm2835 library
+
+#include "bcm2835.h" // Driver for SPI chip
+
+#include "spi_backend.h"
+
+bool Bcm2835Backend::initialize()
+{
+    // The library and peripheral are set up once, for all backplanes
+    static bool library_initialized = false;
+    if (!library_initialized) {
+        if (!bcm2835_init()) {
+            return false;
+        }
+        bcm2835_spi_begin();
+        // The default
+        bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);
+        // Set Mode to zero
+        bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
+        library_initialized = true;
+    }
+    // Clock divider 256 gives 1024 ns clock; nominal value needed by BP is
+    // 640 ns - slower works too
+    // Tried 512 ns (BCM2835_SPI_CLOCK_DIVIDER_128) 8-10-2015 Seems OK
+    bcm2835_spi_setClockDivider(clock_divider);
+    bcm2835_spi_chipSelect(chip_select);
+    bcm2835_spi_setChipSelectPolarity(chip_select, LOW); // the default
+    return true;
+}
+
+void Bcm2835Backend::transfer(const char *tbuf, char *rbuf,
+        unsigned int length)
+{
+    // Backplanes on other chip selects may have been sent to since
+    bcm2835_spi_setClockDivider(clock_divider);
+    bcm2835_spi_chipSelect(chip_select);
+    bcm2835_spi_transfernb((char *)tbuf, rbuf, length);
+}
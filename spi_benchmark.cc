@@ -0,0 +1,195 @@
+// spi_benchmark.cc
+/* Compare SPI backends (see spi_backend.h) by timing the reads the Pi
+ * performs most: single message reads of the trigger counters, and eight
+ * message housekeeping reads. For each, report the rate achieved, the bus
+ * throughput, and how much of the CPU the reads took. The ADC conversion time
+ * is set to 0 so that only the bus is measured. Read only commands are used,
+ * so this is safe to run on a live backplane.
+ * Each backend must also give the same results: before timing, the reads are
+ * sent once through each, and the messages sent and the replies compared
+ * with those of the first backend given. The messages, the echoed SOM and
+ * command word and the EOM of every reply, and the modules present must be
+ * identical; readings and counters change with time on a live backplane, so
+ * only the framing of their replies is compared. Any difference, or any
+ * reply failing its checks, makes the exit status 1. */
+
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "backplane_spi.h"
+#include "spi_protocol.h"
+
+const int DEFAULT_N_READS = 1000;
+
+// CPU time used by the program so far, user and system, in seconds
+double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+        + 1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+// Time n_reads calls of read, which returns the number of messages sent
+void benchmark(const std::string &name, int n_reads,
+        int (*read)(unsigned short[], unsigned short[]))
+{
+    unsigned short spi_command[8 * SPI_MESSAGE_WORDS];
+    unsigned short spi_data[8 * SPI_MESSAGE_WORDS];
+    long n_messages = 0;
+    double cpu_start = cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n_reads; i++) {
+        n_messages += read(spi_command, spi_data);
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double cpu = cpu_seconds() - cpu_start;
+    double bytes = 2.0 * SPI_FRAME_WORDS * n_messages;
+    std::cout << "  " << name << ": " << n_reads / elapsed.count()
+        << " reads/s, " << bytes / elapsed.count() / 1000 << " kB/s, "
+        << 100 * cpu / elapsed.count() << "% CPU" << std::endl;
+}
+
+int read_counters(unsigned short spi_command[], unsigned short spi_data[])
+{
+    return read_nstimer_trigger_rate(spi_command, spi_data);
+}
+
+int read_all_housekeeping(unsigned short spi_command[],
+        unsigned short spi_data[])
+{
+    float voltages[32];
+    float currents[32];
+    // One more message triggers the ADCs
+    return read_housekeeping(voltages, currents, spi_command, spi_data) + 1;
+}
+
+// Messages sent by each read once, and their replies, the modules present
+// first
+struct ReadReplies {
+    std::vector<unsigned short> sent;
+    std::vector<unsigned short> received;
+};
+
+void add_messages(ReadReplies &replies, int n_messages,
+        const unsigned short spi_command[], const unsigned short spi_data[])
+{
+    int n_words = n_messages * SPI_MESSAGE_WORDS;
+    replies.sent.insert(replies.sent.end(), spi_command,
+            spi_command + n_words);
+    replies.received.insert(replies.received.end(), spi_data,
+            spi_data + n_words);
+}
+
+void read_once(ReadReplies &replies)
+{
+    unsigned short spi_command[8 * SPI_MESSAGE_WORDS];
+    unsigned short spi_data[8 * SPI_MESSAGE_WORDS];
+    unsigned short present[32];
+    float voltages[32];
+    float currents[32];
+    add_messages(replies, read_fees_present(present, spi_command, spi_data),
+            spi_command, spi_data);
+    add_messages(replies, read_counters(spi_command, spi_data), spi_command,
+            spi_data);
+    add_messages(replies, read_housekeeping(voltages, currents, spi_command,
+                spi_data), spi_command, spi_data);
+}
+
+// Compare the reads of a backend with those of the first, as described above
+// Return the number of words differing
+int compare_replies(const ReadReplies &first, const ReadReplies &replies)
+{
+    if (replies.sent.size() != first.sent.size()) {
+        return (int)std::max(replies.sent.size(), first.sent.size());
+    }
+    int n_differing = 0;
+    for (std::size_t i = 0; i < first.sent.size(); i++) {
+        std::size_t message = i / SPI_MESSAGE_WORDS;
+        std::size_t word = i % SPI_MESSAGE_WORDS;
+        bool compared = (message == 0) || (word < 2)
+            || (word == SPI_MESSAGE_WORDS - 1);
+        if ((replies.sent[i] != first.sent[i]) || (compared
+                    && (replies.received[i] != first.received[i]))) {
+            n_differing++;
+        }
+    }
+    return n_differing;
+}
+
+int main(int argc, char *argv[])
+{
+    int n_reads = DEFAULT_N_READS;
+    int option;
+    while ((option = getopt(argc, argv, "n:g:")) != -1) {
+        switch (option) {
+            case 'n':
+                n_reads = std::atoi(optarg);
+                break;
+            case 'g':
+                set_spi_word_gap(std::atoi(optarg));
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind >= argc) {
+        std::cerr << "usage: spi_benchmark [-n reads] [-g word_gap_usec] "
+            << "spi_backend..." << std::endl;
+        std::cerr << "spi_backend: bcm2835, spidev[:device], or simulated"
+            << std::endl;
+        return 1;
+    }
+    set_adc_conversion_time(0);
+
+    bool all_same = true;
+    ReadReplies first;
+    std::string first_backend;
+    SpiCheckTotals totals;
+    for (int i = optind; i < argc; i++) {
+        std::string backend = argv[i];
+        if (!initialize_lowlevel(backend)) {
+            std::cerr << "Error: could not initialize SPI backend " << backend
+                << std::endl;
+            all_same = false;
+            continue;
+        }
+        std::cout << backend << ":" << std::endl;
+        take_spi_check_counts(totals);
+        ReadReplies replies;
+        read_once(replies);
+        if (first_backend.empty()) {
+            first = replies;
+            first_backend = backend;
+        } else {
+            int n_differing = compare_replies(first, replies);
+            if (n_differing > 0) {
+                std::cout << "  " << n_differing << " words differ from "
+                    << first_backend << std::endl;
+                all_same = false;
+            }
+        }
+        benchmark("counters (1 message)", n_reads, read_counters);
+        benchmark("housekeeping (9 messages)", n_reads,
+                read_all_housekeeping);
+        take_spi_check_counts(totals);
+        uint32_t n_failed = 0;
+        for (auto it = totals.begin(); it != totals.end(); ++it) {
+            n_failed += it->second.failed;
+        }
+        if (n_failed > 0) {
+            std::cout << "  " << n_failed << " replies failed their checks"
+                << std::endl;
+            all_same = false;
+        }
+    }
+    return all_same ? 0 : 1;
+}
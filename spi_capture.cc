@@ -0,0 +1,219 @@
+// spi_capture.cc
+// Implementation of the capture and replay of SPI transfers
+
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+#include "spi_capture.h"
+#include "clock_sync.h"
+#include "spi_journal.h"
+
+// Totals of all replay backends
+std::atomic<uint64_t> replay_matched(0);
+std::atomic<uint64_t> replay_unmatched(0);
+std::atomic<uint64_t> replay_captured(0);
+
+bool read_spi_capture(std::string file_name, SpiCapture &capture)
+{
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: could not open capture " << file_name
+            << std::endl;
+        return false;
+    }
+    if (!file.read((char *)&capture.header, sizeof(capture.header))
+            || (std::memcmp(capture.header.magic, SPI_CAPTURE_MAGIC,
+                    sizeof(SPI_CAPTURE_MAGIC)) != 0)
+            || (capture.header.version != SPI_CAPTURE_VERSION)) {
+        std::cerr << "Error: " << file_name
+            << " is not a capture of this version" << std::endl;
+        return false;
+    }
+    capture.transfers.clear();
+    capture.commands.clear();
+    SpiCaptureRecord record;
+    while (file.read((char *)&record, sizeof(record))) {
+        if (record.type == SPI_CAPTURE_TRANSFER) {
+            CapturedTransfer transfer;
+            transfer.time_nsec = record.time_nsec;
+            transfer.duration_nsec = record.duration_nsec;
+            transfer.delay_usec = record.delay_usec;
+            transfer.sent.resize(record.length);
+            transfer.received.resize(record.length);
+            // An empty payload has no first byte to read into
+            if ((record.length != 0)
+                    && (!file.read(&transfer.sent[0], record.length)
+                        || !file.read(&transfer.received[0],
+                            record.length))) {
+                break;
+            }
+            capture.transfers.push_back(transfer);
+        } else if (record.type == SPI_CAPTURE_COMMAND) {
+            CapturedCommand command;
+            command.time_nsec = record.time_nsec;
+            command.command.resize(record.length);
+            if ((record.length != 0)
+                    && !file.read(&command.command[0], record.length)) {
+                break;
+            }
+            capture.commands.push_back(command);
+        } else {
+            std::cerr << "Error: unknown record type " << record.type
+                << " in " << file_name << std::endl;
+            return false;
+        }
+    }
+    // A capture cut short, as by the Pi program being killed, is read up to
+    // its last whole record
+    if (!file.eof() || (file.gcount() != 0)) {
+        std::cerr << "Warning: " << file_name << " ends with a partial record"
+            << std::endl;
+    }
+    return true;
+}
+
+bool SpiCaptureWriter::open(std::string name, int backplane)
+{
+    file_name = name;
+    file.open(file_name, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Error: could not open capture " << file_name
+            << std::endl;
+        return false;
+    }
+    SpiCaptureHeader header;
+    std::memcpy(header.magic, SPI_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = SPI_CAPTURE_VERSION;
+    header.backplane = backplane;
+    header.start_unix_usec = unix_time_usec();
+    header.start_nsec = monotonic_nsec();
+    file.write((const char *)&header, sizeof(header));
+    file.flush();
+    return true;
+}
+
+void SpiCaptureWriter::write_record(const SpiCaptureRecord &record,
+        const char *first, const char *second)
+{
+    std::lock_guard<std::mutex> lock(write_mutex);
+    file.write((const char *)&record, sizeof(record));
+    file.write(first, record.length);
+    if (second) {
+        file.write(second, record.length);
+    }
+    // Commands are rare, and flushing each keeps the capture of a program
+    // that dies complete up to its last command
+    if (record.type == SPI_CAPTURE_COMMAND) {
+        file.flush();
+    }
+}
+
+void SpiCaptureWriter::write_transfer(uint64_t time_nsec,
+        uint32_t duration_nsec, uint32_t delay_usec, const char *sent,
+        const char *received, unsigned int length)
+{
+    SpiCaptureRecord record;
+    record.type = SPI_CAPTURE_TRANSFER;
+    record.length = length;
+    record.time_nsec = time_nsec;
+    record.duration_nsec = duration_nsec;
+    record.delay_usec = delay_usec;
+    write_record(record, sent, received);
+}
+
+void SpiCaptureWriter::write_command(uint64_t time_nsec,
+        const std::string &command)
+{
+    SpiCaptureRecord record;
+    record.type = SPI_CAPTURE_COMMAND;
+    record.length = command.size();
+    record.time_nsec = time_nsec;
+    record.duration_nsec = 0;
+    record.delay_usec = 0;
+    write_record(record, command.data(), NULL);
+}
+
+bool CapturingBackend::initialize()
+{
+    return backend->initialize();
+}
+
+void CapturingBackend::transfer(const char *tbuf, char *rbuf,
+        unsigned int length)
+{
+    uint64_t start_nsec = monotonic_nsec();
+    backend->transfer(tbuf, rbuf, length);
+    writer->write_transfer(start_nsec, monotonic_nsec() - start_nsec, 0,
+            tbuf, rbuf, length);
+}
+
+void CapturingBackend::transfer_segments(const SpiSegment segments[], int n)
+{
+    // The batch is passed on whole, so the backend times it as it would
+    // uncaptured, and then each segment written with the batch's timing
+    uint64_t start_nsec = monotonic_nsec();
+    backend->transfer_segments(segments, n);
+    uint32_t duration_nsec = monotonic_nsec() - start_nsec;
+    for (int i = 0; i < n; i++) {
+        writer->write_transfer(start_nsec, duration_nsec,
+                segments[i].delay_usec, segments[i].tbuf, segments[i].rbuf,
+                segments[i].length);
+    }
+}
+
+bool ReplayBackend::initialize()
+{
+    SpiCapture capture;
+    if (!read_spi_capture(file_name, capture)) {
+        return false;
+    }
+    transfers.swap(capture.transfers);
+    replayed.assign(transfers.size(), false);
+    next = 0;
+    replay_captured += transfers.size();
+    return true;
+}
+
+void ReplayBackend::transfer(const char *tbuf, char *rbuf,
+        unsigned int length)
+{
+    std::size_t end = std::min(transfers.size(), next + REPLAY_SEARCH_WINDOW);
+    for (std::size_t i = next; i < end; i++) {
+        const CapturedTransfer &captured = transfers[i];
+        if (replayed[i] || (captured.sent.size() != length)
+                || (std::memcmp(captured.sent.data(), tbuf, length) != 0)) {
+            continue;
+        }
+        std::memcpy(rbuf, captured.received.data(), length);
+        replayed[i] = true;
+        while ((next < transfers.size()) && replayed[next]) {
+            next++;
+        }
+        replay_matched++;
+        return;
+    }
+    std::memset(rbuf, 0, length);
+    if (replay_unmatched++ == 0) {
+        std::cerr << "Error: a transfer was not found in capture "
+            << file_name << "; transfers not found are answered with zeros"
+            << std::endl;
+    }
+}
+
+void ReplayBackend::transfer_segments(const SpiSegment segments[], int n)
+{
+    for (int i = 0; i < n; i++) {
+        transfer(segments[i].tbuf, segments[i].rbuf, segments[i].length);
+    }
+}
+
+ReplayCounts replay_counts()
+{
+    ReplayCounts counts;
+    counts.matched = replay_matched;
+    counts.unmatched = replay_unmatched;
+    counts.captured = replay_captured;
+    return counts;
+}
@@ -0,0 +1,145 @@
+// spi_capture.h
+// Capture of every SPI transfer made with a backplane, and of the commands
+// it was sent, to a binary file, and replay of a capture as an SPI backend,
+// so that problems seen in the field can be reproduced, and the Pi program
+// tested and profiled, without the backplane
+
+#ifndef SPI_CAPTURE_H
+#define SPI_CAPTURE_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "spi_backend.h"
+
+// A capture file is a header followed by records, each a record header and
+// its payload: for a transfer, the bytes sent followed by the bytes
+// received, length bytes each; for a command, the LowLevelCommand (see
+// slow_control.proto) as received from the server, length bytes. All fields
+// are in the Pi's byte order (little-endian). Records are written in the
+// order they happen, and times are CLOCK_MONOTONIC, so captures of
+// backplanes driven together can be merged by time.
+const char SPI_CAPTURE_MAGIC[8] = {'S', 'P', 'I', 'C', 'A', 'P', 'T', '\0'};
+const uint32_t SPI_CAPTURE_VERSION = 1;
+
+struct SpiCaptureHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t backplane; // index of the backplane captured
+    // Time the capture started, since the Unix epoch and CLOCK_MONOTONIC
+    int64_t start_unix_usec;
+    uint64_t start_nsec;
+};
+
+enum SpiCaptureRecordType {
+    SPI_CAPTURE_TRANSFER = 1,
+    SPI_CAPTURE_COMMAND = 2
+};
+
+struct SpiCaptureRecord {
+    uint32_t type;
+    uint32_t length; // bytes of each part of the payload
+    uint64_t time_nsec; // at the start of the transfer, or on receipt
+    // Of a transfer: how long the batch carrying it took, and the delay
+    // asked for after it
+    uint32_t duration_nsec;
+    uint32_t delay_usec;
+};
+
+// A transfer as captured
+struct CapturedTransfer {
+    uint64_t time_nsec;
+    uint32_t duration_nsec;
+    uint32_t delay_usec;
+    std::string sent;
+    std::string received;
+};
+
+// A command as captured
+struct CapturedCommand {
+    uint64_t time_nsec;
+    std::string command; // serialized LowLevelCommand
+};
+
+// A whole capture file as read
+struct SpiCapture {
+    SpiCaptureHeader header;
+    std::vector<CapturedTransfer> transfers;
+    std::vector<CapturedCommand> commands;
+};
+
+// Read a capture file
+// Return true if successful, false otherwise
+bool read_spi_capture(std::string file_name, SpiCapture &capture);
+
+// Writes the capture of one backplane, from any thread
+class SpiCaptureWriter {
+protected:
+    std::mutex write_mutex;
+    std::ofstream file;
+    std::string file_name;
+    // Write a record, with its payload in up to two parts
+    void write_record(const SpiCaptureRecord &record, const char *first,
+            const char *second);
+public:
+    // Open the file, writing its header
+    // Return true if successful, false otherwise
+    bool open(std::string name, int backplane);
+    void write_transfer(uint64_t time_nsec, uint32_t duration_nsec,
+            uint32_t delay_usec, const char *sent, const char *received,
+            unsigned int length);
+    void write_command(uint64_t time_nsec, const std::string &command);
+};
+
+// Passes transfers on to another backend, capturing each
+class CapturingBackend : public SpiBackend {
+protected:
+    std::unique_ptr<SpiBackend> backend;
+    std::shared_ptr<SpiCaptureWriter> writer;
+public:
+    CapturingBackend(SpiBackend *captured,
+            std::shared_ptr<SpiCaptureWriter> capture_writer) :
+        backend(captured), writer(capture_writer) {}
+    bool initialize();
+    void transfer(const char *tbuf, char *rbuf, unsigned int length);
+    void transfer_segments(const SpiSegment segments[], int n);
+};
+
+// Transfers searched for one matching what is sent, from the oldest not yet
+// replayed
+const std::size_t REPLAY_SEARCH_WINDOW = 4096;
+
+// Replays a capture: each transfer is answered with the reply captured for
+// the oldest transfer not yet replayed that sent the same bytes, so replies
+// come back in the order captured even if threads sharing the backplane
+// interleave their messages differently. A transfer with no match is
+// answered with zeros, which fail the reply checks. Nothing waits: the
+// delays between segments are skipped, so a capture replays as fast as the
+// program sends.
+class ReplayBackend : public SpiBackend {
+protected:
+    std::string file_name;
+    std::vector<CapturedTransfer> transfers;
+    std::vector<bool> replayed;
+    std::size_t next; // oldest transfer not yet replayed
+public:
+    ReplayBackend(std::string capture_file) : file_name(capture_file),
+        next(0) {}
+    bool initialize();
+    void transfer(const char *tbuf, char *rbuf, unsigned int length);
+    void transfer_segments(const SpiSegment segments[], int n);
+};
+
+// Counts of transfers replayed by all replay backends
+struct ReplayCounts {
+    uint64_t matched;
+    uint64_t unmatched;
+    uint64_t captured; // transfers in the captures
+};
+ReplayCounts replay_counts();
+
+#endif
@@ -0,0 +1,109 @@
+// spi_journal.cc
+// Implementation of the journal of SPI messages
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "spi_journal.h"
+
+// Each slot is written as a seqlock: its sequence number is cleared, the
+// fields written, then the sequence number set, so that a reader which finds
+// the same number before and after reading the fields knows they're whole.
+// The fields are atomic (and relaxed), so nothing is ever torn mid-word.
+struct JournalSlot {
+    std::atomic<uint64_t> sequence; // 0 while being written
+    std::atomic<uint64_t> start_nsec;
+    std::atomic<uint64_t> end_nsec;
+    // Command word, command code, source, checks, and backplane, from the
+    // low bits up
+    std::atomic<uint64_t> details;
+};
+
+JournalSlot journal[SPI_JOURNAL_SIZE];
+// Sequence number last given out
+std::atomic<uint64_t> journal_sequence(0);
+
+// What the calling thread's messages are sent for
+thread_local uint8_t journal_source = SPI_SOURCE_OTHER;
+thread_local uint16_t journal_command_code = 0;
+
+const char *spi_source_names[NUM_SPI_SOURCES] = {
+    "other",
+    "command",
+    "sampler",
+    "hit_patterns",
+    "trigger_rates"
+};
+
+void set_spi_journal_source(int source, int command_code)
+{
+    journal_source = source;
+    journal_command_code = command_code;
+}
+
+uint64_t monotonic_nsec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void journal_spi_message(SpiJournalEntry &entry)
+{
+    entry.sequence = journal_sequence.fetch_add(1,
+            std::memory_order_relaxed) + 1;
+    entry.source = journal_source;
+    entry.command_code = journal_command_code;
+    JournalSlot &slot = journal[entry.sequence % SPI_JOURNAL_SIZE];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.start_nsec.store(entry.start_nsec, std::memory_order_relaxed);
+    slot.end_nsec.store(entry.end_nsec, std::memory_order_relaxed);
+    slot.details.store((uint64_t)entry.command_word
+            | (uint64_t)entry.command_code << 16
+            | (uint64_t)entry.source << 32
+            | (uint64_t)entry.checks_passed << 40
+            | (uint64_t)entry.backplane << 48,
+            std::memory_order_relaxed);
+    slot.sequence.store(entry.sequence, std::memory_order_release);
+}
+
+int read_spi_journal(SpiJournalEntry entries[], int max_entries)
+{
+    uint64_t last = journal_sequence.load(std::memory_order_acquire);
+    uint64_t n = std::min<uint64_t>(std::min<uint64_t>(last,
+                SPI_JOURNAL_SIZE), std::max(max_entries, 0));
+    int n_copied = 0;
+    for (uint64_t sequence = last - n + 1; sequence <= last; sequence++) {
+        const JournalSlot &slot = journal[sequence % SPI_JOURNAL_SIZE];
+        if (slot.sequence.load(std::memory_order_acquire) != sequence) {
+            continue; // being written, or already overwritten
+        }
+        SpiJournalEntry &entry = entries[n_copied];
+        entry.sequence = sequence;
+        entry.start_nsec = slot.start_nsec.load(std::memory_order_relaxed);
+        entry.end_nsec = slot.end_nsec.load(std::memory_order_relaxed);
+        uint64_t details = slot.details.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            continue; // overwritten while copying
+        }
+        entry.command_word = details & 0xffff;
+        entry.command_code = (details >> 16) & 0xffff;
+        entry.source = (details >> 32) & 0xff;
+        entry.checks_passed = (details >> 40) & 0xff;
+        entry.backplane = (details >> 48) & 0xff;
+        n_copied++;
+    }
+    return n_copied;
+}
+
+const char *spi_journal_source_name(int source)
+{
+    if ((source < 0) || (source >= NUM_SPI_SOURCES)) {
+        return "";
+    }
+    return spi_source_names[source];
+}
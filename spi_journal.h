@@ -0,0 +1,65 @@
+// spi_journal.h
+// Journal of the latest SPI messages sent to the backplane, with their
+// timing and the checks of their replies, kept in memory at all times so that
+// a misbehaving command can be looked into after the fact
+
+#ifndef SPI_JOURNAL_H
+#define SPI_JOURNAL_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Messages kept; older ones are overwritten
+const std::size_t SPI_JOURNAL_SIZE = 4096;
+
+// What sent a message
+enum SpiJournalSource {
+    SPI_SOURCE_OTHER, // anything not set up to say, such as spi_benchmark
+    SPI_SOURCE_COMMAND, // a command from the server, identified by its code
+    SPI_SOURCE_SAMPLER,
+    SPI_SOURCE_HIT_PATTERNS,
+    SPI_SOURCE_TRIGGER_RATES,
+    NUM_SPI_SOURCES
+};
+
+// Checks of a reply, set in checks_passed if passed (see transfer_messages()
+// in backplane_spi.cc for the reply's layout)
+const unsigned int SPI_CHECK_SOM = 0x1; // SOM echoed
+const unsigned int SPI_CHECK_CW = 0x2; // command word echoed
+const unsigned int SPI_CHECK_EOM = 0x4; // EOM matching the SOM sent
+const unsigned int SPI_CHECK_ALL = 0x7;
+
+// One message as journaled
+struct SpiJournalEntry {
+    uint64_t sequence; // of the message, counting from 1
+    // CLOCK_MONOTONIC, in ns, at the start and end of the transfer carrying
+    // the message, which may carry others
+    uint64_t start_nsec;
+    uint64_t end_nsec;
+    uint16_t command_word;
+    uint16_t command_code; // if sent for a command from the server
+    uint8_t source;
+    uint8_t checks_passed;
+    uint8_t backplane; // index of the backplane sent to
+};
+
+// Set what the messages sent by the calling thread are sent for, until set
+// again
+void set_spi_journal_source(int source, int command_code = 0);
+
+// Return CLOCK_MONOTONIC in ns
+uint64_t monotonic_nsec();
+
+// Journal a message sent by the calling thread, filling in its sequence
+// number and source. Writing doesn't lock, and threads may write at once.
+void journal_spi_message(SpiJournalEntry &entry);
+
+// Copy up to max_entries of the latest messages, oldest first, leaving out
+// any being overwritten as they're copied
+// Return the number copied
+int read_spi_journal(SpiJournalEntry entries[], int max_entries);
+
+// Return the name of a source, or empty string if none
+const char *spi_journal_source_name(int source);
+
+#endif
@@ -0,0 +1,165 @@
+// spi_protocol.h
+// Start/end of message and command words of the SPI messages understood by
+// the backplane housekeeping (HKFPGA) and trigger (TFPGA) FPGAs, and the
+// table of the messages sent to them
+
+#ifndef SPI_PROTOCOL_H
+#define SPI_PROTOCOL_H
+
+// Words in a message: SOM, CW, 8 data words, and EOM
+const int SPI_MESSAGE_WORDS = 11;
+// Words clocked on the bus for each message, which has a null word before
+// its EOM (see transfer_messages() in backplane_spi.cc)
+const int SPI_FRAME_WORDS = 12;
+
+// Modules whose ADC channels are read by each of the four read commands
+// (CW_RD_FEE0, CW_RD_FEE8, CW_RD_FEE16, and CW_RD_FEE24), in data word order
+const int ADC_CHANNEL_MODULES[4][8] = {
+    {5, 12, 6, 17, 7, 13, 11, 18},
+    {4, 10, 1, 0, 3, 2, 16, 22},
+    {28, 24, 30, 23, 31, 29, 26, 25},
+    {20, 8, 27, 15, 9, 19, 21, 14}
+};
+
+/* Command Words */
+#define  SPI_WRAP_AROUND   	0x0000   /* cmd */
+#define  CW_RESET_FEE   	0x0100   /* cmd */
+#define  CW_FEEs_PRESENT    0x0200   /* cmd */
+#define  CW_FEE_POWER_CTL   0x0400   /* cmd */
+#define  CW_RD_FEE0_I	    0x0500   /* cmd */
+#define  CW_RD_FEE8_I	    0x0507   /* cmd */
+#define  CW_RD_FEE16_I	    0x050F   /* cmd */
+#define  CW_RD_FEE24_I	    0x0510   /* cmd */
+#define  CW_RD_FEE0_V	    0x0600   /* cmd */
+#define  CW_RD_FEE8_V	    0x0607   /* cmd */
+#define  CW_RD_FEE16_V	    0x060F   /* cmd */
+#define  CW_RD_FEE24_V	    0x0610   /* cmd */
+#define  CW_RD_ENV          0x0700   /* cmd */
+#define  CW_RD_HKPWB	    0x0800   /* cmd */
+#define  CW_PERI_TRIG       0x0900   /* cmd */
+#define  CW_TRG_ADCS	    0x0A00   /* cmd */
+#define  CW_RD_PWRSTATUS    0x0B00   /* cmd */
+#define  CW_DACQ1_PWR_RESET  0x0C00   /* cmd */
+#define  CW_DACQ2_PWR_RESET  0x0D00   /* cmd */
+#define  SPI_SOM_HKFPGA		0xeb90 // Start of Message HKFPGA
+#define  SPI_EOM_HKFPGA		0xeb09 // End of Message HKFPGA
+
+#define  SPI_SOM_TFPGA		0xeb91 // Start of Message TFPGA
+#define  SPI_EOM_TFPGA		0xeb0a // End of Message TFPGA
+#define  SPI_WRAP_AROUND_TFPGA	0x0000   /* cmd */
+
+#define  SPI_SET_nsTimer_TFPGA   	0x0100   /* cmd */
+#define  SPI_READ_nsTimer_TFPGA   	0x0200   /* cmd */
+#define  SPI_TRIGGERMASK_TFPGA  0x0300 /* cmd */
+#define  SPI_TRIGGERMASK1_TFPGA 0x0400 /* cmd */
+#define  SPI_TRIGGERMASK2_TFPGA 0x0500 /* cmd */
+#define  SPI_TRIGGERMASK3_TFPGA 0x0600 /* cmd */
+#define  SPI_READ_TRIGGER_NSTIMER_TFPGA	0x0700   /* cmd */
+#define  SPI_HOLDOFF_TFPGA   	0x0800   /* cmd */
+#define  SPI_TRIGGER_TFPGA   	0x0900   /* cmd */
+#define  SPI_L1_TRIGGER_EN 0x0a00  /* cmd */
+#define  RESET_TRIGGER_COUNT_AND_NSTIMER 0x0b00 /* cmd */
+#define  SPI_READ_HIT_PATTERN   	0x0c00   /* cmd */
+#define  SPI_READ_HIT_PATTERN1   	0x0d00   /* cmd */
+#define  SPI_READ_HIT_PATTERN2   	0x0e00   /* cmd */
+#define  SPI_READ_HIT_PATTERN3   	0x0f00   /* cmd */
+#define  SPI_SET_ARRAY_SERDES_CONFIG 0x1000  /* cmd */
+#define  SPI_SET_TACK_TYPE_MODE 0x1100 /* cmd */
+#define  SPI_SET_TRIG_AT_TIME 0x1200 /* cmd */
+#define  SPI_READ_DIAT_WORDS 0x1300 /* cmd */
+
+#define  DWnull   	0x0000   /* zero word */
+
+// Data words of a message that don't carry parameters are sent as one of
+// these fills, as they always have been; the FPGAs ignore them
+#define SPI_FILL_COUNTING {0x0111, 0x1222, 0x2333, 0x3444, 0x4555, 0x5666, \
+    0x6777, 0x7888}
+#define SPI_FILL_ADC {0x0111, 0x1222, 0x2333, 0x3444, 0x4555, 0x5666, \
+    0x0000, 0x0088}
+#define SPI_FILL_INDEX {0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, \
+    0x0007, 0x0008}
+#define SPI_FILL_ZERO {0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, \
+    0x0000, 0x0000}
+
+// Whether a message whose reply fails its checks may be sent again, and how
+// many more times
+enum SpiRetryPolicy {
+    RETRY_IF_FAILED,
+    NEVER_RETRY
+};
+const int MAX_SPI_RETRIES = 2;
+
+// The messages sent to the backplane, one per line as
+//     X(message, FPGA, command word, parameters, fill, retry policy)
+// where the parameters are the number of data words, from the first, set
+// when the message is sent, the others being sent as the fill, and the
+// retry policy says whether a message whose reply fails its checks may be
+// sent again (see backplane_spi.h). The frame of each message is built from
+// this table at compile time (see backplane_spi.cc) and only its parameters
+// filled in when sent. Messages sent to each block of eight modules are
+// listed in block order, so that block n's is the first's plus n.
+#define SPI_MESSAGES(X) \
+    X(SPI_MSG_TRIGGER_ADCS, HKFPGA, CW_TRG_ADCS, 0, ADC, NEVER_RETRY) \
+    X(SPI_MSG_READ_CURRENTS_0, HKFPGA, CW_RD_FEE0_I, 0, ADC, RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_CURRENTS_8, HKFPGA, CW_RD_FEE8_I, 0, ADC, RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_CURRENTS_16, HKFPGA, CW_RD_FEE16_I, 0, ADC, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_CURRENTS_24, HKFPGA, CW_RD_FEE24_I, 0, ADC, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_VOLTAGES_0, HKFPGA, CW_RD_FEE0_V, 0, ADC, RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_VOLTAGES_8, HKFPGA, CW_RD_FEE8_V, 0, ADC, RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_VOLTAGES_16, HKFPGA, CW_RD_FEE16_V, 0, ADC, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_VOLTAGES_24, HKFPGA, CW_RD_FEE24_V, 0, ADC, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_FEES_PRESENT, HKFPGA, CW_FEEs_PRESENT, 0, COUNTING, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_POWER_CONTROL, HKFPGA, CW_FEE_POWER_CTL, 2, COUNTING, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_RESET_DACQ1_POWER, HKFPGA, CW_DACQ1_PWR_RESET, 0, COUNTING, \
+            NEVER_RETRY) \
+    X(SPI_MSG_RESET_DACQ2_POWER, HKFPGA, CW_DACQ2_PWR_RESET, 0, COUNTING, \
+            NEVER_RETRY) \
+    X(SPI_MSG_L1_TRIGGER_ENABLE, TFPGA, SPI_L1_TRIGGER_EN, 1, INDEX, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_NSTIMER, TFPGA, SPI_READ_nsTimer_TFPGA, 0, INDEX, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_RESET_TRIGGER_AND_NSTIMER, TFPGA, \
+            RESET_TRIGGER_COUNT_AND_NSTIMER, 0, COUNTING, NEVER_RETRY) \
+    X(SPI_MSG_SET_HOLDOFF, TFPGA, SPI_HOLDOFF_TFPGA, 1, INDEX, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_SET_TACK_TYPE_MODE, TFPGA, SPI_SET_TACK_TYPE_MODE, 1, INDEX, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_SET_TRIGGER_AT_TIME, TFPGA, SPI_SET_TRIG_AT_TIME, 4, INDEX, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_SET_TRIGGER_MASK_0, TFPGA, SPI_TRIGGERMASK_TFPGA, 8, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_SET_TRIGGER_MASK_8, TFPGA, SPI_TRIGGERMASK1_TFPGA, 8, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_SET_TRIGGER_MASK_16, TFPGA, SPI_TRIGGERMASK2_TFPGA, 8, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_SET_TRIGGER_MASK_24, TFPGA, SPI_TRIGGERMASK3_TFPGA, 8, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_HIT_PATTERN_0, TFPGA, SPI_READ_HIT_PATTERN, 0, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_HIT_PATTERN_8, TFPGA, SPI_READ_HIT_PATTERN1, 0, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_HIT_PATTERN_16, TFPGA, SPI_READ_HIT_PATTERN2, 0, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_READ_HIT_PATTERN_24, TFPGA, SPI_READ_HIT_PATTERN3, 0, ZERO, \
+            RETRY_IF_FAILED) \
+    X(SPI_MSG_SYNC_SET_TACK_TYPE_MODE, TFPGA, SPI_SET_TACK_TYPE_MODE, 4, \
+            ZERO, NEVER_RETRY) \
+    X(SPI_MSG_SYNC_SET_TRIGGER_AT_TIME, TFPGA, SPI_SET_TRIG_AT_TIME, 4, \
+            ZERO, NEVER_RETRY) \
+    X(SPI_MSG_SYNC_RESET_NSTIMER, TFPGA, RESET_TRIGGER_COUNT_AND_NSTIMER, 4, \
+            ZERO, NEVER_RETRY)
+
+enum SpiMessage {
+#define SPI_MESSAGE_ID(message, fpga, cw, n_parameters, fill, retry) message,
+    SPI_MESSAGES(SPI_MESSAGE_ID)
+#undef SPI_MESSAGE_ID
+    NUM_SPI_MESSAGES
+};
+
+#endif
@@ -0,0 +1,159 @@
+// spi_replay.cc
+/* Run the Pi's command handling against captures made with slow_control_pi
+ * -r, one for each backplane, without a backplane or a server. The commands
+ * captured are performed in the order received, each once the one before
+ * has finished, and their SPI messages answered with the replies captured
+ * (see ReplayBackend in spi_capture.h). The result of each command is
+ * written to standard output, less its timing and any SPI journal read, so
+ * that the output of runs of different versions of the program can be
+ * compared; how long the replay took against the capture is written to
+ * standard error. */
+
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "backplane_control.h"
+#include "spi_capture.h"
+
+// A command captured from one of the backplanes
+struct ReplayedCommand {
+    uint64_t time_nsec;
+    int backplane;
+    PendingCommand pending;
+};
+
+void print_usage()
+{
+    std::cerr << "usage: spi_replay [-t] [-a adc_conversion_usec] "
+        << "capture_file..." << std::endl;
+    std::cerr << "  -t  send the commands at the times captured, rather than "
+        << "as fast as" << std::endl
+        << "      they're performed" << std::endl;
+    std::cerr << "  -a  time the ADCs are given to convert (0 by default)"
+        << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    bool captured_timing = false;
+    set_adc_conversion_time(0);
+    int option;
+    while ((option = getopt(argc, argv, "ta:")) != -1) {
+        switch (option) {
+            case 't':
+                captured_timing = true;
+                break;
+            case 'a':
+                set_adc_conversion_time(std::atoi(optarg));
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (optind == argc) {
+        print_usage();
+        return 1;
+    }
+
+    // Replay each capture as a backplane, and merge their commands
+    std::vector<ReplayedCommand> commands;
+    for (int i = optind; i < argc; i++) {
+        SpiCapture capture;
+        if (!read_spi_capture(argv[i], capture)) {
+            return 1;
+        }
+        int index = add_backplane(std::string("replay:") + argv[i]);
+        if (index < 0) {
+            std::cerr << "Error: could not replay " << argv[i] << std::endl;
+            return 1;
+        }
+        for (auto it = capture.commands.begin(); it != capture.commands.end();
+                ++it) {
+            ReplayedCommand command;
+            command.time_nsec = it->time_nsec;
+            command.backplane = index;
+            if (!command.pending.command.ParseFromString(it->command)) {
+                std::cerr << "Error: could not parse a command in "
+                    << argv[i] << std::endl;
+                return 1;
+            }
+            commands.push_back(command);
+        }
+    }
+    select_backplane(0);
+    std::stable_sort(commands.begin(), commands.end(),
+            [](const ReplayedCommand &a, const ReplayedCommand &b) {
+                return a.time_nsec < b.time_nsec; });
+    if (commands.empty()) {
+        std::cerr << "Error: no commands captured" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<BackplaneControl>> backplanes;
+    for (int i = 0; i < num_backplanes(); i++) {
+        backplanes.emplace_back(new BackplaneControl(i));
+        backplanes.back()->start_command_thread(CommandThreadSettings());
+    }
+
+    // Perform the commands one at a time, writing each result
+    auto start = std::chrono::steady_clock::now();
+    CommandResult result;
+    slow_control::BackplaneVariables streamed;
+    for (auto it = commands.begin(); it != commands.end(); ++it) {
+        if (captured_timing) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(
+                        it->time_nsec - commands.front().time_nsec));
+        }
+        BackplaneControl &backplane = *backplanes[it->backplane];
+        uint64_t n_done = backplane.commands_done();
+        it->pending.time_received = std::chrono::steady_clock::now();
+        backplane.queue_command(it->pending);
+        backplane.wake_command_thread();
+        while (backplane.commands_done() == n_done) {
+            std::this_thread::yield();
+        }
+        while (backplane.next_result(result)) {
+            // The journal holds the messages of the threads streaming
+            // readings too, as they happened to interleave, so it's left
+            // out with the timing
+            result.variables.clear_command_duration_usec();
+            result.variables.clear_time_usec();
+            result.variables.clear_monotonic_usec();
+            result.variables.clear_spi_journal();
+            if (result.variables.has_snapshot()) {
+                result.variables.mutable_snapshot()->clear_time_usec();
+            }
+            std::cout << "backplane " << it->backplane << ": "
+                << result.variables.ShortDebugString() << std::endl;
+        }
+        // Anything streamed meanwhile depends on timing, so isn't compared
+        streamed.Clear();
+        backplane.add_samples(streamed);
+        backplane.add_hit_patterns(streamed);
+        backplane.add_trigger_rates(streamed);
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double captured = 1e-9 * (commands.back().time_nsec
+            - commands.front().time_nsec);
+
+    ReplayCounts counts = replay_counts();
+    std::cerr << commands.size() << " commands replayed in "
+        << elapsed.count() << " s, captured over " << captured << " s";
+    if (elapsed.count() > 0) {
+        std::cerr << " (" << captured / elapsed.count() << " times as fast)";
+    }
+    std::cerr << std::endl << counts.matched << " transfers replayed, "
+        << counts.unmatched << " not found in the captures, "
+        << counts.captured - counts.matched << " captured not replayed"
+        << std::endl;
+    return (counts.unmatched == 0) ? 0 : 2;
+}
@@ -0,0 +1,61 @@
+// spsc_ring.h
+// Fixed size ring passing items from one thread to another without locking
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <cstddef>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// All slots are allocated up front, and items are copied into and swapped
+// out of them, so that once every slot has been used an item that keeps its
+// own buffers (such as a protobuf message) causes no further allocation.
+// Only one thread may push and only one thread may pop.
+template <typename T>
+class SpscRing {
+protected:
+    std::vector<T> items;
+    std::atomic<std::size_t> head; // next slot written, by the writer only
+    std::atomic<std::size_t> tail; // next slot read, by the reader only
+public:
+    SpscRing(std::size_t capacity) : items(capacity + 1), head(0), tail(0) {}
+
+    // Add an item
+    // Return false, dropping the item, if the ring is full
+    bool push(const T &item)
+    {
+        std::size_t write = head.load(std::memory_order_relaxed);
+        std::size_t next = (write + 1) % items.size();
+        if (next == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        items[write] = item;
+        head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Take the oldest item
+    // Return false if the ring is empty
+    bool pop(T &item)
+    {
+        std::size_t read = tail.load(std::memory_order_relaxed);
+        if (read == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        using std::swap;
+        swap(item, items[read]);
+        tail.store((read + 1) % items.size(), std::memory_order_release);
+        return true;
+    }
+
+    // Return true if there is nothing to pop, as seen by either thread
+    bool empty() const
+    {
+        return (tail.load(std::memory_order_acquire) ==
+                head.load(std::memory_order_acquire));
+    }
+};
+
+#endif
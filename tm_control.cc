@@ -6,11 +6,19 @@
 #include <vector>
 
 #include "tm_control.h"
+#include "clock_sync.h"
 
 bool TMControl::synchronize_network()
 {
     // Send data to and receive settings from server
     if (updates_to_send) {
+        if (echo_server_send_usec != 0) {
+            fill_clock_echo(echo_server_send_usec, echo_receive_usec,
+                    *target_variables.mutable_clock_echo());
+            echo_server_send_usec = 0;
+        } else {
+            target_variables.clear_clock_echo();
+        }
         std::string target_variables_message;
         target_variables.SerializeToString(&target_variables_message);
         if (!update_network(netinfo, target_variables_message)) {
@@ -29,9 +37,14 @@ bool TMControl::synchronize_network()
         if ((iter->device == SERVER) &&
                 (iter->recv_status == MSG_DONE)) {
             iter->recv_status = MSG_STANDBY;
+            int64_t receive_usec = monotonic_time_usec();
             if (!target_command.ParseFromString(iter->message)) {
                 return false;
             }
+            if (target_command.has_server_time_usec()) {
+                echo_server_send_usec = target_command.server_time_usec();
+                echo_receive_usec = receive_usec;
+            }
             std::cout << "Received command." << std::endl; 
         }
     }
@@ -56,5 +69,7 @@ void TMControl::save_updated_variables()
 {
     std::cout << "Functionality to save variables is not yet implemented!!"
         << std::endl;
+    target_variables.set_time_usec(unix_time_usec());
+    target_variables.set_monotonic_usec(monotonic_time_usec());
     updates_to_send = true;
 }
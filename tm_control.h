@@ -4,6 +4,7 @@
 #ifndef TM_CONTROL_H
 #define TM_CONTROL_H
 
+#include <cstdint>
 #include <string>
 
 #include "network.h"
@@ -15,9 +16,16 @@ protected:
     slow_control::TargetVariables target_variables;
     slow_control::LowLevelCommand target_command;
     bool updates_to_send;
+    // Time the server sent the latest command, and the time it was received
+    // on the monotonic clock, to echo with the next update (see
+    // clock_sync.h); 0 once echoed
+    int64_t echo_server_send_usec;
+    int64_t echo_receive_usec;
 public:
     TMControl(std::string hostname) : netinfo(TM, hostname) {
         updates_to_send = false;
+        echo_server_send_usec = 0;
+        echo_receive_usec = 0;
     }
     bool synchronize_network();
     bool command_received();
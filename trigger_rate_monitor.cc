@@ -0,0 +1,146 @@
+// trigger_rate_monitor.cc
+// Implementation of trigger and TACK rate measurement on the Pi
+
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+
+#include "trigger_rate_monitor.h"
+#include "clock_sync.h"
+#include "spi_protocol.h"
+
+void CounterRateTracker::add(uint32_t count, uint64_t interval_nsec)
+{
+    double rate_hz = 1e9 * count / interval_nsec;
+    if (!smoothed_valid) {
+        smoothed_hz = rate_hz;
+        smoothed_valid = true;
+    } else {
+        // Weighted by the length of the interval, so that the time constant
+        // holds however often the counters are read
+        double weight = 1 - std::exp(-1e-9 * interval_nsec
+                / RATE_SMOOTHING_TIME_SEC);
+        smoothed_hz += weight * (rate_hz - smoothed_hz);
+    }
+    if (window_empty) {
+        min_hz = max_hz = rate_hz;
+        window_empty = false;
+    } else {
+        min_hz = std::min(min_hz, rate_hz);
+        max_hz = std::max(max_hz, rate_hz);
+    }
+    window_count += count;
+}
+
+void CounterRateTracker::finish_window(uint64_t window_nsec,
+        CounterRates &rates)
+{
+    rates.count = window_count;
+    rates.mean_hz = (window_nsec > 0) ? 1e9 * window_count / window_nsec : 0;
+    rates.min_hz = min_hz;
+    rates.max_hz = max_hz;
+    rates.smoothed_hz = smoothed_hz;
+    window_empty = true;
+    window_count = 0;
+    min_hz = max_hz = 0;
+}
+
+void CounterRateTracker::reset()
+{
+    smoothed_hz = 0;
+    smoothed_valid = false;
+    window_empty = true;
+    window_count = 0;
+    min_hz = max_hz = 0;
+}
+
+bool TriggerRateCalculator::add(const TriggerCounters &counters)
+{
+    bool measured = false;
+    if (have_last && (counters.nstimer > last.nstimer)) {
+        uint64_t interval_nsec = counters.nstimer - last.nstimer;
+        trigger.add(counters.trigger_count - last.trigger_count,
+                interval_nsec);
+        tack.add(counters.tack_count - last.tack_count, interval_nsec);
+        window_nsec += interval_nsec;
+        n_intervals++;
+        measured = true;
+    }
+    last = counters;
+    have_last = true;
+    return measured;
+}
+
+bool TriggerRateCalculator::finish_window(int64_t time_usec,
+        TriggerRateRecord &record)
+{
+    if (n_intervals == 0) {
+        return false;
+    }
+    record.time_usec = time_usec;
+    record.window_nsec = window_nsec;
+    record.n_intervals = n_intervals;
+    trigger.finish_window(window_nsec, record.trigger);
+    tack.finish_window(window_nsec, record.tack);
+    window_nsec = 0;
+    n_intervals = 0;
+    return true;
+}
+
+void TriggerRateCalculator::reset()
+{
+    have_last = false;
+    window_nsec = 0;
+    n_intervals = 0;
+    trigger.reset();
+    tack.reset();
+}
+
+TriggerRateMonitor::TriggerRateMonitor(std::mutex &spi_bus_mutex,
+        int backplane_index) :
+    record_period_msec(0),
+    reader(spi_bus_mutex, backplane_index, SPI_SOURCE_TRIGGER_RATES,
+            RATE_RECORD_BUFFER_SIZE,
+            [this](TriggerRateRecord &record) {
+                return read_counters(record); },
+            [this]() { restart(); })
+{
+}
+
+void TriggerRateMonitor::set_periods(int read_msec, int record_msec)
+{
+    record_period_msec = (record_msec > 0) ? record_msec : 0;
+    reader.set_period(1000LL * read_msec);
+}
+
+void TriggerRateMonitor::restart()
+{
+    calculator.reset();
+    record_due = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(record_period_msec);
+}
+
+bool TriggerRateMonitor::read_counters(TriggerRateRecord &record)
+{
+    unsigned short spi_command[SPI_MESSAGE_WORDS];
+    unsigned short spi_data[SPI_MESSAGE_WORDS];
+    read_nstimer_trigger_rate(spi_command, spi_data);
+    // A read whose reply failed its checks is skipped, so the interval
+    // measured spans it
+    if (take_thread_check_counts().unrecovered == 0) {
+        TriggerCounters counters;
+        decode_trigger_counters(spi_data, counters);
+        calculator.add(counters);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::milliseconds record_period(record_period_msec);
+    if ((record_period.count() == 0) || (now < record_due)) {
+        return false;
+    }
+    record_due += record_period;
+    if (record_due <= now) {
+        record_due = now + record_period;
+    }
+    return calculator.finish_window(unix_time_usec(), record);
+}
@@ -0,0 +1,119 @@
+// trigger_rate_monitor.h
+// Measurement of the trigger and TACK rates on the Pi from the TFPGA timer
+// and counters, read at a set period, into records drained by the network
+// loop
+
+#ifndef TRIGGER_RATE_MONITOR_H
+#define TRIGGER_RATE_MONITOR_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include "backplane_spi.h"
+#include "periodic_spi_reader.h"
+
+// Records held awaiting sending, about 17 minutes at 1 Hz
+const std::size_t RATE_RECORD_BUFFER_SIZE = 1024;
+// Time constant of the smoothed rates
+const double RATE_SMOOTHING_TIME_SEC = 10.0;
+
+// Rates of one counter over a window of reads
+struct CounterRates {
+    uint32_t count; // counted over the window
+    float mean_hz; // count over the timer time of the window
+    float min_hz; // lowest and highest over one interval between reads
+    float max_hz;
+    float smoothed_hz; // exponentially weighted over RATE_SMOOTHING_TIME_SEC
+};
+
+// The rates over one window
+struct TriggerRateRecord {
+    int64_t time_usec; // since the epoch, at the last read of the window
+    uint64_t window_nsec; // timer time covered by the intervals
+    uint32_t n_intervals; // between reads, each giving a rate
+    CounterRates trigger;
+    CounterRates tack;
+};
+
+// Rates of one counter, interval by interval
+class CounterRateTracker {
+protected:
+    double smoothed_hz;
+    bool smoothed_valid;
+    bool window_empty;
+    uint64_t window_count;
+    double min_hz;
+    double max_hz;
+public:
+    CounterRateTracker() : smoothed_hz(0), smoothed_valid(false),
+        window_empty(true), window_count(0), min_hz(0), max_hz(0) {}
+    // Add the count over an interval of interval_nsec, which must not be 0
+    void add(uint32_t count, uint64_t interval_nsec);
+    // Fill in the rates over the window so far, of window_nsec, and start
+    // the next window; the smoothed rate carries over
+    void finish_window(uint64_t window_nsec, CounterRates &rates);
+    // Forget the smoothed rate as well
+    void reset();
+};
+
+// Rates from successive reads of the timer and counters. Differences are
+// wrap-safe: the counters are 32 bits, so they're differenced modulo 2^32,
+// which is right while fewer than 2^32 are counted between reads; the timer
+// is 64 bits, enough ns for centuries, so it running backwards means it was
+// reset, and the interval across the reset is skipped.
+class TriggerRateCalculator {
+protected:
+    TriggerCounters last;
+    bool have_last;
+    uint64_t window_nsec;
+    uint32_t n_intervals;
+    CounterRateTracker trigger;
+    CounterRateTracker tack;
+public:
+    TriggerRateCalculator() : have_last(false), window_nsec(0),
+        n_intervals(0) {}
+    // Add a read of the timer and counters
+    // Return false if there was no interval to measure: the first read, or
+    // the timer was reset or hadn't moved
+    bool add(const TriggerCounters &counters);
+    // Fill in the rates since the last record, and start the next window
+    // Return false, filling in nothing, if no interval has been measured
+    bool finish_window(int64_t time_usec, TriggerRateRecord &record);
+    // Forget everything, to start again from the next read
+    void reset();
+};
+
+// Thread reading the timer and counters at a set period (see
+// PeriodicSpiReader), and making a record of the rates every record period
+class TriggerRateMonitor {
+protected:
+    // Used by the reader's thread only
+    TriggerRateCalculator calculator;
+    std::chrono::steady_clock::time_point record_due;
+    // Record period in ms, taken up by the reader's thread as it restarts
+    std::atomic<int> record_period_msec;
+    PeriodicSpiReader<TriggerRateRecord> reader; // last, as it starts reading
+
+    // Start again from the next read, with the record period set
+    void restart();
+    // Read the timer and counters, and make a record if one is due
+    // Return true if a record was made
+    bool read_counters(TriggerRateRecord &record);
+public:
+    TriggerRateMonitor(std::mutex &spi_bus_mutex, int backplane_index);
+    // Start reading every read_msec ms, making a record every record_msec
+    // ms (at least every read; none if 0), or pause if read_msec is 0; rates
+    // start again from the first read
+    void set_periods(int read_msec, int record_msec);
+    // Take the oldest record not yet taken
+    // Return false if there is none
+    bool next_record(TriggerRateRecord &record) { return reader.pop(record); }
+    // Return the number of records dropped because the buffer was full
+    // since the last call, and reset the count
+    uint32_t take_dropped_count() { return reader.take_dropped_count(); }
+};
+
+#endif
@@ -0,0 +1,172 @@
+// trigger_rate_monitor_test.cc
+/* Check the rates TriggerRateCalculator (see trigger_rate_monitor.h) makes of
+ * given reads of the timer and counters: counts across the 2^32 wrap of the
+ * counters, the interval across a timer reset being skipped, the lowest and
+ * highest rates between reads of each window, and the smoothed rate carried
+ * from one record to the next.
+ * Exits with status 1 if any rate differs from what it should be. */
+
+#include <cmath>
+#include <iostream>
+#include <string>
+
+#include "trigger_rate_monitor.h"
+
+const uint64_t SECOND_NSEC = 1000000000;
+
+int n_failed = 0;
+
+void check(bool passed, const std::string &what)
+{
+    if (!passed) {
+        std::cout << "FAIL: " << what << std::endl;
+        n_failed++;
+    }
+}
+
+// Check a rate, in single precision as recorded, to a part in 10^6
+void check_rate(float rate_hz, double expected_hz, const std::string &what)
+{
+    check(std::fabs(rate_hz - expected_hz) <= 1e-6 * std::fabs(expected_hz),
+            what + " " + std::to_string(rate_hz) + " Hz, not "
+            + std::to_string(expected_hz));
+}
+
+// Add a read, returning whether it measured an interval
+bool add_read(TriggerRateCalculator &calculator, uint64_t nstimer,
+        uint32_t trigger_count, uint32_t tack_count)
+{
+    TriggerCounters counters;
+    counters.nstimer = nstimer;
+    counters.trigger_count = trigger_count;
+    counters.tack_count = tack_count;
+    return calculator.add(counters);
+}
+
+void check_counter_wrap()
+{
+    TriggerRateCalculator calculator;
+    check(!add_read(calculator, SECOND_NSEC, 0xFFFFFF00u, 0xFFFFFFFFu),
+            "wrap: first read measured");
+    check(add_read(calculator, 2 * SECOND_NSEC, 0x00000100u, 0x00000009u),
+            "wrap: interval not measured");
+    TriggerRateRecord record;
+    check(calculator.finish_window(1, record), "wrap: no record");
+    check(record.trigger.count == 0x200, "wrap: trigger count "
+            + std::to_string(record.trigger.count));
+    check(record.tack.count == 10, "wrap: TACK count "
+            + std::to_string(record.tack.count));
+    check_rate(record.trigger.mean_hz, 512, "wrap: trigger rate");
+    check_rate(record.tack.mean_hz, 10, "wrap: TACK rate");
+}
+
+void check_timer_reset()
+{
+    TriggerRateCalculator calculator;
+    add_read(calculator, 5 * SECOND_NSEC, 500, 50);
+    check(add_read(calculator, 6 * SECOND_NSEC, 600, 60),
+            "reset: interval before the reset not measured");
+    // Reset between reads: the timer and counters start again from 0
+    check(!add_read(calculator, SECOND_NSEC / 2, 25, 5),
+            "reset: interval across the reset measured");
+    // A timer that hasn't moved gives no interval either
+    check(!add_read(calculator, SECOND_NSEC / 2, 25, 5),
+            "reset: interval of no time measured");
+    check(add_read(calculator, 3 * SECOND_NSEC / 2, 325, 35),
+            "reset: interval after the reset not measured");
+    TriggerRateRecord record;
+    check(calculator.finish_window(1, record), "reset: no record");
+    check(record.n_intervals == 2, "reset: intervals "
+            + std::to_string(record.n_intervals));
+    check(record.window_nsec == 2 * SECOND_NSEC, "reset: window "
+            + std::to_string(record.window_nsec) + " ns");
+    check(record.trigger.count == 400, "reset: trigger count "
+            + std::to_string(record.trigger.count));
+    check(record.tack.count == 40, "reset: TACK count "
+            + std::to_string(record.tack.count));
+    check_rate(record.trigger.min_hz, 100, "reset: lowest trigger rate");
+    check_rate(record.trigger.max_hz, 300, "reset: highest trigger rate");
+}
+
+void check_extremes()
+{
+    TriggerRateCalculator calculator;
+    TriggerRateRecord record;
+    check(!calculator.finish_window(1, record), "extremes: empty record");
+    // Intervals of 1 s at 100 Hz, 2 s at 300 Hz, and 0.5 s at 200 Hz
+    add_read(calculator, 0, 0, 0);
+    add_read(calculator, SECOND_NSEC, 100, 10);
+    add_read(calculator, 3 * SECOND_NSEC, 700, 30);
+    add_read(calculator, 7 * SECOND_NSEC / 2, 800, 35);
+    check(calculator.finish_window(1, record), "extremes: no record");
+    check(record.n_intervals == 3, "extremes: intervals "
+            + std::to_string(record.n_intervals));
+    check_rate(record.trigger.min_hz, 100, "extremes: lowest trigger rate");
+    check_rate(record.trigger.max_hz, 300, "extremes: highest trigger rate");
+    check_rate(record.trigger.mean_hz, 800 / 3.5, "extremes: trigger rate");
+    check_rate(record.tack.min_hz, 10, "extremes: lowest TACK rate");
+    check_rate(record.tack.max_hz, 10, "extremes: highest TACK rate");
+
+    // The next window has extremes of its own
+    add_read(calculator, 9 * SECOND_NSEC / 2, 850, 45);
+    check(calculator.finish_window(2, record), "extremes: no next record");
+    check(record.n_intervals == 1, "extremes: next intervals "
+            + std::to_string(record.n_intervals));
+    check_rate(record.trigger.min_hz, 50, "extremes: next lowest rate");
+    check_rate(record.trigger.max_hz, 50, "extremes: next highest rate");
+    check(!calculator.finish_window(3, record),
+            "extremes: record of no intervals");
+}
+
+void check_smoothing()
+{
+    TriggerRateCalculator calculator;
+    TriggerRateRecord record;
+    // The first interval sets the smoothed rate
+    add_read(calculator, 0, 0, 0);
+    add_read(calculator, SECOND_NSEC, 100, 100);
+    calculator.finish_window(1, record);
+    check_rate(record.trigger.smoothed_hz, 100, "smoothing: first rate");
+
+    // Later ones move it towards theirs, weighted by their length, across
+    // records
+    double expected_hz = 100;
+    uint64_t nstimer = SECOND_NSEC;
+    uint32_t count = 100;
+    const uint64_t intervals_nsec[3] = {SECOND_NSEC, 5 * SECOND_NSEC,
+        SECOND_NSEC / 10};
+    for (int i = 0; i < 3; i++) {
+        nstimer += intervals_nsec[i];
+        count += 300 * intervals_nsec[i] / SECOND_NSEC;
+        add_read(calculator, nstimer, count, count);
+        expected_hz += (1 - std::exp(-1e-9 * intervals_nsec[i]
+                    / RATE_SMOOTHING_TIME_SEC)) * (300 - expected_hz);
+        calculator.finish_window(2 + i, record);
+        check_rate(record.trigger.smoothed_hz, expected_hz,
+                "smoothing: rate after record " + std::to_string(2 + i));
+        check_rate(record.trigger.mean_hz, 300,
+                "smoothing: mean of record " + std::to_string(2 + i));
+    }
+
+    // A reset forgets it, and the next interval sets it again
+    calculator.reset();
+    check(!add_read(calculator, nstimer, count, count),
+            "smoothing: first read after reset measured");
+    add_read(calculator, nstimer + SECOND_NSEC, count + 20, count + 20);
+    calculator.finish_window(5, record);
+    check_rate(record.trigger.smoothed_hz, 20, "smoothing: rate after reset");
+}
+
+int main()
+{
+    check_counter_wrap();
+    check_timer_reset();
+    check_extremes();
+    check_smoothing();
+    if (n_failed > 0) {
+        std::cout << n_failed << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All rates as expected" << std::endl;
+    return 0;
+}